@@ -2,19 +2,77 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include <string>
+#include <array>
+#include <vector>
+#include <memory>
+#include <atomic>
 #include <glm/glm.hpp>
+#include "device_memory.h"
+#include "mesh_cache.h"
+#include "image_util.h"
+
+// scene objects sharing a mesh are drawn with one instanced draw, each
+// instance picks its material from the bindless table by index. undefine
+// to get one draw per object through the same path
 #define GPU_INSTANCING
 
-struct AppUniformBuffer {
+// uploads go to a dedicated transfer queue and the rt pass to an async
+// compute queue when the device has such families, undefine to run
+// everything on the graphics queue
+#define ASYNC_QUEUES
+
+// scene objects outside the camera frustum are dropped on the cpu before
+// the instance buffer is written, the gpu cull pass only sees the rest.
+// undefine to hand every instance to the gpu
+#define CPU_CULLING
+
+// registry textures start with their small mips and load the finer ones
+// once they get big enough on screen, within TEXTURE_BUDGET bytes of
+// device memory. undefine to keep every level resident from startup
+#define TEXTURE_STREAMING
+
+const VkDeviceSize TEXTURE_BUDGET = 256 * 1024 * 1024;
+// levels this size and smaller load at startup and are never evicted
+const uint32_t TEXTURE_TAIL_SIZE = 128;
+// decodes running in the background at once
+const uint32_t MAX_TEXTURE_STREAM_REQUESTS = 4;
+
+// meshes share one vertex and one index buffer of this many elements, so
+// a single indirect draw reaches all of them
+const uint32_t GEOMETRY_POOL_VERTICES = 2 * 1024 * 1024;
+const uint32_t GEOMETRY_POOL_INDICES = 8 * 1024 * 1024;
+
+// models are drawn into [0, OFFSCREEN_MODEL_MAX_DEPTH], the skybox behind
+const float OFFSCREEN_MODEL_MAX_DEPTH = 0.9999999f;
+
+// shadow rays are traced at 1 / SHADOW_TRACE_SCALE of the screen size in
+// each direction and upsampled by shaders/shadow_upsample.comp
+// 1 full, 2 half (4x fewer rays), 4 quarter resolution
+const uint32_t SHADOW_TRACE_SCALE = 2;
+
+// cpu may record frame N+1 while the gpu is still on frame N,
+// everything written per frame is duplicated this many times
+const int MAX_FRAMES_IN_FLIGHT = 2;
+
+// uniform data of every pass lives in one persistently mapped buffer
+// each frame in flight owns a slice of it, reset when the frame begins,
+// and allocations are bound with dynamic offsets
+const VkDeviceSize UNIFORM_RING_FRAME_SIZE = 4 * 1024 * 1024;
+
+struct AppUniformRing {
     VkBuffer buffer;
-    VkDeviceMemory deviceMemory;
-    VkDescriptorBufferInfo descriptorBufferInfo;
+    AppAllocation deviceMemory;
+    unsigned char* mapped;
+    VkDeviceSize alignment;
+    // next free byte and end of the current frame's slice
+    VkDeviceSize head;
+    VkDeviceSize frameEnd;
 };
 
 struct AppTexture
 {
     VkImage image;
-    VkDeviceMemory deviceMemory;
+    AppAllocation deviceMemory;
     VkImageView imageView;
     VkSampler sampler;
     VkDescriptorImageInfo descriptorImageInfo;
@@ -22,7 +80,7 @@ struct AppTexture
 
 struct AppFramebufferAttachment {
     VkImage image;
-    VkDeviceMemory deviceMemory;
+    AppAllocation deviceMemory;
     VkImageView imageView;
 };
 
@@ -31,32 +89,296 @@ struct AppTextureInfo {
     AppTexture texture;
 };
 
-struct AppSceneObjectUniformBufferConent {
-    glm::mat4 modelMatrix;
+// vertex and index buffer shared by every mesh, ranges are handed out in
+// load order
+struct AppGeometryPool {
+    VkBuffer vertexBuffer;
+    AppAllocation vertexMemory;
+    VkBuffer indexBuffer;
+    AppAllocation indexMemory;
+    // first free vertex and index
+    uint32_t vertexHead;
+    uint32_t indexHead;
+};
+
+// gpu copy of one obj file, owned by the asset registry and shared by
+// every scene object with the same meshPath
+struct AppMesh {
+    std::string path;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    // object space bounds of the mesh
+    glm::vec3 aabbMin;
+    glm::vec3 aabbMax;
+
+    // where the mesh landed in the geometry pool
+    int32_t vertexOffset;
+    uint32_t firstIndex;
+
+    // object space positions, 9 floats per triangle, every instance
+    // transforms its own copy into the rt triangle list
+    std::vector<float> rtTriangles;
+    uint32_t refCount;
+};
+
+// cpu side of a mesh load, filled by cookSingleMesh on a worker thread
+struct AppMeshData {
+    // the mapped cooked file when it was valid, the vectors otherwise
+    std::unique_ptr<CookedMesh> cooked;
+    std::vector<unsigned char> vertices;
+    std::vector<uint32_t> indices;
+    const void* vertexData = nullptr;
+    const uint32_t* indexData = nullptr;
+    VkDeviceSize vertexBytes = 0;
 };
 
+// mip chain decoded on a worker thread, levels packed in pixels
+// rgba8 texels, or bc blocks when a cooked file was found
+struct AppImageData {
+    VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+    std::vector<unsigned char> pixels;
+    std::vector<imageutil::MipLevel> levels;
+};
 
+// a decode for a streamed texture, filled on a worker thread
+struct AppTextureStreamRequest {
+    AppImageData image;
+    // finest level to make resident once done
+    uint32_t firstLevel;
+    std::atomic<bool> done{ false };
+    bool failed = false;
+};
 
+// levels [residentLevel, levels.size()) of a registry texture are in its
+// image, the ones from tailLevel on always are
+struct AppTextureStreaming {
+    bool enabled = false;
+    // layout of the whole chain, also when only part of it is resident
+    std::vector<imageutil::MipLevel> levels;
+    VkDeviceSize totalBytes = 0;
+    uint32_t residentLevel = 0;
+    uint32_t tailLevel = 0;
+    // finest level any visible object needs, recomputed every frame
+    uint32_t wantedLevel = 0;
+    uint64_t lastVisibleFrame = 0;
+    // decoding the source failed once, the texture keeps what is resident
+    // instead of reading it again every frame
+    bool failed = false;
+    // kept in memory to shrink back to without touching the disk
+    AppImageData tail;
+    std::shared_ptr<AppTextureStreamRequest> request;
+};
+
+// registry entry for a texture shared between scene objects
+struct AppSharedTexture {
+    AppTextureInfo info;
+    uint32_t refCount;
+    AppTextureStreaming streaming;
+};
+
+// an image replaced by streaming, destroyed once no frame in flight can
+// still sample it
+struct AppRetiredTexture {
+    VkImage image;
+    AppAllocation deviceMemory;
+    VkImageView imageView;
+    uint64_t frame;
+};
+
+// what a scene object knows about one of its textures
+struct AppTextureRef {
+    std::string path;
+    AppTexture* texture = nullptr;
+};
 
 struct AppSceneObject {
     
     std::string meshPath;
-    uint32_t vertexCount;
+    // set by acquireMesh, points into the asset registry
+    AppMesh* mesh = nullptr;
+
+    AppTextureRef albedo, normal, mrao;
+    // index into the material table and draw group of the object, set by
+    // buildDrawGroups
+    uint32_t materialIndex;
+    uint32_t drawIndex;
+
+    // only the skybox cube binds its own set, scene objects bind their
+    // material's
+    VkDescriptorSet descriptorSet;
+
+    // copied into the instance buffer every frame
+    glm::mat4 modelMatrix;
+    // world space bounds, follow modelMatrix every frame
+    glm::vec3 aabbMin;
+    glm::vec3 aabbMax;
+};
+
+// one element of the material ssbo, same layout as Material in
+// shaders/mrt.frag (std430), slots in the material texture array
+struct AppMaterialData {
+    uint32_t albedo;
+    uint32_t normal;
+    uint32_t mrao;
+    uint32_t pad;
+};
+
+// the textures of one or more scene objects, an entry of the material table
+struct AppMaterial {
+    AppTexture* albedo;
+    AppTexture* normal;
+    AppTexture* mrao;
+    AppMaterialData data;
+};
+
+// upper bound on the material texture array, lowered to what the device
+// can bind in the fragment stage
+const uint32_t MAX_MATERIAL_TEXTURES = 4096;
+
+// upper bound on instances written per frame
+const uint32_t MAX_SCENE_INSTANCES = 64 * 1024;
+
+// entries of the traversal stack in raytracing.comp (BVH_STACK_SIZE), a
+// bottom level bvh may be at most this many nodes deeper than its root
+const uint32_t RT_BVH_STACK_SIZE = 64;
+// same for the top level walk (TOP_LEVEL_STACK_SIZE), checked every time
+// rt_buildTopLevel rebuilds it
+const uint32_t RT_TOP_LEVEL_STACK_SIZE = 32;
+
+// upper bound on instances in the top level of the ray tracing bvh
+const uint32_t MAX_RT_INSTANCES = 4096;
+
+// bottom levels of the ray tracing bvh are built as morton code lbvhs,
+// several times faster than binned SAH but slower to trace. define for
+// large scenes that are edited often
+// #define RT_LBVH
+
+// one element of the instance ssbo, same layout as InstanceData in
+// shaders/mrt.vert (std430)
+struct AppInstanceData {
+    glm::mat4 modelMatrix;
+    uint32_t materialIndex;
+    // draw group the instance belongs to
+    uint32_t drawIndex;
+    uint32_t pad[2];
+};
+
+// instances [firstInstance, firstInstance + instanceCount) of the instance
+// buffer all use mesh, each with its own materialIndex
+struct AppDrawGroup {
+    AppMesh* mesh;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
+};
+
+// the g buffer pass splits its draw groups into up to this many ranges,
+// each recorded into its own secondary command buffer on a worker thread
+// same as MAX_RECORD_CHUNKS in shaders/cull.comp
+const uint32_t MAX_RECORD_CHUNKS = 16;
+
+// draw groups [firstDraw, firstDraw + drawCount), drawn by one indirect
+// count draw with its own slot in the count buffer
+struct AppRecordChunk {
+    uint32_t firstDraw;
+    uint32_t drawCount;
+};
+
+// command pools of one recording thread, a pool is only ever used by the
+// thread that owns it. reset when its frame in flight is recorded again
+struct AppRecordThread {
+    std::array<VkCommandPool, MAX_FRAMES_IN_FLIGHT> commandPools;
+    // allocated from commandPools[frame] as needed, reused after the reset
+    std::array<std::vector<VkCommandBuffer>, MAX_FRAMES_IN_FLIGHT> commandBuffers;
+    std::array<uint32_t, MAX_FRAMES_IN_FLIGHT> used;
+};
+
+// one element of the draw ssbo of shaders/cull.comp (std430), one per
+// draw group. visible instances of the group are compacted into
+// [firstInstance, firstInstance + instanceCount) of the visible list
+struct AppCullDrawData {
+    // object space bounds, w unused
+    glm::vec4 aabbMin;
+    glm::vec4 aabbMax;
     uint32_t indexCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+    // record chunk of the group, its indirect draw is compacted into the
+    // chunk's range starting at chunkFirstDraw
+    uint32_t chunk;
+    uint32_t chunkFirstDraw;
+    uint32_t pad[2];
+};
 
-    struct {
-        VkBuffer buffer;
-        VkDeviceMemory deviceMemory;
-    } vertexBuffer, indexBuffer;
+// uniform block of shaders/cull.comp
+struct AppCullUniformBufferContent {
+    // frustum test against this frame's matrix, hi-z test against the one
+    // the pyramid was rendered with, last frame's
+    glm::mat4 viewProj;
+    glm::mat4 prevViewProj;
+    glm::vec2 viewportSize;
+    // size of hi-z level 0
+    glm::vec2 hizSize;
+    uint32_t instanceCount;
+    uint32_t drawCount;
+    uint32_t hizLevels;
+    // depth the viewport maps the far end of a model to
+    float maxDepth;
+};
 
-    AppTextureInfo albedo, normal, mrao;
+// max depth pyramid of the previous frame's g buffer depth. level 0 is the
+// power of two at or below the screen size, so every later level halves
+// exactly
+struct AppHiZ {
+    VkImage image;
+    AppAllocation deviceMemory;
+    // the whole chain, sampled by the cull pass
+    VkImageView imageView;
+    // one per level, written by shaders/hiz.comp
+    std::vector<VkImageView> levelViews;
+    VkSampler sampler;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levels;
+    VkPipeline pipeline;
+    VkPipelineLayout pipelineLayout;
+    VkDescriptorSetLayout descriptorSetLayout;
+    // levels per frame in flight, level 0 of frame f reads that frame's depth
+    std::vector<VkDescriptorSet> descriptorSets;
+};
 
-    VkDescriptorSet descriptorSet;
+// frustum and hi-z culling on the gpu, fills the indirect draws of the
+// g buffer pass
+struct AppGpuCullingAssets {
+    // one thread per instance, then one per draw group
+    VkPipeline cullPipeline;
+    VkPipeline compactPipeline;
+    VkPipelineLayout pipelineLayout;
+    VkDescriptorSetLayout descriptorSetLayout;
+    std::array<VkDescriptorSet, MAX_FRAMES_IN_FLIGHT> descriptorSets;
+
+    // AppCullDrawData of every draw group
+    VkBuffer drawBuffer;
+    AppAllocation drawMemory;
+    // written per frame: VkDrawIndexedIndirectCommand per non empty group,
+    // MAX_RECORD_CHUNKS draw counts followed by one instance count per
+    // group, and the instance buffer index of every visible instance
+    std::array<VkBuffer, MAX_FRAMES_IN_FLIGHT> indirectBuffers;
+    std::array<AppAllocation, MAX_FRAMES_IN_FLIGHT> indirectMemories;
+    std::array<VkBuffer, MAX_FRAMES_IN_FLIGHT> countBuffers;
+    std::array<AppAllocation, MAX_FRAMES_IN_FLIGHT> countMemories;
+    std::array<VkBuffer, MAX_FRAMES_IN_FLIGHT> visibleBuffers;
+    std::array<AppAllocation, MAX_FRAMES_IN_FLIGHT> visibleMemories;
 
     struct {
-        AppUniformBuffer uniformBuffer;
-        AppSceneObjectUniformBufferConent content;
-    } uniformBufferAndContent; 
+        AppCullUniformBufferContent content;
+        uint32_t dynamicOffset;
+    } uniformBufferAndContent;
+    // viewProj of the last frame, false until one was rendered
+    glm::mat4 prevViewProj;
+    bool hasPrevViewProj = false;
+
+    AppHiZ hiz;
 };
 
 struct RT_AppSceneObject {
@@ -64,7 +386,7 @@ struct RT_AppSceneObject {
 	std::string meshPath;
 
 	VkBuffer triangleBuffer;
-	VkDeviceMemory trianglerDeviceMem;
+	AppAllocation trianglerDeviceMem;
 };
 
 struct AppDeferredUniformBufferContent {
@@ -78,12 +400,13 @@ struct AppDeferredPipelineAssets {
     VkPipelineLayout pipelineLayout;
     VkRenderPass renderPass;
     VkDescriptorSetLayout descriptorSetLayout;
-    VkDescriptorSet descriptorSet;
+    // reads the g buffer and rt result of the same frame
+    std::array<VkDescriptorSet, MAX_FRAMES_IN_FLIGHT> descriptorSets;
     struct {
         AppTextureInfo brdfLUT;
     } pbrTextures;
     struct {
-        AppUniformBuffer uniformBuffer;
+        uint32_t dynamicOffset;
         AppDeferredUniformBufferContent content;
     } uniformBufferAndContent;
     // output framebuf is swapchain framebuf
@@ -94,9 +417,12 @@ struct AppDeferredPipelineAssets {
 struct AppOffscreenUniformBufferContent {
     glm::mat4 projMatrix;
     glm::mat4 viewMatrix;
-#ifdef GPU_INSTANCING
-    glm::mat4 instancingModelMatrix;
-#endif
+};
+
+struct AppOffscreenFrameBufferAssets {
+    VkFramebuffer frameBuffer;
+    AppTexture position, normal, color, mrao;
+    AppTexture depth;
 };
 
 struct AppOffscreenPipelineAssets {
@@ -104,19 +430,17 @@ struct AppOffscreenPipelineAssets {
     VkPipelineLayout pipelineLayout;
     VkRenderPass renderPass;
     VkDescriptorSetLayout descriptorSetLayout;
-    VkCommandBuffer commandBuffer;
+    std::array<VkCommandBuffer, MAX_FRAMES_IN_FLIGHT> commandBuffers;
 
     struct {
         AppOffscreenUniformBufferContent content;
-        AppUniformBuffer uniformBuffer;
+        uint32_t dynamicOffset;
     } uniformBufferAndContent;
 
-    struct {
-        VkFramebuffer frameBuffer;
-        AppTexture position, normal, color, mrao;
-        AppTexture depth;
-        VkSampler sampler;
-    } frameBufferAssets;
+    // one g buffer per frame in flight, all sampled with the same sampler
+    std::array<AppOffscreenFrameBufferAssets, MAX_FRAMES_IN_FLIGHT>
+        frameBufferAssets;
+    VkSampler frameBufferSampler;
 };
 
 struct AppSkyBoxUniformBufferContent {
@@ -141,7 +465,7 @@ struct AppSkyboxSceneObject {
 struct AppSkyboxPipelineAssets {
     struct {
         AppSkyBoxUniformBufferContent content;
-        AppUniformBuffer uniformBuffer;
+        uint32_t dynamicOffset;
     } uniformBufferAndContent;
 
     VkPipeline pipeline;
@@ -197,13 +521,21 @@ struct Vertex {
 	glm::vec3 tangent;
 };
 
+// what raytracing.comp reads per triangle, vertex 0 and the edges to
+// vertex 1 and 2 so the hit test doesn't subtract them for every ray.
+// the normal is only computed on a hit. w is unused
 struct Triangle
 {
-    
-    glm::vec4 trinormal;
     glm::vec4 vert_0;
-    glm::vec4 vert_1;
-    glm::vec4 vert_2;
-
-    glm::vec4 testColor;
+    glm::vec4 edge_1;
+    glm::vec4 edge_2;
+
+    static Triangle fromVertices(const glm::vec3& v0, const glm::vec3& v1,
+        const glm::vec3& v2) {
+        Triangle tri;
+        tri.vert_0 = glm::vec4(v0, 1.0f);
+        tri.edge_1 = glm::vec4(v1 - v0, 0.0f);
+        tri.edge_2 = glm::vec4(v2 - v0, 0.0f);
+        return tri;
+    }
 };
@@ -0,0 +1,158 @@
+// bvh build time and quality over a large triangle soup, the single
+// threaded binned SAH build against bvh::buildParallel in both modes
+//
+//   bvh_build_benchmark [triangle count] [iterations]
+//
+// defaults to about 1M triangles, prints the best time of all iterations
+// and the SAH cost of the tree, lower traces faster
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../bvh.h"
+
+namespace {
+    template <typename Setup, typename Function>
+    double bestMilliseconds(int iterations, Setup setup, Function function) {
+        double best = 1e30;
+        for (int i = 0; i < iterations; ++i) {
+            setup();
+            auto start = std::chrono::high_resolution_clock::now();
+            function();
+            auto end = std::chrono::high_resolution_clock::now();
+            double ms =
+                std::chrono::duration<double, std::milli>(end - start).count();
+            best = ms < best ? ms : best;
+        }
+        return best;
+    }
+
+    // half the triangles in a rolling grid, the rest in boxes of random
+    // size scattered over it, so both dense and sparse regions exist
+    void buildSoup(size_t triangleCount, std::vector<Triangle>& triangles) {
+        uint32_t cells = static_cast<uint32_t>(
+            std::sqrt(static_cast<double>(triangleCount) / 4.0));
+        float cell = 200.0f / cells;
+        auto corner = [&](uint32_t x, uint32_t z) {
+            float px = -100.0f + x * cell;
+            float pz = -100.0f + z * cell;
+            return glm::vec3(px, 2.0f * std::sin(px * 0.05f) * std::cos(pz * 0.07f), pz);
+        };
+        for (uint32_t z = 0; z < cells; ++z) {
+            for (uint32_t x = 0; x < cells; ++x) {
+                glm::vec3 a = corner(x, z), b = corner(x + 1, z);
+                glm::vec3 c = corner(x + 1, z + 1), d = corner(x, z + 1);
+                triangles.push_back(Triangle::fromVertices(a, b, c));
+                triangles.push_back(Triangle::fromVertices(a, c, d));
+            }
+        }
+
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> position(-90.0f, 90.0f);
+        std::uniform_real_distribution<float> size(0.2f, 3.0f);
+        const int faces[6][4] = {
+            { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 4, 5, 1 },
+            { 2, 3, 7, 6 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 }
+        };
+        while (triangles.size() + 12 <= triangleCount) {
+            glm::vec3 boxMin(position(rng), position(rng) * 0.1f, position(rng));
+            glm::vec3 boxMax = boxMin + glm::vec3(size(rng), size(rng), size(rng));
+            glm::vec3 c[8];
+            for (int i = 0; i < 8; ++i) {
+                c[i] = glm::vec3(i & 1 ? boxMax.x : boxMin.x,
+                    i & 2 ? boxMax.y : boxMin.y, i & 4 ? boxMax.z : boxMin.z);
+            }
+            for (const auto& f : faces) {
+                triangles.push_back(Triangle::fromVertices(c[f[0]], c[f[1]], c[f[2]]));
+                triangles.push_back(Triangle::fromVertices(c[f[0]], c[f[2]], c[f[3]]));
+            }
+        }
+    }
+
+    // every triangle in exactly one leaf and every node reached once
+    bool validTree(const std::vector<BVHNode>& nodes, size_t triangleCount) {
+        std::vector<uint8_t> seen(triangleCount, 0);
+        std::vector<uint8_t> visited(nodes.size(), 0);
+        std::vector<uint32_t> stack = { 0 };
+        while (!stack.empty()) {
+            uint32_t nodeIdx = stack.back();
+            stack.pop_back();
+            if (nodeIdx >= nodes.size() || visited[nodeIdx]++) {
+                return false;
+            }
+            const BVHNode& node = nodes[nodeIdx];
+            if (node.triCount == 0) {
+                stack.push_back(node.leftFirst);
+                stack.push_back(node.leftFirst + 1);
+                continue;
+            }
+            for (uint32_t i = 0; i < node.triCount; ++i) {
+                size_t tri = static_cast<size_t>(node.leftFirst) + i;
+                if (tri >= triangleCount || seen[tri]++) {
+                    return false;
+                }
+            }
+        }
+        for (uint8_t s : seen) {
+            if (!s) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t triangleCount =
+        argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1024 * 1024;
+    int iterations = argc > 2 ? std::atoi(argv[2]) : 3;
+
+    std::vector<Triangle> soup;
+    buildSoup(triangleCount, soup);
+    JobSystem jobs;
+    std::cout << soup.size() << " triangles, " << jobs.concurrency()
+        << " threads" << std::endl;
+
+    struct Builder {
+        const char* name;
+        bool parallel;
+        bvh::BuildMode mode;
+    };
+    const Builder builders[] = {
+        { "binned SAH, 1 thread", false, bvh::BuildMode::BinnedSAH },
+        { "binned SAH, parallel", true, bvh::BuildMode::BinnedSAH },
+        { "LBVH, parallel", true, bvh::BuildMode::LBVH }
+    };
+
+    std::vector<Triangle> triangles;
+    std::vector<BVHNode> nodes;
+    double serialMs = 0.0;
+    for (const Builder& builder : builders) {
+        double ms = bestMilliseconds(iterations, [&]() {
+            triangles = soup;
+        }, [&]() {
+            if (builder.parallel) {
+                bvh::buildParallel(jobs, builder.mode, triangles, nodes);
+            }
+            else {
+                bvh::buildBinnedSAH(triangles, nodes);
+            }
+        });
+        serialMs = serialMs > 0.0 ? serialMs : ms;
+
+        std::cout << builder.name << ": " << ms << " ms, "
+            << soup.size() / (ms * 1e3) << " M triangles/s, "
+            << nodes.size() << " nodes, SAH cost " << bvh::sahCost(nodes)
+            << ", " << serialMs / ms << "x" << std::endl;
+        if (!validTree(nodes, triangles.size())) {
+            std::cout << "broken tree" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
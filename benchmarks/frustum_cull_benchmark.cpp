@@ -0,0 +1,88 @@
+// frustum culling of synthetic boxes, the scalar loop against the simd
+// path the frame loop uses
+//
+//   frustum_cull_benchmark [box count] [iterations]
+//
+// defaults to 100k boxes, prints the best time of all iterations
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../frustum_cull.h"
+
+namespace {
+    template <typename Function>
+    double bestMilliseconds(int iterations, Function function) {
+        double best = 1e30;
+        for (int i = 0; i < iterations; ++i) {
+            auto start = std::chrono::high_resolution_clock::now();
+            function();
+            auto end = std::chrono::high_resolution_clock::now();
+            double ms =
+                std::chrono::duration<double, std::milli>(end - start).count();
+            best = ms < best ? ms : best;
+        }
+        return best;
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    int iterations = argc > 2 ? std::atoi(argv[2]) : 200;
+
+    // scattered through a 2 km cube around the camera, 0.5 to 10 units
+    // wide, about one in twenty ends up in view
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+    std::uniform_real_distribution<float> halfSize(0.25f, 5.0f);
+    frustumcull::Boxes boxes;
+    boxes.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec3 center(position(rng), position(rng), position(rng));
+        glm::vec3 extent(halfSize(rng), halfSize(rng), halfSize(rng));
+        boxes.set(i, center - extent, center + extent);
+    }
+
+    glm::mat4 proj = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f,
+        0.1f, 1000.0f);
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+        glm::vec3(0.0f, 1.0f, 0.0f));
+    frustumcull::Frustum frustum = frustumcull::fromViewProj(proj * view);
+
+    std::vector<uint32_t> scalarVisible(count);
+    std::vector<uint32_t> simdVisible(count);
+    size_t scalarCount = 0;
+    size_t simdCount = 0;
+    double scalarMs = bestMilliseconds(iterations, [&]() {
+        scalarCount = frustumcull::cullScalar(frustum, boxes,
+            scalarVisible.data());
+    });
+    double simdMs = bestMilliseconds(iterations, [&]() {
+        simdCount = frustumcull::cull(frustum, boxes, simdVisible.data());
+    });
+
+    size_t mismatches = scalarCount > simdCount
+        ? scalarCount - simdCount : simdCount - scalarCount;
+    for (size_t i = 0; i < std::min(scalarCount, simdCount); ++i) {
+        mismatches += scalarVisible[i] != simdVisible[i] ? 1 : 0;
+    }
+
+    std::cout << count << " boxes, " << simdCount << " visible" << std::endl;
+    std::cout << "scalar: " << scalarMs << " ms, "
+        << scalarMs * 1e6 / count << " ns per box" << std::endl;
+    std::cout << frustumcull::instructionSet() << ": " << simdMs << " ms, "
+        << simdMs * 1e6 / count << " ns per box, "
+        << scalarMs / simdMs << "x" << std::endl;
+    if (mismatches > 0) {
+        std::cout << mismatches << " boxes differ from the scalar result"
+            << std::endl;
+        return 1;
+    }
+    return 0;
+}
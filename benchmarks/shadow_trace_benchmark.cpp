@@ -0,0 +1,226 @@
+// cpu reference of the rt shadow pass, traced with a growing number of
+// threads. the scene is a synthetic heightfield with instanced boxes on
+// it, or a dump written by shadowtrace::saveDump
+//
+//   shadow_trace_benchmark [box count | --load dump] [--save dump]
+//       [--write image] [--compare image]
+//
+// --write stores the traced image, --compare fails when the trace differs
+// from a stored one, for golden tests on machines without a gpu
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../shadow_trace.h"
+
+namespace {
+    const uint32_t WIDTH = 800;
+    const uint32_t HEIGHT = 600;
+    const uint32_t GROUND_CELLS = 256;
+    const float GROUND_SIZE = 200.0f;
+    // allowed difference of a golden comparison, in world units
+    const float GOLDEN_TOLERANCE = 0.001f;
+
+    void addTriangle(std::vector<Triangle>& triangles,
+        const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+        triangles.push_back(Triangle::fromVertices(a, b, c));
+    }
+
+    void addBox(std::vector<Triangle>& triangles,
+        const glm::vec3& boxMin, const glm::vec3& boxMax) {
+        glm::vec3 c[8];
+        for (int i = 0; i < 8; ++i) {
+            c[i] = glm::vec3(i & 1 ? boxMax.x : boxMin.x,
+                i & 2 ? boxMax.y : boxMin.y, i & 4 ? boxMax.z : boxMin.z);
+        }
+        const int faces[6][4] = {
+            { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 4, 5, 1 },
+            { 2, 3, 7, 6 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 }
+        };
+        for (const auto& f : faces) {
+            addTriangle(triangles, c[f[0]], c[f[1]], c[f[2]]);
+            addTriangle(triangles, c[f[0]], c[f[2]], c[f[3]]);
+        }
+    }
+
+    float groundHeight(float x, float z) {
+        return 2.0f * std::sin(x * 0.05f) * std::cos(z * 0.07f);
+    }
+
+    // rolling ground with boxes standing on it, two meshes: about 130k
+    // triangles of ground and a 12 triangle unit cube placed once per box
+    void buildScene(uint32_t boxCount, shadowtrace::Scene& scene) {
+        std::vector<Triangle>& triangles = scene.triangles;
+        float cell = GROUND_SIZE / GROUND_CELLS;
+        float origin = -0.5f * GROUND_SIZE;
+        for (uint32_t z = 0; z < GROUND_CELLS; ++z) {
+            for (uint32_t x = 0; x < GROUND_CELLS; ++x) {
+                auto corner = [&](uint32_t cx, uint32_t cz) {
+                    float px = origin + cx * cell;
+                    float pz = origin + cz * cell;
+                    return glm::vec3(px, groundHeight(px, pz), pz);
+                };
+                glm::vec3 a = corner(x, z), b = corner(x + 1, z);
+                glm::vec3 c = corner(x + 1, z + 1), d = corner(x, z + 1);
+                addTriangle(triangles, a, b, c);
+                addTriangle(triangles, a, c, d);
+            }
+        }
+        uint32_t groundCount = static_cast<uint32_t>(triangles.size());
+        addBox(triangles, glm::vec3(0.0f), glm::vec3(1.0f));
+
+        std::vector<uint32_t> roots;
+        std::vector<glm::mat4> objectToWorld;
+        roots.push_back(bvh::appendBottomLevel(triangles, 0, groundCount,
+            scene.nodes));
+        objectToWorld.push_back(glm::mat4(1.0f));
+        uint32_t cubeRoot = bvh::appendBottomLevel(triangles, groundCount,
+            static_cast<uint32_t>(triangles.size()) - groundCount, scene.nodes);
+
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> position(
+            -0.45f * GROUND_SIZE, 0.45f * GROUND_SIZE);
+        std::uniform_real_distribution<float> halfSize(0.5f, 3.0f);
+        std::uniform_real_distribution<float> height(1.0f, 12.0f);
+        for (uint32_t i = 0; i < boxCount; ++i) {
+            float x = position(rng);
+            float z = position(rng);
+            float w = halfSize(rng);
+            float y = groundHeight(x, z) - 0.5f;
+            // scale the unit cube, then move its corner to the box minimum
+            glm::mat4 transform(1.0f);
+            transform[0][0] = 2.0f * w;
+            transform[1][1] = height(rng);
+            transform[2][2] = 2.0f * w;
+            transform[3] = glm::vec4(x - w, y, z - w, 1.0f);
+            roots.push_back(cubeRoot);
+            objectToWorld.push_back(transform);
+        }
+        bvh::buildTopLevel(scene.nodes, roots, objectToWorld,
+            scene.instances, scene.topLevelNodes);
+    }
+}
+
+namespace {
+    const char* USAGE =
+        "usage: shadow_trace_benchmark [box count | --load dump] [--save dump]\n"
+        "           [--write image] [--compare image]";
+}
+
+int main(int argc, char** argv) {
+    uint32_t boxCount = 2000;
+    std::string loadPath, savePath, writePath, comparePath;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--help") == 0
+            || std::strcmp(argv[i], "-h") == 0) {
+            std::cout << USAGE << std::endl;
+            return 0;
+        }
+        if (std::strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            loadPath = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--write") == 0 && i + 1 < argc) {
+            writePath = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            comparePath = argv[++i];
+        }
+        else {
+            // anything else must be the box count, digits only
+            char* end = nullptr;
+            unsigned long count = std::strtoul(argv[i], &end, 10);
+            if (argv[i][0] < '0' || argv[i][0] > '9' || *end != '\0'
+                || count > std::numeric_limits<uint32_t>::max()) {
+                std::cerr << "bad argument " << argv[i] << "\n" << USAGE
+                    << std::endl;
+                return 1;
+            }
+            boxCount = static_cast<uint32_t>(count);
+        }
+    }
+
+    JobSystem setupJobs;
+    shadowtrace::Dump dump;
+    if (!loadPath.empty()) {
+        if (!shadowtrace::loadDump(loadPath, dump)) {
+            std::cerr << "failed to load " << loadPath << std::endl;
+            return 1;
+        }
+    }
+    else {
+        buildScene(boxCount, dump.scene);
+        dump.settings.cameraPos = glm::vec3(0.0f, 40.0f, 90.0f);
+        dump.settings.lightPos = glm::vec3(60.0f, 120.0f, 30.0f);
+        shadowtrace::renderGBuffer(setupJobs, dump.scene,
+            dump.settings.cameraPos, glm::vec3(0.0f), glm::radians(45.0f),
+            WIDTH, HEIGHT, dump.gbuffer);
+    }
+    if (!savePath.empty() && !shadowtrace::saveDump(savePath, dump)) {
+        std::cerr << "failed to write " << savePath << std::endl;
+        return 1;
+    }
+
+    std::cout << dump.scene.triangles.size() << " triangles, "
+        << dump.scene.nodes.size() << " nodes, "
+        << dump.scene.instances.size() << " instances, "
+        << dump.gbuffer.width << "x" << dump.gbuffer.height
+        << " g buffer" << std::endl;
+
+    // workers plus the calling thread, doubling up to every core
+    uint32_t hardware = std::max(2u, std::thread::hardware_concurrency());
+    std::vector<uint32_t> workerCounts;
+    for (uint32_t workers = 1; workers + 1 < hardware; workers *= 2) {
+        workerCounts.push_back(workers);
+    }
+    workerCounts.push_back(hardware - 1);
+
+    shadowtrace::Image image;
+    double firstRate = 0.0;
+    for (uint32_t workers : workerCounts) {
+        JobSystem jobs(workers);
+        // the first run warms the caches, keep the better one
+        shadowtrace::Stats best;
+        best.milliseconds = 1e30f;
+        for (int run = 0; run < 2; ++run) {
+            shadowtrace::Stats stats = shadowtrace::trace(jobs, dump.scene,
+                dump.gbuffer, dump.settings, image);
+            best = stats.milliseconds < best.milliseconds ? stats : best;
+        }
+        double rate = best.rays / (best.milliseconds * 1e3);
+        firstRate = firstRate > 0.0 ? firstRate : rate;
+        std::cout << jobs.concurrency() << " threads: " << best.milliseconds
+            << " ms, " << best.rays << " rays, " << rate << " Mrays/s, "
+            << rate / firstRate << "x" << std::endl;
+    }
+
+    if (!writePath.empty() && !shadowtrace::saveImage(writePath, image)) {
+        std::cerr << "failed to write " << writePath << std::endl;
+        return 1;
+    }
+    if (!comparePath.empty()) {
+        shadowtrace::Image golden;
+        if (!shadowtrace::loadImage(comparePath, golden)) {
+            std::cerr << "failed to load " << comparePath << std::endl;
+            return 1;
+        }
+        float difference = shadowtrace::maxDifference(image, golden);
+        std::cout << "max difference to " << comparePath << ": "
+            << difference << std::endl;
+        if (!(difference <= GOLDEN_TOLERANCE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+// ray/triangle tests of random rays against a random triangle soup, the
+// scalar loop against every simd path the cpu supports
+//
+//   tri_intersect_benchmark [triangle count] [ray count] [iterations]
+//
+// defaults to 1024 triangles and 20k rays, prints the best time of all
+// iterations in millions of ray/triangle tests per second
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../tri_intersect.h"
+
+namespace {
+    template <typename Function>
+    double bestMilliseconds(int iterations, Function function) {
+        double best = 1e30;
+        for (int i = 0; i < iterations; ++i) {
+            auto start = std::chrono::high_resolution_clock::now();
+            function();
+            auto end = std::chrono::high_resolution_clock::now();
+            double ms =
+                std::chrono::duration<double, std::milli>(end - start).count();
+            best = ms < best ? ms : best;
+        }
+        return best;
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t triangleCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1024;
+    size_t rayCount = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000;
+    int iterations = argc > 3 ? std::atoi(argv[3]) : 5;
+
+    // triangles up to 10 units wide in a 100 unit cube, rays from random
+    // points towards random points of it, about half of them hit
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+    std::uniform_real_distribution<float> offset(-5.0f, 5.0f);
+    std::vector<glm::vec3> vertices;
+    for (size_t i = 0; i < triangleCount; ++i) {
+        glm::vec3 center(position(rng), position(rng), position(rng));
+        for (int v = 0; v < 3; ++v) {
+            vertices.push_back(center
+                + glm::vec3(offset(rng), offset(rng), offset(rng)));
+        }
+    }
+    std::vector<triintersect::Packet> packets;
+    triintersect::pack(vertices, packets);
+
+    std::vector<glm::vec3> origins(rayCount), directions(rayCount);
+    for (size_t i = 0; i < rayCount; ++i) {
+        origins[i] = glm::vec3(position(rng), position(rng), position(rng));
+        glm::vec3 target(position(rng), position(rng), position(rng));
+        directions[i] = glm::normalize(target - origins[i]);
+    }
+
+    std::vector<triintersect::InstructionSet> sets = {
+        triintersect::InstructionSet::Scalar };
+    triintersect::InstructionSet supported =
+        triintersect::supportedInstructionSet();
+    if (supported >= triintersect::InstructionSet::SSE4) {
+        sets.push_back(triintersect::InstructionSet::SSE4);
+    }
+    if (supported >= triintersect::InstructionSet::AVX2) {
+        sets.push_back(triintersect::InstructionSet::AVX2);
+    }
+
+    double tests = static_cast<double>(rayCount) * packets.size()
+        * triintersect::PACKET_WIDTH;
+    std::cout << triangleCount << " triangles, " << rayCount << " rays, "
+        << triintersect::instructionSetName(supported) << " supported"
+        << std::endl;
+
+    std::vector<triintersect::Hit> scalarHits(rayCount), hits(rayCount);
+    double scalarMs = 0.0;
+    for (triintersect::InstructionSet set : sets) {
+        double ms = bestMilliseconds(iterations, [&]() {
+            for (size_t i = 0; i < rayCount; ++i) {
+                hits[i] = triintersect::intersect(set, packets.data(),
+                    packets.size(), origins[i], directions[i],
+                    0.0001f, 1000.0f);
+            }
+        });
+
+        size_t hitCount = 0;
+        size_t mismatches = 0;
+        for (size_t i = 0; i < rayCount; ++i) {
+            hitCount += hits[i].triangle != triintersect::NO_HIT ? 1 : 0;
+            if (set == triintersect::InstructionSet::Scalar) {
+                scalarHits[i] = hits[i];
+            }
+            else {
+                mismatches += hits[i].triangle != scalarHits[i].triangle
+                    || hits[i].t != scalarHits[i].t ? 1 : 0;
+            }
+        }
+        scalarMs = set == triintersect::InstructionSet::Scalar ? ms : scalarMs;
+
+        std::cout << triintersect::instructionSetName(set) << ": " << ms
+            << " ms, " << tests / (ms * 1e3) << " M tests/s, "
+            << hitCount << " hits, " << scalarMs / ms << "x" << std::endl;
+        if (mismatches > 0) {
+            std::cout << mismatches << " rays differ from the scalar result"
+                << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include "block_compress.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+    const int BC7_WEIGHTS4[16] = {
+        0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+    };
+
+    // little endian bit writer over a 16 byte block
+    struct BitWriter {
+        unsigned char* out;
+        uint32_t position = 0;
+
+        void write(uint32_t value, uint32_t bits) {
+            for (uint32_t i = 0; i < bits; ++i, ++position) {
+                if (value & (1u << i)) {
+                    out[position / 8] |= 1u << (position % 8);
+                }
+            }
+        }
+    };
+
+    int interpolate(int e0, int e1, int weight) {
+        return ((64 - weight) * e0 + weight * e1 + 32) >> 6;
+    }
+
+    // 8 bit value -> 7 bit endpoint with p-bit p, both expanded to 8 bits
+    int quantize7(float value, int p) {
+        int q = static_cast<int>(std::lround((value - p) / 2.0f));
+        return std::min(std::max(q, 0), 127);
+    }
+
+    // endpoint with the p-bit that reproduces value best. alpha errors
+    // count more than all three colors can, so alpha that one p-bit hits
+    // exactly, like 255 of an opaque block, is never rounded off
+    void quantizeEndpoint(const float value[4], int quantized[4], int& pBit) {
+        const float channelWeights[4] = { 1.0f, 1.0f, 1.0f, 4.0f };
+        float bestError = -1.0f;
+        for (int p = 0; p < 2; ++p) {
+            int candidate[4];
+            float error = 0.0f;
+            for (int c = 0; c < 4; ++c) {
+                candidate[c] = quantize7(value[c], p);
+                float d = value[c] - ((candidate[c] << 1) | p);
+                error += channelWeights[c] * d * d;
+            }
+            if (bestError < 0.0f || error < bestError) {
+                bestError = error;
+                pBit = p;
+                std::memcpy(quantized, candidate, sizeof(candidate));
+            }
+        }
+    }
+
+    void encodeBC4Channel(const unsigned char rgba[16 * 4], int channel,
+        unsigned char out[8]) {
+        int lo = 255, hi = 0;
+        for (int i = 0; i < 16; ++i) {
+            lo = std::min(lo, static_cast<int>(rgba[i * 4 + channel]));
+            hi = std::max(hi, static_cast<int>(rgba[i * 4 + channel]));
+        }
+
+        // e0 > e1 selects the 8 value palette, a flat block uses index 0
+        int palette[8] = { hi, lo };
+        for (int i = 1; i < 7; ++i) {
+            palette[i + 1] = ((7 - i) * hi + i * lo + 3) / 7;
+        }
+
+        uint64_t indices = 0;
+        for (int i = 0; i < 16; ++i) {
+            int value = rgba[i * 4 + channel];
+            int best = 0;
+            int bestError = 256;
+            for (int j = 0; j < 8; ++j) {
+                int error = std::abs(palette[j] - value);
+                if (error < bestError) {
+                    bestError = error;
+                    best = j;
+                }
+            }
+            indices |= static_cast<uint64_t>(best) << (3 * i);
+        }
+
+        out[0] = static_cast<unsigned char>(hi);
+        out[1] = static_cast<unsigned char>(lo);
+        for (int i = 0; i < 6; ++i) {
+            out[2 + i] = static_cast<unsigned char>(indices >> (8 * i));
+        }
+    }
+}
+
+namespace blockcompress {
+    void encodeBC7Block(const unsigned char rgba[16 * 4],
+        unsigned char out[BLOCK_BYTES]) {
+        float mean[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int i = 0; i < 16; ++i) {
+            for (int c = 0; c < 4; ++c) {
+                mean[c] += rgba[i * 4 + c] / 16.0f;
+            }
+        }
+
+        // principal axis of the block by power iteration on the covariance
+        float covariance[4][4] = {};
+        for (int i = 0; i < 16; ++i) {
+            float d[4];
+            for (int c = 0; c < 4; ++c) {
+                d[c] = rgba[i * 4 + c] - mean[c];
+            }
+            for (int a = 0; a < 4; ++a) {
+                for (int b = 0; b < 4; ++b) {
+                    covariance[a][b] += d[a] * d[b];
+                }
+            }
+        }
+        // seeded with the channel that varies most. a fixed (1,1,1,1) seed
+        // is lost when the deviations sum to zero, e.g. a red/green checker
+        int seed = 0;
+        for (int c = 1; c < 4; ++c) {
+            seed = covariance[c][c] > covariance[seed][seed] ? c : seed;
+        }
+        float axis[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        axis[seed] = 1.0f;
+        for (int iteration = 0; iteration < 8; ++iteration) {
+            float next[4] = {};
+            for (int a = 0; a < 4; ++a) {
+                for (int b = 0; b < 4; ++b) {
+                    next[a] += covariance[a][b] * axis[b];
+                }
+            }
+            float length = std::sqrt(next[0] * next[0] + next[1] * next[1]
+                + next[2] * next[2] + next[3] * next[3]);
+            if (length < 1e-6f) {
+                break;
+            }
+            for (int c = 0; c < 4; ++c) {
+                axis[c] = next[c] / length;
+            }
+        }
+
+        float tMin = 0.0f, tMax = 0.0f;
+        for (int i = 0; i < 16; ++i) {
+            float t = 0.0f;
+            for (int c = 0; c < 4; ++c) {
+                t += (rgba[i * 4 + c] - mean[c]) * axis[c];
+            }
+            tMin = std::min(tMin, t);
+            tMax = std::max(tMax, t);
+        }
+
+        float endpoints[2][4];
+        for (int c = 0; c < 4; ++c) {
+            endpoints[0][c] = std::min(std::max(
+                mean[c] + tMin * axis[c], 0.0f), 255.0f);
+            endpoints[1][c] = std::min(std::max(
+                mean[c] + tMax * axis[c], 0.0f), 255.0f);
+        }
+
+        int quantized[2][4];
+        int pBits[2];
+        quantizeEndpoint(endpoints[0], quantized[0], pBits[0]);
+        quantizeEndpoint(endpoints[1], quantized[1], pBits[1]);
+
+        int palette[16][4];
+        for (int j = 0; j < 16; ++j) {
+            for (int c = 0; c < 4; ++c) {
+                palette[j][c] = interpolate(
+                    (quantized[0][c] << 1) | pBits[0],
+                    (quantized[1][c] << 1) | pBits[1], BC7_WEIGHTS4[j]);
+            }
+        }
+
+        int indices[16];
+        for (int i = 0; i < 16; ++i) {
+            int bestError = -1;
+            for (int j = 0; j < 16; ++j) {
+                int error = 0;
+                for (int c = 0; c < 4; ++c) {
+                    int d = palette[j][c] - rgba[i * 4 + c];
+                    error += d * d;
+                }
+                if (bestError < 0 || error < bestError) {
+                    bestError = error;
+                    indices[i] = j;
+                }
+            }
+        }
+
+        // the first index is stored without its top bit, which must be 0
+        if (indices[0] & 8) {
+            std::swap(quantized[0], quantized[1]);
+            std::swap(pBits[0], pBits[1]);
+            for (int i = 0; i < 16; ++i) {
+                indices[i] = 15 - indices[i];
+            }
+        }
+
+        std::memset(out, 0, BLOCK_BYTES);
+        BitWriter writer{ out };
+        writer.write(1u << 6, 7);
+        for (int c = 0; c < 4; ++c) {
+            writer.write(quantized[0][c], 7);
+            writer.write(quantized[1][c], 7);
+        }
+        writer.write(pBits[0], 1);
+        writer.write(pBits[1], 1);
+        writer.write(indices[0], 3);
+        for (int i = 1; i < 16; ++i) {
+            writer.write(indices[i], 4);
+        }
+    }
+
+    void encodeBC5Block(const unsigned char rgba[16 * 4],
+        unsigned char out[BLOCK_BYTES]) {
+        encodeBC4Channel(rgba, 0, out);
+        encodeBC4Channel(rgba, 1, out + 8);
+    }
+
+    uint32_t blockCount(uint32_t width, uint32_t height) {
+        return ((width + 3) / 4) * ((height + 3) / 4);
+    }
+
+    void compressRows(Format format, const unsigned char* pixels,
+        uint32_t width, uint32_t height,
+        uint32_t rowBegin, uint32_t rowEnd, unsigned char* out) {
+        const uint32_t blocksX = (width + 3) / 4;
+        unsigned char block[16 * 4];
+        for (uint32_t by = rowBegin; by < rowEnd; ++by) {
+            for (uint32_t bx = 0; bx < blocksX; ++bx) {
+                for (uint32_t y = 0; y < 4; ++y) {
+                    uint32_t sy = std::min(by * 4 + y, height - 1);
+                    for (uint32_t x = 0; x < 4; ++x) {
+                        uint32_t sx = std::min(bx * 4 + x, width - 1);
+                        std::memcpy(block + (y * 4 + x) * 4,
+                            pixels + (sy * width + sx) * 4, 4);
+                    }
+                }
+                unsigned char* dst = out + (by * blocksX + bx) * BLOCK_BYTES;
+                if (format == Format::BC7) {
+                    encodeBC7Block(block, dst);
+                }
+                else {
+                    encodeBC5Block(block, dst);
+                }
+            }
+        }
+    }
+}
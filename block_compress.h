@@ -0,0 +1,31 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+namespace blockcompress {
+    // bytes per 4x4 block, both formats
+    const uint32_t BLOCK_BYTES = 16;
+
+    // mode 6 only: one subset, rgba endpoints along the principal axis,
+    // 16 index levels. good enough for albedo and packed mrao
+    void encodeBC7Block(const unsigned char rgba[16 * 4],
+        unsigned char out[BLOCK_BYTES]);
+
+    // two bc4 channels from r and g, for tangent space normals
+    void encodeBC5Block(const unsigned char rgba[16 * 4],
+        unsigned char out[BLOCK_BYTES]);
+
+    enum class Format {
+        BC7,
+        BC5
+    };
+
+    uint32_t blockCount(uint32_t width, uint32_t height);
+
+    // rgba8 pixels of one level to blocks, edge blocks repeat the last
+    // row/column. row is the block row range [rowBegin, rowEnd) so callers
+    // can split a level across threads, out holds the whole level
+    void compressRows(Format format, const unsigned char* pixels,
+        uint32_t width, uint32_t height,
+        uint32_t rowBegin, uint32_t rowEnd, unsigned char* out);
+}
@@ -0,0 +1,842 @@
+#include "bvh.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <utility>
+
+namespace {
+    const int SAH_BIN_COUNT = 16;
+    const uint32_t MAX_LEAF_SIZE = 8;
+    // cost of visiting a node relative to one ray/triangle test
+    const float SAH_TRAVERSAL_COST = 1.0f;
+    // morton ranges this small become leaves without looking at the codes
+    const uint32_t LBVH_LEAF_SIZE = 4;
+    // primitives per chunk below which splitting work across threads
+    // costs more than it saves
+    const uint32_t MIN_CHUNK_SIZE = 16 * 1024;
+    // the top of a parallel build is split on the calling thread until
+    // there are about this many ranges per thread to build as jobs
+    const uint32_t SUBTREES_PER_THREAD = 8;
+
+    struct AABB {
+        glm::vec3 bmin = glm::vec3(FLT_MAX);
+        glm::vec3 bmax = glm::vec3(-FLT_MAX);
+
+        void grow(const glm::vec3& p) {
+            bmin = glm::min(bmin, p);
+            bmax = glm::max(bmax, p);
+        }
+
+        void grow(const AABB& other) {
+            bmin = glm::min(bmin, other.bmin);
+            bmax = glm::max(bmax, other.bmax);
+        }
+
+        float area() const {
+            if (bmin.x > bmax.x) {
+                return 0.0f;
+            }
+            glm::vec3 e = bmax - bmin;
+            return e.x * e.y + e.y * e.z + e.z * e.x;
+        }
+    };
+
+    struct Bin {
+        AABB bounds;
+        uint32_t triCount = 0;
+    };
+
+    // bins of all three axes over one range of primitives, chunks of a
+    // range are binned separately and merged
+    struct SplitBins {
+        Bin bins[3][SAH_BIN_COUNT];
+
+        void merge(const SplitBins& other) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int i = 0; i < SAH_BIN_COUNT; ++i) {
+                    bins[axis][i].bounds.grow(other.bins[axis][i].bounds);
+                    bins[axis][i].triCount += other.bins[axis][i].triCount;
+                }
+            }
+        }
+    };
+
+    // what the builder splits, triangles of a bottom level or instances of
+    // the top level. order[i] is the input index of primitive i
+    struct Primitives {
+        std::vector<AABB> bounds;
+        std::vector<glm::vec3> centroids;
+        std::vector<uint32_t> order;
+
+        void swap(size_t a, size_t b) {
+            std::swap(bounds[a], bounds[b]);
+            std::swap(centroids[a], centroids[b]);
+            std::swap(order[a], order[b]);
+        }
+    };
+
+    // chunks to split count primitives into, 1 without a job system
+    uint32_t chunkCount(JobSystem* jobs, uint32_t count) {
+        if (!jobs) {
+            return 1;
+        }
+        uint32_t chunks = std::min(jobs->concurrency() * 4,
+            count / MIN_CHUNK_SIZE);
+        return std::max(chunks, 1u);
+    }
+
+    // fn(chunk, begin, end) over [first, first + count) in chunks pieces,
+    // on the calling thread when there is only one
+    template <typename Function>
+    void forChunks(JobSystem* jobs, uint32_t chunks, uint32_t first,
+        uint32_t count, Function fn) {
+        auto runChunk = [&](uint32_t chunk) {
+            uint32_t begin = first + static_cast<uint32_t>(
+                static_cast<uint64_t>(count) * chunk / chunks);
+            uint32_t end = first + static_cast<uint32_t>(
+                static_cast<uint64_t>(count) * (chunk + 1) / chunks);
+            fn(chunk, begin, end);
+        };
+        if (chunks == 1) {
+            runChunk(0);
+            return;
+        }
+        jobs->parallelFor(chunks, runChunk);
+    }
+
+    Primitives trianglePrimitives(const Triangle* triangles, uint32_t count,
+        JobSystem* jobs) {
+        Primitives prims;
+        prims.bounds.resize(count);
+        prims.centroids.resize(count);
+        prims.order.resize(count);
+        forChunks(jobs, chunkCount(jobs, count), 0, count,
+            [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                const Triangle& tri = triangles[i];
+                glm::vec3 v0 = glm::vec3(tri.vert_0);
+                prims.bounds[i].grow(v0);
+                prims.bounds[i].grow(v0 + glm::vec3(tri.edge_1));
+                prims.bounds[i].grow(v0 + glm::vec3(tri.edge_2));
+                prims.centroids[i] = v0
+                    + glm::vec3(tri.edge_1 + tri.edge_2) * (1.0f / 3.0f);
+                prims.order[i] = i;
+            }
+        });
+        return prims;
+    }
+
+    AABB rangeBounds(const Primitives& prims, uint32_t begin, uint32_t end) {
+        AABB box;
+        for (uint32_t i = begin; i < end; ++i) {
+            box.grow(prims.bounds[i]);
+        }
+        return box;
+    }
+
+    AABB rangeCentroidBounds(const Primitives& prims, uint32_t begin,
+        uint32_t end) {
+        AABB box;
+        for (uint32_t i = begin; i < end; ++i) {
+            box.grow(prims.centroids[i]);
+        }
+        return box;
+    }
+
+    // reduces f(begin, end) -> AABB over the chunks of a range
+    template <typename Function>
+    AABB parallelBounds(JobSystem* jobs, uint32_t first, uint32_t count,
+        Function f) {
+        uint32_t chunks = chunkCount(jobs, count);
+        std::vector<AABB> partial(chunks);
+        forChunks(jobs, chunks, first, count,
+            [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+            partial[chunk] = f(begin, end);
+        });
+        AABB box;
+        for (const AABB& part : partial) {
+            box.grow(part);
+        }
+        return box;
+    }
+
+    void updateNodeBounds(BVHNode& node, const Primitives& prims,
+        JobSystem* jobs = nullptr) {
+        AABB box = parallelBounds(jobs, node.leftFirst, node.triCount,
+            [&](uint32_t begin, uint32_t end) {
+            return rangeBounds(prims, begin, end);
+        });
+        node.aabbMin = box.bmin;
+        node.aabbMax = box.bmax;
+    }
+
+    float nodeArea(const BVHNode& node) {
+        AABB box;
+        box.bmin = node.aabbMin;
+        box.bmax = node.aabbMax;
+        return box.area();
+    }
+
+    void binRange(const Primitives& prims, uint32_t begin, uint32_t end,
+        const AABB& centroidBounds, SplitBins& split) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float boundsMin = centroidBounds.bmin[axis];
+            float boundsMax = centroidBounds.bmax[axis];
+            if (boundsMin == boundsMax) {
+                continue;
+            }
+            Bin* bins = split.bins[axis];
+            float scale = SAH_BIN_COUNT / (boundsMax - boundsMin);
+            for (uint32_t i = begin; i < end; ++i) {
+                const glm::vec3& c = prims.centroids[i];
+                int binIdx = std::min(SAH_BIN_COUNT - 1,
+                    static_cast<int>((c[axis] - boundsMin) * scale));
+                bins[binIdx].triCount++;
+                bins[binIdx].bounds.grow(prims.bounds[i]);
+            }
+        }
+    }
+
+    // returns the cost of the best split, axis and split position by output
+    float findBestSplit(const BVHNode& node, const Primitives& prims,
+        int& bestAxis, float& splitPos, JobSystem* jobs = nullptr) {
+
+        float bestCost = FLT_MAX;
+        bestAxis = -1;
+
+        AABB centroidBounds = parallelBounds(jobs, node.leftFirst,
+            node.triCount, [&](uint32_t begin, uint32_t end) {
+            return rangeCentroidBounds(prims, begin, end);
+        });
+
+        SplitBins split;
+        uint32_t chunks = chunkCount(jobs, node.triCount);
+        if (chunks == 1) {
+            binRange(prims, node.leftFirst, node.leftFirst + node.triCount,
+                centroidBounds, split);
+        }
+        else {
+            std::vector<SplitBins> partial(chunks);
+            forChunks(jobs, chunks, node.leftFirst, node.triCount,
+                [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+                binRange(prims, begin, end, centroidBounds, partial[chunk]);
+            });
+            for (const SplitBins& part : partial) {
+                split.merge(part);
+            }
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float boundsMin = centroidBounds.bmin[axis];
+            float boundsMax = centroidBounds.bmax[axis];
+            if (boundsMin == boundsMax) {
+                continue;
+            }
+            const Bin* bins = split.bins[axis];
+            float scale = SAH_BIN_COUNT / (boundsMax - boundsMin);
+
+            // sweep once from each side to get the planes between bins
+            float leftArea[SAH_BIN_COUNT - 1], rightArea[SAH_BIN_COUNT - 1];
+            uint32_t leftCount[SAH_BIN_COUNT - 1], rightCount[SAH_BIN_COUNT - 1];
+            AABB leftBox, rightBox;
+            uint32_t leftSum = 0, rightSum = 0;
+            for (int i = 0; i < SAH_BIN_COUNT - 1; ++i) {
+                leftSum += bins[i].triCount;
+                leftCount[i] = leftSum;
+                leftBox.grow(bins[i].bounds);
+                leftArea[i] = leftBox.area();
+
+                rightSum += bins[SAH_BIN_COUNT - 1 - i].triCount;
+                rightCount[SAH_BIN_COUNT - 2 - i] = rightSum;
+                rightBox.grow(bins[SAH_BIN_COUNT - 1 - i].bounds);
+                rightArea[SAH_BIN_COUNT - 2 - i] = rightBox.area();
+            }
+
+            for (int i = 0; i < SAH_BIN_COUNT - 1; ++i) {
+                if (leftCount[i] == 0 || rightCount[i] == 0) {
+                    continue;
+                }
+                float cost = leftCount[i] * leftArea[i]
+                    + rightCount[i] * rightArea[i];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    splitPos = boundsMin + (i + 1) / scale;
+                }
+            }
+        }
+        return bestCost;
+    }
+
+    // SAH split of node, prims of the left child are moved to the front of
+    // its range. returns their count, 0 keeps node a leaf. leaves larger
+    // than maxLeafSize are split even when SAH says otherwise
+    uint32_t splitSAH(const BVHNode& node, Primitives& prims,
+        uint32_t maxLeafSize, JobSystem* jobs = nullptr) {
+        if (node.triCount <= 1) {
+            return 0;
+        }
+
+        int axis;
+        float splitPos;
+        float splitCost = findBestSplit(node, prims, axis, splitPos, jobs);
+        if (axis == -1) {
+            return 0;
+        }
+        float area = nodeArea(node);
+        float leafCost = node.triCount * area;
+        splitCost += SAH_TRAVERSAL_COST * area;
+        if (splitCost >= leafCost && node.triCount <= maxLeafSize) {
+            return 0;
+        }
+
+        // partition primitives around the split plane
+        uint32_t first = node.leftFirst;
+        int i = static_cast<int>(first);
+        int j = static_cast<int>(first + node.triCount) - 1;
+        while (i <= j) {
+            if (prims.centroids[i][axis] < splitPos) {
+                ++i;
+            }
+            else {
+                prims.swap(i, j);
+                --j;
+            }
+        }
+
+        uint32_t leftCount = static_cast<uint32_t>(i) - first;
+        return leftCount == node.triCount ? 0 : leftCount;
+    }
+
+    // nodes on the longest path of a tree with one prim per leaf that
+    // halves count at every level
+    uint32_t balancedDepth(uint32_t count) {
+        uint32_t depth = 1;
+        for (uint32_t size = 1; size < count; size *= 2) {
+            depth++;
+        }
+        return depth;
+    }
+
+    // object median split along the widest centroid axis, same contract as
+    // splitSAH. halves the range, so the subtrees stay balancedDepth deep
+    uint32_t splitMedian(const BVHNode& node, Primitives& prims) {
+        if (node.triCount <= 1) {
+            return 0;
+        }
+        uint32_t first = node.leftFirst;
+        AABB centroidBounds = rangeCentroidBounds(prims, first,
+            first + node.triCount);
+        glm::vec3 extent = centroidBounds.bmax - centroidBounds.bmin;
+        int axis = extent.x > extent.y ? 0 : 1;
+        axis = extent.z > extent[axis] ? 2 : axis;
+
+        std::vector<uint32_t> sorted(node.triCount);
+        for (uint32_t i = 0; i < node.triCount; ++i) {
+            sorted[i] = first + i;
+        }
+        uint32_t half = node.triCount / 2;
+        std::nth_element(sorted.begin(), sorted.begin() + half, sorted.end(),
+            [&](uint32_t a, uint32_t b) {
+            return prims.centroids[a][axis] < prims.centroids[b][axis];
+        });
+
+        Primitives range;
+        for (uint32_t i : sorted) {
+            range.bounds.push_back(prims.bounds[i]);
+            range.centroids.push_back(prims.centroids[i]);
+            range.order.push_back(prims.order[i]);
+        }
+        std::copy(range.bounds.begin(), range.bounds.end(),
+            prims.bounds.begin() + first);
+        std::copy(range.centroids.begin(), range.centroids.end(),
+            prims.centroids.begin() + first);
+        std::copy(range.order.begin(), range.order.end(),
+            prims.order.begin() + first);
+        return half;
+    }
+
+    // adds the children of nodes[nodeIdx] with leftCount prims on the left,
+    // bounds are left to the caller
+    uint32_t addChildren(std::vector<BVHNode>& nodes, uint32_t nodeIdx,
+        uint32_t leftCount) {
+        uint32_t leftIdx = static_cast<uint32_t>(nodes.size());
+        BVHNode& node = nodes[nodeIdx];
+        BVHNode left{}, right{};
+        left.leftFirst = node.leftFirst;
+        left.triCount = leftCount;
+        right.leftFirst = node.leftFirst + leftCount;
+        right.triCount = node.triCount - leftCount;
+
+        node.leftFirst = leftIdx;
+        node.triCount = 0;
+        // node is not touched after this, push_back may reallocate
+        nodes.push_back(left);
+        nodes.push_back(right);
+        return leftIdx;
+    }
+
+    // binned SAH tree over prims [first, first + count), nodes[0] is the
+    // root and leaves index prims directly. SAH splits that would leave a
+    // child unable to fit below maxDepth become median splits, so the tree
+    // is at most max(maxDepth, balancedDepth(count)) deep
+    void buildRange(Primitives& prims, uint32_t first, uint32_t count,
+        uint32_t maxLeafSize, std::vector<BVHNode>& nodes,
+        uint32_t maxDepth = UINT32_MAX) {
+        nodes.clear();
+
+        BVHNode root{};
+        root.leftFirst = first;
+        root.triCount = count;
+        updateNodeBounds(root, prims);
+        nodes.push_back(root);
+        if (count == 0) {
+            return;
+        }
+        nodes.reserve(2 * count - 1);
+
+        // node index and its depth, the root is 1
+        std::vector<std::pair<uint32_t, uint32_t>> stack = { { 0, 1u } };
+        while (!stack.empty()) {
+            uint32_t nodeIdx = stack.back().first;
+            uint32_t nodeDepth = stack.back().second;
+            stack.pop_back();
+
+            const BVHNode& node = nodes[nodeIdx];
+            uint32_t leftCount = splitSAH(nodes[nodeIdx], prims, maxLeafSize);
+            uint32_t rightCount = node.triCount - leftCount;
+            uint32_t childLevels = nodeDepth + balancedDepth(
+                std::max(leftCount, rightCount));
+            if (leftCount > 0 && childLevels > maxDepth) {
+                leftCount = splitMedian(node, prims);
+            }
+            if (leftCount == 0) {
+                continue;
+            }
+            uint32_t leftIdx = addChildren(nodes, nodeIdx, leftCount);
+            updateNodeBounds(nodes[leftIdx], prims);
+            updateNodeBounds(nodes[leftIdx + 1], prims);
+
+            stack.push_back({ leftIdx, nodeDepth + 1 });
+            stack.push_back({ leftIdx + 1, nodeDepth + 1 });
+        }
+    }
+
+    // prims are reordered so every leaf owns a contiguous range
+    void build(Primitives& prims, uint32_t maxLeafSize,
+        std::vector<BVHNode>& nodes, uint32_t maxDepth = UINT32_MAX) {
+        buildRange(prims, 0, static_cast<uint32_t>(prims.order.size()),
+            maxLeafSize, nodes, maxDepth);
+    }
+
+    // 10 bits of v spread to every third bit
+    uint32_t expandBits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // stable lsd radix sort of keys with their values, 8 bits per pass.
+    // every chunk counts its digits, then scatters behind the chunks before
+    // it, so the passes run in parallel and stay stable
+    void radixSort(JobSystem* jobs, std::vector<uint32_t>& keys,
+        std::vector<uint32_t>& values) {
+        const uint32_t RADIX = 256;
+        uint32_t count = static_cast<uint32_t>(keys.size());
+        uint32_t chunks = chunkCount(jobs, count);
+        std::vector<uint32_t> tmpKeys(count), tmpValues(count);
+        std::vector<uint32_t> offsets(chunks * RADIX);
+
+        for (uint32_t shift = 0; shift < 32; shift += 8) {
+            std::fill(offsets.begin(), offsets.end(), 0u);
+            forChunks(jobs, chunks, 0, count,
+                [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+                uint32_t* counts = &offsets[chunk * RADIX];
+                for (uint32_t i = begin; i < end; ++i) {
+                    counts[(keys[i] >> shift) & (RADIX - 1)]++;
+                }
+            });
+
+            uint32_t sum = 0;
+            for (uint32_t digit = 0; digit < RADIX; ++digit) {
+                for (uint32_t chunk = 0; chunk < chunks; ++chunk) {
+                    uint32_t digitCount = offsets[chunk * RADIX + digit];
+                    offsets[chunk * RADIX + digit] = sum;
+                    sum += digitCount;
+                }
+            }
+
+            forChunks(jobs, chunks, 0, count,
+                [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+                uint32_t* next = &offsets[chunk * RADIX];
+                for (uint32_t i = begin; i < end; ++i) {
+                    uint32_t to = next[(keys[i] >> shift) & (RADIX - 1)]++;
+                    tmpKeys[to] = keys[i];
+                    tmpValues[to] = values[i];
+                }
+            });
+            keys.swap(tmpKeys);
+            values.swap(tmpValues);
+        }
+    }
+
+    // sorts prims along a 30 bit morton curve over their centroids,
+    // codes come back in the same order
+    void sortMorton(JobSystem* jobs, Primitives& prims,
+        std::vector<uint32_t>& codes) {
+        uint32_t count = static_cast<uint32_t>(prims.order.size());
+        AABB centroidBounds = parallelBounds(jobs, 0, count,
+            [&](uint32_t begin, uint32_t end) {
+            return rangeCentroidBounds(prims, begin, end);
+        });
+        glm::vec3 extent = centroidBounds.bmax - centroidBounds.bmin;
+        glm::vec3 scale(0.0f);
+        for (int axis = 0; axis < 3; ++axis) {
+            scale[axis] = extent[axis] > 0.0f ? 1023.0f / extent[axis] : 0.0f;
+        }
+
+        uint32_t chunks = chunkCount(jobs, count);
+        codes.resize(count);
+        std::vector<uint32_t> indices(count);
+        forChunks(jobs, chunks, 0, count,
+            [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                glm::vec3 p = (prims.centroids[i] - centroidBounds.bmin) * scale;
+                codes[i] = expandBits(static_cast<uint32_t>(p.x)) << 2
+                    | expandBits(static_cast<uint32_t>(p.y)) << 1
+                    | expandBits(static_cast<uint32_t>(p.z));
+                indices[i] = i;
+            }
+        });
+        radixSort(jobs, codes, indices);
+
+        Primitives sorted;
+        sorted.bounds.resize(count);
+        sorted.centroids.resize(count);
+        sorted.order.resize(count);
+        forChunks(jobs, chunks, 0, count,
+            [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                sorted.bounds[i] = prims.bounds[indices[i]];
+                sorted.centroids[i] = prims.centroids[indices[i]];
+                sorted.order[i] = prims.order[indices[i]];
+            }
+        });
+        prims = std::move(sorted);
+    }
+
+    // splits a range of sorted codes where its highest differing bit
+    // flips, or in the middle when all codes are equal. 0 keeps a leaf
+    uint32_t splitMorton(const BVHNode& node,
+        const std::vector<uint32_t>& codes) {
+        if (node.triCount <= LBVH_LEAF_SIZE) {
+            return 0;
+        }
+        uint32_t first = node.leftFirst;
+        uint32_t last = first + node.triCount - 1;
+        uint32_t differing = codes[first] ^ codes[last];
+        if (differing == 0) {
+            return node.triCount / 2;
+        }
+        while (differing & (differing - 1)) {
+            differing &= differing - 1;
+        }
+        // first code with the bit set and the prefix above it unchanged
+        uint32_t rightStart = codes[last] & ~(differing - 1);
+        auto split = std::lower_bound(codes.begin() + first,
+            codes.begin() + last + 1, rightStart);
+        return static_cast<uint32_t>(split - (codes.begin() + first));
+    }
+
+    // lbvh over sorted prims [first, first + count), the hierarchy first,
+    // then bounds from the leaves up since children follow their parents
+    void buildMortonRange(const Primitives& prims,
+        const std::vector<uint32_t>& codes, uint32_t first, uint32_t count,
+        std::vector<BVHNode>& nodes) {
+        nodes.clear();
+        BVHNode root{};
+        root.leftFirst = first;
+        root.triCount = count;
+        nodes.push_back(root);
+        if (count == 0) {
+            updateNodeBounds(nodes[0], prims);
+            return;
+        }
+        nodes.reserve(2 * count - 1);
+
+        std::vector<uint32_t> stack = { 0 };
+        while (!stack.empty()) {
+            uint32_t nodeIdx = stack.back();
+            stack.pop_back();
+
+            uint32_t leftCount = splitMorton(nodes[nodeIdx], codes);
+            if (leftCount == 0) {
+                continue;
+            }
+            uint32_t leftIdx = addChildren(nodes, nodeIdx, leftCount);
+            stack.push_back(leftIdx);
+            stack.push_back(leftIdx + 1);
+        }
+
+        for (size_t i = nodes.size(); i-- > 0;) {
+            BVHNode& node = nodes[i];
+            if (node.triCount > 0) {
+                updateNodeBounds(node, prims);
+                continue;
+            }
+            const BVHNode& left = nodes[node.leftFirst];
+            const BVHNode& right = nodes[node.leftFirst + 1];
+            node.aabbMin = glm::min(left.aabbMin, right.aabbMin);
+            node.aabbMax = glm::max(left.aabbMax, right.aabbMax);
+        }
+    }
+
+    // links a subtree built on its own in place of the leaf at nodeIdx,
+    // its other nodes go to the end of nodes
+    void spliceSubtree(std::vector<BVHNode>& nodes, uint32_t nodeIdx,
+        const std::vector<BVHNode>& subtree) {
+        // subtree node j > 0 lands at base + j
+        uint32_t base = static_cast<uint32_t>(nodes.size()) - 1;
+        for (size_t j = 1; j < subtree.size(); ++j) {
+            BVHNode node = subtree[j];
+            node.leftFirst += node.triCount > 0 ? 0 : base;
+            nodes.push_back(node);
+        }
+        BVHNode root = subtree[0];
+        root.leftFirst += root.triCount > 0 ? 0 : base;
+        nodes[nodeIdx] = root;
+    }
+
+    // splits the top of the tree on the calling thread, binning and bounds
+    // spread over jobs, until every open range fits one job. those ranges
+    // are built as parallel jobs with buildSubtree and linked in.
+    // split(node, jobs) returns the left count like splitSAH
+    template <typename Split, typename BuildSubtree>
+    void buildTopDown(JobSystem* jobs, Primitives& prims,
+        std::vector<BVHNode>& nodes, Split split, BuildSubtree buildSubtree) {
+        uint32_t primCount = static_cast<uint32_t>(prims.order.size());
+        uint32_t subtreeSize = jobs
+            ? std::max(primCount / (jobs->concurrency() * SUBTREES_PER_THREAD),
+                MIN_CHUNK_SIZE)
+            : primCount;
+
+        nodes.clear();
+        BVHNode root{};
+        root.leftFirst = 0;
+        root.triCount = primCount;
+        updateNodeBounds(root, prims, jobs);
+        nodes.push_back(root);
+
+        std::vector<uint32_t> open = { 0 };
+        std::vector<uint32_t> subtrees;
+        while (!open.empty()) {
+            uint32_t nodeIdx = open.back();
+            open.pop_back();
+            if (nodes[nodeIdx].triCount <= subtreeSize) {
+                subtrees.push_back(nodeIdx);
+                continue;
+            }
+
+            uint32_t leftCount = split(nodes[nodeIdx], jobs);
+            if (leftCount == 0) {
+                continue;
+            }
+            uint32_t leftIdx = addChildren(nodes, nodeIdx, leftCount);
+            updateNodeBounds(nodes[leftIdx], prims, jobs);
+            updateNodeBounds(nodes[leftIdx + 1], prims, jobs);
+            open.push_back(leftIdx);
+            open.push_back(leftIdx + 1);
+        }
+
+        std::vector<std::vector<BVHNode>> built(subtrees.size());
+        auto buildOne = [&](uint32_t i) {
+            const BVHNode& leaf = nodes[subtrees[i]];
+            buildSubtree(leaf.leftFirst, leaf.triCount, built[i]);
+        };
+        if (jobs) {
+            jobs->parallelFor(static_cast<uint32_t>(subtrees.size()), buildOne);
+        }
+        else {
+            for (uint32_t i = 0; i < subtrees.size(); ++i) {
+                buildOne(i);
+            }
+        }
+
+        size_t nodeCount = nodes.size();
+        for (const auto& subtree : built) {
+            nodeCount += subtree.size() - 1;
+        }
+        nodes.reserve(nodeCount);
+        for (size_t i = 0; i < subtrees.size(); ++i) {
+            spliceSubtree(nodes, subtrees[i], built[i]);
+        }
+    }
+
+    // the tree for mode over triangle prims, prims end in leaf order
+    void buildPrimitives(JobSystem* jobs, bvh::BuildMode mode,
+        Primitives& prims, std::vector<BVHNode>& nodes) {
+        if (mode == bvh::BuildMode::LBVH) {
+            std::vector<uint32_t> codes;
+            sortMorton(jobs, prims, codes);
+            buildTopDown(jobs, prims, nodes,
+                [&](const BVHNode& node, JobSystem*) {
+                return splitMorton(node, codes);
+            },
+                [&](uint32_t first, uint32_t count,
+                    std::vector<BVHNode>& subtree) {
+                buildMortonRange(prims, codes, first, count, subtree);
+            });
+            return;
+        }
+        buildTopDown(jobs, prims, nodes,
+            [&](const BVHNode& node, JobSystem* splitJobs) {
+            return splitSAH(node, prims, MAX_LEAF_SIZE, splitJobs);
+        },
+            [&](uint32_t first, uint32_t count, std::vector<BVHNode>& subtree) {
+            buildRange(prims, first, count, MAX_LEAF_SIZE, subtree);
+        });
+    }
+
+    void reorderTriangles(Triangle* triangles, const Primitives& prims,
+        JobSystem* jobs) {
+        uint32_t count = static_cast<uint32_t>(prims.order.size());
+        std::vector<Triangle> sorted(count);
+        forChunks(jobs, chunkCount(jobs, count), 0, count,
+            [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i) {
+                sorted[i] = triangles[prims.order[i]];
+            }
+        });
+        std::copy(sorted.begin(), sorted.end(), triangles);
+    }
+
+    // builds over count triangles from triangles on, reordered into leaf
+    // order. jobs may be null
+    void buildTriangles(JobSystem* jobs, bvh::BuildMode mode,
+        Triangle* triangles, uint32_t count, std::vector<BVHNode>& nodes) {
+        Primitives prims = trianglePrimitives(triangles, count, jobs);
+        buildPrimitives(jobs, mode, prims, nodes);
+        reorderTriangles(triangles, prims, jobs);
+    }
+
+    // the center moves with the transform, every axis of the extent adds
+    // its absolute projection
+    AABB transformBox(const glm::mat4& transform, const glm::vec3& boxMin,
+        const glm::vec3& boxMax) {
+        glm::vec3 center = 0.5f * (boxMin + boxMax);
+        glm::vec3 extent = 0.5f * (boxMax - boxMin);
+        glm::vec3 worldCenter = glm::vec3(transform * glm::vec4(center, 1.0f));
+        glm::vec3 worldExtent(0.0f);
+        for (int axis = 0; axis < 3; ++axis) {
+            glm::vec3 column = glm::vec3(transform[axis]);
+            worldExtent += glm::abs(column) * extent[axis];
+        }
+        AABB box;
+        box.bmin = worldCenter - worldExtent;
+        box.bmax = worldCenter + worldExtent;
+        return box;
+    }
+}
+
+namespace bvh {
+    void buildBinnedSAH(std::vector<Triangle>& triangles,
+        std::vector<BVHNode>& nodes) {
+        buildTriangles(nullptr, BuildMode::BinnedSAH, triangles.data(),
+            static_cast<uint32_t>(triangles.size()), nodes);
+    }
+
+    void buildParallel(JobSystem& jobs, BuildMode mode,
+        std::vector<Triangle>& triangles, std::vector<BVHNode>& nodes) {
+        buildTriangles(&jobs, mode, triangles.data(),
+            static_cast<uint32_t>(triangles.size()), nodes);
+    }
+
+    uint32_t appendBottomLevel(std::vector<Triangle>& triangles,
+        uint32_t first, uint32_t count, std::vector<BVHNode>& nodes) {
+        return appendBottomLevel(nullptr, BuildMode::BinnedSAH, triangles,
+            first, count, nodes);
+    }
+
+    uint32_t appendBottomLevel(JobSystem* jobs, BuildMode mode,
+        std::vector<Triangle>& triangles, uint32_t first, uint32_t count,
+        std::vector<BVHNode>& nodes) {
+        std::vector<BVHNode> meshNodes;
+        buildTriangles(jobs, mode, triangles.data() + first, count, meshNodes);
+
+        uint32_t root = static_cast<uint32_t>(nodes.size());
+        for (BVHNode node : meshNodes) {
+            node.leftFirst += node.triCount > 0 ? first : root;
+            nodes.push_back(node);
+        }
+        return root;
+    }
+
+    uint32_t buildTopLevel(const std::vector<BVHNode>& nodes,
+        const std::vector<uint32_t>& roots,
+        const std::vector<glm::mat4>& objectToWorld,
+        std::vector<BVHInstance>& instances,
+        std::vector<BVHNode>& topLevelNodes) {
+        uint32_t count = static_cast<uint32_t>(roots.size());
+        Primitives prims;
+        prims.bounds.resize(count);
+        prims.centroids.resize(count);
+        prims.order.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            const BVHNode& root = nodes[roots[i]];
+            prims.bounds[i] = transformBox(objectToWorld[i],
+                root.aabbMin, root.aabbMax);
+            prims.centroids[i] =
+                0.5f * (prims.bounds[i].bmin + prims.bounds[i].bmax);
+            prims.order[i] = i;
+        }
+
+        // one instance per leaf, testing one costs a whole bottom level.
+        // kept shallow enough for the walk in raytracing.comp
+        build(prims, 1, topLevelNodes, RT_TOP_LEVEL_STACK_SIZE + 1);
+
+        instances.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t source = prims.order[i];
+            instances[i] = BVHInstance{};
+            instances[i].worldToObject = glm::inverse(objectToWorld[source]);
+            instances[i].rootNode = roots[source];
+        }
+        return count > 0 ? depth(topLevelNodes) : 0;
+    }
+
+    float sahCost(const std::vector<BVHNode>& nodes) {
+        if (nodes.empty()) {
+            return 0.0f;
+        }
+        float rootArea = nodeArea(nodes[0]);
+        if (rootArea <= 0.0f) {
+            return 0.0f;
+        }
+        float cost = 0.0f;
+        for (const auto& node : nodes) {
+            float area = nodeArea(node);
+            cost += node.triCount > 0
+                ? area * node.triCount : area * SAH_TRAVERSAL_COST;
+        }
+        return cost / rootArea;
+    }
+
+    uint32_t depth(const std::vector<BVHNode>& nodes, uint32_t root) {
+        uint32_t deepest = 0;
+        std::vector<std::pair<uint32_t, uint32_t>> stack = { { root, 1u } };
+        while (!stack.empty()) {
+            uint32_t nodeIdx = stack.back().first;
+            uint32_t nodeDepth = stack.back().second;
+            stack.pop_back();
+            deepest = std::max(deepest, nodeDepth);
+            const BVHNode& node = nodes[nodeIdx];
+            if (node.triCount == 0) {
+                stack.push_back({ node.leftFirst, nodeDepth + 1 });
+                stack.push_back({ node.leftFirst + 1, nodeDepth + 1 });
+            }
+        }
+        return deepest;
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "app_util.h"
+#include "job_system.h"
+
+// flattened bvh node, same layout as BVHNode in shaders/raytracing.comp
+// interior node: leftFirst is the left child, right child is leftFirst + 1
+// leaf node: leftFirst is the first triangle, triCount > 0
+struct BVHNode {
+    glm::vec3 aabbMin;
+    uint32_t leftFirst;
+    glm::vec3 aabbMax;
+    uint32_t triCount;
+};
+
+// one placed mesh of the top level, same layout as BVHInstance in
+// shaders/raytracing.comp. worldToObject takes rays into the space the
+// mesh's bottom level was built in, rootNode is that bottom level's root
+struct BVHInstance {
+    glm::mat4 worldToObject;
+    uint32_t rootNode;
+    uint32_t pad[3];
+};
+
+namespace bvh {
+    enum class BuildMode {
+        // binned SAH, the better tree to trace
+        BinnedSAH,
+        // morton codes sorted by radix sort, split where the codes differ.
+        // builds several times faster, traces slower
+        LBVH
+    };
+
+    // build a binned SAH bvh over triangles
+    // triangles are reordered in place so every leaf owns a contiguous range
+    void buildBinnedSAH(std::vector<Triangle>& triangles,
+        std::vector<BVHNode>& nodes);
+
+    // same on the threads of jobs. the top of the tree is split on the
+    // caller with binning spread over jobs, the subtrees below are built
+    // as one job each. BinnedSAH gives the tree buildBinnedSAH gives, with
+    // the nodes in another order
+    void buildParallel(JobSystem& jobs, BuildMode mode,
+        std::vector<Triangle>& triangles, std::vector<BVHNode>& nodes);
+
+    // bottom level over the count > 0 triangles from first on, appended to
+    // nodes that several meshes share. child and triangle indices point
+    // into the shared arrays, returns the root
+    uint32_t appendBottomLevel(std::vector<Triangle>& triangles,
+        uint32_t first, uint32_t count, std::vector<BVHNode>& nodes);
+    // built with buildParallel when jobs isn't null
+    uint32_t appendBottomLevel(JobSystem* jobs, BuildMode mode,
+        std::vector<Triangle>& triangles, uint32_t first, uint32_t count,
+        std::vector<BVHNode>& nodes);
+
+    // top level over instances of the bottom levels at roots, placed by
+    // objectToWorld. leaves index instances, which come back in leaf order.
+    // SAH splits that would go deeper than the shader's stack can walk
+    // become median splits, so any instance count fits. returns the depth
+    // of the top level, 0 without instances
+    uint32_t buildTopLevel(const std::vector<BVHNode>& nodes,
+        const std::vector<uint32_t>& roots,
+        const std::vector<glm::mat4>& objectToWorld,
+        std::vector<BVHInstance>& instances,
+        std::vector<BVHNode>& topLevelNodes);
+
+    // SAH cost of the tree relative to the root surface area
+    float sahCost(const std::vector<BVHNode>& nodes);
+
+    // nodes on the longest path from root to a leaf, 1 for a lone leaf.
+    // the near-first walk in raytracing.comp keeps up to depth - 1 far
+    // children on its stack
+    uint32_t depth(const std::vector<BVHNode>& nodes, uint32_t root = 0);
+}
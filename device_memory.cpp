@@ -0,0 +1,284 @@
+#include "device_memory.h"
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+    VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+        // vulkan alignments are always powers of two
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+}
+
+void DeviceMemoryAllocator::init(VkDevice device,
+    VkPhysicalDevice physicalDevice, VkDeviceSize blockSize) {
+    device_ = device;
+    block_size_ = blockSize;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memory_properties_);
+}
+
+AppAllocation DeviceMemoryAllocator::allocate(
+    const VkMemoryRequirements& requirements,
+    VkMemoryPropertyFlags properties, bool linear) {
+
+    uint32_t memoryTypeIndex =
+        findMemoryType(requirements.memoryTypeBits, properties);
+    uint32_t poolIndex = findPool(memoryTypeIndex, linear);
+    Pool& pool = pools_[poolIndex];
+
+    VkDeviceSize offset = 0;
+    uint32_t blockIndex = static_cast<uint32_t>(pool.blocks.size());
+
+    // anything bigger than half a block gets a block of its own
+    if (requirements.size > block_size_ / 2) {
+        blockIndex = createBlock(pool, requirements.size);
+        allocateFromBlock(pool.blocks[blockIndex], requirements.size,
+            requirements.alignment, offset);
+    }
+    else {
+        for (uint32_t i = 0; i < pool.blocks.size(); ++i) {
+            Block& block = pool.blocks[i];
+            if (block.memory != VK_NULL_HANDLE && block.size == block_size_
+                && allocateFromBlock(block, requirements.size,
+                    requirements.alignment, offset)) {
+                blockIndex = i;
+                break;
+            }
+        }
+        if (blockIndex == pool.blocks.size()) {
+            blockIndex = createBlock(pool, block_size_);
+            allocateFromBlock(pool.blocks[blockIndex], requirements.size,
+                requirements.alignment, offset);
+        }
+    }
+
+    Block& block = pool.blocks[blockIndex];
+    block.allocationCount++;
+    block.used += requirements.size;
+
+    AppAllocation allocation;
+    allocation.memory = block.memory;
+    allocation.offset = offset;
+    allocation.size = requirements.size;
+    allocation.poolIndex = poolIndex;
+    allocation.blockIndex = blockIndex;
+    if (block.mapped) {
+        allocation.mapped = static_cast<char*>(block.mapped) + offset;
+    }
+    return allocation;
+}
+
+void DeviceMemoryAllocator::free(AppAllocation& allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) {
+        return;
+    }
+
+    Pool& pool = pools_[allocation.poolIndex];
+    Block& block = pool.blocks[allocation.blockIndex];
+
+    // insert the range back in offset order and merge with its neighbours
+    auto& ranges = block.freeRanges;
+    size_t i = 0;
+    while (i < ranges.size() && ranges[i].offset < allocation.offset) {
+        ++i;
+    }
+    ranges.insert(ranges.begin() + i, { allocation.offset, allocation.size });
+    if (i + 1 < ranges.size()
+        && ranges[i].offset + ranges[i].size == ranges[i + 1].offset) {
+        ranges[i].size += ranges[i + 1].size;
+        ranges.erase(ranges.begin() + i + 1);
+    }
+    if (i > 0 && ranges[i - 1].offset + ranges[i - 1].size == ranges[i].offset) {
+        ranges[i - 1].size += ranges[i].size;
+        ranges.erase(ranges.begin() + i);
+    }
+
+    block.allocationCount--;
+    block.used -= allocation.size;
+
+    // dedicated blocks go back to the driver right away. one empty regular
+    // block per pool is kept so staging buffers don't allocate a new block
+    // every upload, any other empty one is released
+    if (block.allocationCount == 0
+        && (block.size != block_size_ || hasSpareBlock(pool, block))) {
+        releaseBlock(block);
+    }
+
+    allocation = AppAllocation();
+}
+
+void DeviceMemoryAllocator::printStats() const {
+    VkDeviceSize totalReserved = 0, totalUsed = 0;
+    uint32_t totalAllocations = 0;
+
+    std::cout << "device memory:" << std::endl;
+    for (const auto& pool : pools_) {
+        VkDeviceSize reserved = 0, used = 0;
+        uint32_t blockCount = 0, allocations = 0;
+        size_t freeRanges = 0;
+        for (const auto& block : pool.blocks) {
+            if (block.memory == VK_NULL_HANDLE) {
+                continue;
+            }
+            blockCount++;
+            reserved += block.size;
+            used += block.used;
+            allocations += block.allocationCount;
+            freeRanges += block.freeRanges.size();
+        }
+        if (blockCount == 0) {
+            continue;
+        }
+
+        std::cout << "  type " << pool.memoryTypeIndex
+            << (pool.linear ? " linear" : " optimal")
+            << (pool.hostVisible ? " host" : " device")
+            << ": " << allocations << " allocations in "
+            << blockCount << " blocks, "
+            << used / 1024 << " / " << reserved / 1024 << " KB used, "
+            << freeRanges << " free ranges" << std::endl;
+
+        totalReserved += reserved;
+        totalUsed += used;
+        totalAllocations += allocations;
+    }
+
+    std::cout << "  total: " << totalAllocations << " allocations, "
+        << device_allocation_count_ << " vkAllocateMemory blocks (peak "
+        << peak_device_allocation_count_ << "), "
+        << totalUsed / (1024 * 1024) << " / "
+        << totalReserved / (1024 * 1024) << " MB used" << std::endl;
+}
+
+void DeviceMemoryAllocator::destroy() {
+    for (auto& pool : pools_) {
+        for (auto& block : pool.blocks) {
+            if (block.memory == VK_NULL_HANDLE) {
+                continue;
+            }
+            if (block.mapped) {
+                vkUnmapMemory(device_, block.memory);
+            }
+            vkFreeMemory(device_, block.memory, nullptr);
+        }
+    }
+    pools_.clear();
+    device_allocation_count_ = 0;
+}
+
+uint32_t DeviceMemoryAllocator::findMemoryType(uint32_t typeFilter,
+    VkMemoryPropertyFlags properties) const {
+    for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; i++) {
+        if ((typeFilter & (1 << i))
+            && (memory_properties_.memoryTypes[i].propertyFlags & properties)
+            == properties) {
+            return i;
+        }
+    }
+
+    throw std::runtime_error("failed to find suitable memory type!");
+}
+
+uint32_t DeviceMemoryAllocator::findPool(uint32_t memoryTypeIndex,
+    bool linear) {
+    for (uint32_t i = 0; i < pools_.size(); ++i) {
+        if (pools_[i].memoryTypeIndex == memoryTypeIndex
+            && pools_[i].linear == linear) {
+            return i;
+        }
+    }
+
+    Pool pool;
+    pool.memoryTypeIndex = memoryTypeIndex;
+    pool.linear = linear;
+    pool.hostVisible = (memory_properties_.memoryTypes[memoryTypeIndex]
+        .propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+    pools_.push_back(pool);
+    return static_cast<uint32_t>(pools_.size() - 1);
+}
+
+bool DeviceMemoryAllocator::hasSpareBlock(const Pool& pool,
+    const Block& except) const {
+    for (const auto& block : pool.blocks) {
+        if (&block != &except && block.memory != VK_NULL_HANDLE
+            && block.size == block_size_ && block.allocationCount == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DeviceMemoryAllocator::releaseBlock(Block& block) {
+    if (block.mapped) {
+        vkUnmapMemory(device_, block.memory);
+    }
+    vkFreeMemory(device_, block.memory, nullptr);
+    // the slot stays so indices of other blocks don't move
+    block = Block();
+    device_allocation_count_--;
+}
+
+uint32_t DeviceMemoryAllocator::createBlock(Pool& pool, VkDeviceSize size) {
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = pool.memoryTypeIndex;
+
+    Block block;
+    if (vkAllocateMemory(device_, &allocInfo, nullptr, &block.memory)
+        != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate device memory block!");
+    }
+    block.size = size;
+    block.freeRanges.push_back({ 0, size });
+
+    // mapped once here, vkMapMemory can't be called per sub-allocation
+    if (pool.hostVisible) {
+        if (vkMapMemory(device_, block.memory, 0, VK_WHOLE_SIZE, 0,
+            &block.mapped) != VK_SUCCESS) {
+            throw std::runtime_error("failed to map device memory block!");
+        }
+    }
+
+    device_allocation_count_++;
+    if (device_allocation_count_ > peak_device_allocation_count_) {
+        peak_device_allocation_count_ = device_allocation_count_;
+    }
+
+    // reuse a slot left by a released block so indices stay stable
+    for (uint32_t i = 0; i < pool.blocks.size(); ++i) {
+        if (pool.blocks[i].memory == VK_NULL_HANDLE) {
+            pool.blocks[i] = block;
+            return i;
+        }
+    }
+    pool.blocks.push_back(block);
+    return static_cast<uint32_t>(pool.blocks.size() - 1);
+}
+
+bool DeviceMemoryAllocator::allocateFromBlock(Block& block, VkDeviceSize size,
+    VkDeviceSize alignment, VkDeviceSize& offset) {
+    // first fit
+    auto& ranges = block.freeRanges;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        FreeRange range = ranges[i];
+        VkDeviceSize alignedOffset = alignUp(range.offset, alignment);
+        VkDeviceSize padding = alignedOffset - range.offset;
+        if (padding + size > range.size) {
+            continue;
+        }
+
+        offset = alignedOffset;
+        ranges.erase(ranges.begin() + i);
+        // the tail goes back first so the padding ends up in front of it
+        VkDeviceSize tail = range.size - padding - size;
+        if (tail > 0) {
+            ranges.insert(ranges.begin() + i,
+                { alignedOffset + size, tail });
+        }
+        if (padding > 0) {
+            ranges.insert(ranges.begin() + i, { range.offset, padding });
+        }
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include <vector>
+
+// a range inside one of DeviceMemoryAllocator's blocks
+// bind with memory + offset, never vkFreeMemory/vkMapMemory it directly
+struct AppAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    // host visible blocks stay mapped, this already points at offset
+    void* mapped = nullptr;
+    uint32_t poolIndex = 0;
+    uint32_t blockIndex = 0;
+};
+
+// sub-allocates resources out of large VkDeviceMemory blocks
+// one pool per (memory type, linear/optimal) pair so buffers and optimal
+// images never share a block and bufferImageGranularity can be ignored
+// each block keeps a sorted free list, neighbours are merged on free.
+// empty blocks are released except one spare per pool
+class DeviceMemoryAllocator
+{
+public:
+    static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+
+    void init(VkDevice device, VkPhysicalDevice physicalDevice,
+        VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE);
+    // linear is true for buffers and linear tiled images
+    AppAllocation allocate(const VkMemoryRequirements& requirements,
+        VkMemoryPropertyFlags properties, bool linear);
+    void free(AppAllocation& allocation);
+    void printStats() const;
+    // releases every block, all resources must be destroyed by now
+    void destroy();
+
+private:
+    struct FreeRange {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    struct Block {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        VkDeviceSize used = 0;
+        void* mapped = nullptr;
+        uint32_t allocationCount = 0;
+        // sorted by offset
+        std::vector<FreeRange> freeRanges;
+    };
+
+    struct Pool {
+        uint32_t memoryTypeIndex;
+        bool linear;
+        bool hostVisible;
+        std::vector<Block> blocks;
+    };
+
+    uint32_t findMemoryType(uint32_t typeFilter,
+        VkMemoryPropertyFlags properties) const;
+    uint32_t findPool(uint32_t memoryTypeIndex, bool linear);
+    uint32_t createBlock(Pool& pool, VkDeviceSize size);
+    // true if pool has an empty regular block other than except
+    bool hasSpareBlock(const Pool& pool, const Block& except) const;
+    void releaseBlock(Block& block);
+    bool allocateFromBlock(Block& block, VkDeviceSize size,
+        VkDeviceSize alignment, VkDeviceSize& offset);
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memory_properties_;
+    VkDeviceSize block_size_ = DEFAULT_BLOCK_SIZE;
+    std::vector<Pool> pools_;
+    // live vkAllocateMemory blocks, what maxMemoryAllocationCount limits
+    uint32_t device_allocation_count_ = 0;
+    uint32_t peak_device_allocation_count_ = 0;
+};
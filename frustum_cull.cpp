@@ -0,0 +1,219 @@
+#include "frustum_cull.h"
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FRUSTUM_CULL_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FRUSTUM_CULL_SSE
+#endif
+
+namespace {
+    // a box is outside a plane when even its corner furthest along the
+    // normal is behind it, that corner is center + |normal| * extent away
+    bool boxInside(const frustumcull::Frustum& frustum,
+        const frustumcull::Boxes& boxes, size_t i) {
+        for (const glm::vec4& plane : frustum.planes) {
+            // summed in the same order as the simd paths
+            float distance =
+                ((plane.x * boxes.centerX[i] + plane.y * boxes.centerY[i])
+                    + (plane.z * boxes.centerZ[i] + plane.w))
+                + ((std::fabs(plane.x) * boxes.extentX[i]
+                    + std::fabs(plane.y) * boxes.extentY[i])
+                    + std::fabs(plane.z) * boxes.extentZ[i]);
+            if (distance < 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t cullTail(const frustumcull::Frustum& frustum,
+        const frustumcull::Boxes& boxes, size_t first, uint32_t* visible,
+        size_t count) {
+        for (size_t i = first; i < boxes.size(); ++i) {
+            visible[count] = static_cast<uint32_t>(i);
+            count += boxInside(frustum, boxes, i) ? 1 : 0;
+        }
+        return count;
+    }
+}
+
+namespace frustumcull {
+    Frustum fromViewProj(const glm::mat4& viewProj) {
+        glm::vec4 rows[4];
+        for (int i = 0; i < 4; ++i) {
+            rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i],
+                viewProj[2][i], viewProj[3][i]);
+        }
+        Frustum frustum;
+        frustum.planes[0] = rows[3] + rows[0];
+        frustum.planes[1] = rows[3] - rows[0];
+        frustum.planes[2] = rows[3] + rows[1];
+        frustum.planes[3] = rows[3] - rows[1];
+        frustum.planes[4] = rows[2];
+        frustum.planes[5] = rows[3] - rows[2];
+        return frustum;
+    }
+
+    void Boxes::resize(size_t count) {
+        for (std::vector<float>* values : { &centerX, &centerY, &centerZ,
+            &extentX, &extentY, &extentZ }) {
+            values->resize(count);
+        }
+    }
+
+    void Boxes::set(size_t index, const glm::vec3& boxMin,
+        const glm::vec3& boxMax) {
+        centerX[index] = 0.5f * (boxMin.x + boxMax.x);
+        centerY[index] = 0.5f * (boxMin.y + boxMax.y);
+        centerZ[index] = 0.5f * (boxMin.z + boxMax.z);
+        extentX[index] = 0.5f * (boxMax.x - boxMin.x);
+        extentY[index] = 0.5f * (boxMax.y - boxMin.y);
+        extentZ[index] = 0.5f * (boxMax.z - boxMin.z);
+    }
+
+    void transformBox(const glm::mat4& transform,
+        const glm::vec3& boxMin, const glm::vec3& boxMax,
+        glm::vec3& outMin, glm::vec3& outMax) {
+        // the center moves with the transform, every axis of the extent
+        // adds its absolute projection onto the world axes
+        glm::vec3 center = 0.5f * (boxMin + boxMax);
+        glm::vec3 extent = 0.5f * (boxMax - boxMin);
+        glm::vec3 worldCenter(transform * glm::vec4(center, 1.0f));
+        glm::vec3 worldExtent(0.0f);
+        for (int column = 0; column < 3; ++column) {
+            for (int row = 0; row < 3; ++row) {
+                worldExtent[row] +=
+                    std::fabs(transform[column][row]) * extent[column];
+            }
+        }
+        outMin = worldCenter - worldExtent;
+        outMax = worldCenter + worldExtent;
+    }
+
+    size_t cullScalar(const Frustum& frustum, const Boxes& boxes,
+        uint32_t* visible) {
+        return cullTail(frustum, boxes, 0, visible, 0);
+    }
+
+    const char* instructionSet() {
+#if defined(FRUSTUM_CULL_AVX)
+        return "avx";
+#elif defined(FRUSTUM_CULL_SSE)
+        return "sse";
+#else
+        return "scalar";
+#endif
+    }
+
+#if defined(FRUSTUM_CULL_AVX)
+    size_t cull(const Frustum& frustum, const Boxes& boxes,
+        uint32_t* visible) {
+        __m256 normalX[6], normalY[6], normalZ[6], offset[6];
+        __m256 absX[6], absY[6], absZ[6];
+        for (int p = 0; p < 6; ++p) {
+            const glm::vec4& plane = frustum.planes[p];
+            normalX[p] = _mm256_set1_ps(plane.x);
+            normalY[p] = _mm256_set1_ps(plane.y);
+            normalZ[p] = _mm256_set1_ps(plane.z);
+            offset[p] = _mm256_set1_ps(plane.w);
+            absX[p] = _mm256_set1_ps(std::fabs(plane.x));
+            absY[p] = _mm256_set1_ps(std::fabs(plane.y));
+            absZ[p] = _mm256_set1_ps(std::fabs(plane.z));
+        }
+        const __m256 zero = _mm256_setzero_ps();
+
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 8 <= boxes.size(); i += 8) {
+            __m256 cx = _mm256_loadu_ps(&boxes.centerX[i]);
+            __m256 cy = _mm256_loadu_ps(&boxes.centerY[i]);
+            __m256 cz = _mm256_loadu_ps(&boxes.centerZ[i]);
+            __m256 ex = _mm256_loadu_ps(&boxes.extentX[i]);
+            __m256 ey = _mm256_loadu_ps(&boxes.extentY[i]);
+            __m256 ez = _mm256_loadu_ps(&boxes.extentZ[i]);
+
+            __m256 inside = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+            for (int p = 0; p < 6; ++p) {
+                __m256 distance = _mm256_add_ps(
+                    _mm256_add_ps(
+                        _mm256_add_ps(_mm256_mul_ps(normalX[p], cx),
+                            _mm256_mul_ps(normalY[p], cy)),
+                        _mm256_add_ps(_mm256_mul_ps(normalZ[p], cz),
+                            offset[p])),
+                    _mm256_add_ps(
+                        _mm256_add_ps(_mm256_mul_ps(absX[p], ex),
+                            _mm256_mul_ps(absY[p], ey)),
+                        _mm256_mul_ps(absZ[p], ez)));
+                inside = _mm256_and_ps(inside,
+                    _mm256_cmp_ps(distance, zero, _CMP_GE_OQ));
+            }
+
+            // branchless compaction, every lane is written and only the
+            // inside ones advance count
+            int mask = _mm256_movemask_ps(inside);
+            for (int lane = 0; lane < 8; ++lane) {
+                visible[count] = static_cast<uint32_t>(i + lane);
+                count += (mask >> lane) & 1;
+            }
+        }
+        return cullTail(frustum, boxes, i, visible, count);
+    }
+#elif defined(FRUSTUM_CULL_SSE)
+    size_t cull(const Frustum& frustum, const Boxes& boxes,
+        uint32_t* visible) {
+        __m128 normalX[6], normalY[6], normalZ[6], offset[6];
+        __m128 absX[6], absY[6], absZ[6];
+        for (int p = 0; p < 6; ++p) {
+            const glm::vec4& plane = frustum.planes[p];
+            normalX[p] = _mm_set1_ps(plane.x);
+            normalY[p] = _mm_set1_ps(plane.y);
+            normalZ[p] = _mm_set1_ps(plane.z);
+            offset[p] = _mm_set1_ps(plane.w);
+            absX[p] = _mm_set1_ps(std::fabs(plane.x));
+            absY[p] = _mm_set1_ps(std::fabs(plane.y));
+            absZ[p] = _mm_set1_ps(std::fabs(plane.z));
+        }
+        const __m128 zero = _mm_setzero_ps();
+
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 4 <= boxes.size(); i += 4) {
+            __m128 cx = _mm_loadu_ps(&boxes.centerX[i]);
+            __m128 cy = _mm_loadu_ps(&boxes.centerY[i]);
+            __m128 cz = _mm_loadu_ps(&boxes.centerZ[i]);
+            __m128 ex = _mm_loadu_ps(&boxes.extentX[i]);
+            __m128 ey = _mm_loadu_ps(&boxes.extentY[i]);
+            __m128 ez = _mm_loadu_ps(&boxes.extentZ[i]);
+
+            __m128 inside = _mm_cmpeq_ps(zero, zero);
+            for (int p = 0; p < 6; ++p) {
+                __m128 distance = _mm_add_ps(
+                    _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(normalX[p], cx),
+                            _mm_mul_ps(normalY[p], cy)),
+                        _mm_add_ps(_mm_mul_ps(normalZ[p], cz), offset[p])),
+                    _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(absX[p], ex),
+                            _mm_mul_ps(absY[p], ey)),
+                        _mm_mul_ps(absZ[p], ez)));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, zero));
+            }
+
+            int mask = _mm_movemask_ps(inside);
+            for (int lane = 0; lane < 4; ++lane) {
+                visible[count] = static_cast<uint32_t>(i + lane);
+                count += (mask >> lane) & 1;
+            }
+        }
+        return cullTail(frustum, boxes, i, visible, count);
+    }
+#else
+    size_t cull(const Frustum& frustum, const Boxes& boxes,
+        uint32_t* visible) {
+        return cullScalar(frustum, boxes, visible);
+    }
+#endif
+}
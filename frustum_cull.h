@@ -0,0 +1,44 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+namespace frustumcull {
+    // xyz of every plane points inwards, a point p is inside when
+    // dot(xyz, p) + w >= 0. planes are not normalized
+    struct Frustum {
+        glm::vec4 planes[6];
+    };
+
+    // left, right, bottom, top, near, far of a 0..1 depth projection
+    Frustum fromViewProj(const glm::mat4& viewProj);
+
+    // world space boxes as structure of arrays, so one register holds the
+    // same coordinate of 4 or 8 boxes
+    struct Boxes {
+        std::vector<float> centerX, centerY, centerZ;
+        std::vector<float> extentX, extentY, extentZ;
+
+        void resize(size_t count);
+        size_t size() const { return centerX.size(); }
+        void set(size_t index, const glm::vec3& boxMin, const glm::vec3& boxMax);
+    };
+
+    // bounds of an object space box after transform, wider than the
+    // transformed box when it is rotated
+    void transformBox(const glm::mat4& transform,
+        const glm::vec3& boxMin, const glm::vec3& boxMax,
+        glm::vec3& outMin, glm::vec3& outMax);
+
+    // writes the indices of the boxes touching the frustum to visible in
+    // ascending order, returns how many. visible holds boxes.size()
+    // entries. 8 boxes per step with AVX, 4 with SSE
+    size_t cull(const Frustum& frustum, const Boxes& boxes, uint32_t* visible);
+    // one box at a time, same result up to fused multiply-adds the
+    // compiler may form
+    size_t cullScalar(const Frustum& frustum, const Boxes& boxes,
+        uint32_t* visible);
+    // "avx", "sse" or "scalar", whatever cull was compiled with
+    const char* instructionSet();
+}
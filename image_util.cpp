@@ -0,0 +1,69 @@
+#include "image_util.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    const uint32_t CHANNELS = 4;
+
+    void downsample(const unsigned char* src, uint32_t srcWidth,
+        uint32_t srcHeight, unsigned char* dst, uint32_t dstWidth,
+        uint32_t dstHeight) {
+        for (uint32_t y = 0; y < dstHeight; ++y) {
+            const uint32_t y0 = std::min(2 * y, srcHeight - 1);
+            const uint32_t y1 = std::min(2 * y + 1, srcHeight - 1);
+            for (uint32_t x = 0; x < dstWidth; ++x) {
+                const uint32_t x0 = std::min(2 * x, srcWidth - 1);
+                const uint32_t x1 = std::min(2 * x + 1, srcWidth - 1);
+                const unsigned char* p00 = src + (y0 * srcWidth + x0) * CHANNELS;
+                const unsigned char* p01 = src + (y0 * srcWidth + x1) * CHANNELS;
+                const unsigned char* p10 = src + (y1 * srcWidth + x0) * CHANNELS;
+                const unsigned char* p11 = src + (y1 * srcWidth + x1) * CHANNELS;
+                unsigned char* out = dst + (y * dstWidth + x) * CHANNELS;
+                for (uint32_t c = 0; c < CHANNELS; ++c) {
+                    // +2 rounds to nearest
+                    out[c] = static_cast<unsigned char>(
+                        (p00[c] + p01[c] + p10[c] + p11[c] + 2) / 4);
+                }
+            }
+        }
+    }
+}
+
+namespace imageutil {
+    uint32_t mipLevelCount(uint32_t width, uint32_t height) {
+        uint32_t levels = 1;
+        uint32_t size = std::max(width, height);
+        while (size > 1) {
+            size /= 2;
+            levels++;
+        }
+        return levels;
+    }
+
+    void buildMipChain(const unsigned char* pixels,
+        uint32_t width, uint32_t height,
+        std::vector<unsigned char>& chain, std::vector<MipLevel>& levels) {
+        const uint32_t levelCount = mipLevelCount(width, height);
+        levels.resize(levelCount);
+
+        size_t total = 0;
+        uint32_t w = width;
+        uint32_t h = height;
+        for (uint32_t i = 0; i < levelCount; ++i) {
+            levels[i] = { w, h, total };
+            total += static_cast<size_t>(w) * h * CHANNELS;
+            w = std::max(w / 2, 1u);
+            h = std::max(h / 2, 1u);
+        }
+
+        chain.resize(total);
+        std::memcpy(chain.data(), pixels,
+            static_cast<size_t>(width) * height * CHANNELS);
+        for (uint32_t i = 1; i < levelCount; ++i) {
+            const MipLevel& src = levels[i - 1];
+            const MipLevel& dst = levels[i];
+            downsample(chain.data() + src.offset, src.width, src.height,
+                chain.data() + dst.offset, dst.width, dst.height);
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace imageutil {
+    // where one level of a mip chain sits in the packed pixel array
+    struct MipLevel {
+        uint32_t width;
+        uint32_t height;
+        size_t offset;
+    };
+
+    // full chain down to 1x1
+    uint32_t mipLevelCount(uint32_t width, uint32_t height);
+
+    // box filters rgba8 pixels down to 1x1, every level packed after the
+    // previous one in chain, level 0 is a copy of pixels
+    // odd sizes clamp the last row/column instead of widening the kernel
+    void buildMipChain(const unsigned char* pixels,
+        uint32_t width, uint32_t height,
+        std::vector<unsigned char>& chain, std::vector<MipLevel>& levels);
+}
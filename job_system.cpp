@@ -0,0 +1,158 @@
+#include "job_system.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace {
+    thread_local uint32_t thread_index = 0;
+}
+
+JobSystem::JobSystem(uint32_t threadCount) {
+    if (threadCount == 0) {
+        uint32_t hardware = std::thread::hardware_concurrency();
+        threadCount = hardware > 1 ? hardware - 1 : 1;
+    }
+    workers_.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; ++i) {
+        workers_.emplace_back(&JobSystem::workerLoop, this, i + 1);
+    }
+}
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    job_available_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void JobSystem::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+        pending_++;
+    }
+    job_available_.notify_one();
+}
+
+void JobSystem::waitIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (runOne(lock)) {
+    }
+    all_done_.wait(lock, [this] { return pending_ == 0; });
+
+    if (first_error_) {
+        std::exception_ptr error = first_error_;
+        first_error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void JobSystem::parallelFor(uint32_t count,
+    const std::function<void(uint32_t)>& fn) {
+    // a few chunks per thread so uneven jobs still balance
+    uint32_t chunkCount = std::min(count, concurrency() * 4);
+    if (chunkCount == 0) {
+        return;
+    }
+
+    // chunks are claimed by whoever gets there first, the caller included,
+    // so it never runs or waits for unrelated jobs. helpers that start
+    // after the last chunk was claimed return without touching fn
+    struct Group {
+        std::atomic<uint32_t> next{ 0 };
+        uint32_t finished = 0;
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+    auto group = std::make_shared<Group>();
+    auto run = [group, &fn, count, chunkCount] {
+        uint32_t chunk;
+        while ((chunk = group->next.fetch_add(1)) < chunkCount) {
+            uint32_t begin = static_cast<uint32_t>(
+                static_cast<uint64_t>(count) * chunk / chunkCount);
+            uint32_t end = static_cast<uint32_t>(
+                static_cast<uint64_t>(count) * (chunk + 1) / chunkCount);
+            std::exception_ptr error;
+            try {
+                for (uint32_t i = begin; i < end; ++i) {
+                    fn(i);
+                }
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(group->mutex);
+            if (error && !group->error) {
+                group->error = error;
+            }
+            if (++group->finished == chunkCount) {
+                group->done.notify_all();
+            }
+        }
+    };
+
+    uint32_t helpers = std::min(chunkCount - 1,
+        static_cast<uint32_t>(workers_.size()));
+    for (uint32_t i = 0; i < helpers; ++i) {
+        submit(run);
+    }
+    run();
+
+    std::unique_lock<std::mutex> lock(group->mutex);
+    group->done.wait(lock, [&group, chunkCount] {
+        return group->finished == chunkCount;
+    });
+    if (group->error) {
+        std::rethrow_exception(group->error);
+    }
+}
+
+uint32_t JobSystem::threadIndex() {
+    return thread_index;
+}
+
+void JobSystem::workerLoop(uint32_t index) {
+    thread_index = index;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        job_available_.wait(lock, [this] {
+            return stopping_ || !jobs_.empty();
+        });
+        if (stopping_ && jobs_.empty()) {
+            return;
+        }
+        runOne(lock);
+    }
+}
+
+bool JobSystem::runOne(std::unique_lock<std::mutex>& lock) {
+    if (jobs_.empty()) {
+        return false;
+    }
+    std::function<void()> job = std::move(jobs_.front());
+    jobs_.pop_front();
+
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+        job();
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    lock.lock();
+
+    if (error && !first_error_) {
+        first_error_ = error;
+    }
+    if (--pending_ == 0) {
+        all_done_.notify_all();
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed pool of worker threads pulling from one fifo
+// jobs must not touch vulkan objects that aren't externally synchronized,
+// anything submitting to a queue stays on the main thread
+class JobSystem
+{
+public:
+    // 0 means one worker per hardware thread minus the caller
+    explicit JobSystem(uint32_t threadCount = 0);
+    ~JobSystem();
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    void submit(std::function<void()> job);
+    // the caller helps until every submitted job has finished, then
+    // rethrows the first exception a job threw, never call it from a job
+    void waitIdle();
+    // fn(i) for every i in [0, count), returns when all are done and
+    // rethrows the first exception fn threw. only waits for its own work,
+    // jobs submitted before keep running
+    void parallelFor(uint32_t count,
+        const std::function<void(uint32_t)>& fn);
+
+    // 0 on threads that aren't workers of a job system, i + 1 on worker i,
+    // always below concurrency()
+    static uint32_t threadIndex();
+
+    // workers plus the calling thread
+    uint32_t concurrency() const {
+        return static_cast<uint32_t>(workers_.size()) + 1;
+    }
+
+private:
+    void workerLoop(uint32_t index);
+    // pops and runs one job, false if the queue was empty
+    bool runOne(std::unique_lock<std::mutex>& lock);
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable job_available_;
+    std::condition_variable all_done_;
+    // queued plus running
+    uint32_t pending_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr first_error_;
+};
@@ -5,18 +5,50 @@
 #define TINYOBJLOADER_IMPLEMENTATION
 
 #include "vulkan_app.h"
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
 
-int main() {
-    VulkanApp app;
+// --headless [--frames N] [--output prefix] [--any-device]
+int main(int argc, char* argv[]) {
+    HeadlessSettings headless;
 
     try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--headless") {
+                headless.enabled = true;
+            }
+            else if (arg == "--frames" && i + 1 < argc) {
+                const char* value = argv[++i];
+                char* end = nullptr;
+                unsigned long frames = std::strtoul(value, &end, 10);
+                if (*value < '0' || *value > '9' || *end != '\0'
+                    || frames > std::numeric_limits<uint32_t>::max()) {
+                    throw std::runtime_error(
+                        std::string("failed to parse --frames ") + value);
+                }
+                headless.frameCount = static_cast<uint32_t>(frames);
+            }
+            else if (arg == "--output" && i + 1 < argc) {
+                headless.outputPrefix = argv[++i];
+            }
+            else if (arg == "--any-device") {
+                headless.preferCpuDevice = false;
+            }
+        }
+
+        VulkanApp app(headless);
         app.run();
     }
     catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
-        _fgetchar();
+        // nobody is around to press a key on the render farm
+        if (!headless.enabled) {
+            std::getchar();
+        }
         return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,279 @@
+#include "mesh_cache.h"
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    // "MESH"
+    const uint32_t COOKED_MESH_MAGIC = 0x4853454d;
+
+    struct SourceStamp {
+        uint64_t size;
+        int64_t mtime;
+    };
+
+    bool sourceStamp(const std::string& path, SourceStamp& stamp) {
+        std::error_code error;
+        auto size = std::filesystem::file_size(path, error);
+        if (error) {
+            return false;
+        }
+        auto mtime = std::filesystem::last_write_time(path, error);
+        if (error) {
+            return false;
+        }
+        stamp.size = static_cast<uint64_t>(size);
+        stamp.mtime = static_cast<int64_t>(
+            mtime.time_since_epoch().count());
+        return true;
+    }
+
+    // fnv-1a 64 over the whole source file
+    bool sourceHash(const std::string& path, uint64_t& hash) {
+        MappedFile file;
+        if (!file.open(path)) {
+            return false;
+        }
+        hash = 14695981039346656037ull;
+        const unsigned char* bytes = file.data();
+        for (size_t i = 0; i < file.size(); ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+        return true;
+    }
+
+    // stores the new mtime of a source that was touched but hashes the
+    // same, so the next load skips the hash. the file must not be mapped,
+    // windows refuses to write to a mapped file
+    bool rewriteSourceMtime(const std::string& cookedFile, int64_t mtime) {
+        std::fstream file(cookedFile,
+            std::ios::binary | std::ios::in | std::ios::out);
+        if (!file) {
+            return false;
+        }
+        file.seekp(offsetof(CookedMeshHeader, sourceMtime));
+        file.write(reinterpret_cast<const char*>(&mtime), sizeof(mtime));
+        return static_cast<bool>(file);
+    }
+}
+
+// mapped file =================================================
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0,
+        nullptr);
+    if (!mapping) {
+        CloseHandle(file);
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_ = file;
+    mapping_ = mapping;
+    data_ = static_cast<const unsigned char*>(view);
+    size_ = static_cast<size_t>(size.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+        MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+    fd_ = fd;
+    data_ = static_cast<const unsigned char*>(view);
+    size_ = static_cast<size_t>(st.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close() {
+    if (!data_) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    CloseHandle(file_);
+    mapping_ = nullptr;
+    file_ = nullptr;
+#else
+    munmap(const_cast<unsigned char*>(data_), size_);
+    ::close(fd_);
+    fd_ = -1;
+#endif
+    data_ = nullptr;
+    size_ = 0;
+}
+
+// mesh cache =================================================
+namespace meshcache {
+    std::string cookedPath(const std::string& sourcePath) {
+        return sourcePath + ".cooked";
+    }
+
+    bool load(const std::string& sourcePath, uint32_t vertexStride,
+        CookedMesh& mesh) {
+        SourceStamp stamp;
+        if (!sourceStamp(sourcePath, stamp)
+            || !mesh.file.open(cookedPath(sourcePath))) {
+            return false;
+        }
+
+        const size_t fileSize = mesh.file.size();
+        if (fileSize < sizeof(CookedMeshHeader)) {
+            mesh.file.close();
+            return false;
+        }
+        const CookedMeshHeader* header =
+            reinterpret_cast<const CookedMeshHeader*>(mesh.file.data());
+        if (header->magic != COOKED_MESH_MAGIC
+            || header->version != COOKED_MESH_VERSION
+            || header->vertexStride != vertexStride) {
+            mesh.file.close();
+            return false;
+        }
+
+        const size_t vertexBytes =
+            static_cast<size_t>(header->vertexCount) * vertexStride;
+        const size_t indexBytes =
+            static_cast<size_t>(header->indexCount) * sizeof(uint32_t);
+        const size_t rtBytes =
+            static_cast<size_t>(header->rtTriangleCount) * 9 * sizeof(float);
+        if (fileSize != sizeof(CookedMeshHeader) + vertexBytes + indexBytes
+            + rtBytes) {
+            mesh.file.close();
+            return false;
+        }
+
+        if (header->sourceSize != stamp.size
+            || header->sourceMtime != stamp.mtime) {
+            // touched, maybe not changed
+            uint64_t hash;
+            if (header->sourceSize != stamp.size
+                || !sourceHash(sourcePath, hash)
+                || hash != header->sourceHash) {
+                mesh.file.close();
+                return false;
+            }
+
+            // unchanged, keep the mtime so the hash isn't taken every run.
+            // failing to write only means hashing again next time
+            mesh.file.close();
+            if (!rewriteSourceMtime(cookedPath(sourcePath), stamp.mtime)) {
+                std::cerr << "failed to update " << cookedPath(sourcePath)
+                    << std::endl;
+            }
+            if (!mesh.file.open(cookedPath(sourcePath))
+                || mesh.file.size() != fileSize) {
+                mesh.file.close();
+                return false;
+            }
+            header = reinterpret_cast<const CookedMeshHeader*>(mesh.file.data());
+        }
+
+        const unsigned char* blob = mesh.file.data() + sizeof(CookedMeshHeader);
+        mesh.header = header;
+        mesh.vertices = blob;
+        mesh.indices = reinterpret_cast<const uint32_t*>(blob + vertexBytes);
+        mesh.rtTriangles =
+            reinterpret_cast<const float*>(blob + vertexBytes + indexBytes);
+        return true;
+    }
+
+    void save(const std::string& sourcePath, uint32_t vertexStride,
+        const void* vertices, uint32_t vertexCount,
+        const std::vector<uint32_t>& indices,
+        const std::vector<float>& rtTriangles,
+        const glm::vec3& aabbMin, const glm::vec3& aabbMax) {
+        SourceStamp stamp;
+        uint64_t hash;
+        if (!sourceStamp(sourcePath, stamp)
+            || !sourceHash(sourcePath, hash)) {
+            return;
+        }
+
+        CookedMeshHeader header = {};
+        header.magic = COOKED_MESH_MAGIC;
+        header.version = COOKED_MESH_VERSION;
+        header.sourceSize = stamp.size;
+        header.sourceMtime = stamp.mtime;
+        header.sourceHash = hash;
+        header.vertexStride = vertexStride;
+        header.vertexCount = vertexCount;
+        header.indexCount = static_cast<uint32_t>(indices.size());
+        header.rtTriangleCount = static_cast<uint32_t>(rtTriangles.size() / 9);
+        for (int i = 0; i < 3; ++i) {
+            header.aabbMin[i] = aabbMin[i];
+            header.aabbMax[i] = aabbMax[i];
+        }
+
+        // write to a temp file and rename so a crash never leaves a
+        // truncated cache behind
+        std::string path = cookedPath(sourcePath);
+        std::string tempPath = path + ".tmp";
+        {
+            std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                std::cerr << "failed to write " << tempPath << std::endl;
+                return;
+            }
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(static_cast<const char*>(vertices),
+                static_cast<std::streamsize>(vertexCount) * vertexStride);
+            file.write(reinterpret_cast<const char*>(indices.data()),
+                indices.size() * sizeof(uint32_t));
+            file.write(reinterpret_cast<const char*>(rtTriangles.data()),
+                rtTriangles.size() * sizeof(float));
+            if (!file) {
+                std::cerr << "failed to write " << tempPath << std::endl;
+                return;
+            }
+        }
+
+        std::error_code error;
+        std::filesystem::rename(tempPath, path, error);
+        if (error) {
+            std::filesystem::remove(tempPath, error);
+            std::cerr << "failed to write " << path << std::endl;
+        }
+    }
+}
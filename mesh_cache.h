@@ -0,0 +1,84 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// cooked mesh file, written next to the source as <source>.cooked
+//
+//   CookedMeshHeader
+//   vertex blob    vertexCount * vertexStride bytes
+//   index blob     indexCount * uint32_t
+//   rt triangles   rtTriangleCount * 9 floats, object space positions in
+//                  source face order
+//
+// everything is 4 byte aligned so the blobs can be used straight out of
+// the mapping
+struct CookedMeshHeader {
+    uint32_t magic;
+    uint32_t version;
+    // stale if the source changed, mtime is checked first and the hash
+    // only when the mtime differs (a fresh checkout touches every file)
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t sourceHash;
+    uint32_t vertexStride;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t rtTriangleCount;
+    float aabbMin[3];
+    float aabbMax[3];
+};
+
+// read only view of a file, mmap / MapViewOfFile
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    bool open(const std::string& path);
+    void close();
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// a valid cooked mesh, pointers stay good while the mesh is alive
+struct CookedMesh {
+    MappedFile file;
+    const CookedMeshHeader* header = nullptr;
+    const void* vertices = nullptr;
+    const uint32_t* indices = nullptr;
+    const float* rtTriangles = nullptr;
+};
+
+namespace meshcache {
+    // bump whenever the cooking in VulkanApp::cookSingleMesh changes
+    const uint32_t COOKED_MESH_VERSION = 1;
+
+    std::string cookedPath(const std::string& sourcePath);
+
+    // false when there is no cooked file or it is stale, the caller then
+    // parses the source and calls save
+    bool load(const std::string& sourcePath, uint32_t vertexStride,
+        CookedMesh& mesh);
+
+    // failing to write is not fatal, the next run just cooks again
+    void save(const std::string& sourcePath, uint32_t vertexStride,
+        const void* vertices, uint32_t vertexCount,
+        const std::vector<uint32_t>& indices,
+        const std::vector<float>& rtTriangles,
+        const glm::vec3& aabbMin, const glm::vec3& aabbMax);
+}
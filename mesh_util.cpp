@@ -0,0 +1,209 @@
+#include "mesh_util.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    const float CACHE_DECAY_POWER = 1.5f;
+    const float LAST_TRIANGLE_SCORE = 0.75f;
+    const float VALENCE_BOOST_SCALE = 2.0f;
+    const float VALENCE_BOOST_POWER = 0.5f;
+
+    // cachePosition is -1 when the vertex is not in the cache
+    float vertexScore(int cachePosition, uint32_t remainingTriangles) {
+        if (remainingTriangles == 0) {
+            return -1.0f;
+        }
+
+        float score = 0.0f;
+        if (cachePosition >= 0) {
+            if (cachePosition < 3) {
+                // used by the last triangle, fixed score so it isn't
+                // favoured too much over its neighbours
+                score = LAST_TRIANGLE_SCORE;
+            }
+            else {
+                const float scaler =
+                    1.0f / (meshutil::VERTEX_CACHE_SIZE - 3);
+                score = std::pow(1.0f - (cachePosition - 3) * scaler,
+                    CACHE_DECAY_POWER);
+            }
+        }
+
+        // prefer vertices with few triangles left so they finish early
+        score += VALENCE_BOOST_SCALE * std::pow(
+            static_cast<float>(remainingTriangles), -VALENCE_BOOST_POWER);
+        return score;
+    }
+}
+
+namespace meshutil {
+    void optimizeVertexCache(std::vector<uint32_t>& indices,
+        uint32_t vertexCount) {
+        const uint32_t triangleCount =
+            static_cast<uint32_t>(indices.size() / 3);
+        if (triangleCount == 0) {
+            return;
+        }
+
+        // vertex -> triangles, triangles of v live in
+        // adjacency[offsets[v], offsets[v] + remaining[v])
+        std::vector<uint32_t> remaining(vertexCount, 0);
+        for (uint32_t index : indices) {
+            remaining[index]++;
+        }
+        std::vector<uint32_t> offsets(vertexCount, 0);
+        for (uint32_t v = 1; v < vertexCount; ++v) {
+            offsets[v] = offsets[v - 1] + remaining[v - 1];
+        }
+        std::vector<uint32_t> adjacency(indices.size());
+        std::vector<uint32_t> fill(offsets);
+        for (uint32_t t = 0; t < triangleCount; ++t) {
+            for (int k = 0; k < 3; ++k) {
+                adjacency[fill[indices[3 * t + k]]++] = t;
+            }
+        }
+
+        std::vector<float> score(vertexCount);
+        for (uint32_t v = 0; v < vertexCount; ++v) {
+            score[v] = vertexScore(-1, remaining[v]);
+        }
+
+        std::vector<float> triangleScore(triangleCount);
+        std::vector<bool> emitted(triangleCount, false);
+        uint32_t bestTriangle = 0;
+        for (uint32_t t = 0; t < triangleCount; ++t) {
+            triangleScore[t] = score[indices[3 * t]]
+                + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+            if (triangleScore[t] > triangleScore[bestTriangle]) {
+                bestTriangle = t;
+            }
+        }
+
+        std::vector<uint32_t> result;
+        result.reserve(indices.size());
+        std::vector<uint32_t> cache, newCache;
+        cache.reserve(VERTEX_CACHE_SIZE + 3);
+        newCache.reserve(VERTEX_CACHE_SIZE + 3);
+        // next triangle in input order to restart from when the cache runs dry
+        uint32_t restartCursor = 0;
+
+        for (uint32_t emittedCount = 0; emittedCount < triangleCount;
+            ++emittedCount) {
+            if (emitted[bestTriangle]) {
+                while (emitted[restartCursor]) {
+                    restartCursor++;
+                }
+                bestTriangle = restartCursor;
+            }
+
+            const uint32_t* tri = &indices[3 * bestTriangle];
+            emitted[bestTriangle] = true;
+            newCache.clear();
+            for (int k = 0; k < 3; ++k) {
+                uint32_t v = tri[k];
+                result.push_back(v);
+
+                // drop the triangle from v's list
+                uint32_t begin = offsets[v];
+                uint32_t end = begin + remaining[v];
+                for (uint32_t i = begin; i < end; ++i) {
+                    if (adjacency[i] == bestTriangle) {
+                        adjacency[i] = adjacency[end - 1];
+                        break;
+                    }
+                }
+                remaining[v]--;
+
+                if (std::find(newCache.begin(), newCache.end(), v)
+                    == newCache.end()) {
+                    newCache.push_back(v);
+                }
+            }
+            for (uint32_t v : cache) {
+                if (std::find(newCache.begin(), newCache.end(), v)
+                    == newCache.end()) {
+                    newCache.push_back(v);
+                }
+            }
+
+            // rescore everything that moved in the cache or fell out of it
+            for (uint32_t i = 0; i < newCache.size(); ++i) {
+                uint32_t v = newCache[i];
+                int position = i < VERTEX_CACHE_SIZE ? static_cast<int>(i) : -1;
+
+                float newScore = vertexScore(position, remaining[v]);
+                float delta = newScore - score[v];
+                score[v] = newScore;
+                for (uint32_t j = offsets[v]; j < offsets[v] + remaining[v];
+                    ++j) {
+                    triangleScore[adjacency[j]] += delta;
+                }
+            }
+            if (newCache.size() > VERTEX_CACHE_SIZE) {
+                newCache.resize(VERTEX_CACHE_SIZE);
+            }
+            cache.swap(newCache);
+
+            // only triangles touching the cache can have gained score
+            float bestScore = -1.0f;
+            for (uint32_t v : cache) {
+                for (uint32_t j = offsets[v]; j < offsets[v] + remaining[v];
+                    ++j) {
+                    uint32_t t = adjacency[j];
+                    if (triangleScore[t] > bestScore) {
+                        bestScore = triangleScore[t];
+                        bestTriangle = t;
+                    }
+                }
+            }
+            // nothing left around the cache, restart from input order
+            if (bestScore < 0.0f) {
+                bestTriangle = restartCursor;
+            }
+        }
+
+        indices.swap(result);
+    }
+
+    std::vector<uint32_t> optimizeVertexFetch(std::vector<uint32_t>& indices,
+        uint32_t vertexCount) {
+        const uint32_t unused = UINT32_MAX;
+        std::vector<uint32_t> remap(vertexCount, unused);
+        uint32_t next = 0;
+        for (uint32_t& index : indices) {
+            if (remap[index] == unused) {
+                remap[index] = next++;
+            }
+            index = remap[index];
+        }
+        // unreferenced vertices go to the end
+        for (uint32_t& r : remap) {
+            if (r == unused) {
+                r = next++;
+            }
+        }
+        return remap;
+    }
+
+    float averageCacheMissRatio(const std::vector<uint32_t>& indices,
+        uint32_t vertexCount, uint32_t cacheSize) {
+        const uint32_t triangleCount =
+            static_cast<uint32_t>(indices.size() / 3);
+        if (triangleCount == 0) {
+            return 0.0f;
+        }
+
+        // a vertex is in the fifo if it was pushed less than cacheSize
+        // pushes ago
+        std::vector<uint32_t> pushedAt(vertexCount, 0);
+        uint32_t timestamp = cacheSize + 1;
+        uint32_t misses = 0;
+        for (uint32_t index : indices) {
+            if (timestamp - pushedAt[index] > cacheSize) {
+                pushedAt[index] = timestamp++;
+                misses++;
+            }
+        }
+        return static_cast<float>(misses) / triangleCount;
+    }
+}
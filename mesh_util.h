@@ -0,0 +1,23 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+namespace meshutil {
+    // size of the simulated post-transform cache
+    const uint32_t VERTEX_CACHE_SIZE = 32;
+
+    // reorder triangles so recently transformed vertices get reused
+    // (Forsyth's linear speed vertex cache optimization)
+    void optimizeVertexCache(std::vector<uint32_t>& indices,
+        uint32_t vertexCount);
+
+    // renumber vertices in the order the index buffer first touches them
+    // returns remap[oldIndex] = newIndex, indices are rewritten in place
+    std::vector<uint32_t> optimizeVertexFetch(std::vector<uint32_t>& indices,
+        uint32_t vertexCount);
+
+    // transformed vertices per triangle with a fifo cache of cacheSize
+    // 3.0 means no reuse at all, ~0.6 is about as good as closed meshes get
+    float averageCacheMissRatio(const std::vector<uint32_t>& indices,
+        uint32_t vertexCount, uint32_t cacheSize = 16);
+}
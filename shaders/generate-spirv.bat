@@ -10,4 +10,7 @@ glslangvalidator -V raytracing.comp -o raytracing.comp.spv
 glslangvalidator -V skybox.vert -o skybox.vert.spv
 glslangvalidator -V skybox.frag -o skybox.frag.spv
 glslangvalidator -V deferred_shadow.frag -o deferred_shadow.frag.spv
+glslangvalidator -V cull.comp -o cull.comp.spv
+glslangvalidator -V hiz.comp -o hiz.comp.spv
+glslangvalidator -V shadow_upsample.comp -o shadow_upsample.comp.spv
 
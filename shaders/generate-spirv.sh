@@ -0,0 +1,19 @@
+#!/bin/sh
+# same as generate-spirv.bat, for linux and macos
+cd "$(dirname "$0")" || exit 1
+set -e
+glslangValidator -V deferred.vert -o deferred.vert.spv
+glslangValidator -V deferred.frag -o deferred.frag.spv
+glslangValidator -V deferred_pbr.frag -o deferred_pbr.frag.spv
+glslangValidator -V deferred_pbr_substance.frag -o deferred_pbr_substance.frag.spv
+glslangValidator -V mrt.vert -o mrt.vert.spv
+glslangValidator -V mrt.frag -o mrt.frag.spv
+glslangValidator -V texture.frag -o texture.frag.spv
+glslangValidator -V texture.vert -o texture.vert.spv
+glslangValidator -V raytracing.comp -o raytracing.comp.spv
+glslangValidator -V skybox.vert -o skybox.vert.spv
+glslangValidator -V skybox.frag -o skybox.frag.spv
+glslangValidator -V deferred_shadow.frag -o deferred_shadow.frag.spv
+glslangValidator -V cull.comp -o cull.comp.spv
+glslangValidator -V hiz.comp -o hiz.comp.spv
+glslangValidator -V shadow_upsample.comp -o shadow_upsample.comp.spv
@@ -2,16 +2,30 @@
 
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
+#extension GL_EXT_nonuniform_qualifier : require
 
-layout (binding = 2) uniform sampler2D samplerColor;
-layout (binding = 3) uniform sampler2D samplerNormalMap;
-layout (binding = 4) uniform sampler2D samplerMrao;
+// slots in textures, same layout as AppMaterialData
+struct Material
+{
+	uint albedo;
+	uint normal;
+	uint mrao;
+	uint pad;
+};
+
+layout (std430, binding = 2) readonly buffer Materials
+{
+	Material materials[];
+};
+
+layout (binding = 3) uniform sampler2D textures[];
 
 layout (location = 0) in vec3 inNormal;
 layout (location = 1) in vec2 inUV;
 layout (location = 2) in vec3 inColor;
 layout (location = 3) in vec3 inWorldPos;
 layout (location = 4) in vec3 inTangent;
+layout (location = 5) flat in uint inMaterialIndex;
 
 
 layout (location = 0) out vec4 outPosition;
@@ -21,6 +35,9 @@ layout (location = 3) out vec4 outMrao;
 
 void main() 
 {
+	// instances of one draw may use different materials
+	Material material = materials[inMaterialIndex];
+
 	outPosition = vec4(inWorldPos, 1.0);
 	// Calculate normal in tangent space
 	vec3 N = normalize(inNormal);
@@ -28,11 +45,14 @@ void main()
 	vec3 T = normalize(inTangent);
 	vec3 B = cross(N, T);
 	mat3 TBN = mat3(T, B, N);
-	vec3 tnorm = TBN * normalize(texture(samplerNormalMap, inUV).xyz * 2.0 - vec3(1.0));
+	// z is rebuilt from xy, cooked bc5 normal maps only store those
+	vec2 nxy = texture(textures[nonuniformEXT(material.normal)], inUV).xy * 2.0 - vec2(1.0);
+	vec3 nmap = vec3(nxy, sqrt(max(1.0 - dot(nxy, nxy), 0.0)));
+	vec3 tnorm = TBN * normalize(nmap);
 	outNormal = vec4(normalize(tnorm), 1.0);
 	// outNormal = vec4(normalize(N), 1.0);
 	outNormal.y = -outNormal.y;
 
-	outAlbedo = texture(samplerColor, inUV);
-	outMrao = texture(samplerMrao, inUV);
+	outAlbedo = texture(textures[nonuniformEXT(material.albedo)], inUV);
+	outMrao = texture(textures[nonuniformEXT(material.mrao)], inUV);
 }
\ No newline at end of file
@@ -15,16 +15,31 @@ layout (binding = 0) uniform CamInfo
 	mat4 viewMatrix;
 } camera;
 
-layout (binding = 1) uniform SceneObject 
+// one entry per instance
+struct InstanceData
 {
 	mat4 modelMatrix;
-} model;
+	uint materialIndex;
+};
+
+layout (std430, binding = 1) readonly buffer Instances
+{
+	InstanceData instances[];
+};
+
+// instance buffer index of every instance the cull pass kept, grouped by
+// draw, gl_InstanceIndex already includes firstInstance
+layout (std430, binding = 4) readonly buffer VisibleInstances
+{
+	uint visibleInstances[];
+};
 
 layout (location = 0) out vec3 outNormal;
 layout (location = 1) out vec2 outUV;
 layout (location = 2) out vec3 outColor;
 layout (location = 3) out vec3 outWorldPos;
 layout (location = 4) out vec3 outTangent;
+layout (location = 5) flat out uint outMaterialIndex;
 
 out gl_PerVertex
 {
@@ -34,18 +49,20 @@ out gl_PerVertex
 void main() 
 {
 	// instancing
+	uint instanceIndex = visibleInstances[gl_InstanceIndex];
+	mat4 modelMatrix = instances[instanceIndex].modelMatrix;
 	vec4 tmpPos = vec4(inPos, 1.f);
 
-	gl_Position = camera.projMatrix * camera.viewMatrix * model.modelMatrix * tmpPos;
+	gl_Position = camera.projMatrix * camera.viewMatrix * modelMatrix * tmpPos;
 	gl_Position.y = -gl_Position.y;
 	
 	// Vertex position in world space
-	outWorldPos = vec3(model.modelMatrix * tmpPos);
+	outWorldPos = vec3(modelMatrix * tmpPos);
 	// GL to Vulkan coord space
 	// outWorldPos.y = -outWorldPos.y;
 	
 	// Normal in world space
-	mat3 mNormal = transpose(inverse(mat3(model.modelMatrix)));
+	mat3 mNormal = transpose(inverse(mat3(modelMatrix)));
 	outNormal = mNormal * normalize(inNormal);	
 	outTangent = mNormal * normalize(inTangent);
 	
@@ -53,4 +70,5 @@ void main()
 	outUV.x = 1.0 - outUV.x;
 
 	outColor = inColor;
+	outMaterialIndex = instances[instanceIndex].materialIndex;
 }
@@ -0,0 +1,518 @@
+#include "shadow_trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+    // same as shaders/raytracing.comp
+    const float EPSILON = 0.0001f;
+    const float MAXLEN = 1000.0f;
+    const int BVH_STACK_SIZE = RT_BVH_STACK_SIZE;
+    const int TOP_LEVEL_STACK_SIZE = RT_TOP_LEVEL_STACK_SIZE;
+    const glm::vec3 BACKGROUND = glm::vec3(0.25f);
+    const glm::vec3 MISS_COLOR = glm::vec3(0.0f, 1.0f, 0.0f);
+
+    const uint32_t TILE_SIZE = 16;
+
+    // "SHDW" and "SIMG"
+    const uint32_t DUMP_MAGIC = 0x57444853;
+    const uint32_t IMAGE_MAGIC = 0x474d4953;
+    // 2 since Triangle holds edges instead of vertices 1 and 2, 3 since
+    // the bvh has two levels
+    const uint32_t DUMP_VERSION = 3;
+
+    struct DumpHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t triangleCount;
+        uint32_t nodeCount;
+        uint32_t instanceCount;
+        uint32_t topLevelNodeCount;
+        uint32_t width;
+        uint32_t height;
+        uint32_t traceScale;
+        float cameraPos[3];
+        float lightPos[3];
+    };
+
+    // the functions below follow their namesakes in raytracing.comp line
+    // by line, including the branches that look odd, so both agree on
+    // which blocker an any hit ray reports
+
+    bool intersectRayTriangle(const glm::vec3& orig, const glm::vec3& dir,
+        const glm::vec3& vert0, const glm::vec3& edge1, const glm::vec3& edge2,
+        glm::vec2& baryPosition, float& distance) {
+        glm::vec3 p = glm::cross(dir, edge2);
+        float det = glm::dot(edge1, p);
+
+        glm::vec3 qvec;
+        if (det > EPSILON) {
+            glm::vec3 tvec = orig - vert0;
+            baryPosition.x = glm::dot(tvec, p);
+            if (baryPosition.x < 0.0f || baryPosition.x > det) {
+                return false;
+            }
+            qvec = glm::cross(tvec, edge1);
+            baryPosition.y = glm::dot(dir, qvec);
+            if (baryPosition.y < 0.0f || baryPosition.x + baryPosition.y > det) {
+                return false;
+            }
+        }
+        else if (det < EPSILON) {
+            glm::vec3 tvec = orig - vert0;
+            baryPosition.x = glm::dot(tvec, p);
+            if (baryPosition.x > 0.0f || baryPosition.x < det) {
+                return false;
+            }
+            qvec = glm::cross(tvec, edge1);
+            baryPosition.y = glm::dot(dir, qvec);
+            if (baryPosition.y > 0.0f || baryPosition.x + baryPosition.y < det) {
+                return false;
+            }
+        }
+        else {
+            return false;
+        }
+
+        float inv_det = 1.0f / det;
+        distance = glm::dot(edge2, qvec) * inv_det;
+        baryPosition *= inv_det;
+        return true;
+    }
+
+    float triangleIntersectionTest(const glm::vec3& rayO, const glm::vec3& rayD,
+        const Triangle& tri) {
+        glm::vec2 bary;
+        float distance;
+        if (intersectRayTriangle(rayO, rayD, glm::vec3(tri.vert_0),
+            glm::vec3(tri.edge_1), glm::vec3(tri.edge_2), bary, distance)) {
+            return distance;
+        }
+        return MAXLEN;
+    }
+
+    glm::vec3 triangleNormal(const Triangle& tri) {
+        return glm::normalize(glm::cross(glm::vec3(tri.edge_1),
+            glm::vec3(tri.edge_2)));
+    }
+
+    float intersectAABB(const glm::vec3& rayO, const glm::vec3& invD,
+        const glm::vec3& bmin, const glm::vec3& bmax, float tMax) {
+        glm::vec3 t0 = (bmin - rayO) * invD;
+        glm::vec3 t1 = (bmax - rayO) * invD;
+        glm::vec3 tSmall = glm::min(t0, t1);
+        glm::vec3 tBig = glm::max(t0, t1);
+        float tNear = std::max(std::max(tSmall.x, tSmall.y), tSmall.z);
+        float tFar = std::min(std::min(tBig.x, tBig.y), tBig.z);
+        if (tFar < std::max(tNear, 0.0f) || tNear > tMax) {
+            return MAXLEN;
+        }
+        return tNear;
+    }
+
+    using shadowtrace::Scene;
+
+    bool traverseBottomLevel(const Scene& scene, uint32_t root,
+        const glm::vec3& rayO, const glm::vec3& rayD, float& resT,
+        glm::vec3* triNor, bool anyHit) {
+        const std::vector<BVHNode>& nodes = scene.nodes;
+        bool beHit = false;
+        glm::vec3 invD = 1.0f / rayD;
+
+        uint32_t stack[BVH_STACK_SIZE];
+        int stackPtr = 0;
+        uint32_t nodeIdx = root;
+
+        if (intersectAABB(rayO, invD, nodes[root].aabbMin, nodes[root].aabbMax,
+            resT) >= MAXLEN) {
+            return false;
+        }
+
+        while (true) {
+            const BVHNode& node = nodes[nodeIdx];
+            if (node.triCount > 0) {
+                for (uint32_t i = 0; i < node.triCount; ++i) {
+                    const Triangle& tri = scene.triangles[node.leftFirst + i];
+                    float tTri = triangleIntersectionTest(rayO, rayD, tri);
+                    if (tTri > EPSILON && tTri < resT) {
+                        beHit = true;
+                        resT = tTri;
+                        if (anyHit) {
+                            return true;
+                        }
+                        if (triNor) {
+                            *triNor = triangleNormal(tri);
+                        }
+                    }
+                }
+                if (stackPtr == 0) {
+                    break;
+                }
+                nodeIdx = stack[--stackPtr];
+                continue;
+            }
+
+            uint32_t nearIdx = node.leftFirst;
+            uint32_t farIdx = node.leftFirst + 1;
+            float tNear = intersectAABB(rayO, invD, nodes[nearIdx].aabbMin,
+                nodes[nearIdx].aabbMax, resT);
+            float tFar = intersectAABB(rayO, invD, nodes[farIdx].aabbMin,
+                nodes[farIdx].aabbMax, resT);
+            if (tFar < tNear) {
+                std::swap(nearIdx, farIdx);
+                std::swap(tNear, tFar);
+            }
+
+            if (tNear >= MAXLEN) {
+                if (stackPtr == 0) {
+                    break;
+                }
+                nodeIdx = stack[--stackPtr];
+            }
+            else {
+                nodeIdx = nearIdx;
+                if (tFar < MAXLEN && stackPtr < BVH_STACK_SIZE) {
+                    stack[stackPtr++] = farIdx;
+                }
+            }
+        }
+        return beHit;
+    }
+
+    bool traverseBVH(const Scene& scene, const glm::vec3& rayO,
+        const glm::vec3& rayD, float& resT, glm::vec3* triNor, bool anyHit) {
+        const std::vector<BVHNode>& nodes = scene.topLevelNodes;
+        if (scene.instances.empty()) {
+            return false;
+        }
+
+        bool beHit = false;
+        glm::vec3 invD = 1.0f / rayD;
+
+        uint32_t stack[TOP_LEVEL_STACK_SIZE];
+        int stackPtr = 0;
+        uint32_t nodeIdx = 0;
+
+        if (intersectAABB(rayO, invD, nodes[0].aabbMin, nodes[0].aabbMax,
+            resT) >= MAXLEN) {
+            return false;
+        }
+
+        while (true) {
+            const BVHNode& node = nodes[nodeIdx];
+            if (node.triCount > 0) {
+                for (uint32_t i = 0; i < node.triCount; ++i) {
+                    const BVHInstance& instance =
+                        scene.instances[node.leftFirst + i];
+                    glm::vec3 objectO = glm::vec3(
+                        instance.worldToObject * glm::vec4(rayO, 1.0f));
+                    glm::vec3 objectD = glm::vec3(
+                        instance.worldToObject * glm::vec4(rayD, 0.0f));
+                    glm::vec3 objectNor;
+                    if (traverseBottomLevel(scene, instance.rootNode, objectO,
+                        objectD, resT, triNor ? &objectNor : nullptr, anyHit)) {
+                        beHit = true;
+                        if (anyHit) {
+                            return true;
+                        }
+                        if (triNor) {
+                            *triNor = glm::normalize(glm::transpose(
+                                glm::mat3(instance.worldToObject)) * objectNor);
+                        }
+                    }
+                }
+                if (stackPtr == 0) {
+                    break;
+                }
+                nodeIdx = stack[--stackPtr];
+                continue;
+            }
+
+            uint32_t nearIdx = node.leftFirst;
+            uint32_t farIdx = node.leftFirst + 1;
+            float tNear = intersectAABB(rayO, invD, nodes[nearIdx].aabbMin,
+                nodes[nearIdx].aabbMax, resT);
+            float tFar = intersectAABB(rayO, invD, nodes[farIdx].aabbMin,
+                nodes[farIdx].aabbMax, resT);
+            if (tFar < tNear) {
+                std::swap(nearIdx, farIdx);
+                std::swap(tNear, tFar);
+            }
+
+            if (tNear >= MAXLEN) {
+                if (stackPtr == 0) {
+                    break;
+                }
+                nodeIdx = stack[--stackPtr];
+            }
+            else {
+                nodeIdx = nearIdx;
+                if (tFar < MAXLEN && stackPtr < TOP_LEVEL_STACK_SIZE) {
+                    stack[stackPtr++] = farIdx;
+                }
+            }
+        }
+        return beHit;
+    }
+
+    // 1 when blocked before t, t shrinks to the blocker found
+    bool calcShadow(const Scene& scene, const glm::vec3& rayO,
+        const glm::vec3& rayD, float& t) {
+        return traverseBVH(scene, rayO, rayD, t, nullptr, true);
+    }
+
+    glm::vec3 renderScene(const Scene& scene, const glm::vec3& lightPos,
+        const glm::vec3& rayO, glm::vec3 rayD, const glm::vec3& normalMapNormal,
+        uint32_t& rays) {
+        float t = MAXLEN;
+        rays++;
+        if (!traverseBVH(scene, rayO, rayD, t, nullptr, false)) {
+            return MISS_COLOR;
+        }
+        if (t > MAXLEN - 1) {
+            return MISS_COLOR;
+        }
+
+        glm::vec3 pos = rayO + t * rayD;
+        glm::vec3 lightVec = glm::normalize(lightPos - pos);
+        glm::vec3 normal = normalMapNormal;
+        rays += 3;
+
+        t = glm::length(lightPos - pos);
+        calcShadow(scene, pos, lightVec, t);
+        float x = -1.0f;
+        if (t < glm::length(lightPos - pos)) {
+            x = t;
+        }
+
+        float z = -1.0f;
+        t = MAXLEN;
+        calcShadow(scene, pos, normal, t);
+        if (t < MAXLEN) {
+            z = t;
+        }
+
+        float y = -1.0f;
+        t = MAXLEN;
+        rayD = rayD + 2.0f * -glm::dot(normal, rayD) * normal;
+        calcShadow(scene, pos, glm::normalize(rayD), t);
+        if (t < MAXLEN) {
+            y = t;
+        }
+
+        return glm::vec3(x, y, z);
+    }
+
+    template <typename T>
+    bool writeArray(std::ofstream& file, const std::vector<T>& data) {
+        file.write(reinterpret_cast<const char*>(data.data()),
+            static_cast<std::streamsize>(data.size() * sizeof(T)));
+        return static_cast<bool>(file);
+    }
+
+    template <typename T>
+    bool readArray(std::ifstream& file, std::vector<T>& data, size_t count) {
+        data.resize(count);
+        file.read(reinterpret_cast<char*>(data.data()),
+            static_cast<std::streamsize>(count * sizeof(T)));
+        return static_cast<bool>(file);
+    }
+}
+
+namespace shadowtrace {
+    Stats trace(JobSystem& jobs, const Scene& scene, const GBuffer& gbuffer,
+        const Settings& settings, Image& image) {
+        // the walk drops subtrees past the stack just like the shader,
+        // so trees that would need it are refused instead
+        for (const BVHInstance& instance : scene.instances) {
+            if (bvh::depth(scene.nodes, instance.rootNode)
+                > RT_BVH_STACK_SIZE + 1) {
+                throw std::runtime_error(
+                    "failed to trace, bottom level deeper than RT_BVH_STACK_SIZE");
+            }
+        }
+        if (!scene.topLevelNodes.empty() && bvh::depth(scene.topLevelNodes)
+            > RT_TOP_LEVEL_STACK_SIZE + 1) {
+            throw std::runtime_error(
+                "failed to trace, top level deeper than RT_TOP_LEVEL_STACK_SIZE");
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+
+        uint32_t scale = std::max(settings.traceScale, 1u);
+        image.width = (gbuffer.width + scale - 1) / scale;
+        image.height = (gbuffer.height + scale - 1) / scale;
+        image.texels.assign(static_cast<size_t>(image.width) * image.height,
+            glm::vec3(0.0f));
+
+        uint32_t tilesX = (image.width + TILE_SIZE - 1) / TILE_SIZE;
+        uint32_t tilesY = (image.height + TILE_SIZE - 1) / TILE_SIZE;
+        std::atomic<uint64_t> rays{ 0 };
+
+        jobs.parallelFor(tilesX * tilesY, [&](uint32_t tile) {
+            uint32_t x0 = (tile % tilesX) * TILE_SIZE;
+            uint32_t y0 = (tile / tilesX) * TILE_SIZE;
+            uint32_t x1 = std::min(x0 + TILE_SIZE, image.width);
+            uint32_t y1 = std::min(y0 + TILE_SIZE, image.height);
+            uint32_t tileRays = 0;
+
+            for (uint32_t y = y0; y < y1; ++y) {
+                for (uint32_t x = x0; x < x1; ++x) {
+                    size_t pixel = static_cast<size_t>(y * scale) * gbuffer.width
+                        + x * scale;
+                    const glm::vec4& fragPos = gbuffer.position[pixel];
+                    glm::vec3 color = BACKGROUND;
+                    if (fragPos.w >= 1.0f) {
+                        glm::vec3 dirCamToFrag = glm::normalize(
+                            glm::vec3(fragPos) - settings.cameraPos);
+                        color = renderScene(scene, settings.lightPos,
+                            settings.cameraPos, dirCamToFrag,
+                            glm::vec3(gbuffer.normal[pixel]), tileRays);
+                    }
+                    image.texels[static_cast<size_t>(y) * image.width + x] = color;
+                }
+            }
+            rays += tileRays;
+        });
+
+        Stats stats;
+        stats.rays = rays;
+        stats.milliseconds = std::chrono::duration<float, std::milli>(
+            std::chrono::high_resolution_clock::now() - start).count();
+        return stats;
+    }
+
+    void renderGBuffer(JobSystem& jobs, const Scene& scene,
+        const glm::vec3& cameraPos,
+        const glm::vec3& lookAt, float fovy, uint32_t width, uint32_t height,
+        GBuffer& gbuffer) {
+        gbuffer.width = width;
+        gbuffer.height = height;
+        gbuffer.position.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+        gbuffer.normal.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+
+        glm::vec3 forward = glm::normalize(lookAt - cameraPos);
+        glm::vec3 right = glm::normalize(glm::cross(forward, glm::vec3(0.0f, 1.0f, 0.0f)));
+        glm::vec3 up = glm::cross(right, forward);
+        float tanHalf = std::tan(fovy * 0.5f);
+        float aspect = static_cast<float>(width) / static_cast<float>(height);
+
+        jobs.parallelFor(height, [&](uint32_t y) {
+            for (uint32_t x = 0; x < width; ++x) {
+                float u = ((x + 0.5f) / width * 2.0f - 1.0f) * tanHalf * aspect;
+                float v = (1.0f - (y + 0.5f) / height * 2.0f) * tanHalf;
+                glm::vec3 dir = glm::normalize(forward + right * u + up * v);
+
+                float t = MAXLEN;
+                glm::vec3 normal;
+                if (!traverseBVH(scene, cameraPos, dir, t, &normal, false)) {
+                    continue;
+                }
+                if (glm::dot(normal, dir) > 0.0f) {
+                    normal = -normal;
+                }
+                size_t pixel = static_cast<size_t>(y) * width + x;
+                gbuffer.position[pixel] = glm::vec4(cameraPos + t * dir, 1.0f);
+                gbuffer.normal[pixel] = glm::vec4(normal, 0.0f);
+            }
+        });
+    }
+
+    bool saveDump(const std::string& path, const Dump& dump) {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+
+        DumpHeader header = {};
+        header.magic = DUMP_MAGIC;
+        header.version = DUMP_VERSION;
+        header.triangleCount =
+            static_cast<uint32_t>(dump.scene.triangles.size());
+        header.nodeCount = static_cast<uint32_t>(dump.scene.nodes.size());
+        header.instanceCount =
+            static_cast<uint32_t>(dump.scene.instances.size());
+        header.topLevelNodeCount =
+            static_cast<uint32_t>(dump.scene.topLevelNodes.size());
+        header.width = dump.gbuffer.width;
+        header.height = dump.gbuffer.height;
+        header.traceScale = dump.settings.traceScale;
+        for (int i = 0; i < 3; ++i) {
+            header.cameraPos[i] = dump.settings.cameraPos[i];
+            header.lightPos[i] = dump.settings.lightPos[i];
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        return writeArray(file, dump.scene.triangles)
+            && writeArray(file, dump.scene.nodes)
+            && writeArray(file, dump.scene.instances)
+            && writeArray(file, dump.scene.topLevelNodes)
+            && writeArray(file, dump.gbuffer.position)
+            && writeArray(file, dump.gbuffer.normal);
+    }
+
+    bool loadDump(const std::string& path, Dump& dump) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+
+        DumpHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!file || header.magic != DUMP_MAGIC
+            || header.version != DUMP_VERSION) {
+            return false;
+        }
+        dump.gbuffer.width = header.width;
+        dump.gbuffer.height = header.height;
+        dump.settings.traceScale = header.traceScale;
+        for (int i = 0; i < 3; ++i) {
+            dump.settings.cameraPos[i] = header.cameraPos[i];
+            dump.settings.lightPos[i] = header.lightPos[i];
+        }
+        size_t pixelCount = static_cast<size_t>(header.width) * header.height;
+        return readArray(file, dump.scene.triangles, header.triangleCount)
+            && readArray(file, dump.scene.nodes, header.nodeCount)
+            && readArray(file, dump.scene.instances, header.instanceCount)
+            && readArray(file, dump.scene.topLevelNodes,
+                header.topLevelNodeCount)
+            && readArray(file, dump.gbuffer.position, pixelCount)
+            && readArray(file, dump.gbuffer.normal, pixelCount);
+    }
+
+    bool saveImage(const std::string& path, const Image& image) {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        uint32_t header[] = { IMAGE_MAGIC, image.width, image.height };
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        return writeArray(file, image.texels);
+    }
+
+    bool loadImage(const std::string& path, Image& image) {
+        std::ifstream file(path, std::ios::binary);
+        uint32_t header[3];
+        file.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!file || header[0] != IMAGE_MAGIC) {
+            return false;
+        }
+        image.width = header[1];
+        image.height = header[2];
+        return readArray(file, image.texels,
+            static_cast<size_t>(image.width) * image.height);
+    }
+
+    float maxDifference(const Image& a, const Image& b) {
+        if (a.width != b.width || a.height != b.height) {
+            return INFINITY;
+        }
+        float difference = 0.0f;
+        for (size_t i = 0; i < a.texels.size(); ++i) {
+            glm::vec3 d = glm::abs(a.texels[i] - b.texels[i]);
+            difference = std::max(difference, std::max(d.x, std::max(d.y, d.z)));
+        }
+        return difference;
+    }
+}
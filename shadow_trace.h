@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "bvh.h"
+#include "job_system.h"
+
+// cpu version of shaders/raytracing.comp, step for step the same rays,
+// bvh walk and triangle test, for golden images and as a rays per second
+// baseline without a gpu
+namespace shadowtrace {
+    // world space g buffer as the rt pass samples it, position.w < 1 where
+    // nothing was drawn
+    struct GBuffer {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<glm::vec4> position;
+        std::vector<glm::vec4> normal;
+    };
+
+    // what RTUniformBufferObject and TRACE_SCALE hand to the shader
+    struct Settings {
+        glm::vec3 cameraPos;
+        glm::vec3 lightPos;
+        // texel t reads g buffer pixel t * traceScale
+        uint32_t traceScale = 1;
+    };
+
+    // the two level bvh as the shader gets it. nodes holds the bottom
+    // levels built by bvh::appendBottomLevel over triangles, instances and
+    // topLevelNodes come from bvh::buildTopLevel
+    struct Scene {
+        std::vector<Triangle> triangles;
+        std::vector<BVHNode> nodes;
+        std::vector<BVHInstance> instances;
+        std::vector<BVHNode> topLevelNodes;
+    };
+
+    // everything one trace needs, written and read by saveDump/loadDump
+    struct Dump {
+        Scene scene;
+        GBuffer gbuffer;
+        Settings settings;
+    };
+
+    // x, y, z of resultImage before the rgba8 store clamps them: distance
+    // to the blocker towards the light, along the reflected view ray and
+    // along the normal, -1 when unblocked
+    struct Image {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<glm::vec3> texels;
+    };
+
+    struct Stats {
+        uint64_t rays = 0;
+        float milliseconds = 0.0f;
+    };
+
+    // one job per 16x16 tile, throws std::runtime_error when a bvh is
+    // deeper than the shader's stack can walk
+    Stats trace(JobSystem& jobs, const Scene& scene, const GBuffer& gbuffer,
+        const Settings& settings, Image& image);
+
+    // first hits of a pinhole camera through the same bvh, for scenes
+    // that come without a g buffer. normals face the camera
+    void renderGBuffer(JobSystem& jobs, const Scene& scene,
+        const glm::vec3& cameraPos,
+        const glm::vec3& lookAt, float fovy, uint32_t width, uint32_t height,
+        GBuffer& gbuffer);
+
+    // raw little endian file, false if it can't be written or read
+    bool saveDump(const std::string& path, const Dump& dump);
+    bool loadDump(const std::string& path, Dump& dump);
+
+    bool saveImage(const std::string& path, const Image& image);
+    bool loadImage(const std::string& path, Image& image);
+
+    // largest per channel difference, infinite when the sizes differ
+    float maxDifference(const Image& a, const Image& b);
+}
@@ -0,0 +1,111 @@
+#include "texture_cache.h"
+#include <filesystem>
+#include <iostream>
+#include <cstring>
+#include <gli/gli.hpp>
+
+namespace {
+    // the formats the cooker writes
+    bool toGliFormat(VkFormat format, gli::format& out) {
+        switch (format) {
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+            out = gli::FORMAT_RGBA_BP_UNORM_BLOCK16;
+            return true;
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+            out = gli::FORMAT_RG_ATI2N_UNORM_BLOCK16;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool toVkFormat(gli::format format, VkFormat& out) {
+        switch (format) {
+        case gli::FORMAT_RGBA_BP_UNORM_BLOCK16:
+            out = VK_FORMAT_BC7_UNORM_BLOCK;
+            return true;
+        case gli::FORMAT_RG_ATI2N_UNORM_BLOCK16:
+            out = VK_FORMAT_BC5_UNORM_BLOCK;
+            return true;
+        default:
+            return false;
+        }
+    }
+}
+
+namespace texturecache {
+    std::string cookedPath(const std::string& sourcePath) {
+        return std::filesystem::path(sourcePath)
+            .replace_extension(".ktx").string();
+    }
+
+    bool load(const std::string& sourcePath, VkFormat& format,
+        std::vector<unsigned char>& data,
+        std::vector<imageutil::MipLevel>& levels) {
+        std::string path = cookedPath(sourcePath);
+
+        // cooked offline, so only a timestamp check: a source edited after
+        // cooking wins until the cooker runs again
+        std::error_code error;
+        auto cookedTime = std::filesystem::last_write_time(path, error);
+        if (error) {
+            return false;
+        }
+        auto sourceTime = std::filesystem::last_write_time(sourcePath, error);
+        if (!error && sourceTime > cookedTime) {
+            std::cerr << path << " is older than its source, not used"
+                << std::endl;
+            return false;
+        }
+
+        gli::texture loaded = gli::load_ktx(path);
+        if (loaded.empty() || loaded.target() != gli::TARGET_2D
+            || !toVkFormat(loaded.format(), format)) {
+            return false;
+        }
+
+        gli::texture2d texture(loaded);
+        const unsigned char* base =
+            static_cast<const unsigned char*>(texture.data());
+        data.assign(base, base + texture.size());
+        levels.resize(texture.levels());
+        for (size_t level = 0; level < texture.levels(); ++level) {
+            levels[level].width =
+                static_cast<uint32_t>(texture.extent(level).x);
+            levels[level].height =
+                static_cast<uint32_t>(texture.extent(level).y);
+            levels[level].offset = static_cast<const unsigned char*>(
+                texture[level].data()) - base;
+        }
+        return true;
+    }
+
+    bool save(const std::string& sourcePath, VkFormat format,
+        const std::vector<unsigned char>& data,
+        const std::vector<imageutil::MipLevel>& levels) {
+        gli::format gliFormat;
+        if (!toGliFormat(format, gliFormat) || levels.empty()) {
+            return false;
+        }
+
+        gli::texture2d texture(gliFormat,
+            gli::extent2d(levels[0].width, levels[0].height),
+            levels.size());
+        for (size_t level = 0; level < levels.size(); ++level) {
+            size_t end = level + 1 < levels.size()
+                ? levels[level + 1].offset : data.size();
+            if (end - levels[level].offset != texture[level].size()) {
+                return false;
+            }
+            std::memcpy(texture[level].data(),
+                data.data() + levels[level].offset, texture[level].size());
+        }
+
+        std::string path = cookedPath(sourcePath);
+        if (!gli::save_ktx(texture, path)) {
+            std::cerr << "failed to write " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include <string>
+#include <vector>
+#include "image_util.h"
+
+// block compressed textures written by tools/texture_cooker.cpp next to
+// the source image, <source without extension>.ktx with the full mip chain
+// levels are packed like imageutil::buildMipChain, with blocks instead of
+// texels and offsets in bytes
+namespace texturecache {
+    std::string cookedPath(const std::string& sourcePath);
+
+    // false when there is no cooked file, it is older than the source or
+    // holds a format the renderer can't sample, the caller then decodes
+    // the source itself
+    bool load(const std::string& sourcePath, VkFormat& format,
+        std::vector<unsigned char>& data,
+        std::vector<imageutil::MipLevel>& levels);
+
+    bool save(const std::string& sourcePath, VkFormat format,
+        const std::vector<unsigned char>& data,
+        const std::vector<imageutil::MipLevel>& levels);
+}
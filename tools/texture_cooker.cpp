@@ -0,0 +1,107 @@
+// offline cooker for scene textures, writes block compressed ktx files
+// with full mip chains next to the sources, picked up at load time by
+// texturecache::load
+//
+//   texture_cooker <albedo|mrao|normal> <image>...
+//
+// albedo and mrao become bc7, tangent space normals bc5 (x and y only,
+// mrt.frag rebuilds z)
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../block_compress.h"
+#include "../image_util.h"
+#include "../job_system.h"
+#include "../texture_cache.h"
+
+namespace {
+    bool cook(JobSystem& jobs, const std::string& path,
+        blockcompress::Format format) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        int width, height, channels;
+        stbi_uc* pixels = stbi_load(path.c_str(), &width, &height, &channels,
+            STBI_rgb_alpha);
+        if (!pixels) {
+            std::cerr << "failed to load " << path << std::endl;
+            return false;
+        }
+
+        std::vector<unsigned char> chain;
+        std::vector<imageutil::MipLevel> levels;
+        imageutil::buildMipChain(pixels, width, height, chain, levels);
+        stbi_image_free(pixels);
+
+        std::vector<imageutil::MipLevel> blockLevels(levels.size());
+        size_t blockBytes = 0;
+        for (size_t i = 0; i < levels.size(); ++i) {
+            blockLevels[i] = { levels[i].width, levels[i].height, blockBytes };
+            blockBytes += blockcompress::blockCount(levels[i].width,
+                levels[i].height) * blockcompress::BLOCK_BYTES;
+        }
+        std::vector<unsigned char> blocks(blockBytes);
+
+        // one job per block row of every level, level 0 dominates anyway
+        std::vector<std::pair<uint32_t, uint32_t>> rows;
+        for (uint32_t i = 0; i < levels.size(); ++i) {
+            for (uint32_t row = 0; row < (levels[i].height + 3) / 4; ++row) {
+                rows.push_back({ i, row });
+            }
+        }
+        jobs.parallelFor(static_cast<uint32_t>(rows.size()), [&](uint32_t i) {
+            const imageutil::MipLevel& level = levels[rows[i].first];
+            blockcompress::compressRows(format, chain.data() + level.offset,
+                level.width, level.height, rows[i].second, rows[i].second + 1,
+                blocks.data() + blockLevels[rows[i].first].offset);
+        });
+
+        VkFormat vkFormat = format == blockcompress::Format::BC7
+            ? VK_FORMAT_BC7_UNORM_BLOCK : VK_FORMAT_BC5_UNORM_BLOCK;
+        if (!texturecache::save(path, vkFormat, blocks, blockLevels)) {
+            std::cerr << "failed to cook " << path << std::endl;
+            return false;
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << path << " -> " << texturecache::cookedPath(path) << ": "
+            << levels.size() << " levels, " << chain.size() / 1024 << " KB -> "
+            << blocks.size() / 1024 << " KB in "
+            << std::chrono::duration<float, std::milli>(end - start).count()
+            << " ms" << std::endl;
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "usage: texture_cooker <albedo|mrao|normal> <image>..."
+            << std::endl;
+        return 1;
+    }
+
+    blockcompress::Format format;
+    if (std::strcmp(argv[1], "albedo") == 0
+        || std::strcmp(argv[1], "mrao") == 0) {
+        format = blockcompress::Format::BC7;
+    }
+    else if (std::strcmp(argv[1], "normal") == 0) {
+        format = blockcompress::Format::BC5;
+    }
+    else {
+        std::cerr << "unknown texture kind " << argv[1] << std::endl;
+        return 1;
+    }
+
+    JobSystem jobs;
+    int failed = 0;
+    for (int i = 2; i < argc; ++i) {
+        if (!cook(jobs, argv[i], format)) {
+            failed++;
+        }
+    }
+    return failed == 0 ? 0 : 1;
+}
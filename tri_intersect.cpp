@@ -0,0 +1,419 @@
+#include "tri_intersect.h"
+#include <cmath>
+
+// the simd paths are compiled with their own target whatever the rest of
+// the build uses, and only called once the cpu reported support
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TRI_INTERSECT_X86
+#define TARGET_SSE4 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define TRI_INTERSECT_X86
+#define TARGET_SSE4
+#define TARGET_AVX2
+#endif
+
+namespace {
+    using triintersect::Hit;
+    using triintersect::Packet;
+    using triintersect::PACKET_WIDTH;
+    using triintersect::NO_HIT;
+
+    // only rejects triangles parallel to the ray and degenerate ones, a
+    // larger bound would drop small triangles
+    const float DET_EPSILON = 1e-12f;
+
+    // one lane, summed in the same order as the simd paths
+    bool testLane(const Packet& p, uint32_t lane, const glm::vec3& o,
+        const glm::vec3& d, float tMin, float tMax,
+        float& t, float& u, float& v) {
+        float px = d.y * p.e2z[lane] - d.z * p.e2y[lane];
+        float py = d.z * p.e2x[lane] - d.x * p.e2z[lane];
+        float pz = d.x * p.e2y[lane] - d.y * p.e2x[lane];
+        float det = (p.e1x[lane] * px + p.e1y[lane] * py) + p.e1z[lane] * pz;
+        float invDet = 1.0f / det;
+
+        float sx = o.x - p.v0x[lane];
+        float sy = o.y - p.v0y[lane];
+        float sz = o.z - p.v0z[lane];
+        u = ((sx * px + sy * py) + sz * pz) * invDet;
+
+        float qx = sy * p.e1z[lane] - sz * p.e1y[lane];
+        float qy = sz * p.e1x[lane] - sx * p.e1z[lane];
+        float qz = sx * p.e1y[lane] - sy * p.e1x[lane];
+        v = ((d.x * qx + d.y * qy) + d.z * qz) * invDet;
+        t = ((p.e2x[lane] * qx + p.e2y[lane] * qy) + p.e2z[lane] * qz) * invDet;
+
+        return std::fabs(det) > DET_EPSILON && u >= 0.0f && v >= 0.0f
+            && u + v <= 1.0f && t > tMin && t < tMax;
+    }
+
+    Hit intersectScalar(const Packet* packets, size_t count,
+        const glm::vec3& o, const glm::vec3& d, float tMin, float tMax,
+        bool anyHit) {
+        Hit hit;
+        hit.t = tMax;
+        for (size_t i = 0; i < count; ++i) {
+            for (uint32_t lane = 0; lane < PACKET_WIDTH; ++lane) {
+                float t, u, v;
+                if (testLane(packets[i], lane, o, d, tMin, hit.t, t, u, v)) {
+                    hit.triangle = static_cast<uint32_t>(i) * PACKET_WIDTH + lane;
+                    hit.t = t;
+                    hit.u = u;
+                    hit.v = v;
+                    if (anyHit) {
+                        return hit;
+                    }
+                }
+            }
+        }
+        return hit;
+    }
+
+    // the simd paths keep the nearest hit per lane and pick among the
+    // lanes at the end, equal distances to the lower index like the
+    // scalar loop
+    Hit nearestLane(const float* t, const float* u, const float* v,
+        const uint32_t* triangle, float tMax) {
+        Hit hit;
+        hit.t = tMax;
+        for (uint32_t lane = 0; lane < PACKET_WIDTH; ++lane) {
+            if (triangle[lane] == NO_HIT) {
+                continue;
+            }
+            if (hit.triangle == NO_HIT || t[lane] < hit.t
+                || (t[lane] == hit.t && triangle[lane] < hit.triangle)) {
+                hit.triangle = triangle[lane];
+                hit.t = t[lane];
+                hit.u = u[lane];
+                hit.v = v[lane];
+            }
+        }
+        return hit;
+    }
+
+#if defined(TRI_INTERSECT_X86)
+    // any hit only reports which triangle stopped the ray
+    Hit firstLane(size_t packet, uint32_t offset, int mask) {
+        Hit hit;
+        uint32_t lane = 0;
+        while ((mask & (1 << lane)) == 0) {
+            ++lane;
+        }
+        hit.triangle = static_cast<uint32_t>(packet) * PACKET_WIDTH
+            + offset + lane;
+        return hit;
+    }
+
+    struct Ray4 {
+        __m128 ox, oy, oz, dx, dy, dz, tMin;
+    };
+
+    // 4 lanes of a packet starting at first, the hit mask and their t, u, v
+    TARGET_SSE4 inline __m128 testSse4(const Packet& p, uint32_t first,
+        const Ray4& ray, __m128 tMax, __m128& t, __m128& u, __m128& v) {
+        __m128 e1x = _mm_load_ps(p.e1x + first);
+        __m128 e1y = _mm_load_ps(p.e1y + first);
+        __m128 e1z = _mm_load_ps(p.e1z + first);
+        __m128 e2x = _mm_load_ps(p.e2x + first);
+        __m128 e2y = _mm_load_ps(p.e2y + first);
+        __m128 e2z = _mm_load_ps(p.e2z + first);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(ray.dy, e2z), _mm_mul_ps(ray.dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(ray.dz, e2x), _mm_mul_ps(ray.dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(ray.dx, e2y), _mm_mul_ps(ray.dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px),
+            _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+        __m128 sx = _mm_sub_ps(ray.ox, _mm_load_ps(p.v0x + first));
+        __m128 sy = _mm_sub_ps(ray.oy, _mm_load_ps(p.v0y + first));
+        __m128 sz = _mm_sub_ps(ray.oz, _mm_load_ps(p.v0z + first));
+        u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px),
+            _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ray.dx, qx),
+            _mm_mul_ps(ray.dy, qy)), _mm_mul_ps(ray.dz, qz)), invDet);
+        t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx),
+            _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+        __m128 zero = _mm_setzero_ps();
+        __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+        __m128 mask = _mm_cmpgt_ps(absDet, _mm_set1_ps(DET_EPSILON));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+        mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, ray.tMin));
+        return _mm_and_ps(mask, _mm_cmplt_ps(t, tMax));
+    }
+
+    TARGET_SSE4 Hit intersectSse4(const Packet* packets, size_t count,
+        const glm::vec3& o, const glm::vec3& d, float tMin, float tMax,
+        bool anyHit) {
+        Ray4 ray = { _mm_set1_ps(o.x), _mm_set1_ps(o.y), _mm_set1_ps(o.z),
+            _mm_set1_ps(d.x), _mm_set1_ps(d.y), _mm_set1_ps(d.z),
+            _mm_set1_ps(tMin) };
+
+        // lanes 0-3 and 4-7 of every packet
+        __m128 bestT[2] = { _mm_set1_ps(tMax), _mm_set1_ps(tMax) };
+        __m128 bestU[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+        __m128 bestV[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+        __m128i bestTriangle[2] = { _mm_set1_epi32(-1), _mm_set1_epi32(-1) };
+        __m128i triangle[2] = { _mm_setr_epi32(0, 1, 2, 3),
+            _mm_setr_epi32(4, 5, 6, 7) };
+        const __m128i step = _mm_set1_epi32(PACKET_WIDTH);
+
+        for (size_t i = 0; i < count; ++i) {
+            for (int half = 0; half < 2; ++half) {
+                __m128 t, u, v;
+                __m128 mask = testSse4(packets[i], half * 4, ray, bestT[half],
+                    t, u, v);
+                if (anyHit && _mm_movemask_ps(mask) != 0) {
+                    return firstLane(i, half * 4, _mm_movemask_ps(mask));
+                }
+                bestT[half] = _mm_blendv_ps(bestT[half], t, mask);
+                bestU[half] = _mm_blendv_ps(bestU[half], u, mask);
+                bestV[half] = _mm_blendv_ps(bestV[half], v, mask);
+                bestTriangle[half] = _mm_castps_si128(_mm_blendv_ps(
+                    _mm_castsi128_ps(bestTriangle[half]),
+                    _mm_castsi128_ps(triangle[half]), mask));
+                triangle[half] = _mm_add_epi32(triangle[half], step);
+            }
+        }
+
+        alignas(16) float t[PACKET_WIDTH], u[PACKET_WIDTH], v[PACKET_WIDTH];
+        alignas(16) uint32_t index[PACKET_WIDTH];
+        for (int half = 0; half < 2; ++half) {
+            _mm_store_ps(t + half * 4, bestT[half]);
+            _mm_store_ps(u + half * 4, bestU[half]);
+            _mm_store_ps(v + half * 4, bestV[half]);
+            _mm_store_si128(reinterpret_cast<__m128i*>(index + half * 4),
+                bestTriangle[half]);
+        }
+        return nearestLane(t, u, v, index, tMax);
+    }
+
+    TARGET_AVX2 Hit intersectAvx2(const Packet* packets, size_t count,
+        const glm::vec3& o, const glm::vec3& d, float tMin, float tMax,
+        bool anyHit) {
+        const __m256 ox = _mm256_set1_ps(o.x);
+        const __m256 oy = _mm256_set1_ps(o.y);
+        const __m256 oz = _mm256_set1_ps(o.z);
+        const __m256 dx = _mm256_set1_ps(d.x);
+        const __m256 dy = _mm256_set1_ps(d.y);
+        const __m256 dz = _mm256_set1_ps(d.z);
+        const __m256 rayTMin = _mm256_set1_ps(tMin);
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256 signBit = _mm256_set1_ps(-0.0f);
+        const __m256 detEpsilon = _mm256_set1_ps(DET_EPSILON);
+        const __m256i step = _mm256_set1_epi32(PACKET_WIDTH);
+
+        __m256 bestT = _mm256_set1_ps(tMax);
+        __m256 bestU = zero;
+        __m256 bestV = zero;
+        __m256i bestTriangle = _mm256_set1_epi32(-1);
+        __m256i triangle = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+        for (size_t i = 0; i < count; ++i) {
+            const Packet& p = packets[i];
+            __m256 e1x = _mm256_load_ps(p.e1x);
+            __m256 e1y = _mm256_load_ps(p.e1y);
+            __m256 e1z = _mm256_load_ps(p.e1z);
+            __m256 e2x = _mm256_load_ps(p.e2x);
+            __m256 e2y = _mm256_load_ps(p.e2y);
+            __m256 e2z = _mm256_load_ps(p.e2z);
+
+            __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+            __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+            __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+            __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px),
+                _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+            __m256 invDet = _mm256_div_ps(one, det);
+
+            __m256 sx = _mm256_sub_ps(ox, _mm256_load_ps(p.v0x));
+            __m256 sy = _mm256_sub_ps(oy, _mm256_load_ps(p.v0y));
+            __m256 sz = _mm256_sub_ps(oz, _mm256_load_ps(p.v0z));
+            __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)),
+                _mm256_mul_ps(sz, pz)), invDet);
+
+            __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+            __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+            __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+            __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                _mm256_mul_ps(dz, qz)), invDet);
+            __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+                _mm256_mul_ps(e2z, qz)), invDet);
+
+            __m256 mask = _mm256_cmp_ps(_mm256_andnot_ps(signBit, det),
+                detEpsilon, _CMP_GT_OQ);
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+            mask = _mm256_and_ps(mask,
+                _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, rayTMin, _CMP_GT_OQ));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, bestT, _CMP_LT_OQ));
+
+            if (anyHit && _mm256_movemask_ps(mask) != 0) {
+                return firstLane(i, 0, _mm256_movemask_ps(mask));
+            }
+            bestT = _mm256_blendv_ps(bestT, t, mask);
+            bestU = _mm256_blendv_ps(bestU, u, mask);
+            bestV = _mm256_blendv_ps(bestV, v, mask);
+            bestTriangle = _mm256_castps_si256(_mm256_blendv_ps(
+                _mm256_castsi256_ps(bestTriangle),
+                _mm256_castsi256_ps(triangle), mask));
+            triangle = _mm256_add_epi32(triangle, step);
+        }
+
+        alignas(32) float t[PACKET_WIDTH], u[PACKET_WIDTH], v[PACKET_WIDTH];
+        alignas(32) uint32_t index[PACKET_WIDTH];
+        _mm256_store_ps(t, bestT);
+        _mm256_store_ps(u, bestU);
+        _mm256_store_ps(v, bestV);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(index), bestTriangle);
+        return nearestLane(t, u, v, index, tMax);
+    }
+#endif
+
+    triintersect::InstructionSet detectInstructionSet() {
+        using triintersect::InstructionSet;
+#if defined(TRI_INTERSECT_X86) && defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        int maxLeaf = info[0];
+        __cpuid(info, 1);
+        bool sse41 = (info[2] & (1 << 19)) != 0;
+        // avx registers also need the os to save them on context switches
+        bool avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0
+            && (_xgetbv(0) & 6) == 6;
+        bool avx2 = false;
+        if (avx && maxLeaf >= 7) {
+            __cpuidex(info, 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+        }
+        if (avx2) {
+            return InstructionSet::AVX2;
+        }
+        if (sse41) {
+            return InstructionSet::SSE4;
+        }
+#elif defined(TRI_INTERSECT_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return InstructionSet::AVX2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return InstructionSet::SSE4;
+        }
+#endif
+        return InstructionSet::Scalar;
+    }
+
+    Hit dispatch(triintersect::InstructionSet set, const Packet* packets,
+        size_t count, const glm::vec3& o, const glm::vec3& d,
+        float tMin, float tMax, bool anyHit) {
+#if defined(TRI_INTERSECT_X86)
+        switch (set) {
+        case triintersect::InstructionSet::AVX2:
+            return intersectAvx2(packets, count, o, d, tMin, tMax, anyHit);
+        case triintersect::InstructionSet::SSE4:
+            return intersectSse4(packets, count, o, d, tMin, tMax, anyHit);
+        default:
+            break;
+        }
+#else
+        (void)set;
+#endif
+        return intersectScalar(packets, count, o, d, tMin, tMax, anyHit);
+    }
+}
+
+namespace triintersect {
+    void Packet::set(uint32_t lane, const glm::vec3& vert0,
+        const glm::vec3& vert1, const glm::vec3& vert2) {
+        glm::vec3 edge1 = vert1 - vert0;
+        glm::vec3 edge2 = vert2 - vert0;
+        v0x[lane] = vert0.x;
+        v0y[lane] = vert0.y;
+        v0z[lane] = vert0.z;
+        e1x[lane] = edge1.x;
+        e1y[lane] = edge1.y;
+        e1z[lane] = edge1.z;
+        e2x[lane] = edge2.x;
+        e2y[lane] = edge2.y;
+        e2z[lane] = edge2.z;
+    }
+
+    void Packet::clear(uint32_t lane) {
+        set(lane, glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f));
+    }
+
+    void pack(const std::vector<glm::vec3>& vertices,
+        std::vector<Packet>& packets) {
+        size_t triangleCount = vertices.size() / 3;
+        packets.resize((triangleCount + PACKET_WIDTH - 1) / PACKET_WIDTH);
+        for (size_t i = 0; i < packets.size() * PACKET_WIDTH; ++i) {
+            Packet& packet = packets[i / PACKET_WIDTH];
+            uint32_t lane = static_cast<uint32_t>(i % PACKET_WIDTH);
+            if (i < triangleCount) {
+                packet.set(lane, vertices[i * 3], vertices[i * 3 + 1],
+                    vertices[i * 3 + 2]);
+            }
+            else {
+                packet.clear(lane);
+            }
+        }
+    }
+
+    InstructionSet supportedInstructionSet() {
+        static const InstructionSet supported = detectInstructionSet();
+        return supported;
+    }
+
+    const char* instructionSetName(InstructionSet set) {
+        switch (set) {
+        case InstructionSet::AVX2:
+            return "avx2";
+        case InstructionSet::SSE4:
+            return "sse4";
+        default:
+            return "scalar";
+        }
+    }
+
+    Hit intersect(const Packet* packets, size_t count, const glm::vec3& origin,
+        const glm::vec3& direction, float tMin, float tMax) {
+        return dispatch(supportedInstructionSet(), packets, count,
+            origin, direction, tMin, tMax, false);
+    }
+
+    bool occluded(const Packet* packets, size_t count, const glm::vec3& origin,
+        const glm::vec3& direction, float tMin, float tMax) {
+        return dispatch(supportedInstructionSet(), packets, count,
+            origin, direction, tMin, tMax, true).triangle != NO_HIT;
+    }
+
+    Hit intersect(InstructionSet set, const Packet* packets, size_t count,
+        const glm::vec3& origin, const glm::vec3& direction,
+        float tMin, float tMax) {
+        return dispatch(set, packets, count, origin, direction,
+            tMin, tMax, false);
+    }
+
+    bool occluded(InstructionSet set, const Packet* packets, size_t count,
+        const glm::vec3& origin, const glm::vec3& direction,
+        float tMin, float tMax) {
+        return dispatch(set, packets, count, origin, direction,
+            tMin, tMax, true).triangle != NO_HIT;
+    }
+}
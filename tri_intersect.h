@@ -0,0 +1,69 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+// möller-trumbore of one ray against 8 triangles at a time, for cpu side
+// tracing over rt_all_triangles (picking, baking, reference renders). the
+// simd path is picked at runtime from what the cpu supports
+namespace triintersect {
+    const uint32_t PACKET_WIDTH = 8;
+    const uint32_t NO_HIT = 0xffffffff;
+
+    // 8 triangles as structure of arrays, vertex 0 and the two edges out of
+    // it, so one register holds the same coordinate of every triangle.
+    // lanes without a triangle are degenerate and never hit
+    struct alignas(32) Packet {
+        float v0x[PACKET_WIDTH], v0y[PACKET_WIDTH], v0z[PACKET_WIDTH];
+        float e1x[PACKET_WIDTH], e1y[PACKET_WIDTH], e1z[PACKET_WIDTH];
+        float e2x[PACKET_WIDTH], e2y[PACKET_WIDTH], e2z[PACKET_WIDTH];
+
+        void set(uint32_t lane, const glm::vec3& vert0, const glm::vec3& vert1,
+            const glm::vec3& vert2);
+        void clear(uint32_t lane);
+    };
+
+    // triangle i goes to lane i % 8 of packet i / 8, the last packet is
+    // padded with empty lanes
+    void pack(const std::vector<glm::vec3>& vertices,
+        std::vector<Packet>& packets);
+
+    // triangle is packet * 8 + lane, NO_HIT with t = tMax when nothing was
+    // hit. u and v weight vertex 1 and vertex 2
+    struct Hit {
+        uint32_t triangle = NO_HIT;
+        float t = 0.0f;
+        float u = 0.0f;
+        float v = 0.0f;
+    };
+
+    enum class InstructionSet {
+        Scalar,
+        SSE4,
+        AVX2
+    };
+
+    // best the cpu supports, checked once
+    InstructionSet supportedInstructionSet();
+    // "avx2", "sse4" or "scalar"
+    const char* instructionSetName(InstructionSet set);
+
+    // nearest hit with tMin < t < tMax. equal distances go to the lower
+    // triangle index, so every instruction set gives the same hit up to
+    // fused multiply-adds the compiler may form
+    Hit intersect(const Packet* packets, size_t count, const glm::vec3& origin,
+        const glm::vec3& direction, float tMin, float tMax);
+    // true on the first hit with tMin < t < tMax, for shadow rays
+    bool occluded(const Packet* packets, size_t count, const glm::vec3& origin,
+        const glm::vec3& direction, float tMin, float tMax);
+
+    // forced instruction set for tests and benchmarks, it has to be
+    // supported by the cpu
+    Hit intersect(InstructionSet set, const Packet* packets, size_t count,
+        const glm::vec3& origin, const glm::vec3& direction,
+        float tMin, float tMax);
+    bool occluded(InstructionSet set, const Packet* packets, size_t count,
+        const glm::vec3& origin, const glm::vec3& direction,
+        float tMin, float tMax);
+}
@@ -0,0 +1,359 @@
+#include "upload_batch.h"
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+    // bufferOffset of an image copy has to be a multiple of the texel
+    // (or compressed block) size, 16 covers every format used here
+    const VkDeviceSize STAGING_ALIGNMENT = 16;
+
+    VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+}
+
+void UploadBatch::init(VkDevice device, DeviceMemoryAllocator* allocator,
+    const UploadQueue& transfer, const std::vector<UploadQueue>& consumers,
+    VkDeviceSize arenaSize) {
+    device_ = device;
+    allocator_ = allocator;
+
+    submissions_.resize(1);
+    submissions_[0].queue = transfer;
+    for (const auto& consumer : consumers) {
+        bool known = false;
+        for (const auto& submission : submissions_) {
+            known = known || submission.queue.family == consumer.family;
+        }
+        if (!known) {
+            submissions_.emplace_back();
+            submissions_.back().queue = consumer;
+        }
+    }
+
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    for (auto& submission : submissions_) {
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = submission.queue.family;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT
+            | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        if (vkCreateCommandPool(device_, &poolInfo, nullptr,
+            &submission.commandPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create upload command pool!");
+        }
+
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = submission.commandPool;
+        allocInfo.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(device_, &allocInfo,
+            &submission.commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error(
+                "failed to allocate upload command buffer!");
+        }
+
+        if (vkCreateSemaphore(device_, &semaphoreInfo, nullptr,
+            &submission.done) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create upload semaphore!");
+        }
+    }
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    if (vkCreateFence(device_, &fenceInfo, nullptr, &fence_) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upload fence!");
+    }
+
+    arena_size_ = arenaSize;
+    arena_head_ = 0;
+    arena_ = createStaging(arena_size_);
+}
+
+void UploadBatch::destroy() {
+    flush();
+    vkDestroyBuffer(device_, arena_.buffer, nullptr);
+    allocator_->free(arena_.memory);
+    vkDestroyFence(device_, fence_, nullptr);
+    for (auto& submission : submissions_) {
+        vkDestroySemaphore(device_, submission.done, nullptr);
+        vkDestroyCommandPool(device_, submission.commandPool, nullptr);
+    }
+    submissions_.clear();
+}
+
+void UploadBatch::copyToBuffer(VkBuffer dst, const void* data,
+    VkDeviceSize size, uint32_t dstFamily, VkDeviceSize dstOffset) {
+    waitPending();
+    VkBuffer src;
+    VkDeviceSize srcOffset;
+    stage(data, size, src, srcOffset);
+
+    VkCommandBuffer commandBuffer = record(submissions_[0]);
+    VkBufferCopy region = {};
+    region.srcOffset = srcOffset;
+    region.dstOffset = dstOffset;
+    region.size = size;
+    vkCmdCopyBuffer(commandBuffer, src, dst, 1, &region);
+
+    if (dstFamily == transferFamily()) {
+        // the memory barrier in flush covers it
+        return;
+    }
+
+    VkBufferMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = transferFamily();
+    barrier.dstQueueFamilyIndex = dstFamily;
+    barrier.buffer = dst;
+    barrier.offset = dstOffset;
+    barrier.size = size;
+
+    // release
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+    // acquire
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    vkCmdPipelineBarrier(record(submission(dstFamily)),
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+        0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void UploadBatch::copyToImage(VkImage image,
+    const VkImageSubresourceRange& range, const void* data,
+    VkDeviceSize size, const VkBufferImageCopy* regions,
+    uint32_t regionCount, VkImageLayout finalLayout, uint32_t dstFamily) {
+    waitPending();
+    VkBuffer src;
+    VkDeviceSize srcOffset;
+    // staged first, a flush in there must not split the transitions
+    // from the copy
+    stage(data, size, src, srcOffset);
+
+    VkCommandBuffer commandBuffer = record(submissions_[0]);
+
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange = range;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    std::vector<VkBufferImageCopy> staged(regions, regions + regionCount);
+    for (auto& region : staged) {
+        region.bufferOffset += srcOffset;
+    }
+    vkCmdCopyBufferToImage(commandBuffer, src, image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regionCount, staged.data());
+
+    // both halves of an ownership transfer carry the same layout change
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = finalLayout;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+    if (dstFamily == transferFamily()) {
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            0, 0, nullptr, 0, nullptr, 1, &barrier);
+        return;
+    }
+
+    barrier.srcQueueFamilyIndex = transferFamily();
+    barrier.dstQueueFamilyIndex = dstFamily;
+
+    // release
+    barrier.dstAccessMask = 0;
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    // acquire
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(record(submission(dstFamily)),
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+VkCommandBuffer UploadBatch::commandBuffer(uint32_t family) {
+    waitPending();
+    return record(submission(family));
+}
+
+void UploadBatch::flush() {
+    submit(VK_NULL_HANDLE);
+    waitPending();
+}
+
+bool UploadBatch::submit(VkSemaphore signal) {
+    bool recording = false;
+    for (const auto& submission : submissions_) {
+        recording = recording || submission.recording;
+    }
+    if (!recording) {
+        return false;
+    }
+
+    if (submissions_[0].recording) {
+        // buffers copied for the transfer family get no barrier of their
+        // own, make every copy visible to whatever reads it next
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        vkCmdPipelineBarrier(submissions_[0].commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    // transfer first, then every consumer waiting on the one before it,
+    // the last one signals the fence and signal
+    std::vector<Submission*> chain;
+    for (auto& submission : submissions_) {
+        if (submission.recording) {
+            if (vkEndCommandBuffer(submission.commandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error(
+                    "failed to end upload command buffer!");
+            }
+            submission.recording = false;
+            chain.push_back(&submission);
+        }
+    }
+
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    for (size_t i = 0; i < chain.size(); ++i) {
+        bool last = i + 1 == chain.size();
+
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        if (i > 0) {
+            submitInfo.waitSemaphoreCount = 1;
+            submitInfo.pWaitSemaphores = &chain[i - 1]->done;
+            submitInfo.pWaitDstStageMask = &waitStage;
+        }
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &chain[i]->commandBuffer;
+        if (!last) {
+            submitInfo.signalSemaphoreCount = 1;
+            submitInfo.pSignalSemaphores = &chain[i]->done;
+        }
+        else if (signal != VK_NULL_HANDLE) {
+            submitInfo.signalSemaphoreCount = 1;
+            submitInfo.pSignalSemaphores = &signal;
+        }
+        if (vkQueueSubmit(chain[i]->queue.queue, 1, &submitInfo,
+            last ? fence_ : VK_NULL_HANDLE) != VK_SUCCESS) {
+            throw std::runtime_error("failed to submit upload command buffer!");
+        }
+    }
+    submit_count_ += static_cast<uint32_t>(chain.size());
+    pending_ = true;
+    return true;
+}
+
+void UploadBatch::waitPending() {
+    if (!pending_) {
+        return;
+    }
+    vkWaitForFences(device_, 1, &fence_, VK_TRUE,
+        std::numeric_limits<uint64_t>::max());
+    vkResetFences(device_, 1, &fence_);
+    // none of them is recording, see the callers
+    for (auto& submission : submissions_) {
+        vkResetCommandBuffer(submission.commandBuffer, 0);
+    }
+    pending_ = false;
+
+    arena_head_ = 0;
+    for (auto& staging : oversized_) {
+        vkDestroyBuffer(device_, staging.buffer, nullptr);
+        allocator_->free(staging.memory);
+    }
+    oversized_.clear();
+}
+
+UploadBatch::Submission& UploadBatch::submission(uint32_t family) {
+    for (auto& submission : submissions_) {
+        if (submission.queue.family == family) {
+            return submission;
+        }
+    }
+    throw std::runtime_error("no upload queue for this queue family!");
+}
+
+VkCommandBuffer UploadBatch::record(Submission& submission) {
+    if (!submission.recording) {
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(submission.commandBuffer, &beginInfo)
+            != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin upload command buffer!");
+        }
+        submission.recording = true;
+    }
+    return submission.commandBuffer;
+}
+
+void UploadBatch::stage(const void* data, VkDeviceSize size,
+    VkBuffer& buffer, VkDeviceSize& offset) {
+    staged_bytes_ += size;
+
+    if (size > arena_size_) {
+        oversized_.push_back(createStaging(size));
+        memcpy(oversized_.back().memory.mapped, data, static_cast<size_t>(size));
+        buffer = oversized_.back().buffer;
+        offset = 0;
+        return;
+    }
+
+    offset = alignUp(arena_head_, STAGING_ALIGNMENT);
+    if (offset + size > arena_size_) {
+        // everything staged so far has to land before it is overwritten
+        flush();
+        offset = 0;
+    }
+    memcpy(static_cast<unsigned char*>(arena_.memory.mapped) + offset, data,
+        static_cast<size_t>(size));
+    arena_head_ = offset + size;
+    buffer = arena_.buffer;
+}
+
+UploadBatch::Staging UploadBatch::createStaging(VkDeviceSize size) {
+    Staging staging;
+
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(device_, &bufferInfo, nullptr, &staging.buffer)
+        != VK_SUCCESS) {
+        throw std::runtime_error("failed to create staging buffer!");
+    }
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(device_, staging.buffer, &memRequirements);
+    staging.memory = allocator_->allocate(memRequirements,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+        | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, true);
+    vkBindBufferMemory(device_, staging.buffer, staging.memory.memory,
+        staging.memory.offset);
+    return staging;
+}
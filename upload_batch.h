@@ -0,0 +1,102 @@
+#pragma once
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+#include <vector>
+#include "device_memory.h"
+
+struct UploadQueue {
+    VkQueue queue;
+    uint32_t family;
+};
+
+// records the staging copies of many resources into one command buffer on
+// the transfer queue and submits them with a single fence on flush
+// source data is copied into a persistently mapped staging arena right
+// away, so callers may free it as soon as a copy call returns
+// when a resource is used by another queue family than the transfer one,
+// ownership is released after the copy and acquired in a command buffer of
+// that family, submitted right after the copies and chained by semaphores
+// main thread only, like the allocator it draws from
+class UploadBatch
+{
+public:
+    static const VkDeviceSize DEFAULT_ARENA_SIZE = 32 * 1024 * 1024;
+
+    // consumers are the queues resources are handed to, families equal to
+    // the transfer one are folded into it
+    void init(VkDevice device, DeviceMemoryAllocator* allocator,
+        const UploadQueue& transfer, const std::vector<UploadQueue>& consumers,
+        VkDeviceSize arenaSize = DEFAULT_ARENA_SIZE);
+    // flushes whatever is still recorded first
+    void destroy();
+
+    void copyToBuffer(VkBuffer dst, const void* data, VkDeviceSize size,
+        uint32_t dstFamily, VkDeviceSize dstOffset = 0);
+    // moves range from UNDEFINED to TRANSFER_DST, copies, and leaves it in
+    // finalLayout owned by dstFamily
+    // bufferOffset of every region is relative to data
+    void copyToImage(VkImage image, const VkImageSubresourceRange& range,
+        const void* data, VkDeviceSize size,
+        const VkBufferImageCopy* regions, uint32_t regionCount,
+        VkImageLayout finalLayout, uint32_t dstFamily);
+    // for barriers that are not part of a copy, e.g. the first layout
+    // transition of an attachment. runs after every copy of the batch
+    VkCommandBuffer commandBuffer(uint32_t family);
+
+    // submits everything recorded so far and waits on the fence, the arena
+    // is reused after that. called by itself when the arena runs full
+    void flush();
+    // submits without waiting, for uploads in the frame loop. signal is
+    // signaled once the copies (and acquires) are done, for the submit
+    // that reads them to wait on. the fence is only waited for the next
+    // time the batch records, a frame later. false if nothing was
+    // recorded, then signal is left alone
+    bool submit(VkSemaphore signal);
+
+    uint32_t transferFamily() const { return submissions_[0].queue.family; }
+    uint32_t submitCount() const { return submit_count_; }
+    VkDeviceSize stagedBytes() const { return staged_bytes_; }
+
+private:
+    struct Staging {
+        VkBuffer buffer;
+        AppAllocation memory;
+    };
+
+    // [0] records the copies, the rest acquire on the consumer queues
+    struct Submission {
+        UploadQueue queue;
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        // signaled for the next submission in the chain
+        VkSemaphore done = VK_NULL_HANDLE;
+        bool recording = false;
+    };
+
+    Submission& submission(uint32_t family);
+    VkCommandBuffer record(Submission& submission);
+    // copies data into the arena (or a dedicated buffer when it can
+    // never fit), sets where it landed
+    void stage(const void* data, VkDeviceSize size, VkBuffer& buffer,
+        VkDeviceSize& offset);
+    Staging createStaging(VkDeviceSize size);
+    // waits for a submit that flush didn't wait for, then frees its
+    // staging. nothing is recorded while one is pending
+    void waitPending();
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    DeviceMemoryAllocator* allocator_ = nullptr;
+    std::vector<Submission> submissions_;
+    VkFence fence_ = VK_NULL_HANDLE;
+    // fence_ belongs to a submit nobody waited for yet
+    bool pending_ = false;
+
+    Staging arena_;
+    VkDeviceSize arena_size_ = 0;
+    VkDeviceSize arena_head_ = 0;
+    // bigger than the arena, freed on the next flush
+    std::vector<Staging> oversized_;
+
+    uint32_t submit_count_ = 0;
+    VkDeviceSize staged_bytes_ = 0;
+};
@@ -1,5 +1,8 @@
 ﻿#include "vulkan_app.h"
 #include "app_util.h"
+#include "mesh_util.h"
+#include "mesh_cache.h"
+#include "texture_cache.h"
 #include <tiny_obj_loader.h>
 #define TINYOBJLOADER_IMPLEMENTATION
 #define GLFW_INCLUDE_VULKAN
@@ -11,15 +14,18 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/transform.hpp>
 #include <stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+#include <deque>
+#include <sstream>
+#include <map>
+#include <future>
+#include <thread>
 #include <gli/gli.hpp>
 #include <glm/gtc/constants.hpp>
 
 #define SHOW_SHADOW_SCENE
 
-// Temp =================================================
-bool tempPushTriangleSwitch = true;
-glm::mat4 tempGlobalModelMatrix = glm::mat4(1.f);
-
 // Timers =================================================
 std::chrono::time_point<std::chrono::steady_clock> START_TIME;
 std::chrono::time_point<std::chrono::steady_clock> LAST_RECORD_TIME;
@@ -160,6 +166,8 @@ void VulkanApp::initWindow() {
     glfwInit();
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    // the swapchain and everything sized from it are never recreated
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
 
     window_ = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
     glfwSetWindowUserPointer(window_, this);
@@ -171,12 +179,22 @@ void VulkanApp::initWindow() {
 
 VulkanApp::VulkanApp() {}
 
+VulkanApp::VulkanApp(const HeadlessSettings& headless)
+    : headless_(headless) {}
+
 void VulkanApp::run() {
-    initWindow();
+    if (!headless_.enabled) {
+        initWindow();
+    }
     initCam();
     initVulkan();
     INIT_GLOBAL_TIME();
-    mainLoop();
+    if (headless_.enabled) {
+        headlessLoop();
+    }
+    else {
+        mainLoop();
+    }
     cleanup();
 }
 
@@ -188,16 +206,39 @@ void VulkanApp::framebufferResizeCallback(GLFWwindow* window, int width, int hei
 void VulkanApp::initVulkan() {
     createInstance();
     setupDebugCallback();
-    createSurface();
+    if (!headless_.enabled) {
+        createSurface();
+    }
     pickPhysicalDevice();
     createLogicalDevice();
-    createSwapChain();
-    createSwapChainImageViews();
+    memory_allocator_.init(device_, physical_device_);
+    if (headless_.enabled) {
+        createHeadlessColorTarget();
+    }
+    else {
+        createSwapChain();
+        createSwapChainImageViews();
+    }
     initSemAndSubmitInfo();
 
     createPipelineCache();
     createCommandPool();
+    createRecordThreads();
+    upload_batch_.init(device_, &memory_allocator_,
+        { transfer_queue_, queue_families_.transferFamily.value() },
+        { { queue_, queue_families_.graphicsFamily.value() },
+          { compute_.rt_computeQueue, queue_families_.computeFamily.value() } });
+#ifdef TEXTURE_STREAMING
+    texture_streaming_ = !headless_.enabled;
+#endif
+#ifdef CPU_CULLING
+    cpu_culling_ = true;
+#endif
     createDescriptorPool();
+    createUniformRing();
+    createInstanceBuffer();
+    rt_createTopLevelBuffer();
+    createGeometryPool();
     createDepthResources();
     setupVertexDescriptions();
     // begin offscreen ==========================================
@@ -205,9 +246,21 @@ void VulkanApp::initVulkan() {
     
     // start to combine ray tracing to deferred
     rt_createSema();
-    rt_createUniformBuffers();
     rt_prepareStorageBuffers();
-    rt_prepareTextureTarget(rt_result, VK_FORMAT_R8G8B8A8_UNORM);
+#ifdef ONLY_RT
+    // no g buffer to guide an upsample
+    rt_traceScale = 1;
+#endif
+    for (auto& rt_result : rt_results) {
+        rt_prepareTextureTarget(rt_result, VK_FORMAT_R8G8B8A8_UNORM);
+    }
+    if (rt_traceScale > 1) {
+        for (auto& rt_lowResult : rt_lowResults) {
+            rt_prepareTextureTarget(rt_lowResult, VK_FORMAT_R8G8B8A8_UNORM,
+                (WIDTH + rt_traceScale - 1) / rt_traceScale,
+                (HEIGHT + rt_traceScale - 1) / rt_traceScale);
+        }
+    }
 #ifndef ONLY_RT
     prepareSkybox();
     prepareSceneObjectsData();
@@ -218,24 +271,29 @@ void VulkanApp::initVulkan() {
 
     prepareOffscreen();
     rt_prepareCompute();
+    rt_prepareShadowUpsample();
 
     // because create pipeline need renderpass which now is offscreen.renderpass
     createSkyboxPipeline();
 
+    // the material table sets point at the visible lists of the cull pass
+    prepareGpuCulling();
     prepareSceneObjectsDescriptor();
     prepareOffscreenCommandBuffer();
     rt_createComputeCommandBuffer();
     prepareDeferred();
 
+    if (headless_.enabled) {
+        prepareHeadlessReadback();
+    }
 #endif
 
 #ifdef ONLY_RT
 	// ray tracing pipeline
 	rt_createSema();
-	rt_createUniformBuffers();
 	rt_prepareStorageBuffers();
 	rt_prepareObjFileBuffer();
-	rt_prepareTextureTarget(rt_result, VK_FORMAT_R8G8B8A8_UNORM);
+	rt_prepareTextureTarget(rt_results[0], VK_FORMAT_R8G8B8A8_UNORM);
 	rt_graphics_setupDescriptorSetLayout();
 	rt_graphics_setupDescriptorSet();
 	rt_createPipelineLayout();
@@ -246,6 +304,13 @@ void VulkanApp::initVulkan() {
 	rt_createComputeCommandBuffer();
 	rt_createRaytraceDisplayCommandBuffer();
 #endif
+
+    // everything recorded since createCommandPool lands in one go
+    upload_batch_.flush();
+    std::cout << "uploads: " << upload_batch_.stagedBytes() / (1024 * 1024)
+        << " MB in " << upload_batch_.submitCount() << " submits"
+        << std::endl;
+    memory_allocator_.printStats();
 }
 
 void VulkanApp::mainLoop() {
@@ -256,9 +321,14 @@ void VulkanApp::mainLoop() {
 #ifdef ONLY_RT
         rt_draw();
 #else
+        // uniform buffers of this frame may still be read by the gpu
+        vkWaitForFences(device_, 1, &waitFences[current_frame_], VK_TRUE,
+            std::numeric_limits<uint64_t>::max());
+        beginUniformRingFrame();
         updateUniformBuffers();
         rt_updateUniformBuffer();
         showFPS();
+        updateTextureStreaming();
         draw();
 #endif
     }
@@ -277,17 +347,49 @@ void VulkanApp::cleanup() {
     vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_, nullptr);
 
     vkDestroyBuffer(device_, quadIndexBuffer, nullptr);
-    vkFreeMemory(device_, quadIndexBufferMemory, nullptr);
+    memory_allocator_.free(quadIndexBufferMemory);
+
+    cleanupUniformRing();
+    cleanupInstanceBuffer();
+    rt_cleanupTopLevelBuffer();
+    cleanupMaterialTable();
+#ifndef ONLY_RT
+    cleanupGpuCulling();
+    rt_cleanupShadowUpsample();
+#endif
 
     vkDestroyBuffer(device_, quadVertexBuffer, nullptr);
-    vkFreeMemory(device_, quadVertexBufferMemory, nullptr);
+    memory_allocator_.free(quadVertexBufferMemory);
 
-    vkDestroySemaphore(device_, offscreen_complete_semaphore_, nullptr);
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        vkDestroySemaphore(device_, offscreen_complete_semaphores_[i], nullptr);
+        vkDestroySemaphore(device_, rt_complete_semas[i], nullptr);
+        vkDestroySemaphore(device_, semaphores_.presentComplete[i], nullptr);
+        vkDestroySemaphore(device_, semaphores_.renderComplete[i], nullptr);
+        vkDestroyFence(device_, waitFences[i], nullptr);
+    }
+    vkDestroySemaphore(device_, stream_upload_semaphore_, nullptr);
 
+    if (headless_.enabled) {
+        cleanupHeadless();
+    }
 
     vkDestroyPipelineCache(device_, pipelineCache, nullptr);
 
     vkDestroyCommandPool(device_, command_pool_, nullptr);
+    vkDestroyCommandPool(device_, compute_.rt_commandPool, nullptr);
+    cleanupRecordThreads();
+
+    // the gpu is idle by now, scene assets go back through the registry
+    for (auto& scene_object : scene_objects_) {
+        releaseSceneObjectAssets(scene_object);
+    }
+    releaseSceneObjectAssets(skybox_.skyBoxCube.mesh);
+    cleanupTextureStreaming();
+    cleanupGeometryPool();
+
+    upload_batch_.destroy();
+    memory_allocator_.destroy();
 
     vkDestroyDevice(device_, nullptr);
 
@@ -295,12 +397,15 @@ void VulkanApp::cleanup() {
         DestroyDebugUtilsMessengerEXT(instance_, callback_, nullptr);
     }
 
-    vkDestroySurfaceKHR(instance_, surface_, nullptr);
+    if (!headless_.enabled) {
+        vkDestroySurfaceKHR(instance_, surface_, nullptr);
+    }
     vkDestroyInstance(instance_, nullptr);
 
-    glfwDestroyWindow(window_);
-
-    glfwTerminate();
+    if (!headless_.enabled) {
+        glfwDestroyWindow(window_);
+        glfwTerminate();
+    }
 
     delete firstPersonCam;
 }
@@ -316,7 +421,8 @@ void VulkanApp::createInstance() {
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "No Engine";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+    // descriptor indexing for the material table is core in 1.2
+    appInfo.apiVersion = VK_API_VERSION_1_2;
 
     VkInstanceCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -370,7 +476,23 @@ void VulkanApp::pickPhysicalDevice() {
     std::vector<VkPhysicalDevice> devices(deviceCount);
     vkEnumeratePhysicalDevices(instance_, &deviceCount, devices.data());
 
+    // software implementations are what the render farm has, try them first
+    if (headless_.enabled && headless_.preferCpuDevice) {
+        for (const auto& device : devices) {
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(device, &properties);
+            if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU
+                && isDeviceSuitable(device)) {
+                physical_device_ = device;
+                break;
+            }
+        }
+    }
+
     for (const auto& device : devices) {
+        if (physical_device_ != VK_NULL_HANDLE) {
+            break;
+        }
         if (isDeviceSuitable(device)) {
             physical_device_ = device;
             break;
@@ -380,13 +502,20 @@ void VulkanApp::pickPhysicalDevice() {
     if (physical_device_ == VK_NULL_HANDLE) {
         throw std::runtime_error("failed to find a suitable GPU!");
     }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device_, &properties);
+    std::cout << "device: " << properties.deviceName << std::endl;
 }
 
 void VulkanApp::createLogicalDevice() {
     QueueFamilyIndices indices = findQueueFamilies(physical_device_);
+    queue_families_ = indices;
 
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-    std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value() };
+    std::set<uint32_t> uniqueQueueFamilies = {
+        indices.graphicsFamily.value(), indices.presentFamily.value(),
+        indices.computeFamily.value(), indices.transferFamily.value() };
 
     float queuePriority = 1.0f;
     for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -402,6 +531,9 @@ void VulkanApp::createLogicalDevice() {
     deviceFeatures.samplerAnisotropy = VK_TRUE;
     // for skybox
     deviceFeatures.textureCompressionBC = VK_TRUE;
+    // the g buffer pass is one indirect draw over every draw group
+    deviceFeatures.multiDrawIndirect = VK_TRUE;
+    deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
 
     VkDeviceCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -411,8 +543,30 @@ void VulkanApp::createLogicalDevice() {
 
     createInfo.pEnabledFeatures = &deviceFeatures;
 
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    // checked in isDeviceSuitable
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {};
+    vulkan12Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vulkan12Features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+    vulkan12Features.runtimeDescriptorArray = VK_TRUE;
+    vulkan12Features.descriptorBindingPartiallyBound = VK_TRUE;
+    vulkan12Features.drawIndirectCount = VK_TRUE;
+    createInfo.pNext = &vulkan12Features;
+
+    // the table shares the fragment stage with nothing else of its set,
+    // leave a few slots for other sets of the same pipeline
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device_, &properties);
+    const VkPhysicalDeviceLimits& limits = properties.limits;
+    material_texture_capacity_ = std::min({ MAX_MATERIAL_TEXTURES,
+        limits.maxPerStageDescriptorSamplers - 4,
+        limits.maxPerStageDescriptorSampledImages - 4,
+        limits.maxDescriptorSetSamplers - 4,
+        limits.maxDescriptorSetSampledImages - 4 });
+
+    auto extensions = getRequiredDeviceExtensions();
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    createInfo.ppEnabledExtensionNames = extensions.data();
 
     if (enableValidationLayers) {
         createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
@@ -427,10 +581,20 @@ void VulkanApp::createLogicalDevice() {
     }
 
     vkGetDeviceQueue(device_, indices.graphicsFamily.value(), 0, &queue_);
+    // same VkQueue as queue_ when the family is the same
+    vkGetDeviceQueue(device_, indices.computeFamily.value(), 0,
+        &compute_.rt_computeQueue);
+    vkGetDeviceQueue(device_, indices.transferFamily.value(), 0,
+        &transfer_queue_);
+    async_compute_ = indices.computeFamily != indices.graphicsFamily;
     // vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
     std::cout << "queue g: " << indices.graphicsFamily.value() << std::endl;
     std::cout << "queue p: " << indices.presentFamily.value() << std::endl;
-    std::cout << "queue c: " << indices.computeFamily.value() << std::endl;
+    std::cout << "queue c: " << indices.computeFamily.value()
+        << (async_compute_ ? " (async)" : "") << std::endl;
+    std::cout << "queue t: " << indices.transferFamily.value()
+        << (indices.transferFamily != indices.graphicsFamily ? " (async)" : "")
+        << std::endl;
     std::cout << "graphicsQueue: " << queue_ << std::endl;
     // std::cout << "presentQueue: " << presentQueue << std::endl;
 
@@ -498,7 +662,11 @@ void VulkanApp::createSwapChainImageViews() {
 
 VkPipelineShaderStageCreateInfo VulkanApp::loadShader(std::string fileName, VkShaderStageFlagBits stage)
 {
-
+    // binaries are build output, not all of them are checked in
+    if (!std::ifstream(fileName, std::ios::binary).is_open()) {
+        throw std::runtime_error("failed to open " + fileName
+            + ", build the shaders with shaders/generate-spirv");
+    }
     auto shaderCode = readFile(fileName);
 
     VkShaderModule shaderModule = createShaderModule(shaderCode);
@@ -546,11 +714,11 @@ void VulkanApp::createSwapChainFramebuffers() {
 }
 
 void VulkanApp::createCommandPool() {
-    QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physical_device_);
-
     VkCommandPoolCreateInfo poolInfo = {};
     poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+    poolInfo.queueFamilyIndex = queue_families_.graphicsFamily.value();
+    // per frame command buffers are re-recorded with new uniform offsets
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
     if (vkCreateCommandPool(device_, &poolInfo, nullptr, &command_pool_) != VK_SUCCESS) {
         throw std::runtime_error("failed to create graphics command pool!");
@@ -569,7 +737,9 @@ void VulkanApp::createDepthResources() {
     depth_attachment_.imageView = createImageView(depth_attachment_.image, depthFormat,
         VK_IMAGE_ASPECT_DEPTH_BIT);
 
-    transitionImageLayout(depth_attachment_.image, depthFormat,
+    transitionImageLayout(
+        upload_batch_.commandBuffer(queue_families_.graphicsFamily.value()),
+        depth_attachment_.image, depthFormat,
         VK_IMAGE_LAYOUT_UNDEFINED,
         VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
 }
@@ -611,7 +781,7 @@ bool VulkanApp::hasStencilComponent(VkFormat format) {
     return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
 }
 
-VkImageView VulkanApp::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags) {
+VkImageView VulkanApp::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels) {
     VkImageViewCreateInfo viewInfo = {};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.image = image;
@@ -619,7 +789,7 @@ VkImageView VulkanApp::createImageView(VkImage image, VkFormat format, VkImageAs
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = aspectFlags;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = mipLevels;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
 
@@ -637,7 +807,8 @@ void VulkanApp::createImage(uint32_t width, uint32_t height,
     VkImageUsageFlags usage,
     VkMemoryPropertyFlags properties,
     VkImage& image,
-    VkDeviceMemory& imageMemory) {
+    AppAllocation& imageMemory,
+    uint32_t mipLevels) {
 
     VkImageCreateInfo imageInfo = {};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -645,7 +816,7 @@ void VulkanApp::createImage(uint32_t width, uint32_t height,
     imageInfo.extent.width = width;
     imageInfo.extent.height = height;
     imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
+    imageInfo.mipLevels = mipLevels;
     imageInfo.arrayLayers = 1;
     imageInfo.format = format;
     imageInfo.tiling = tiling;
@@ -661,22 +832,15 @@ void VulkanApp::createImage(uint32_t width, uint32_t height,
     VkMemoryRequirements memRequirements;
     vkGetImageMemoryRequirements(device_, image, &memRequirements);
 
-    VkMemoryAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-    if (vkAllocateMemory(device_, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate image memory!");
-    }
+    imageMemory = memory_allocator_.allocate(memRequirements, properties,
+        tiling == VK_IMAGE_TILING_LINEAR);
 
-    vkBindImageMemory(device_, image, imageMemory, 0);
+    vkBindImageMemory(device_, image, imageMemory.memory, imageMemory.offset);
 }
 
-void VulkanApp::transitionImageLayout(VkImage image, VkFormat format,
+void VulkanApp::transitionImageLayout(VkCommandBuffer commandBuffer,
+    VkImage image, VkFormat format,
     VkImageLayout oldLayout, VkImageLayout newLayout) {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
     VkImageMemoryBarrier barrier = {};
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
     barrier.oldLayout = oldLayout;
@@ -746,34 +910,40 @@ void VulkanApp::transitionImageLayout(VkImage image, VkFormat format,
         0, nullptr,
         1, &barrier
     );
+}
 
-    endSingleTimeCommands(commandBuffer);
-}
-
-void VulkanApp::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-    VkBufferImageCopy region = {};
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
-    region.imageOffset = { 0, 0, 0 };
-    region.imageExtent = {
-        width,
-        height,
-        1
-    };
-
-    vkCmdCopyBufferToImage(commandBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-    endSingleTimeCommands(commandBuffer);
+void VulkanApp::recordImageOwnershipTransfer(VkCommandBuffer commandBuffer,
+    const std::vector<VkImage>& images, VkImageLayout layout,
+    uint32_t srcFamily, uint32_t dstFamily, bool release,
+    VkPipelineStageFlags stage, VkAccessFlags access) {
+    std::vector<VkImageMemoryBarrier> barriers(images.size());
+    for (size_t i = 0; i < images.size(); ++i) {
+        VkImageMemoryBarrier& barrier = barriers[i];
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = layout;
+        barrier.newLayout = layout;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.image = images[i];
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        // dst access of a release and src access of an acquire are ignored
+        barrier.srcAccessMask = release ? access : 0;
+        barrier.dstAccessMask = release ? 0 : access;
+    }
+
+    // an acquire waits on the semaphore wait stage, which is also its
+    // first use
+    vkCmdPipelineBarrier(commandBuffer,
+        stage,
+        release ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : stage,
+        0,
+        0, nullptr,
+        0, nullptr,
+        static_cast<uint32_t>(barriers.size()), barriers.data());
 }
 
-void VulkanApp::loadSingleSceneObjectMesh(AppSceneObject& object_struct) {
+// no vulkan calls in here, runs on a worker thread
+void VulkanApp::cookSingleMesh(AppMesh& mesh, AppMeshData& data) {
     struct Vertex {
         float pos[3];
         float uv[2];
@@ -782,179 +952,270 @@ void VulkanApp::loadSingleSceneObjectMesh(AppSceneObject& object_struct) {
         float tangent[3];
     };
 
-    std::string file_path = object_struct.meshPath;
+    std::string file_path = mesh.path;
 
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
+    // object space positions, 9 floats per triangle in source face order
+    std::vector<float>& rtTriangles = mesh.rtTriangles;
+    rtTriangles.clear();
+    glm::vec3 aabbMin(std::numeric_limits<float>::max());
+    glm::vec3 aabbMax(-std::numeric_limits<float>::max());
+
+    // the cooked file is used straight out of the mapping, the vectors are
+    // only filled when the obj has to be parsed
+    data.cooked.reset(new CookedMesh());
+    CookedMesh& cooked = *data.cooked;
+    uint32_t vertexCount, indexCount;
+
+    if (meshcache::load(file_path, sizeof(Vertex), cooked)) {
+        data.vertexData = cooked.vertices;
+        data.indexData = cooked.indices;
+        vertexCount = cooked.header->vertexCount;
+        indexCount = cooked.header->indexCount;
+        rtTriangles.assign(cooked.rtTriangles,
+            cooked.rtTriangles + 9 * cooked.header->rtTriangleCount);
+        aabbMin = glm::vec3(cooked.header->aabbMin[0],
+            cooked.header->aabbMin[1], cooked.header->aabbMin[2]);
+        aabbMax = glm::vec3(cooked.header->aabbMax[0],
+            cooked.header->aabbMax[1], cooked.header->aabbMax[2]);
+    }
+    else {
+        tinyobj::attrib_t attrib;
+        std::vector<tinyobj::shape_t> shapes;
+        std::vector<tinyobj::material_t> materials;
+        std::string warn, err;
 
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string warn, err;
-
-
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, file_path.c_str())) {
-        throw std::runtime_error(warn + err);
-    }
-
-    int colorRounding = 1333;
-    for (const auto& shape : shapes) {
-        // +3 for per triangle
-        for (int i = 0; i < shape.mesh.indices.size(); i += 3) {
-            colorRounding += 1333333;
-            Vertex verts[3];
-            const tinyobj::index_t idx[] = {
-                shape.mesh.indices[i],
-                shape.mesh.indices[i + 1],
-                shape.mesh.indices[i + 2] };
-
-            float colorVul[3];
-            colorVul[0] = (float)(colorRounding % 255) / (float)255;
-            colorRounding += 345256;
-            colorVul[1] = 0.f;
-            colorVul[2] = (float)(colorRounding % 255) / (float)255;
-
-            for (int j = 0; j < 3; ++j) {
-                const auto& index = idx[j];
-                auto& vert = verts[j];
-                vert.pos[0] = attrib.vertices[3 * index.vertex_index + 2];
-                vert.pos[1] = attrib.vertices[3 * index.vertex_index + 1];
-                vert.pos[2] = attrib.vertices[3 * index.vertex_index + 0];
-
-                vert.uv[0] = 1.0f - attrib.texcoords[2 * index.texcoord_index + 0];
-                vert.uv[1] = 1.0f - attrib.texcoords[2 * index.texcoord_index + 1];
-
-                vert.col[0] = colorVul[0];
-                vert.col[1] = colorVul[1];
-                vert.col[2] = colorVul[2];
-
-                vert.normal[0] = attrib.normals[3 * index.normal_index + 2];
-                vert.normal[1] = attrib.normals[3 * index.normal_index + 1];
-                vert.normal[2] = attrib.normals[3 * index.normal_index + 0];
-            }
 
-            // clac tangent
-            // Edges of the triangle : position delta
-            glm::vec3 deltaPos1 = glm::vec3(
-                verts[1].pos[0] - verts[0].pos[0],
-                verts[1].pos[1] - verts[0].pos[1],
-                verts[1].pos[2] - verts[0].pos[2]);
-            glm::vec3 deltaPos2 = glm::vec3(
-                verts[2].pos[0] - verts[0].pos[0],
-                verts[2].pos[1] - verts[0].pos[1],
-                verts[2].pos[2] - verts[0].pos[2]);
-
-            // UV delta
-            glm::vec2 deltaUV1 = glm::vec2(
-                verts[1].uv[0] - verts[0].uv[0],
-                verts[1].uv[1] - verts[0].uv[1]
-            );
-            glm::vec2 deltaUV2 = glm::vec2(
-                verts[2].uv[0] - verts[0].uv[0],
-                verts[2].uv[1] - verts[0].uv[1]
-            );
-
-            float r = 1.0f / (deltaUV1.x*deltaUV2.y - deltaUV1.y*deltaUV2.x);
-            glm::vec3 tangent = r
-                * (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y);
-
-            // write tangent
-            for (int j = 0; j < 3; ++j) {
-                verts[j].tangent[0] = tangent.x;
-                verts[j].tangent[1] = tangent.y;
-                verts[j].tangent[2] = tangent.z;
-            }
+        if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, file_path.c_str())) {
+            throw std::runtime_error(warn + err);
+        }
 
-            // push_back
-            for (int j = 0; j < 3; ++j) {
-                vertices.push_back(verts[j]);
-                indices.push_back(indices.size());
+        // obj indexes position, uv and normal separately, a vertex is only
+        // emitted once per distinct (position, uv, normal)
+        struct VertexKey {
+            float pos[3];
+            float uv[2];
+            float normal[3];
+
+            bool operator==(const VertexKey& other) const {
+                return memcmp(this, &other, sizeof(VertexKey)) == 0;
+            }
+        };
+        struct VertexKeyHash {
+            size_t operator()(const VertexKey& key) const {
+                // fnv-1a over the raw bits, keys are compared bitwise too
+                const unsigned char* bytes =
+                    reinterpret_cast<const unsigned char*>(&key);
+                size_t hash = 14695981039346656037ull;
+                for (size_t i = 0; i < sizeof(VertexKey); ++i) {
+                    hash = (hash ^ bytes[i]) * 1099511628211ull;
+                }
+                return hash;
             }
+        };
+        std::unordered_map<VertexKey, uint32_t, VertexKeyHash> uniqueVertices;
+        // face tangents summed per vertex, orthonormalized once all faces are in
+        std::vector<glm::vec3> tangentSums;
+        size_t faceCornerCount = 0;
+
+        int colorRounding = 1333;
+        for (const auto& shape : shapes) {
+            // +3 for per triangle
+            for (int i = 0; i < shape.mesh.indices.size(); i += 3) {
+                colorRounding += 1333333;
+                Vertex verts[3];
+                const tinyobj::index_t idx[] = {
+                    shape.mesh.indices[i],
+                    shape.mesh.indices[i + 1],
+                    shape.mesh.indices[i + 2] };
+
+                float colorVul[3];
+                colorVul[0] = (float)(colorRounding % 255) / (float)255;
+                colorRounding += 345256;
+                colorVul[1] = 0.f;
+                colorVul[2] = (float)(colorRounding % 255) / (float)255;
+
+                for (int j = 0; j < 3; ++j) {
+                    const auto& index = idx[j];
+                    auto& vert = verts[j];
+                    vert.pos[0] = attrib.vertices[3 * index.vertex_index + 2];
+                    vert.pos[1] = attrib.vertices[3 * index.vertex_index + 1];
+                    vert.pos[2] = attrib.vertices[3 * index.vertex_index + 0];
+
+                    vert.uv[0] = 1.0f - attrib.texcoords[2 * index.texcoord_index + 0];
+                    vert.uv[1] = 1.0f - attrib.texcoords[2 * index.texcoord_index + 1];
+
+                    vert.col[0] = colorVul[0];
+                    vert.col[1] = colorVul[1];
+                    vert.col[2] = colorVul[2];
+
+                    vert.normal[0] = attrib.normals[3 * index.normal_index + 2];
+                    vert.normal[1] = attrib.normals[3 * index.normal_index + 1];
+                    vert.normal[2] = attrib.normals[3 * index.normal_index + 0];
+                }
 
-            if (tempPushTriangleSwitch) {
-                Triangle temp;
-                temp.vert_0 = tempGlobalModelMatrix * glm::vec4(verts[0].pos[0], verts[0].pos[1], verts[0].pos[2], 1.0f);
-                temp.vert_1 = tempGlobalModelMatrix * glm::vec4(verts[1].pos[0], verts[1].pos[1], verts[1].pos[2], 1.0f);
-                temp.vert_2 = tempGlobalModelMatrix * glm::vec4(verts[2].pos[0], verts[2].pos[1], verts[2].pos[2], 1.0f);
+                // clac tangent
+                // Edges of the triangle : position delta
+                glm::vec3 deltaPos1 = glm::vec3(
+                    verts[1].pos[0] - verts[0].pos[0],
+                    verts[1].pos[1] - verts[0].pos[1],
+                    verts[1].pos[2] - verts[0].pos[2]);
+                glm::vec3 deltaPos2 = glm::vec3(
+                    verts[2].pos[0] - verts[0].pos[0],
+                    verts[2].pos[1] - verts[0].pos[1],
+                    verts[2].pos[2] - verts[0].pos[2]);
+
+                // UV delta
+                glm::vec2 deltaUV1 = glm::vec2(
+                    verts[1].uv[0] - verts[0].uv[0],
+                    verts[1].uv[1] - verts[0].uv[1]
+                );
+                glm::vec2 deltaUV2 = glm::vec2(
+                    verts[2].uv[0] - verts[0].uv[0],
+                    verts[2].uv[1] - verts[0].uv[1]
+                );
+
+                // not normalized, so bigger faces weigh more in the vertex sum
+                // faces without a usable uv mapping add nothing
+                glm::vec3 tangent(0.0f);
+                float det = deltaUV1.x*deltaUV2.y - deltaUV1.y*deltaUV2.x;
+                if (std::abs(det) > 1e-12f) {
+                    tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y)
+                        / det;
+                }
 
-                temp.trinormal = glm::vec4(1.0, 0.0, 0.0, 0.0);
-                rt_all_triangles.push_back(temp);
+                // push_back, sharing vertices already emitted
+                for (int j = 0; j < 3; ++j) {
+                    VertexKey key;
+                    memcpy(key.pos, verts[j].pos, sizeof(key.pos));
+                    memcpy(key.uv, verts[j].uv, sizeof(key.uv));
+                    memcpy(key.normal, verts[j].normal, sizeof(key.normal));
+
+                    auto inserted = uniqueVertices.emplace(key,
+                        static_cast<uint32_t>(vertices.size()));
+                    if (inserted.second) {
+                        vertices.push_back(verts[j]);
+                        tangentSums.push_back(glm::vec3(0.0f));
+                    }
+                    uint32_t vertexIndex = inserted.first->second;
+                    tangentSums[vertexIndex] += tangent;
+                    indices.push_back(vertexIndex);
+                }
+                faceCornerCount += 3;
+
+                for (int j = 0; j < 3; ++j) {
+                    rtTriangles.insert(rtTriangles.end(),
+                        verts[j].pos, verts[j].pos + 3);
+                    aabbMin = glm::min(aabbMin,
+                        glm::vec3(verts[j].pos[0], verts[j].pos[1], verts[j].pos[2]));
+                    aabbMax = glm::max(aabbMax,
+                        glm::vec3(verts[j].pos[0], verts[j].pos[1], verts[j].pos[2]));
+                }
             }
         }
-    }
-
-    object_struct.vertexCount = static_cast<uint32_t>(vertices.size());
-    object_struct.indexCount = static_cast<uint32_t>(indices.size());
-
-    // create vertex buffer for arbitary  model
-    VkDeviceSize vertexBufferSize = sizeof(Vertex) * vertices.size();
-
-    VkBuffer vertexStagingBuffer;
-    VkDeviceMemory vertexStagingBufferMemory;
-    createBuffer(vertexBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        vertexStagingBuffer, vertexStagingBufferMemory);
-
-    void* vertexData;
-    vkMapMemory(device_, vertexStagingBufferMemory, 0, vertexBufferSize, 0,
-        &vertexData);
-    memcpy(vertexData, vertices.data(), (size_t)vertexBufferSize);
-    vkUnmapMemory(device_, vertexStagingBufferMemory);
-
-    createBuffer(
-        vertexBufferSize,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        object_struct.vertexBuffer.buffer,
-        object_struct.vertexBuffer.deviceMemory
-    );
-
-    copyBuffer(vertexStagingBuffer, object_struct.vertexBuffer.buffer,
-        vertexBufferSize);
-
-    vkDestroyBuffer(device_, vertexStagingBuffer, nullptr);
-    vkFreeMemory(device_, vertexStagingBufferMemory, nullptr);
 
-    // create index buffer for arbitary  model
-    VkDeviceSize indexBufferSize = sizeof(indices[0]) * indices.size();
-
-    VkBuffer indexStagingBuffer;
-    VkDeviceMemory indexStagingBufferMemory;
-    createBuffer(indexBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        indexStagingBuffer, indexStagingBufferMemory);
-
-    void* indexData;
-    vkMapMemory(device_, indexStagingBufferMemory, 0, indexBufferSize, 0,
-        &indexData);
-    memcpy(indexData, indices.data(), (size_t)indexBufferSize);
-    vkUnmapMemory(device_, indexStagingBufferMemory);
-
-    createBuffer(indexBufferSize,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        object_struct.indexBuffer.buffer, object_struct.indexBuffer.deviceMemory);
+        // write tangent, gram-schmidt against the vertex normal
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            auto& vert = vertices[i];
+            glm::vec3 n = glm::normalize(
+                glm::vec3(vert.normal[0], vert.normal[1], vert.normal[2]));
+            glm::vec3 t = tangentSums[i] - n * glm::dot(n, tangentSums[i]);
+            if (glm::dot(t, t) < 1e-12f) {
+                // no uv gradient here, any vector perpendicular to n will do
+                t = glm::cross(n, std::abs(n.x) < 0.9f
+                    ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f));
+            }
+            t = glm::normalize(t);
+            vert.tangent[0] = t.x;
+            vert.tangent[1] = t.y;
+            vert.tangent[2] = t.z;
+        }
 
-    copyBuffer(indexStagingBuffer, object_struct.indexBuffer.buffer,
-        indexBufferSize);
+        uint32_t uniqueVertexCount = static_cast<uint32_t>(vertices.size());
+        float acmrBefore = meshutil::averageCacheMissRatio(indices,
+            uniqueVertexCount);
+        meshutil::optimizeVertexCache(indices, uniqueVertexCount);
+
+        // lay vertices out in the order the optimized indices fetch them
+        std::vector<uint32_t> remap =
+            meshutil::optimizeVertexFetch(indices, uniqueVertexCount);
+        std::vector<Vertex> fetchOrdered(vertices.size());
+        for (uint32_t i = 0; i < uniqueVertexCount; ++i) {
+            fetchOrdered[remap[i]] = vertices[i];
+        }
+        vertices.swap(fetchOrdered);
+
+        // one write so lines from other workers don't interleave
+        std::ostringstream log;
+        log << file_path << ": " << uniqueVertexCount << " vertices for "
+            << faceCornerCount << " corners, acmr " << acmrBefore << " -> "
+            << meshutil::averageCacheMissRatio(indices, uniqueVertexCount)
+            << "\n";
+        std::cout << log.str();
+
+        meshcache::save(file_path, sizeof(Vertex), vertices.data(),
+            uniqueVertexCount, indices, rtTriangles, aabbMin, aabbMax);
+
+        data.cooked.reset();
+        data.vertices.resize(sizeof(Vertex) * vertices.size());
+        memcpy(data.vertices.data(), vertices.data(), data.vertices.size());
+        data.indices.swap(indices);
+        data.vertexData = data.vertices.data();
+        data.indexData = data.indices.data();
+        vertexCount = uniqueVertexCount;
+        indexCount = static_cast<uint32_t>(data.indices.size());
+    }
+
+    mesh.aabbMin = aabbMin;
+    mesh.aabbMax = aabbMax;
+
+    mesh.vertexCount = vertexCount;
+    mesh.indexCount = indexCount;
+    data.vertexBytes = sizeof(Vertex) * vertexCount;
+}
 
-    vkDestroyBuffer(device_, indexStagingBuffer, nullptr);
-    vkFreeMemory(device_, indexStagingBufferMemory, nullptr);
+void VulkanApp::uploadSingleMesh(AppMesh& mesh, const AppMeshData& data) {
+    // both ranges go to the end of the geometry pool
+    if (geometry_pool_.vertexHead + mesh.vertexCount > GEOMETRY_POOL_VERTICES
+        || geometry_pool_.indexHead + mesh.indexCount > GEOMETRY_POOL_INDICES) {
+        throw std::runtime_error("failed to upload mesh " + mesh.path
+            + ", geometry pool is full");
+    }
+    mesh.vertexOffset = static_cast<int32_t>(geometry_pool_.vertexHead);
+    mesh.firstIndex = geometry_pool_.indexHead;
+    geometry_pool_.vertexHead += mesh.vertexCount;
+    geometry_pool_.indexHead += mesh.indexCount;
+
+    upload_batch_.copyToBuffer(geometry_pool_.vertexBuffer, data.vertexData,
+        data.vertexBytes, queue_families_.graphicsFamily.value(),
+        sizeof(Vertex) * static_cast<VkDeviceSize>(mesh.vertexOffset));
+
+    upload_batch_.copyToBuffer(geometry_pool_.indexBuffer, data.indexData,
+        sizeof(uint32_t) * mesh.indexCount,
+        queue_families_.graphicsFamily.value(),
+        sizeof(uint32_t) * static_cast<VkDeviceSize>(mesh.firstIndex));
 }
 
 
 
 void VulkanApp::createDescriptorPool() {
     // todo check if all pipelins share the same decriptor pool
-    std::array<VkDescriptorPoolSize, 4> poolSizes = {};
+    // most sets are allocated once per frame in flight
+    std::array<VkDescriptorPoolSize, 6> poolSizes = {};
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    poolSizes[0].descriptorCount = 40;
+    poolSizes[0].descriptorCount = 40 * MAX_FRAMES_IN_FLIGHT;
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    poolSizes[1].descriptorCount = 40;
+    poolSizes[1].descriptorCount =
+        (40 + material_texture_capacity_) * MAX_FRAMES_IN_FLIGHT;
     poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    poolSizes[2].descriptorCount = 40;
+    poolSizes[2].descriptorCount = 40 * MAX_FRAMES_IN_FLIGHT;
     poolSizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    poolSizes[3].descriptorCount = 40;
+    poolSizes[3].descriptorCount = 40 * MAX_FRAMES_IN_FLIGHT;
+    poolSizes[4].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    poolSizes[4].descriptorCount = 40 * MAX_FRAMES_IN_FLIGHT;
+    poolSizes[5].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    poolSizes[5].descriptorCount = 40 * MAX_FRAMES_IN_FLIGHT;
 
 
     VkDescriptorPoolCreateInfo poolInfo = {};
@@ -962,7 +1223,7 @@ void VulkanApp::createDescriptorPool() {
     poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
     poolInfo.pPoolSizes = poolSizes.data();
     //poolInfo.maxSets = static_cast<uint32_t>(swapChainImages.size());
-    poolInfo.maxSets = 50;
+    poolInfo.maxSets = 50 * MAX_FRAMES_IN_FLIGHT;
 
     if (vkCreateDescriptorPool(device_, &poolInfo, nullptr, &descriptor_pool_) != VK_SUCCESS) {
         throw std::runtime_error("failed to create descriptor pool!");
@@ -974,7 +1235,8 @@ void VulkanApp::createBuffer(
     VkBufferUsageFlags usage,
     VkMemoryPropertyFlags properties,
     VkBuffer& buffer,
-    VkDeviceMemory& bufferMemory) 
+    AppAllocation& bufferMemory,
+    bool sharedWithCompute) 
 {
     VkBufferCreateInfo bufferInfo = {};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -982,6 +1244,16 @@ void VulkanApp::createBuffer(
     bufferInfo.usage = usage;
     bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
+    uint32_t families[] = {
+        queue_families_.graphicsFamily.value(),
+        queue_families_.computeFamily.value()
+    };
+    if (sharedWithCompute && async_compute_) {
+        bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferInfo.queueFamilyIndexCount = 2;
+        bufferInfo.pQueueFamilyIndices = families;
+    }
+
     if (vkCreateBuffer(device_, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
         throw std::runtime_error("failed to create buffer!");
     }
@@ -989,75 +1261,11 @@ void VulkanApp::createBuffer(
     VkMemoryRequirements memRequirements;
     vkGetBufferMemoryRequirements(device_, buffer, &memRequirements);
 
-    VkMemoryAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-    if (vkAllocateMemory(device_, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate buffer memory!");
-    }
-
-    vkBindBufferMemory(device_, buffer, bufferMemory, 0);
-}
-
-VkCommandBuffer VulkanApp::beginSingleTimeCommands() {
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = command_pool_;
-    allocInfo.commandBufferCount = 1;
-
-    VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(device_, &allocInfo, &commandBuffer);
-
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
-
-    return commandBuffer;
-}
-
-void VulkanApp::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-    vkEndCommandBuffer(commandBuffer);
-
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-
-    vkQueueSubmit(queue_, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(queue_);
-
-    vkFreeCommandBuffers(device_, command_pool_, 1, &commandBuffer);
-}
-
-void VulkanApp::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-    VkBufferCopy copyRegion = {};
-    copyRegion.size = size;
-    vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-
-    endSingleTimeCommands(commandBuffer);
-}
-
-uint32_t VulkanApp::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(physical_device_, &memProperties);
-
-    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-        if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-            return i;
-        }
-    }
+    bufferMemory = memory_allocator_.allocate(memRequirements, properties, true);
 
-    throw std::runtime_error("failed to find suitable memory type!");
+    vkBindBufferMemory(device_, buffer, bufferMemory.memory, bufferMemory.offset);
 }
 
-
 VkShaderModule VulkanApp::createShaderModule(const std::vector<char>& code) {
     VkShaderModuleCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -1150,8 +1358,9 @@ bool VulkanApp::isDeviceSuitable(VkPhysicalDevice device) {
 
     bool extensionsSupported = checkDeviceExtensionSupport(device);
 
-    bool swapChainAdequate = false;
-    if (extensionsSupported) {
+    // nothing is presented in headless mode
+    bool swapChainAdequate = headless_.enabled;
+    if (extensionsSupported && !headless_.enabled) {
         SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
         swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
     }
@@ -1159,7 +1368,30 @@ bool VulkanApp::isDeviceSuitable(VkPhysicalDevice device) {
     VkPhysicalDeviceFeatures supportedFeatures;
     vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
 
-    return indices.isComplete() && extensionsSupported && swapChainAdequate  && supportedFeatures.samplerAnisotropy;
+    // the material table indexes one sampler array per fragment, the cull
+    // pass decides how many indirect draws run
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+    bool vulkan12Supported = false;
+    if (properties.apiVersion >= VK_API_VERSION_1_2) {
+        VkPhysicalDeviceVulkan12Features vulkan12Features = {};
+        vulkan12Features.sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        VkPhysicalDeviceFeatures2 features2 = {};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &vulkan12Features;
+        vkGetPhysicalDeviceFeatures2(device, &features2);
+        vulkan12Supported =
+            vulkan12Features.shaderSampledImageArrayNonUniformIndexing
+            && vulkan12Features.runtimeDescriptorArray
+            && vulkan12Features.descriptorBindingPartiallyBound
+            && vulkan12Features.drawIndirectCount;
+    }
+
+    return indices.isComplete() && extensionsSupported && swapChainAdequate  && supportedFeatures.samplerAnisotropy
+        && supportedFeatures.multiDrawIndirect
+        && supportedFeatures.drawIndirectFirstInstance
+        && vulkan12Supported;
 }
 
 bool VulkanApp::checkDeviceExtensionSupport(VkPhysicalDevice device) {
@@ -1169,7 +1401,8 @@ bool VulkanApp::checkDeviceExtensionSupport(VkPhysicalDevice device) {
     std::vector<VkExtensionProperties> availableExtensions(extensionCount);
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-    std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+    auto extensions = getRequiredDeviceExtensions();
+    std::set<std::string> requiredExtensions(extensions.begin(), extensions.end());
 
     for (const auto& extension : availableExtensions) {
         requiredExtensions.erase(extension.extensionName);
@@ -1178,6 +1411,13 @@ bool VulkanApp::checkDeviceExtensionSupport(VkPhysicalDevice device) {
     return requiredExtensions.empty();
 }
 
+std::vector<const char*> VulkanApp::getRequiredDeviceExtensions() {
+    if (headless_.enabled) {
+        return {};
+    }
+    return deviceExtensions;
+}
+
 QueueFamilyIndices VulkanApp::findQueueFamilies(VkPhysicalDevice device) {
     QueueFamilyIndices indices;
 
@@ -1201,7 +1441,13 @@ QueueFamilyIndices VulkanApp::findQueueFamilies(VkPhysicalDevice device) {
         }
 
         VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface_, &presentSupport);
+        if (headless_.enabled) {
+            // no surface, the graphics queue does the readback
+            presentSupport = (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+        }
+        else {
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface_, &presentSupport);
+        }
 
         if (queueFamily.queueCount > 0 && presentSupport) {
             indices.presentFamily = i;
@@ -1220,15 +1466,64 @@ QueueFamilyIndices VulkanApp::findQueueFamilies(VkPhysicalDevice device) {
         i++;
     }
 
+#if defined(ASYNC_QUEUES) && !defined(ONLY_RT)
+    // a compute family without graphics runs the rt pass next to the
+    // graphics work, a transfer only family is a dedicated copy engine
+    std::optional<uint32_t> transferOnly, transferNoGraphics;
+    for (uint32_t family = 0; family < queueFamilyCount; ++family) {
+        const VkQueueFamilyProperties& properties = queueFamilies[family];
+        if (properties.queueCount == 0
+            || (properties.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            continue;
+        }
+        if ((properties.queueFlags & VK_QUEUE_COMPUTE_BIT)
+            && indices.computeFamily == indices.graphicsFamily) {
+            indices.computeFamily = family;
+        }
+        // compute families can transfer without reporting it, anything
+        // else (video, sparse binding only) has to say so
+        bool compute = (properties.queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
+        bool transfer = (properties.queueFlags & VK_QUEUE_TRANSFER_BIT) != 0;
+        if (!compute && !transfer) {
+            continue;
+        }
+        // copies of partial mip levels need a granularity of one texel
+        const VkExtent3D& granularity = properties.minImageTransferGranularity;
+        if (granularity.width != 1 || granularity.height != 1
+            || granularity.depth != 1) {
+            continue;
+        }
+        if (!compute && !transferOnly.has_value()) {
+            transferOnly = family;
+        }
+        if (!transferNoGraphics.has_value()) {
+            transferNoGraphics = family;
+        }
+    }
+    if (transferOnly.has_value()) {
+        indices.transferFamily = transferOnly;
+    }
+    else if (transferNoGraphics.has_value()) {
+        indices.transferFamily = transferNoGraphics;
+    }
+#endif
+    // graphics queues can always transfer
+    if (!indices.transferFamily.has_value()) {
+        indices.transferFamily = indices.graphicsFamily;
+    }
+
     return indices;
 }
 
 std::vector<const char*> VulkanApp::getRequiredExtensions() {
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    std::vector<const char*> extensions;
 
-    std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    if (!headless_.enabled) {
+        uint32_t glfwExtensionCount = 0;
+        const char** glfwExtensions;
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
 
     if (enableValidationLayers) {
         extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -1318,24 +1613,11 @@ void VulkanApp::createQuadVertexBuffer()
 
     VkDeviceSize bufferSize = sizeof(tempVertexBuffer[0]) * tempVertexBuffer.size();
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        stagingBuffer, stagingBufferMemory);
-
-    void* data;
-    vkMapMemory(device_, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, tempVertexBuffer.data(), (size_t)bufferSize);
-    vkUnmapMemory(device_, stagingBufferMemory);
-
     createBuffer(bufferSize,
         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, quadVertexBuffer, quadVertexBufferMemory);
-    copyBuffer(stagingBuffer, quadVertexBuffer, bufferSize);
-
-    vkDestroyBuffer(device_, stagingBuffer, nullptr);
-    vkFreeMemory(device_, stagingBufferMemory, nullptr);
+    upload_batch_.copyToBuffer(quadVertexBuffer, tempVertexBuffer.data(),
+        bufferSize, queue_families_.graphicsFamily.value());
 }
 
 void VulkanApp::createQuadIndexBuffer() {
@@ -1348,25 +1630,12 @@ void VulkanApp::createQuadIndexBuffer() {
     std::cout << std::endl;
     VkDeviceSize bufferSize = sizeof(tempIndexBuffer[0]) * tempIndexBuffer.size();
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        stagingBuffer, stagingBufferMemory);
-
-    void* data;
-    vkMapMemory(device_, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, tempIndexBuffer.data(), (size_t)bufferSize);
-    vkUnmapMemory(device_, stagingBufferMemory);
-
     createBuffer(bufferSize,
         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, quadIndexBuffer, quadIndexBufferMemory);
 
-    copyBuffer(stagingBuffer, quadIndexBuffer, bufferSize);
-
-    vkDestroyBuffer(device_, stagingBuffer, nullptr);
-    vkFreeMemory(device_, stagingBufferMemory, nullptr);
+    upload_batch_.copyToBuffer(quadIndexBuffer, tempIndexBuffer.data(),
+        bufferSize, queue_families_.graphicsFamily.value());
 }
 
 void VulkanApp::prepareQuadVertexAndIndexBuffer()
@@ -1444,13 +1713,26 @@ void VulkanApp::initSemAndSubmitInfo()
 {
     VkSemaphoreCreateInfo semaphoreCreateInfo{};
     semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &semaphores_.presentComplete) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed tp create presentComplete semaphore");
-    }
-    if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &semaphores_.renderComplete) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed tp create presentComplete semaphore");
+
+    // signaled so the first wait on each frame returns immediately
+    VkFenceCreateInfo fenceCreateInfo{};
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    waitFences.resize(MAX_FRAMES_IN_FLIGHT);
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &semaphores_.presentComplete[i]) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed tp create presentComplete semaphore");
+        }
+        if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &semaphores_.renderComplete[i]) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed tp create presentComplete semaphore");
+        }
+        if (vkCreateFence(device_, &fenceCreateInfo, nullptr, &waitFences[i]) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create waitFences");
+        }
     }
 
     mySubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -1479,25 +1761,13 @@ void VulkanApp::rt_createSema()
 	VkSemaphoreCreateInfo semaphoreCreateInfo{};
 	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-	if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &rt_complete_sema) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create offscreenSemaphore");
+	for (auto& rt_complete_sema : rt_complete_semas) {
+		if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &rt_complete_sema) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create offscreenSemaphore");
+		}
 	}
 }
 
-void VulkanApp::rt_createUniformBuffers() {
-	VkDeviceSize rtBufferSize = sizeof(RTUniformBufferObject);
-	createBuffer(rtBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		rt_uniformBuffers.rt_compute.buffer, rt_uniformBuffers.rt_compute.deviceMem
-	);
-
-	VkDeviceSize rtGeomSize = sizeof(RT_GEOM);
-	createBuffer(rtGeomSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		rt_uniformBuffers.rt_geom.buffer, rt_uniformBuffers.rt_geom.deviceMem
-	);
-}
-
 void VulkanApp::rt_prepareStorageBuffers() {
    
     // Spheres
@@ -1507,17 +1777,6 @@ void VulkanApp::rt_prepareStorageBuffers() {
     //spheres.push_back(newSphere(glm::vec3(-1.75f, -0.75f, -0.5f), 1.25f, glm::vec3(0.9f, 0.76f, 0.46f), 32.0f));
     VkDeviceSize sphereStorageBufferSize = spheres.size() * sizeof(Sphere);
 
-    VkBuffer sphereStagingBuffer;
-    VkDeviceMemory sphereStagingBufferMemory;
-    createBuffer(sphereStorageBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        sphereStagingBuffer, sphereStagingBufferMemory);
-
-    void* sphere_data;
-    vkMapMemory(device_, sphereStagingBufferMemory, 0, sphereStorageBufferSize, 0, &sphere_data);
-    memcpy(sphere_data, spheres.data(), (size_t)sphereStorageBufferSize);
-    vkUnmapMemory(device_, sphereStagingBufferMemory);
-
     createBuffer(
 		sphereStorageBufferSize,
         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
@@ -1525,11 +1784,8 @@ void VulkanApp::rt_prepareStorageBuffers() {
 		compute_.mySphereBuffer.buffer,
 		compute_.mySphereBuffer.deviceMem
 	);
-    copyBuffer(sphereStagingBuffer, compute_.mySphereBuffer.buffer, sphereStorageBufferSize);
-
-    vkDestroyBuffer(device_, sphereStagingBuffer, nullptr);
-    vkFreeMemory(device_, sphereStagingBufferMemory, nullptr);
-    // Copy to staging buffer
+    upload_batch_.copyToBuffer(compute_.mySphereBuffer.buffer, spheres.data(),
+        sphereStorageBufferSize, queue_families_.computeFamily.value());
 
     // Planes
     std::vector<Plane> planes;
@@ -1544,29 +1800,14 @@ void VulkanApp::rt_prepareStorageBuffers() {
 
     VkDeviceSize planeStorageBufferSize = planes.size() * sizeof(Plane);
 
-    VkBuffer planeStagingBuffer;
-    VkDeviceMemory planeStagingBufferMemory;
-    createBuffer(planeStorageBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        planeStagingBuffer, planeStagingBufferMemory);
-
-    void* plane_data;
-    vkMapMemory(device_, planeStagingBufferMemory, 0, planeStorageBufferSize, 0,
-        &plane_data);
-    memcpy(plane_data, planes.data(), (size_t)planeStorageBufferSize);
-    vkUnmapMemory(device_, planeStagingBufferMemory);
-
     createBuffer(planeStorageBufferSize,
         VK_BUFFER_USAGE_TRANSFER_DST_BIT
         | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
         | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
         compute_.myPlaneBuffer.buffer, compute_.myPlaneBuffer.deviceMem);
-    copyBuffer(planeStagingBuffer,
-        compute_.myPlaneBuffer.buffer, planeStorageBufferSize);
-
-    vkDestroyBuffer(device_, planeStagingBuffer, nullptr);
-    vkFreeMemory(device_, planeStagingBufferMemory, nullptr);
+    upload_batch_.copyToBuffer(compute_.myPlaneBuffer.buffer, planes.data(),
+        planeStorageBufferSize, queue_families_.computeFamily.value());
 }
 
 
@@ -1586,7 +1827,9 @@ void VulkanApp::rt_prepareTextureTarget(MyTexture& tex, VkFormat format, uint32_
 		tex.textureImage, //image
 		tex.textureImageMemory); //imagemem
 
-	transitionImageLayout(tex.textureImage, format,
+	transitionImageLayout(
+		upload_batch_.commandBuffer(queue_families_.graphicsFamily.value()),
+		tex.textureImage, format,
 		VK_IMAGE_LAYOUT_UNDEFINED,
 		VK_IMAGE_LAYOUT_GENERAL);
 
@@ -1666,8 +1909,8 @@ void VulkanApp::rt_graphics_setupDescriptorSet()
 
 	VkDescriptorImageInfo rt_imageInfo{};
 	rt_imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-	rt_imageInfo.imageView = rt_result.textureImageView;
-	rt_imageInfo.sampler = rt_result.textureSampler;
+	rt_imageInfo.imageView = rt_results[0].textureImageView;
+	rt_imageInfo.sampler = rt_results[0].textureSampler;
 
 	// Binding 0 : Fragment shader texture sampler
 	VkWriteDescriptorSet writeDescriptorSet{};
@@ -1928,16 +2171,7 @@ void VulkanApp::rt_createPipeline()
 
 void VulkanApp::rt_prepareCompute() {
 
-    QueueFamilyIndices fi = findQueueFamilies(physical_device_);
-
-    // todo: what is this for?....................
-    VkDeviceQueueCreateInfo queueCreateInfo = {};
-    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queueCreateInfo.pNext = NULL;
-    queueCreateInfo.queueCount = 1;
-    queueCreateInfo.queueFamilyIndex = fi.computeFamily.value();
-
-    vkGetDeviceQueue(device_, fi.computeFamily.value(), 0, &compute_.rt_computeQueue);
+    // compute_.rt_computeQueue is fetched in createLogicalDevice
 
     // Binding 0: Storage image (raytraced output)
     VkDescriptorSetLayoutBinding rt_storage;
@@ -1948,7 +2182,7 @@ void VulkanApp::rt_prepareCompute() {
 
     // Binding 1: Uniform buffer block
     VkDescriptorSetLayoutBinding rt_uniform;
-    rt_uniform.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    rt_uniform.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     rt_uniform.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     rt_uniform.binding = 1;
     rt_uniform.descriptorCount = 1;
@@ -1976,7 +2210,7 @@ void VulkanApp::rt_prepareCompute() {
 
 	// Binding 5: Uniform buffer block
 	VkDescriptorSetLayoutBinding rt_uniform_geom;
-	rt_uniform_geom.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	rt_uniform_geom.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	rt_uniform_geom.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 	rt_uniform_geom.binding = 5;
 	rt_uniform_geom.descriptorCount = 1;
@@ -1994,6 +2228,24 @@ void VulkanApp::rt_prepareCompute() {
             7,
             VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
             1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 8: bvh nodes
+        apputil::createDescriptorSetLayoutBinding(
+            8,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 9: top level nodes
+        apputil::createDescriptorSetLayoutBinding(
+            9,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 10: top level instances
+        apputil::createDescriptorSetLayoutBinding(
+            10,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1,
             VK_SHADER_STAGE_COMPUTE_BIT)
     };
 
@@ -2017,142 +2269,176 @@ void VulkanApp::rt_prepareCompute() {
         throw std::runtime_error("failed to create rt_computePipelineLayout!");
     }
 
-    VkDescriptorSetAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    allocInfo.descriptorPool = descriptor_pool_;
-    allocInfo.pSetLayouts = &compute_.rt_computeDescriptorSetLayout;
-    allocInfo.descriptorSetCount = 1;
-
-    if (vkAllocateDescriptorSets(device_, &allocInfo, &compute_.rt_computeDescriptorSet) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to create rt_computeDescriptorSet!");
-    }
-
-    // TODO: update imageinfo and bufferinfo for write descriptor set
-    VkDescriptorImageInfo rt_out_storage_imageInfo = {};
-    rt_out_storage_imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-    rt_out_storage_imageInfo.sampler = rt_result.textureSampler;
-    rt_out_storage_imageInfo.imageView = rt_result.textureImageView;
+    // one set per frame in flight, each reads its own g buffer and writes
+    // its own rt result
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        VkDescriptorSet& descriptorSet = compute_.rt_computeDescriptorSets[frame];
 
-    // to check out whether offset is 0;
-    VkDescriptorBufferInfo rt_uniform_bufferInfo{};
-    rt_uniform_bufferInfo.buffer = rt_uniformBuffers.rt_compute.buffer;
-    rt_uniform_bufferInfo.offset = 0;
-    rt_uniform_bufferInfo.range = sizeof(RTUniformBufferObject);
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = descriptor_pool_;
+        allocInfo.pSetLayouts = &compute_.rt_computeDescriptorSetLayout;
+        allocInfo.descriptorSetCount = 1;
 
-    // update desbuffinfo for computer's union buffer
-    rt_uniformBuffers.rt_compute.desBuffInfo = rt_uniform_bufferInfo;
-
-
-    VkDescriptorBufferInfo rt_storage_sphere{};
-    rt_storage_sphere.buffer = compute_.mySphereBuffer.buffer;
-    rt_storage_sphere.offset = 0;
-    // todo 
-    rt_storage_sphere.range = VK_WHOLE_SIZE;
-    //rt_storage_sphere.range = 3 * sizeof(Sphere);
-
-    VkDescriptorBufferInfo rt_storage_plane{};
-    rt_storage_plane.buffer = compute_.myPlaneBuffer.buffer;
-    rt_storage_plane.offset = 0;
-    //rt_storage_plane.range = VK_WHOLE_SIZE;
-    rt_storage_plane.range = VK_WHOLE_SIZE;
-
-	VkDescriptorBufferInfo rt_storage_tri{};
-	rt_storage_tri.buffer = compute_.myTriBuffer.buffer;
-	rt_storage_tri.offset = 0;
-	rt_storage_tri.range = VK_WHOLE_SIZE;
-
-	VkDescriptorBufferInfo rt_uniform_geom_bufferInfo{};
-	rt_uniform_geom_bufferInfo.buffer = rt_uniformBuffers.rt_geom.buffer;
-	rt_uniform_geom_bufferInfo.offset = 0;
-	rt_uniform_geom_bufferInfo.range = sizeof(RT_GEOM);
-
-	// update desbuffinfo for computer's union buffer
-	rt_uniformBuffers.rt_geom.desBuffInfo = rt_uniform_geom_bufferInfo;
-
-
-
-    // Binding 0: Output storage image
-    VkWriteDescriptorSet rt_out_storage{};
-    rt_out_storage.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    rt_out_storage.dstSet = compute_.rt_computeDescriptorSet;
-    rt_out_storage.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    rt_out_storage.dstBinding = 0;
-    rt_out_storage.pImageInfo = &rt_out_storage_imageInfo;
-    rt_out_storage.descriptorCount = 1;
-
-    // Binding 1: Uniform buffer block
-    VkWriteDescriptorSet rt_uni_block{};
-    rt_uni_block.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    rt_uni_block.dstSet = compute_.rt_computeDescriptorSet;
-    rt_uni_block.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    rt_uni_block.dstBinding = 1;
-    rt_uni_block.pBufferInfo = &rt_uniformBuffers.rt_compute.desBuffInfo;
-    rt_uni_block.descriptorCount = 1;
-
-    // Binding 2: Shader storage buffer for the spheres
-    VkWriteDescriptorSet rt_uni_storage_sphere{};
-    rt_uni_storage_sphere.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    rt_uni_storage_sphere.dstSet = compute_.rt_computeDescriptorSet;
-    rt_uni_storage_sphere.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    rt_uni_storage_sphere.dstBinding = 2;
-    rt_uni_storage_sphere.pBufferInfo = &rt_storage_sphere;
-    rt_uni_storage_sphere.descriptorCount = 1;
+        if (vkAllocateDescriptorSets(device_, &allocInfo, &descriptorSet) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create rt_computeDescriptorSet!");
+        }
 
-    // Binding 3: Shader storage buffer for the planes
-    VkWriteDescriptorSet rt_uni_storage_plane{};
-    rt_uni_storage_plane.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    rt_uni_storage_plane.dstSet = compute_.rt_computeDescriptorSet;
-    rt_uni_storage_plane.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    rt_uni_storage_plane.dstBinding = 3;
-    rt_uni_storage_plane.pBufferInfo = &rt_storage_plane;
-    rt_uni_storage_plane.descriptorCount = 1;
-
-	// Binding 4: Shader storage buffer for the triangles
-	VkWriteDescriptorSet rt_uni_storage_tri{};
-	rt_uni_storage_tri.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	rt_uni_storage_tri.dstSet = compute_.rt_computeDescriptorSet;
-	rt_uni_storage_tri.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-	rt_uni_storage_tri.dstBinding = 4;
-	rt_uni_storage_tri.pBufferInfo = &rt_storage_tri;
-	rt_uni_storage_tri.descriptorCount = 1;
-
-
-	// Binding 5: GEOM
-	VkWriteDescriptorSet rt_uni_geom_block{};
-	rt_uni_geom_block.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	rt_uni_geom_block.dstSet = compute_.rt_computeDescriptorSet;
-	rt_uni_geom_block.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	rt_uni_geom_block.dstBinding = 5;
-	rt_uni_geom_block.pBufferInfo = &rt_uniformBuffers.rt_geom.desBuffInfo;
-	rt_uni_geom_block.descriptorCount = 1;
-
-
-    std::vector<VkWriteDescriptorSet> computeWriteDescriptorSets =
-    {
-        rt_out_storage,
-		rt_uni_block,
-		rt_uni_storage_sphere,
-		rt_uni_storage_plane,
-		rt_uni_storage_tri,
-		rt_uni_geom_block,
-        // binding 6: world position
-        apputil::createImageWriteDescriptorSet(
-            compute_.rt_computeDescriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            6,
-            &offscreen_.frameBufferAssets.position.descriptorImageInfo,
-            1),
-        // binding 7: world normal
-        apputil::createImageWriteDescriptorSet(
-            compute_.rt_computeDescriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            7,
-            &offscreen_.frameBufferAssets.normal.descriptorImageInfo,
-            1),
-    };
+        // TODO: update imageinfo and bufferinfo for write descriptor set
+        VkDescriptorImageInfo rt_out_storage_imageInfo = {};
+        rt_out_storage_imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        rt_out_storage_imageInfo.sampler = rt_traceTarget(frame).textureSampler;
+        rt_out_storage_imageInfo.imageView = rt_traceTarget(frame).textureImageView;
+
+        // offset comes from uniform_ring_ at bind time
+        VkDescriptorBufferInfo rt_uniform_bufferInfo =
+            uniformRingDescriptor(sizeof(RTUniformBufferObject));
+
+
+        VkDescriptorBufferInfo rt_storage_sphere{};
+        rt_storage_sphere.buffer = compute_.mySphereBuffer.buffer;
+        rt_storage_sphere.offset = 0;
+        // todo 
+        rt_storage_sphere.range = VK_WHOLE_SIZE;
+        //rt_storage_sphere.range = 3 * sizeof(Sphere);
+
+        VkDescriptorBufferInfo rt_storage_plane{};
+        rt_storage_plane.buffer = compute_.myPlaneBuffer.buffer;
+        rt_storage_plane.offset = 0;
+        //rt_storage_plane.range = VK_WHOLE_SIZE;
+        rt_storage_plane.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo rt_storage_tri{};
+        rt_storage_tri.buffer = compute_.myTriBuffer.buffer;
+        rt_storage_tri.offset = 0;
+        rt_storage_tri.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo rt_storage_bvh{};
+        rt_storage_bvh.buffer = compute_.myBVHBuffer.buffer;
+        rt_storage_bvh.offset = 0;
+        rt_storage_bvh.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo rt_uniform_geom_bufferInfo =
+            uniformRingDescriptor(sizeof(RT_GEOM));
+
+        // the frame's slice of rt_topLevelBuffer
+        VkDescriptorBufferInfo rt_storage_top_nodes{};
+        rt_storage_top_nodes.buffer = rt_topLevelBuffer;
+        rt_storage_top_nodes.offset = rt_topLevelSliceSize * frame;
+        rt_storage_top_nodes.range = rt_topLevelInstanceOffset;
+
+        VkDescriptorBufferInfo rt_storage_instances{};
+        rt_storage_instances.buffer = rt_topLevelBuffer;
+        rt_storage_instances.offset =
+            rt_topLevelSliceSize * frame + rt_topLevelInstanceOffset;
+        rt_storage_instances.range = sizeof(BVHInstance) * MAX_RT_INSTANCES;
+
+
+
+        // Binding 0: Output storage image
+        VkWriteDescriptorSet rt_out_storage{};
+        rt_out_storage.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        rt_out_storage.dstSet = descriptorSet;
+        rt_out_storage.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        rt_out_storage.dstBinding = 0;
+        rt_out_storage.pImageInfo = &rt_out_storage_imageInfo;
+        rt_out_storage.descriptorCount = 1;
+
+        // Binding 1: Uniform buffer block
+        VkWriteDescriptorSet rt_uni_block{};
+        rt_uni_block.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        rt_uni_block.dstSet = descriptorSet;
+        rt_uni_block.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        rt_uni_block.dstBinding = 1;
+        rt_uni_block.pBufferInfo = &rt_uniform_bufferInfo;
+        rt_uni_block.descriptorCount = 1;
+
+        // Binding 2: Shader storage buffer for the spheres
+        VkWriteDescriptorSet rt_uni_storage_sphere{};
+        rt_uni_storage_sphere.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        rt_uni_storage_sphere.dstSet = descriptorSet;
+        rt_uni_storage_sphere.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        rt_uni_storage_sphere.dstBinding = 2;
+        rt_uni_storage_sphere.pBufferInfo = &rt_storage_sphere;
+        rt_uni_storage_sphere.descriptorCount = 1;
+
+        // Binding 3: Shader storage buffer for the planes
+        VkWriteDescriptorSet rt_uni_storage_plane{};
+        rt_uni_storage_plane.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        rt_uni_storage_plane.dstSet = descriptorSet;
+        rt_uni_storage_plane.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        rt_uni_storage_plane.dstBinding = 3;
+        rt_uni_storage_plane.pBufferInfo = &rt_storage_plane;
+        rt_uni_storage_plane.descriptorCount = 1;
+
+        // Binding 4: Shader storage buffer for the triangles
+        VkWriteDescriptorSet rt_uni_storage_tri{};
+        rt_uni_storage_tri.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        rt_uni_storage_tri.dstSet = descriptorSet;
+        rt_uni_storage_tri.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        rt_uni_storage_tri.dstBinding = 4;
+        rt_uni_storage_tri.pBufferInfo = &rt_storage_tri;
+        rt_uni_storage_tri.descriptorCount = 1;
+
+
+        // Binding 5: GEOM
+        VkWriteDescriptorSet rt_uni_geom_block{};
+        rt_uni_geom_block.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        rt_uni_geom_block.dstSet = descriptorSet;
+        rt_uni_geom_block.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        rt_uni_geom_block.dstBinding = 5;
+        rt_uni_geom_block.pBufferInfo = &rt_uniform_geom_bufferInfo;
+        rt_uni_geom_block.descriptorCount = 1;
+
+
+        std::vector<VkWriteDescriptorSet> computeWriteDescriptorSets =
+        {
+            rt_out_storage,
+            rt_uni_block,
+            rt_uni_storage_sphere,
+            rt_uni_storage_plane,
+            rt_uni_storage_tri,
+            rt_uni_geom_block,
+            // binding 6: world position
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                6,
+                &offscreen_.frameBufferAssets[frame].position.descriptorImageInfo,
+                1),
+            // binding 7: world normal
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                7,
+                &offscreen_.frameBufferAssets[frame].normal.descriptorImageInfo,
+                1),
+            // binding 8: bvh nodes
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                8,
+                &rt_storage_bvh,
+                1),
+            // binding 9: top level nodes
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                9,
+                &rt_storage_top_nodes,
+                1),
+            // binding 10: top level instances
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                10,
+                &rt_storage_instances,
+                1),
+        };
 
-    vkUpdateDescriptorSets(device_, computeWriteDescriptorSets.size(), computeWriteDescriptorSets.data(), 0, NULL);
+        vkUpdateDescriptorSets(device_, computeWriteDescriptorSets.size(), computeWriteDescriptorSets.data(), 0, NULL);
+    }
 
 
     // Create compute shader pipelines
@@ -2163,20 +2449,32 @@ void VulkanApp::rt_prepareCompute() {
     computePipelineCreateInfo.stage = loadShader("../../shaders/raytracing.comp.spv",
         VK_SHADER_STAGE_COMPUTE_BIT);
 
+    // TRACE_SCALE, pixel of the g buffer each traced texel reads
+    VkSpecializationMapEntry scaleEntry = {};
+    scaleEntry.constantID = 0;
+    scaleEntry.offset = 0;
+    scaleEntry.size = sizeof(uint32_t);
+    VkSpecializationInfo specialization = {};
+    specialization.mapEntryCount = 1;
+    specialization.pMapEntries = &scaleEntry;
+    specialization.dataSize = sizeof(rt_traceScale);
+    specialization.pData = &rt_traceScale;
+    computePipelineCreateInfo.stage.pSpecializationInfo = &specialization;
+
     if (vkCreateComputePipelines(device_, pipelineCache, 1,
         &computePipelineCreateInfo, nullptr, &compute_.rt_computePipine)
         != VK_SUCCESS) {
         throw std::runtime_error("failed to create compute.rt_computePipine!");
     }
 
-    //// Separate command pool as queue family for compute may be different than graphics
-    //VkCommandPoolCreateInfo cmdPoolInfo = {};
-    //cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    //cmdPoolInfo.queueFamilyIndex = fi.computeFamily.value();
-    //cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    //if (vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &compute.rt_) != VK_SUCCESS) {
-    //    throw std::runtime_error("failed to create commandPool");
-    //}
+    // Separate command pool as queue family for compute may be different than graphics
+    VkCommandPoolCreateInfo cmdPoolInfo = {};
+    cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmdPoolInfo.queueFamilyIndex = queue_families_.computeFamily.value();
+    cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    if (vkCreateCommandPool(device_, &cmdPoolInfo, nullptr, &compute_.rt_commandPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create compute_.rt_commandPool");
+    }
 
    
 }
@@ -2185,13 +2483,13 @@ void VulkanApp::rt_createComputeCommandBuffer() {
 
 	VkCommandBufferAllocateInfo cmdBufAllocateInfo{};
 	cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	cmdBufAllocateInfo.commandPool = command_pool_;
+	cmdBufAllocateInfo.commandPool = compute_.rt_commandPool;
 	cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	cmdBufAllocateInfo.commandBufferCount = 1;
+	cmdBufAllocateInfo.commandBufferCount = MAX_FRAMES_IN_FLIGHT;
 
-	if (vkAllocateCommandBuffers(device_, &cmdBufAllocateInfo, &compute_.rt_computeCmdBuffer) != VK_SUCCESS)
+	if (vkAllocateCommandBuffers(device_, &cmdBufAllocateInfo, compute_.rt_computeCmdBuffers.data()) != VK_SUCCESS)
 	{
-		throw std::runtime_error("failed to allocate rt_computeCmdBuffer");
+		throw std::runtime_error("failed to allocate rt_computeCmdBuffers");
 	}
 
 	VkFenceCreateInfo fenceCreateInfo{};
@@ -2201,53 +2499,258 @@ void VulkanApp::rt_createComputeCommandBuffer() {
 	if (vkCreateFence(device_, &fenceCreateInfo, nullptr, &compute_.rt_fence)) {
 		throw std::runtime_error("failed to create compute.rt_fence!");
 	}
+}
+
+// recorded each frame after rt_updateUniformBuffer
+void VulkanApp::rt_recordComputeCommandBuffer(int frame) {
+	VkCommandBuffer cmdBuffer = compute_.rt_computeCmdBuffers[frame];
 
 	// buildComputeCommandBuffer
 	VkCommandBufferBeginInfo cmdBufBeginInfo{};
 	cmdBufBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	cmdBufBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+	cmdBufBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-	if (vkBeginCommandBuffer(compute_.rt_computeCmdBuffer, &cmdBufBeginInfo) != VK_SUCCESS) {
+	if (vkBeginCommandBuffer(cmdBuffer, &cmdBufBeginInfo) != VK_SUCCESS) {
 		throw std::runtime_error("failed to begin rt_computeCmdBuffer");
 	}
 
-	vkCmdBindPipeline(compute_.rt_computeCmdBuffer,
+	uint32_t graphicsFamily = queue_families_.graphicsFamily.value();
+	uint32_t computeFamily = queue_families_.computeFamily.value();
+	std::vector<VkImage> gbuffer = {
+		offscreen_.frameBufferAssets[frame].position.image,
+		offscreen_.frameBufferAssets[frame].normal.image
+	};
+	if (async_compute_) {
+		recordImageOwnershipTransfer(cmdBuffer, gbuffer,
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			graphicsFamily, computeFamily, false,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		// rt_results[frame] is overwritten completely, so it is taken over
+		// without the graphics side releasing it
+	}
+
+	vkCmdBindPipeline(cmdBuffer,
 		VK_PIPELINE_BIND_POINT_COMPUTE,
 		compute_.rt_computePipine);
-	vkCmdBindDescriptorSets(compute_.rt_computeCmdBuffer,
+
+	// binding 1 then binding 5
+	uint32_t dynamicOffsets[] = {
+		rt_uniformOffsets.rt_compute, rt_uniformOffsets.rt_geom
+	};
+	vkCmdBindDescriptorSets(cmdBuffer,
 		VK_PIPELINE_BIND_POINT_COMPUTE, compute_.rt_computePipelineLayout,
-		0, 1, &compute_.rt_computeDescriptorSet, 0, 0);
+		0, 1, &compute_.rt_computeDescriptorSets[frame], 2, dynamicOffsets);
+
+	// 16x16 threads per group, the shader skips texels past the edge
+	uint32_t traceWidth = (swapchain_extent_.width + rt_traceScale - 1) / rt_traceScale;
+	uint32_t traceHeight = (swapchain_extent_.height + rt_traceScale - 1) / rt_traceScale;
+	vkCmdDispatch(cmdBuffer, (traceWidth + 15) / 16, (traceHeight + 15) / 16, 1);
+
+	if (rt_traceScale > 1) {
+		VkMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(cmdBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+		// back to full resolution, guided by the g buffer
+		vkCmdBindPipeline(cmdBuffer,
+			VK_PIPELINE_BIND_POINT_COMPUTE, rt_upsample.pipeline);
+		vkCmdBindDescriptorSets(cmdBuffer,
+			VK_PIPELINE_BIND_POINT_COMPUTE, rt_upsample.pipelineLayout,
+			0, 1, &rt_upsample.descriptorSets[frame], 0, nullptr);
+		vkCmdDispatch(cmdBuffer, (swapchain_extent_.width + 15) / 16,
+			(swapchain_extent_.height + 15) / 16, 1);
+	}
 
-	// TODO why 16
-	vkCmdDispatch(compute_.rt_computeCmdBuffer, swapchain_extent_.width / 16, swapchain_extent_.height / 16, 1);
+	// the deferred pass samples all three
+	if (async_compute_) {
+		recordImageOwnershipTransfer(cmdBuffer, { rt_results[frame].textureImage },
+			VK_IMAGE_LAYOUT_GENERAL,
+			computeFamily, graphicsFamily, true,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+		recordImageOwnershipTransfer(cmdBuffer, gbuffer,
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			computeFamily, graphicsFamily, true,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0);
+	}
 
-	vkEndCommandBuffer(compute_.rt_computeCmdBuffer);
+	vkEndCommandBuffer(cmdBuffer);
 }
 
-void VulkanApp::rt_createRaytraceDisplayCommandBuffer() {
-    rt_drawCommandBuffer.resize(swapchain_images_.size());
-
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool = command_pool_;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = static_cast<uint32_t>(rt_drawCommandBuffer.size());
-
-    if (vkAllocateCommandBuffers(device_, &allocInfo, rt_drawCommandBuffer.data()) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate 3 x rt_drawCommandBuffer buffers!");
+// shadow upsample =================================================
+void VulkanApp::rt_prepareShadowUpsample() {
+    if (rt_traceScale == 1) {
+        return;
     }
 
-    for (int32_t i = 0; i < rt_drawCommandBuffer.size(); ++i)
-    {
-        VkCommandBufferBeginInfo cmdBufBeginInfo{};
-        cmdBufBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        cmdBufBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-
-        VkClearValue clearValues[2];
-        clearValues[0].color = { 0.025f, 0.025f, 0.025f, 1.0f };
-        clearValues[1].depthStencil = { 1.0f, 0 };
-
-        VkRenderPassBeginInfo renderPassBeginInfo{};
+    std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
+        // binding 0: shadows traced at low resolution
+        apputil::createDescriptorSetLayoutBinding(
+            0,
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 1: position texture
+        apputil::createDescriptorSetLayoutBinding(
+            1,
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 2: normal texture
+        apputil::createDescriptorSetLayoutBinding(
+            2,
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 3: full resolution result, sampled by the deferred pass
+        apputil::createDescriptorSetLayoutBinding(
+            3,
+            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT)
+    };
+
+    VkDescriptorSetLayoutCreateInfo descriptorLayout{};
+    descriptorLayout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorLayout.pBindings = setLayoutBindings.data();
+    descriptorLayout.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
+    if (vkCreateDescriptorSetLayout(device_, &descriptorLayout, nullptr,
+        &rt_upsample.descriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create rt_upsample.descriptorSetLayout!");
+    }
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &rt_upsample.descriptorSetLayout;
+    if (vkCreatePipelineLayout(device_, &pipelineLayoutInfo, nullptr,
+        &rt_upsample.pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create rt_upsample.pipelineLayout!");
+    }
+
+    std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT,
+        rt_upsample.descriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptor_pool_;
+    allocInfo.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+    allocInfo.pSetLayouts = layouts.data();
+    if (vkAllocateDescriptorSets(device_, &allocInfo,
+        rt_upsample.descriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate rt_upsample.descriptorSets");
+    }
+
+    // each frame reads its own g buffer and low resolution shadows
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        VkDescriptorSet descriptorSet = rt_upsample.descriptorSets[frame];
+
+        VkDescriptorImageInfo low_info = {};
+        low_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        low_info.sampler = rt_lowResults[frame].textureSampler;
+        low_info.imageView = rt_lowResults[frame].textureImageView;
+
+        VkDescriptorImageInfo result_info = {};
+        result_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        result_info.sampler = rt_results[frame].textureSampler;
+        result_info.imageView = rt_results[frame].textureImageView;
+
+        std::vector<VkWriteDescriptorSet> write_sets = {
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                0,
+                &low_info,
+                1),
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                1,
+                &offscreen_.frameBufferAssets[frame].position.descriptorImageInfo,
+                1),
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                2,
+                &offscreen_.frameBufferAssets[frame].normal.descriptorImageInfo,
+                1),
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                3,
+                &result_info,
+                1),
+        };
+        vkUpdateDescriptorSets(device_,
+            static_cast<uint32_t>(write_sets.size()), write_sets.data(),
+            0, NULL);
+    }
+
+    // SCALE, same as TRACE_SCALE of the raytracing pipeline
+    VkSpecializationMapEntry scaleEntry = {};
+    scaleEntry.constantID = 0;
+    scaleEntry.offset = 0;
+    scaleEntry.size = sizeof(uint32_t);
+    VkSpecializationInfo specialization = {};
+    specialization.mapEntryCount = 1;
+    specialization.pMapEntries = &scaleEntry;
+    specialization.dataSize = sizeof(rt_traceScale);
+    specialization.pData = &rt_traceScale;
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.layout = rt_upsample.pipelineLayout;
+    pipelineInfo.stage = loadShader("../../shaders/shadow_upsample.comp.spv",
+        VK_SHADER_STAGE_COMPUTE_BIT);
+    pipelineInfo.stage.pSpecializationInfo = &specialization;
+    if (vkCreateComputePipelines(device_, pipelineCache, 1, &pipelineInfo,
+        nullptr, &rt_upsample.pipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create rt_upsample.pipeline!");
+    }
+}
+
+void VulkanApp::rt_cleanupShadowUpsample() {
+    if (rt_traceScale == 1) {
+        return;
+    }
+    vkDestroyPipeline(device_, rt_upsample.pipeline, nullptr);
+    vkDestroyPipelineLayout(device_, rt_upsample.pipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device_, rt_upsample.descriptorSetLayout, nullptr);
+    for (auto& rt_lowResult : rt_lowResults) {
+        vkDestroySampler(device_, rt_lowResult.textureSampler, nullptr);
+        vkDestroyImageView(device_, rt_lowResult.textureImageView, nullptr);
+        vkDestroyImage(device_, rt_lowResult.textureImage, nullptr);
+        memory_allocator_.free(rt_lowResult.textureImageMemory);
+    }
+}
+
+void VulkanApp::rt_createRaytraceDisplayCommandBuffer() {
+    rt_drawCommandBuffer.resize(swapchain_images_.size());
+
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = command_pool_;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = static_cast<uint32_t>(rt_drawCommandBuffer.size());
+
+    if (vkAllocateCommandBuffers(device_, &allocInfo, rt_drawCommandBuffer.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate 3 x rt_drawCommandBuffer buffers!");
+    }
+
+    for (int32_t i = 0; i < rt_drawCommandBuffer.size(); ++i)
+    {
+        VkCommandBufferBeginInfo cmdBufBeginInfo{};
+        cmdBufBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        cmdBufBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+
+        VkClearValue clearValues[2];
+        clearValues[0].color = { 0.025f, 0.025f, 0.025f, 1.0f };
+        clearValues[1].depthStencil = { 1.0f, 0 };
+
+        VkRenderPassBeginInfo renderPassBeginInfo{};
         renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
         renderPassBeginInfo.renderPass = graphics_.renderPass;
         renderPassBeginInfo.renderArea.offset.x = 0;
@@ -2269,7 +2772,7 @@ void VulkanApp::rt_createRaytraceDisplayCommandBuffer() {
         imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
         imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
         imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageMemoryBarrier.image = rt_result.textureImage;
+        imageMemoryBarrier.image = rt_results[0].textureImage;
         imageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
         imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
         imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
@@ -2313,6 +2816,11 @@ void VulkanApp::rt_createRaytraceDisplayCommandBuffer() {
 }
 
 void VulkanApp::rt_draw() {
+    // the queue is idle at the end of every rt_draw, slot 0 is always free
+    beginUniformRingFrame();
+    rt_updateUniformBuffer();
+    rt_recordComputeCommandBuffer(0);
+
     //initial submit info
     mySubmitInfo = {};
     mySubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -2324,16 +2832,19 @@ void VulkanApp::rt_draw() {
     uint32_t imageIndex;
     VkResult result = vkAcquireNextImageKHR(device_, swapchain_,
         std::numeric_limits<uint64_t>::max(),
-        semaphores_.presentComplete,
+        semaphores_.presentComplete[0],
         VK_NULL_HANDLE, &imageIndex);
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+        throw std::runtime_error("failed to acquire swap chain image!");
+    }
     
-    VkSemaphore waitSemaphores[] = { semaphores_.presentComplete };
+    VkSemaphore waitSemaphores[] = { semaphores_.presentComplete[0] };
     // submit compute
     // wait for swap chian presentation to finish
     mySubmitInfo.pWaitSemaphores = waitSemaphores;
-    mySubmitInfo.pSignalSemaphores = &rt_complete_sema;
+    mySubmitInfo.pSignalSemaphores = &rt_complete_semas[0];
     mySubmitInfo.commandBufferCount = 1;
-    mySubmitInfo.pCommandBuffers = &compute_.rt_computeCmdBuffer;
+    mySubmitInfo.pCommandBuffers = &compute_.rt_computeCmdBuffers[0];
 
     // Command buffer to be sumitted to the queue
     if (vkQueueSubmit(queue_, 1, &mySubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
@@ -2341,16 +2852,19 @@ void VulkanApp::rt_draw() {
     }
 
     // wait for offsreen
-    VkSemaphore waitSemaphores_2[] = { rt_complete_sema };
+    VkSemaphore waitSemaphores_2[] = { rt_complete_semas[0] };
     mySubmitInfo.pWaitSemaphores = waitSemaphores_2;
-    mySubmitInfo.pSignalSemaphores = &semaphores_.renderComplete;
+    mySubmitInfo.pSignalSemaphores = &semaphores_.renderComplete[0];
     mySubmitInfo.pCommandBuffers = &rt_drawCommandBuffer[imageIndex];
     if (vkQueueSubmit(queue_, 1, &mySubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
     {
         throw std::runtime_error("failed to submit rt_drawCommandBuffer in graphicsQueue");
     }
 
-    VkResult res = queuePresent(queue_, imageIndex, semaphores_.renderComplete);
+    result = queuePresent(queue_, imageIndex, semaphores_.renderComplete[0]);
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+        throw std::runtime_error("failed to present swap chain image!");
+    }
     vkQueueWaitIdle(queue_);
 }
 
@@ -2391,46 +2905,29 @@ void VulkanApp::rt_updateUniformBuffer() {
     rt_ubo.camera.pos = firstPersonCam->GetPos();
     rt_ubo.camera.lookat = firstPersonCam->GetForward();
 
-	void* data;
-	vkMapMemory(device_, rt_uniformBuffers.rt_compute.deviceMem, 0, sizeof(rt_ubo), 0, &data);
-	memcpy(data, &rt_ubo, sizeof(rt_ubo));
-	vkUnmapMemory(device_, rt_uniformBuffers.rt_compute.deviceMem);
-
-	// scene object positions
-	glm::mat4 modelMat;
-	modelMat = glm::translate(glm::vec3(0.f, 2.f, 0.f));
+	rt_uniformOffsets.rt_compute = uniformRingPush(&rt_ubo, sizeof(rt_ubo));
 
-	// rt_g
-	rt_g.transform = modelMat;
-	rt_g.inverseTransform = glm::inverse(modelMat);
-	void* geom_data;
-	vkMapMemory(device_, rt_uniformBuffers.rt_geom.deviceMem, 0, sizeof(rt_g), 0, &geom_data);
-	memcpy(geom_data, &rt_g, sizeof(rt_g));
-	vkUnmapMemory(device_, rt_uniformBuffers.rt_geom.deviceMem);
+	// scene object positions, set by updateUniformBuffers
+	rt_buildTopLevel(current_frame_);
+	rt_uniformOffsets.rt_geom = uniformRingPush(&rt_g, sizeof(rt_g));
 }
 
 void VulkanApp::rt_loadObj(std::vector<Triangle>& tri)
 {
-#ifndef SHOW_SHADOW_SCENE
-    Triangle space_holder;
-    tri.clear();
-    tri.push_back(space_holder);
-#endif // SHOW_SHADOW_SCENE
-
+    std::cout << "bvh: " << rt_meshRoots.size() << " bottom levels, "
+        << tri.size() << " triangles, " << rt_bvh_nodes.size()
+        << " nodes, " << rt_instanceObjects.size() << " instances"
+        << std::endl;
+
+    // nothing to trace, the shader stops at instanceCount == 0 but the
+    // buffers can't be empty. zero edges, never hit
+    if (tri.empty()) {
+        Triangle space_holder = {};
+        tri.push_back(space_holder);
+        rt_bvh_nodes.push_back(BVHNode{});
+    }
     
     VkDeviceSize triBufferSize = sizeof(Triangle) * tri.size();
-    VkBuffer StagingBuffer;
-    VkDeviceMemory StagingBufferMemory;
-    createBuffer(triBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        StagingBuffer, StagingBufferMemory);
-
-    void* data;
-    vkMapMemory(device_, StagingBufferMemory, 0, triBufferSize, 0,
-        &data);
-    memcpy(data, tri.data(), (size_t)triBufferSize);
-    vkUnmapMemory(device_, StagingBufferMemory);
-
     createBuffer(
         triBufferSize,
         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
@@ -2439,11 +2936,108 @@ void VulkanApp::rt_loadObj(std::vector<Triangle>& tri)
         compute_.myTriBuffer.deviceMem
     );
 
-    copyBuffer(StagingBuffer, compute_.myTriBuffer.buffer,
-        triBufferSize);
+    upload_batch_.copyToBuffer(compute_.myTriBuffer.buffer, tri.data(),
+        triBufferSize, queue_families_.computeFamily.value());
+
+    // bvh nodes
+    VkDeviceSize bvhBufferSize = sizeof(BVHNode) * rt_bvh_nodes.size();
+    createBuffer(
+        bvhBufferSize,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        compute_.myBVHBuffer.buffer,
+        compute_.myBVHBuffer.deviceMem
+    );
+
+    upload_batch_.copyToBuffer(compute_.myBVHBuffer.buffer,
+        rt_bvh_nodes.data(), bvhBufferSize, queue_families_.computeFamily.value());
+}
+
+// two level bvh =================================================
+void VulkanApp::rt_addInstance(uint32_t objectIndex) {
+    const AppMesh* mesh = scene_objects_[objectIndex].mesh;
+    const std::vector<float>& tris = mesh->rtTriangles;
+    if (tris.empty()) {
+        return;
+    }
+    if (rt_instanceObjects.size() >= MAX_RT_INSTANCES) {
+        throw std::runtime_error("failed to add rt instance, MAX_RT_INSTANCES reached");
+    }
+
+    // first use of the mesh builds its bottom level in object space
+    auto found = rt_meshRoots.find(mesh);
+    if (found == rt_meshRoots.end()) {
+        uint32_t first = static_cast<uint32_t>(rt_all_triangles.size());
+        for (size_t i = 0; i < tris.size(); i += 9) {
+            rt_all_triangles.push_back(Triangle::fromVertices(
+                glm::vec3(tris[i + 0], tris[i + 1], tris[i + 2]),
+                glm::vec3(tris[i + 3], tris[i + 4], tris[i + 5]),
+                glm::vec3(tris[i + 6], tris[i + 7], tris[i + 8])));
+        }
+        uint32_t count = static_cast<uint32_t>(rt_all_triangles.size()) - first;
+#ifdef RT_LBVH
+        bvh::BuildMode mode = bvh::BuildMode::LBVH;
+#else
+        bvh::BuildMode mode = bvh::BuildMode::BinnedSAH;
+#endif // RT_LBVH
+        uint32_t root = bvh::appendBottomLevel(&job_system_, mode,
+            rt_all_triangles, first, count, rt_bvh_nodes);
+        // the shader drops far subtrees once its stack is full
+        if (bvh::depth(rt_bvh_nodes, root) > RT_BVH_STACK_SIZE + 1) {
+            throw std::runtime_error("failed to build rt bvh, deeper than RT_BVH_STACK_SIZE");
+        }
+        found = rt_meshRoots.emplace(mesh, root).first;
+    }
+    rt_instanceObjects.push_back(objectIndex);
+    rt_instanceRoots.push_back(found->second);
+}
+
+void VulkanApp::rt_createTopLevelBuffer() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device_, &properties);
+    VkDeviceSize alignment = properties.limits.minStorageBufferOffsetAlignment;
+
+    // a top level over n instances has at most 2n - 1 nodes
+    VkDeviceSize nodeBytes = sizeof(BVHNode) * (2 * MAX_RT_INSTANCES - 1);
+    VkDeviceSize instanceBytes = sizeof(BVHInstance) * MAX_RT_INSTANCES;
+    rt_topLevelInstanceOffset = (nodeBytes + alignment - 1) & ~(alignment - 1);
+    rt_topLevelSliceSize = rt_topLevelInstanceOffset + instanceBytes;
+    rt_topLevelSliceSize =
+        (rt_topLevelSliceSize + alignment - 1) & ~(alignment - 1);
+    createBuffer(rt_topLevelSliceSize * MAX_FRAMES_IN_FLIGHT,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        rt_topLevelBuffer, rt_topLevelMemory);
+}
+
+// called after the fence of frame has signaled, a binned build over the
+// instances, not their triangles
+void VulkanApp::rt_buildTopLevel(int frame) {
+    rt_instanceMatrices.resize(rt_instanceObjects.size());
+    for (size_t i = 0; i < rt_instanceObjects.size(); ++i) {
+        rt_instanceMatrices[i] = scene_objects_[rt_instanceObjects[i]].modelMatrix;
+    }
+    // the builder keeps it within the shader's stack, MAX_RT_INSTANCES is
+    // far below what that allows
+    bvh::buildTopLevel(rt_bvh_nodes, rt_instanceRoots, rt_instanceMatrices,
+        rt_topLevelInstances, rt_topLevelNodes);
+
+    unsigned char* slice = static_cast<unsigned char*>(rt_topLevelMemory.mapped)
+        + rt_topLevelSliceSize * frame;
+    std::memcpy(slice, rt_topLevelNodes.data(),
+        sizeof(BVHNode) * rt_topLevelNodes.size());
+    if (!rt_topLevelInstances.empty()) {
+        std::memcpy(slice + rt_topLevelInstanceOffset,
+            rt_topLevelInstances.data(),
+            sizeof(BVHInstance) * rt_topLevelInstances.size());
+    }
+
+    rt_g.instanceCount = static_cast<uint32_t>(rt_topLevelInstances.size());
+}
 
-    vkDestroyBuffer(device_, StagingBuffer, nullptr);
-    vkFreeMemory(device_, StagingBufferMemory, nullptr);
+void VulkanApp::rt_cleanupTopLevelBuffer() {
+    vkDestroyBuffer(device_, rt_topLevelBuffer, nullptr);
+    memory_allocator_.free(rt_topLevelMemory);
 }
 
 
@@ -2453,7 +3047,6 @@ void VulkanApp::rt_loadObj(std::vector<Triangle>& tri)
 
 void VulkanApp::prepareOffscreen() {
     createOffscreenDescriptorSetLayout();
-    createOffscreenUniformBuffer();
     createOffscreenPipelineLayout();
     createOffscreenRenderPass();
     createOffscreenFrameBuffer();
@@ -2466,62 +3059,53 @@ void VulkanApp::prepareOffscreenCommandBuffer() {
 	createOffscreenForSkyboxAndModel();
 }
 
-void VulkanApp::createOffscreenUniformBuffer() {
-    VkDeviceSize bufferSize = sizeof(AppOffscreenUniformBufferContent);
-    createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        offscreen_.uniformBufferAndContent.uniformBuffer.buffer,
-        offscreen_.uniformBufferAndContent.uniformBuffer.deviceMemory
-    );
-
-    VkDescriptorBufferInfo& buffer_info =
-        offscreen_.uniformBufferAndContent.uniformBuffer.descriptorBufferInfo;
-
-    buffer_info.buffer =
-        offscreen_.uniformBufferAndContent.uniformBuffer.buffer;
-    buffer_info.offset = 0;
-    buffer_info.range = VK_WHOLE_SIZE;
-}
-
 // IMPT: Add skybox as a samplercube to offscreen
 void VulkanApp::createOffscreenDescriptorSetLayout() {
     std::vector<VkDescriptorSetLayoutBinding> bindings = {
         // binding 0: uniform buffer
         apputil::createDescriptorSetLayoutBinding(
             0,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             1,
             VK_SHADER_STAGE_VERTEX_BIT),
-        // binding 1: model info (mode matrix/pos)
+        // binding 1: per instance model matrix and material
         apputil::createDescriptorSetLayoutBinding(
             1,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
             1,
             VK_SHADER_STAGE_VERTEX_BIT),
-        // binding 2: albedo texture
+        // binding 2: material table
         apputil::createDescriptorSetLayoutBinding(
             2,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
             1,
             VK_SHADER_STAGE_FRAGMENT_BIT),
-        // binding 3: normal map
+        // binding 3: every material texture
         apputil::createDescriptorSetLayoutBinding(
             3,
             VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            1,
+            material_texture_capacity_,
             VK_SHADER_STAGE_FRAGMENT_BIT),
-        // binding 4: mrao texture
+        // binding 4: instances left by the cull pass
         apputil::createDescriptorSetLayoutBinding(
             4,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
             1,
-            VK_SHADER_STAGE_FRAGMENT_BIT)
-
-
+            VK_SHADER_STAGE_VERTEX_BIT)
     };
 
+    // slots past the scene's textures stay unwritten
+    std::vector<VkDescriptorBindingFlags> bindingFlags(bindings.size(), 0);
+    bindingFlags[3] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo = {};
+    bindingFlagsInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    bindingFlagsInfo.bindingCount = static_cast<uint32_t>(bindingFlags.size());
+    bindingFlagsInfo.pBindingFlags = bindingFlags.data();
+
     VkDescriptorSetLayoutCreateInfo layoutInfo = {};
     layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext = &bindingFlagsInfo;
     layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
     layoutInfo.pBindings = bindings.data();
 
@@ -2564,120 +3148,126 @@ void VulkanApp::createOffscreenFrameBuffer() {
     samplerCreateInfo.maxLod = 1.0f;
     samplerCreateInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
     if (vkCreateSampler(device_, &samplerCreateInfo, nullptr,
-        &offscreen_.frameBufferAssets.sampler) != VK_SUCCESS) {
+        &offscreen_.frameBufferSampler) != VK_SUCCESS) {
         throw std::runtime_error(
-            "failed to create offscreen_.frameBufferAssets.sampler");
-    }
-
-    // for output
-    // world space pos -------------------------------------------------
-    AppTexture& posRef = offscreen_.frameBufferAssets.position;
-    VkFormat positionFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
-    createImage(swapchain_extent_.width, swapchain_extent_.height,
-        positionFormat,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        posRef.image,
-        posRef.deviceMemory);
-
-    posRef.imageView = createImageView(posRef.image, positionFormat,
-            VK_IMAGE_ASPECT_COLOR_BIT);
-
-    posRef.descriptorImageInfo.sampler = offscreen_.frameBufferAssets.sampler;
-    posRef.descriptorImageInfo.imageView = posRef.imageView;
-    posRef.descriptorImageInfo.imageLayout =
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    // world space normal -------------------------------------------------
-    AppTexture& normalRef = offscreen_.frameBufferAssets.normal;
-    VkFormat normalFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
-    createImage(swapchain_extent_.width, swapchain_extent_.height, normalFormat,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        normalRef.image,
-        normalRef.deviceMemory);
-    normalRef.imageView = createImageView(normalRef.image, normalFormat,
-            VK_IMAGE_ASPECT_COLOR_BIT);
-    normalRef.descriptorImageInfo.sampler = offscreen_.frameBufferAssets.sampler;
-    normalRef.descriptorImageInfo.imageView = normalRef.imageView;
-    normalRef.descriptorImageInfo.imageLayout =
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    // color -------------------------------------------------
-    AppTexture& colorRef = offscreen_.frameBufferAssets.color;
-    VkFormat colorFormat = VK_FORMAT_R8G8B8A8_UNORM;
-    createImage(swapchain_extent_.width, swapchain_extent_.height, colorFormat,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        colorRef.image,
-        colorRef.deviceMemory);
-
-    colorRef.imageView = createImageView(colorRef.image, colorFormat,
+            "failed to create offscreen_.frameBufferSampler");
+    }
+
+    for (auto& assets : offscreen_.frameBufferAssets) {
+        // for output
+        // world space pos -------------------------------------------------
+        AppTexture& posRef = assets.position;
+        VkFormat positionFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+        createImage(swapchain_extent_.width, swapchain_extent_.height,
+            positionFormat,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            posRef.image,
+            posRef.deviceMemory);
+
+        posRef.imageView = createImageView(posRef.image, positionFormat,
+                VK_IMAGE_ASPECT_COLOR_BIT);
+
+        posRef.descriptorImageInfo.sampler = offscreen_.frameBufferSampler;
+        posRef.descriptorImageInfo.imageView = posRef.imageView;
+        posRef.descriptorImageInfo.imageLayout =
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+        // world space normal -------------------------------------------------
+        AppTexture& normalRef = assets.normal;
+        VkFormat normalFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+        createImage(swapchain_extent_.width, swapchain_extent_.height, normalFormat,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            normalRef.image,
+            normalRef.deviceMemory);
+        normalRef.imageView = createImageView(normalRef.image, normalFormat,
+                VK_IMAGE_ASPECT_COLOR_BIT);
+        normalRef.descriptorImageInfo.sampler = offscreen_.frameBufferSampler;
+        normalRef.descriptorImageInfo.imageView = normalRef.imageView;
+        normalRef.descriptorImageInfo.imageLayout =
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+        // color -------------------------------------------------
+        AppTexture& colorRef = assets.color;
+        VkFormat colorFormat = VK_FORMAT_R8G8B8A8_UNORM;
+        createImage(swapchain_extent_.width, swapchain_extent_.height, colorFormat,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            colorRef.image,
+            colorRef.deviceMemory);
+
+        colorRef.imageView = createImageView(colorRef.image, colorFormat,
+                VK_IMAGE_ASPECT_COLOR_BIT);
+
+        colorRef.descriptorImageInfo.sampler = offscreen_.frameBufferSampler;
+        colorRef.descriptorImageInfo.imageView = colorRef.imageView;
+        colorRef.descriptorImageInfo.imageLayout =
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+        // mrao -------------------------------------------------
+        AppTexture& mraoRef = assets.mrao;
+        VkFormat mraoFormat = VK_FORMAT_R8G8B8A8_UNORM;
+        createImage(swapchain_extent_.width, swapchain_extent_.height, mraoFormat,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            mraoRef.image, mraoRef.deviceMemory);
+
+        mraoRef.imageView = createImageView(mraoRef.image, mraoFormat,
             VK_IMAGE_ASPECT_COLOR_BIT);
 
-    colorRef.descriptorImageInfo.sampler = offscreen_.frameBufferAssets.sampler;
-    colorRef.descriptorImageInfo.imageView = colorRef.imageView;
-    colorRef.descriptorImageInfo.imageLayout =
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    // mrao -------------------------------------------------
-    AppTexture& mraoRef = offscreen_.frameBufferAssets.mrao;
-    VkFormat mraoFormat = VK_FORMAT_R8G8B8A8_UNORM;
-    createImage(swapchain_extent_.width, swapchain_extent_.height, mraoFormat,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        mraoRef.image, mraoRef.deviceMemory);
-
-    mraoRef.imageView = createImageView(mraoRef.image, mraoFormat,
-        VK_IMAGE_ASPECT_COLOR_BIT);
-
-    mraoRef.imageView =
-        createImageView(mraoRef.image, mraoFormat, VK_IMAGE_ASPECT_COLOR_BIT);
-    mraoRef.descriptorImageInfo.sampler = offscreen_.frameBufferAssets.sampler;
-    mraoRef.descriptorImageInfo.imageView = mraoRef.imageView;
-    mraoRef.descriptorImageInfo.imageLayout =
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-
-    // Depth -------------------------------------------------
-    VkFormat depthFormat = findDepthFormat();
-    createImage(swapchain_extent_.width, swapchain_extent_.height, depthFormat,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        offscreen_.frameBufferAssets.depth.image,
-        offscreen_.frameBufferAssets.depth.deviceMemory);
-
-    offscreen_.frameBufferAssets.depth.imageView = createImageView(
-        offscreen_.frameBufferAssets.depth.image,
-        depthFormat,
-        VK_IMAGE_ASPECT_DEPTH_BIT);
-
-    std::array<VkImageView, 5> attachments;
-    attachments[0] = offscreen_.frameBufferAssets.position.imageView;
-    attachments[1] = offscreen_.frameBufferAssets.normal.imageView;
-    attachments[2] = offscreen_.frameBufferAssets.color.imageView;
-    attachments[3] = offscreen_.frameBufferAssets.mrao.imageView;
-    attachments[4] = offscreen_.frameBufferAssets.depth.imageView;
+        mraoRef.imageView =
+            createImageView(mraoRef.image, mraoFormat, VK_IMAGE_ASPECT_COLOR_BIT);
+        mraoRef.descriptorImageInfo.sampler = offscreen_.frameBufferSampler;
+        mraoRef.descriptorImageInfo.imageView = mraoRef.imageView;
+        mraoRef.descriptorImageInfo.imageLayout =
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+
+        // Depth -------------------------------------------------
+        VkFormat depthFormat = findDepthFormat();
+        createImage(swapchain_extent_.width, swapchain_extent_.height, depthFormat,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            assets.depth.image,
+            assets.depth.deviceMemory);
+
+        assets.depth.imageView = createImageView(
+            assets.depth.image,
+            depthFormat,
+            VK_IMAGE_ASPECT_DEPTH_BIT);
+        assets.depth.descriptorImageInfo.sampler = offscreen_.frameBufferSampler;
+        assets.depth.descriptorImageInfo.imageView = assets.depth.imageView;
+        assets.depth.descriptorImageInfo.imageLayout =
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+        std::array<VkImageView, 5> attachments;
+        attachments[0] = assets.position.imageView;
+        attachments[1] = assets.normal.imageView;
+        attachments[2] = assets.color.imageView;
+        attachments[3] = assets.mrao.imageView;
+        attachments[4] = assets.depth.imageView;
     
-    VkFramebufferCreateInfo fbufCreateInfo = {};
-    fbufCreateInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-    fbufCreateInfo.pNext = NULL;
-    fbufCreateInfo.renderPass = offscreen_.renderPass;
-    fbufCreateInfo.pAttachments = attachments.data();
-    fbufCreateInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
-    fbufCreateInfo.width = swapchain_extent_.width;
-    fbufCreateInfo.height = swapchain_extent_.height;
-    fbufCreateInfo.layers = 1;
-
-    if (vkCreateFramebuffer(device_, &fbufCreateInfo, nullptr,
-        &offscreen_.frameBufferAssets.frameBuffer) != VK_SUCCESS) {
-        throw std::runtime_error(
-            "failed to create offscreen_.frameBufferAssets.frameBuffer");
+        VkFramebufferCreateInfo fbufCreateInfo = {};
+        fbufCreateInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        fbufCreateInfo.pNext = NULL;
+        fbufCreateInfo.renderPass = offscreen_.renderPass;
+        fbufCreateInfo.pAttachments = attachments.data();
+        fbufCreateInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+        fbufCreateInfo.width = swapchain_extent_.width;
+        fbufCreateInfo.height = swapchain_extent_.height;
+        fbufCreateInfo.layers = 1;
+
+        if (vkCreateFramebuffer(device_, &fbufCreateInfo, nullptr,
+            &assets.frameBuffer) != VK_SUCCESS) {
+            throw std::runtime_error(
+                "failed to create offscreen_.frameBufferAssets.frameBuffer");
+        }
     }
 }
 
@@ -2803,8 +3393,9 @@ void VulkanApp::createOffscreenRenderPass() {
         attachmentDescs[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         if (i == 4)
         {
+            // the hi-z build reads it right after the pass
             attachmentDescs[i].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-            attachmentDescs[i].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+            attachmentDescs[i].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
         }
         else
         {
@@ -2836,7 +3427,7 @@ void VulkanApp::createOffscreenRenderPass() {
     subpass.colorAttachmentCount = static_cast<uint32_t>(colorReferences.size());
     subpass.pDepthStencilAttachment = &depthReference;
 
-    std::array<VkSubpassDependency, 2> dependencies;
+    std::array<VkSubpassDependency, 3> dependencies;
 
     dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
     dependencies[0].dstSubpass = 0;
@@ -2854,13 +3445,22 @@ void VulkanApp::createOffscreenRenderPass() {
     dependencies[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
     dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
+    // depth is reduced into the hi-z pyramid by a compute shader
+    dependencies[2].srcSubpass = 0;
+    dependencies[2].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[2].srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[2].dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    dependencies[2].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependencies[2].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    dependencies[2].dependencyFlags = 0;
+
     VkRenderPassCreateInfo renderPassInfo = {};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
     renderPassInfo.pAttachments = attachmentDescs.data();
     renderPassInfo.attachmentCount = static_cast<uint32_t>(attachmentDescs.size());
     renderPassInfo.subpassCount = 1;
     renderPassInfo.pSubpasses = &subpass;
-    renderPassInfo.dependencyCount = 2;
+    renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
     renderPassInfo.pDependencies = dependencies.data();
 
     if (vkCreateRenderPass(device_, &renderPassInfo, nullptr, &offscreen_.renderPass) != VK_SUCCESS) {
@@ -2884,7 +3484,7 @@ void VulkanApp::prepareSceneObjectsData() {
     ground_shadow.normal.path = "../../textures/substance_ground_shadow/normal.png";
     ground_shadow.mrao.path =
         "../../textures/substance_ground_shadow/mrao.png";
-    ground_shadow.uniformBufferAndContent.content.modelMatrix = modelMat;
+    ground_shadow.modelMatrix = modelMat;
 
     AppSceneObject box{};
     box.meshPath = "../../models/maya_cube_2.obj";
@@ -2894,7 +3494,7 @@ void VulkanApp::prepareSceneObjectsData() {
         "../../textures/substance_cube_2_bronze/mrao.png";
     modelMat = glm::scale(glm::vec3(4.0f, 4.0f, 4.0f));
     modelMat = glm::translate(glm::vec3(0.f, 1.f, 0.f)) * modelMat;
-    box.uniformBufferAndContent.content.modelMatrix = modelMat;
+    box.modelMatrix = modelMat;
 
     AppSceneObject box2{};
     box2.meshPath = "../../models/maya_cube_2.obj";
@@ -2902,7 +3502,7 @@ void VulkanApp::prepareSceneObjectsData() {
     box2.normal.path = "../../textures/substance_cube_2_shinny/normal.png";
     box2.mrao.path =
         "../../textures/substance_cube_2_shinny/mrao.png";
-    box2.uniformBufferAndContent.content.modelMatrix =
+    box2.modelMatrix =
         glm::translate(glm::vec3(-1.f, 0.f, 1.f));
 
     AppSceneObject box3{};
@@ -2911,7 +3511,7 @@ void VulkanApp::prepareSceneObjectsData() {
     box3.normal.path = "../../textures/substance_cube_2_rust/normal.png";
     box3.mrao.path =
         "../../textures/substance_cube_2_rust/mrao.png";
-    box3.uniformBufferAndContent.content.modelMatrix =
+    box3.modelMatrix =
         glm::translate(glm::vec3(-1.f, 0.f, -1.f));
 
     AppSceneObject ground{};
@@ -2923,7 +3523,7 @@ void VulkanApp::prepareSceneObjectsData() {
         "../../textures/substance_ground/mrao.png";
     modelMat = glm::scale(glm::vec3(0.7f, 0.7f, 0.7f));
     modelMat = glm::translate(glm::vec3(0.f, -1.f, 0.f)) * modelMat;
-    ground.uniformBufferAndContent.content.modelMatrix = modelMat;
+    ground.modelMatrix = modelMat;
 
     AppSceneObject sphere1{};
     sphere1.meshPath = "../../models/substance_sphere.obj";
@@ -2931,7 +3531,7 @@ void VulkanApp::prepareSceneObjectsData() {
     sphere1.normal.path = "../../textures/substance_bronze/normal.png";
     sphere1.mrao.path =
         "../../textures/substance_bronze/mrao.png";
-    sphere1.uniformBufferAndContent.content.modelMatrix =
+    sphere1.modelMatrix =
         glm::translate(glm::vec3(-1.f, 0.f, -1.f));
     
     AppSceneObject sphere2{};
@@ -2941,7 +3541,7 @@ void VulkanApp::prepareSceneObjectsData() {
     sphere2.normal.path = "../../textures/substance_machinery/normal.png";
     sphere2.mrao.path =
         "../../textures/substance_machinery/mrao.png";
-    sphere2.uniformBufferAndContent.content.modelMatrix =
+    sphere2.modelMatrix =
         glm::translate(glm::vec3(1.f, 0.f, -1.f));
 
     AppSceneObject sphere3{};
@@ -2951,7 +3551,7 @@ void VulkanApp::prepareSceneObjectsData() {
     sphere3.normal.path = "../../textures/substance_steal/normal.png";
     sphere3.mrao.path =
         "../../textures/substance_steal/mrao.png";
-    sphere3.uniformBufferAndContent.content.modelMatrix =
+    sphere3.modelMatrix =
         glm::translate(glm::vec3(1.f, 0.f, 1.f));
 
     AppSceneObject sphere4{};
@@ -2961,7 +3561,7 @@ void VulkanApp::prepareSceneObjectsData() {
     sphere4.normal.path = "../../textures/substance_ruststeal/normal.png";
     sphere4.mrao.path =
         "../../textures/substance_ruststeal/mrao.png";
-    sphere4.uniformBufferAndContent.content.modelMatrix =
+    sphere4.modelMatrix =
         glm::translate(glm::vec3(-1.f, 0.f, 1.f));
 
 #ifdef SHOW_SHADOW_SCENE
@@ -2981,91 +3581,85 @@ void VulkanApp::prepareSceneObjectsData() {
     
     
     
-    // the following 2 functions must be called before scene object loading
-    // scene object descriptor set requires offscreen uniform buffer and
-    // descriptor set layout
+    // the following function must be called before scene object loading
+    // scene object descriptor set requires offscreen descriptor set layout
     // createOffscreenDescriptorSetLayout()
-    // createOffscreenUniformBuffer()
 
     rt_all_triangles.clear();
     for (auto& scene_object : scene_objects_) {
-        tempGlobalModelMatrix =
-            scene_object.uniformBufferAndContent.content.modelMatrix;
-        loadSingleSceneObjectMesh(scene_object);
-        // texture
-        // loadSceneObjectTexture(scene_object);
-        loadSingleSceneObjectTexture(scene_object.albedo);
-        loadSingleSceneObjectTexture(scene_object.normal);
-        loadSingleSceneObjectTexture(scene_object.mrao);
-        // uniform buffer
-        createModelMatrixUniformBuffer(scene_object);
+        acquireSceneObjectAssets(scene_object);
+    }
+    // also picks up the skybox cube acquired in prepareSkybox
+    loadPendingAssets();
+
+    rt_bvh_nodes.clear();
+    rt_meshRoots.clear();
+    rt_instanceObjects.clear();
+    rt_instanceRoots.clear();
+#ifdef SHOW_SHADOW_SCENE
+    for (uint32_t i = 0; i < scene_objects_.size(); ++i) {
+        rt_addInstance(i);
     }
+#endif // SHOW_SHADOW_SCENE
+    std::cout << scene_objects_.size() << " scene objects share "
+        << mesh_registry_.size() << " meshes and "
+        << texture_registry_.size() << " textures" << std::endl;
+    buildDrawGroups();
     // ray tracing 
     rt_loadObj(rt_all_triangles);
 }
 
 void VulkanApp::prepareSceneObjectsDescriptor() {
-    for (auto& scene_object : scene_objects_) {
-        // allocate descriptor
-        createSceneObjectDescriptorSet(scene_object);
-    }
+    createMaterialTable();
 	//auto& skybox_scene_object = skybox_.skyBoxCube.mesh;
 	//createSceneObjectDescriptorSet(skybox_scene_object);
 }
 
-void VulkanApp::loadSingleSceneObjectTexture(AppTextureInfo& texture_info) {
-    // load file
+void VulkanApp::loadSingleSceneObjectTexture(AppTextureInfo& texture_info,
+    bool mipmaps) {
+    AppImageData image;
+    decodeSingleTexture(texture_info.path, image, mipmaps);
+    uploadSingleTexture(texture_info, image);
+}
+
+// no vulkan calls in here, runs on a worker thread
+void VulkanApp::decodeSingleTexture(const std::string& path,
+    AppImageData& image, bool mipmaps) {
+    // cooked files always carry their mips
+    if (mipmaps && texturecache::load(path, image.format, image.pixels,
+        image.levels)) {
+        return;
+    }
+
     int texWidth, texHeight, texChannels;
-    stbi_uc* pixels = stbi_load(texture_info.path.c_str(),
+    stbi_uc* pixels = stbi_load(path.c_str(),
         &texWidth, &texHeight, &texChannels,
         STBI_rgb_alpha);
-    VkDeviceSize imageSize = texWidth * texHeight * 4;
 
     if (!pixels) {
-        throw std::runtime_error("failed to load abledo texture image!");
+        throw std::runtime_error("failed to load texture image " + path);
     }
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-
-    createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        stagingBuffer, stagingBufferMemory);
-
-    void* data;
-
-    vkMapMemory(device_, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels, static_cast<size_t>(imageSize));
-    vkUnmapMemory(device_, stagingBufferMemory);
-
+    // box filtered here rather than blitted on the gpu, so the upload
+    // stays a plain copy the transfer queue can do
+    uint32_t width = static_cast<uint32_t>(texWidth);
+    uint32_t height = static_cast<uint32_t>(texHeight);
+    if (mipmaps) {
+        imageutil::buildMipChain(pixels, width, height,
+            image.pixels, image.levels);
+    }
+    else {
+        image.pixels.assign(pixels, pixels + width * height * 4);
+        image.levels = { { width, height, 0 } };
+    }
     stbi_image_free(pixels);
+}
 
-    createImage(texWidth, texHeight,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        texture_info.texture.image,
-        texture_info.texture.deviceMemory);
-
-    texture_info.texture.imageView = createImageView(
-        texture_info.texture.image,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_ASPECT_COLOR_BIT);
-
-    transitionImageLayout(texture_info.texture.image,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_LAYOUT_UNDEFINED,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    copyBufferToImage(stagingBuffer, texture_info.texture.image,
-        static_cast<uint32_t>(texWidth),
-        static_cast<uint32_t>(texHeight));
-    transitionImageLayout(texture_info.texture.image,
-        VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-    vkDestroyBuffer(device_, stagingBuffer, nullptr);
-    vkFreeMemory(device_, stagingBufferMemory, nullptr);
+void VulkanApp::uploadSingleTexture(AppTextureInfo& texture_info,
+    const AppImageData& image, uint32_t firstLevel) {
+    uploadTextureLevels(texture_info.texture, image, firstLevel);
+    // covers the whole chain, lods past the resident levels are clamped
+    uint32_t mipLevels = static_cast<uint32_t>(image.levels.size());
 
     // create sampler
     VkSamplerCreateInfo samplerInfo = {};
@@ -3082,6 +3676,8 @@ void VulkanApp::loadSingleSceneObjectTexture(AppTextureInfo& texture_info) {
     samplerInfo.compareEnable = VK_FALSE;
     samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
     samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = static_cast<float>(mipLevels);
 
     if (vkCreateSampler(device_, &samplerInfo, nullptr,
         &texture_info.texture.sampler) != VK_SUCCESS) {
@@ -3089,122 +3685,464 @@ void VulkanApp::loadSingleSceneObjectTexture(AppTextureInfo& texture_info) {
             "failed to create texture_info.texture.sampler!");
     }
 
-    // fill image info
-    VkDescriptorImageInfo& image_info =
-        texture_info.texture.descriptorImageInfo;
-    image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    image_info.sampler = texture_info.texture.sampler;
-    image_info.imageView = texture_info.texture.imageView;
+    texture_info.texture.descriptorImageInfo.sampler =
+        texture_info.texture.sampler;
 }
 
-void VulkanApp::createSceneObjectDescriptorSet(AppSceneObject& scene_object) {
-    VkDescriptorSetAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    allocInfo.descriptorPool = descriptor_pool_;
-    allocInfo.descriptorSetCount = 1;
-    allocInfo.pSetLayouts = &offscreen_.descriptorSetLayout;
+void VulkanApp::uploadTextureLevels(AppTexture& texture,
+    const AppImageData& image, uint32_t firstLevel) {
+    uint32_t mipLevels =
+        static_cast<uint32_t>(image.levels.size()) - firstLevel;
+    const imageutil::MipLevel& top = image.levels[firstLevel];
+
+    createImage(top.width, top.height,
+        image.format,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        texture.image,
+        texture.deviceMemory,
+        mipLevels);
+
+    texture.imageView = createImageView(
+        texture.image,
+        image.format,
+        VK_IMAGE_ASPECT_COLOR_BIT,
+        mipLevels);
+
+    // one region per level, all from the same staging copy
+    std::vector<VkBufferImageCopy> regions(mipLevels);
+    for (uint32_t level = 0; level < mipLevels; ++level) {
+        const imageutil::MipLevel& source = image.levels[firstLevel + level];
+        VkBufferImageCopy& region = regions[level];
+        region = {};
+        region.bufferOffset = source.offset - top.offset;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = level;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = { source.width, source.height, 1 };
+    }
+
+    VkImageSubresourceRange range =
+        { VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1 };
+    upload_batch_.copyToImage(texture.image, range,
+        image.pixels.data() + top.offset, image.pixels.size() - top.offset,
+        regions.data(), mipLevels,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        queue_families_.graphicsFamily.value());
 
+    texture.descriptorImageInfo.imageLayout =
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    texture.descriptorImageInfo.imageView = texture.imageView;
+}
 
-    if (vkAllocateDescriptorSets(device_, &allocInfo,
-        &scene_object.descriptorSet) != VK_SUCCESS)
-    {
-        throw std::runtime_error(
-            "failed to allocate scene_object.descriptorSet");
+// geometry pool =================================================
+void VulkanApp::createGeometryPool() {
+    createBuffer(sizeof(Vertex) * static_cast<VkDeviceSize>(GEOMETRY_POOL_VERTICES),
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        geometry_pool_.vertexBuffer, geometry_pool_.vertexMemory);
+    createBuffer(sizeof(uint32_t) * static_cast<VkDeviceSize>(GEOMETRY_POOL_INDICES),
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        geometry_pool_.indexBuffer, geometry_pool_.indexMemory);
+    geometry_pool_.vertexHead = 0;
+    geometry_pool_.indexHead = 0;
+}
+
+void VulkanApp::cleanupGeometryPool() {
+    vkDestroyBuffer(device_, geometry_pool_.vertexBuffer, nullptr);
+    memory_allocator_.free(geometry_pool_.vertexMemory);
+    vkDestroyBuffer(device_, geometry_pool_.indexBuffer, nullptr);
+    memory_allocator_.free(geometry_pool_.indexMemory);
+}
+
+// asset registry =================================================
+AppMesh* VulkanApp::acquireMesh(const std::string& path) {
+    auto found = mesh_registry_.find(path);
+    if (found != mesh_registry_.end()) {
+        found->second.refCount++;
+        return &found->second;
     }
 
-    std::vector<VkWriteDescriptorSet> write_sets = {
-        // binding 0: offscreen uniformBuffer
-        apputil::createBufferWriteDescriptorSet(
-            scene_object.descriptorSet,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-            0,
-            &offscreen_.uniformBufferAndContent.uniformBuffer
-                .descriptorBufferInfo,
-            1),
-        // binding 1: self uniformBuffer
-        apputil::createBufferWriteDescriptorSet(
-            scene_object.descriptorSet,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-            1,
-            &scene_object.uniformBufferAndContent.uniformBuffer
-                .descriptorBufferInfo,
-            1),
-        // binding 2: albedo texture
-        apputil::createImageWriteDescriptorSet(
-            scene_object.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            2,
-            &scene_object.albedo.texture.descriptorImageInfo,
-            1),
-        // binding 3: normal map
-        apputil::createImageWriteDescriptorSet(
-            scene_object.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            3,
-            &scene_object.normal.texture.descriptorImageInfo,
-            1),
-        // binding 4: mrao texture
-        apputil::createImageWriteDescriptorSet(
-            scene_object.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            4,
-            &scene_object.mrao.texture.descriptorImageInfo,
-            1),
-		//// binding 5: cube map tex
-		//apputil::createImageWriteDescriptorSet(
-		//	scene_object.descriptorSet,
-		//	VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-		//	5,
-		//	&skybox_.skyBoxCube.cubemap.textureInfo.texture.descriptorImageInfo,
-		//	1),
-		//// binding 6: uniform buf (cam)
-		//apputil::createBufferWriteDescriptorSet(
-		//	scene_object.descriptorSet,
-		//	VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-		//	6,
-		//	&skybox_.uniformBufferAndContent.uniformBuffer
-		//	.descriptorBufferInfo,
-		//	1),
-    };
+    // loaded with everything else in the next loadPendingAssets
+    AppMesh& mesh = mesh_registry_[path];
+    mesh.path = path;
+    mesh.refCount = 1;
+    pending_meshes_.push_back(&mesh);
+    return &mesh;
+}
 
-    vkUpdateDescriptorSets(device_, static_cast<uint32_t>(write_sets.size()),
-        write_sets.data(), 0, NULL);
+AppTexture* VulkanApp::acquireTexture(const std::string& path) {
+    auto found = texture_registry_.find(path);
+    if (found != texture_registry_.end()) {
+        found->second.refCount++;
+        return &found->second.info.texture;
+    }
+
+    AppSharedTexture& shared = texture_registry_[path];
+    shared.info.path = path;
+    shared.refCount = 1;
+    pending_textures_.push_back(&shared.info);
+    return &shared.info.texture;
 }
 
-void VulkanApp::createModelMatrixUniformBuffer(AppSceneObject& scene_object) {
-    
-    VkDeviceSize buffSize = sizeof(AppSceneObjectUniformBufferConent);
-    createBuffer(buffSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        scene_object.uniformBufferAndContent.uniformBuffer.buffer,
-        scene_object.uniformBufferAndContent.uniformBuffer.deviceMemory
-    );
+void VulkanApp::releaseMesh(const std::string& path) {
+    auto found = mesh_registry_.find(path);
+    if (found == mesh_registry_.end()) {
+        throw std::runtime_error("failed to release mesh " + path
+            + ", it was never acquired");
+    }
+    AppMesh& mesh = found->second;
+    if (--mesh.refCount > 0) {
+        return;
+    }
 
-    VkDescriptorBufferInfo& buffer_info =
-        scene_object.uniformBufferAndContent.uniformBuffer.descriptorBufferInfo;
-    
-    buffer_info.buffer =
-        scene_object.uniformBufferAndContent.uniformBuffer.buffer;
-    buffer_info.offset = 0;
-    buffer_info.range = VK_WHOLE_SIZE;
-}   
+    // only the last ranges of the pool go back, meshes in the middle keep
+    // theirs until the pool is destroyed
+    if (static_cast<uint32_t>(mesh.vertexOffset) + mesh.vertexCount
+            == geometry_pool_.vertexHead
+        && mesh.firstIndex + mesh.indexCount == geometry_pool_.indexHead) {
+        geometry_pool_.vertexHead = static_cast<uint32_t>(mesh.vertexOffset);
+        geometry_pool_.indexHead = mesh.firstIndex;
+    }
+    mesh_registry_.erase(found);
+}
 
-// cubemap =================================================
-void VulkanApp::prepareSkybox() {
-    prepareSkyboxTexture();
-    loadSkyboxMesh();
-    createSkyboxUniformBuffer();
-    createSkyboxDescriptorSetLayout();
-    createSkyboxDescriptorSet();
-    createSkyboxPipelineLayout();
+void VulkanApp::releaseTexture(const std::string& path) {
+    auto found = texture_registry_.find(path);
+    if (found == texture_registry_.end()) {
+        throw std::runtime_error("failed to release texture " + path
+            + ", it was never acquired");
+    }
+    AppSharedTexture& shared = found->second;
+    if (--shared.refCount > 0) {
+        return;
+    }
+
+    AppTexture& texture = shared.info.texture;
+    vkDestroySampler(device_, texture.sampler, nullptr);
+    vkDestroyImageView(device_, texture.imageView, nullptr);
+    vkDestroyImage(device_, texture.image, nullptr);
+    memory_allocator_.free(texture.deviceMemory);
+    texture_registry_.erase(found);
 }
 
+void VulkanApp::acquireSceneObjectAssets(AppSceneObject& scene_object) {
+    scene_object.mesh = acquireMesh(scene_object.meshPath);
+    for (AppTextureRef* ref : { &scene_object.albedo, &scene_object.normal,
+        &scene_object.mrao }) {
+        ref->texture = acquireTexture(ref->path);
+    }
+}
 
-void VulkanApp::prepareSkyboxTexture()
-{
-    getEnabledFeatures();
-    //VkFormat format{};
-    VkFormat format;
+void VulkanApp::releaseSceneObjectAssets(AppSceneObject& scene_object) {
+    if (scene_object.mesh) {
+        releaseMesh(scene_object.meshPath);
+        scene_object.mesh = nullptr;
+    }
+    for (AppTextureRef* ref : { &scene_object.albedo, &scene_object.normal,
+        &scene_object.mrao }) {
+        if (ref->texture) {
+            releaseTexture(ref->path);
+            ref->texture = nullptr;
+        }
+    }
+}
+
+void VulkanApp::loadPendingAssets() {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // parse and decode on every core, vulkan only on this thread
+    uint32_t meshCount = static_cast<uint32_t>(pending_meshes_.size());
+    uint32_t textureCount = static_cast<uint32_t>(pending_textures_.size());
+    std::vector<AppMeshData> meshData(meshCount);
+    std::vector<AppImageData> imageData(textureCount);
+    job_system_.parallelFor(meshCount + textureCount, [&](uint32_t i) {
+        if (i < meshCount) {
+            cookSingleMesh(*pending_meshes_[i], meshData[i]);
+        }
+        else {
+            decodeSingleTexture(pending_textures_[i - meshCount]->path,
+                imageData[i - meshCount]);
+        }
+    });
+
+    for (uint32_t i = 0; i < meshCount; ++i) {
+        uploadSingleMesh(*pending_meshes_[i], meshData[i]);
+    }
+    for (uint32_t i = 0; i < textureCount; ++i) {
+        uint32_t firstLevel = 0;
+        if (texture_streaming_) {
+            firstLevel = initTextureStreaming(
+                texture_registry_.at(pending_textures_[i]->path),
+                imageData[i]);
+        }
+        uploadSingleTexture(*pending_textures_[i], imageData[i], firstLevel);
+    }
+    pending_meshes_.clear();
+    pending_textures_.clear();
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "loaded " << meshCount << " meshes and " << textureCount
+        << " textures on " << job_system_.concurrency() << " threads in "
+        << std::chrono::duration<float, std::milli>(end - start).count()
+        << " ms" << std::endl;
+}
+
+// texture streaming =================================================
+namespace {
+    // bytes of levels [firstLevel, end) of a streamed texture
+    VkDeviceSize streamedBytes(const AppTextureStreaming& streaming,
+        uint32_t firstLevel) {
+        return streaming.totalBytes - streaming.levels[firstLevel].offset;
+    }
+}
+
+uint32_t VulkanApp::initTextureStreaming(AppSharedTexture& shared,
+    const AppImageData& image) {
+    AppTextureStreaming& streaming = shared.streaming;
+    uint32_t levelCount = static_cast<uint32_t>(image.levels.size());
+    uint32_t tailLevel = 0;
+    while (tailLevel + 1 < levelCount
+        && std::max(image.levels[tailLevel].width,
+            image.levels[tailLevel].height) > TEXTURE_TAIL_SIZE) {
+        tailLevel++;
+    }
+    if (tailLevel == 0) {
+        // small enough to stay resident as a whole
+        return 0;
+    }
+
+    streaming.enabled = true;
+    streaming.levels = image.levels;
+    streaming.totalBytes = image.pixels.size();
+    streaming.tailLevel = tailLevel;
+    streaming.residentLevel = tailLevel;
+    streaming.wantedLevel = tailLevel;
+
+    // the tail with its offsets rebased, level 0 of it is tailLevel
+    size_t tailOffset = image.levels[tailLevel].offset;
+    streaming.tail.format = image.format;
+    streaming.tail.pixels.assign(image.pixels.begin() + tailOffset,
+        image.pixels.end());
+    streaming.tail.levels.assign(image.levels.begin() + tailLevel,
+        image.levels.end());
+    for (auto& level : streaming.tail.levels) {
+        level.offset -= tailOffset;
+    }
+    return tailLevel;
+}
+
+void VulkanApp::computeWantedTextureLevels() {
+    for (auto& entry : texture_registry_) {
+        AppTextureStreaming& streaming = entry.second.streaming;
+        streaming.wantedLevel = streaming.tailLevel;
+    }
+
+    glm::vec3 eye = firstPersonCam->GetPos();
+    // projected size of one world unit at distance one
+    float pixelsPerUnit = swapchain_extent_.height
+        / (2.0f * std::tan(glm::radians(firstPersonCam->fovy) * 0.5f));
+
+    // only what cullSceneObjects found inside the frustum this frame
+    for (uint32_t i = 0; i < visible_instance_count_; ++i) {
+        const AppSceneObject& scene_object =
+            scene_objects_[instance_objects_[visible_instances_[i]]];
+        const glm::vec3& boxMin = scene_object.aabbMin;
+        const glm::vec3& boxMax = scene_object.aabbMax;
+        float radius = 0.5f * glm::length(boxMax - boxMin);
+
+        // assumes the uv range covers the object once, textures tiling
+        // over it get less detail than they could use
+        glm::vec3 closest = glm::clamp(eye, boxMin, boxMax);
+        float distance = std::max(glm::length(closest - eye),
+            firstPersonCam->near_clip);
+        float pixels = std::max(2.0f * radius / distance * pixelsPerUnit, 1.0f);
+
+        for (const AppTextureRef* ref : { &scene_object.albedo,
+            &scene_object.normal, &scene_object.mrao }) {
+            AppTextureStreaming& streaming =
+                texture_registry_.at(ref->path).streaming;
+            if (!streaming.enabled) {
+                continue;
+            }
+            float size = static_cast<float>(std::max(
+                streaming.levels[0].width, streaming.levels[0].height));
+            uint32_t level = pixels < size
+                ? static_cast<uint32_t>(std::log2(size / pixels)) : 0;
+            streaming.wantedLevel = std::min(streaming.wantedLevel, level);
+            streaming.lastVisibleFrame = stream_frame_;
+        }
+    }
+}
+
+void VulkanApp::retireTexture(AppTexture& texture) {
+    retired_textures_.push_back({ texture.image, texture.deviceMemory,
+        texture.imageView, stream_frame_ });
+    material_table_dirty_frames_ = (1u << MAX_FRAMES_IN_FLIGHT) - 1;
+}
+
+void VulkanApp::updateTextureStreaming() {
+    if (!texture_streaming_) {
+        return;
+    }
+    stream_frame_++;
+
+    // this frame's fence was waited on, so the frames that could still
+    // sample an image retired MAX_FRAMES_IN_FLIGHT frames ago are done
+    auto retired = std::remove_if(retired_textures_.begin(),
+        retired_textures_.end(), [this](const AppRetiredTexture& texture) {
+        if (texture.frame + MAX_FRAMES_IN_FLIGHT > stream_frame_) {
+            return false;
+        }
+        vkDestroyImageView(device_, texture.imageView, nullptr);
+        vkDestroyImage(device_, texture.image, nullptr);
+        memory_allocator_.free(texture.deviceMemory);
+        return true;
+    });
+    retired_textures_.erase(retired, retired_textures_.end());
+
+    computeWantedTextureLevels();
+
+    // finished decodes go in first, their memory was counted when they
+    // were requested
+    VkDeviceSize resident = 0;
+    uint32_t inFlight = 0;
+    std::vector<AppSharedTexture*> candidates;
+    for (auto& entry : texture_registry_) {
+        AppSharedTexture& shared = entry.second;
+        AppTextureStreaming& streaming = shared.streaming;
+        if (!streaming.enabled) {
+            continue;
+        }
+        if (streaming.request && streaming.request->done) {
+            std::shared_ptr<AppTextureStreamRequest> request =
+                std::move(streaming.request);
+            if (!request->failed) {
+                retireTexture(shared.info.texture);
+                uploadTextureLevels(shared.info.texture, request->image,
+                    request->firstLevel);
+                streaming.residentLevel = request->firstLevel;
+            }
+            else {
+                streaming.failed = true;
+            }
+        }
+
+        resident += streamedBytes(streaming, streaming.residentLevel);
+        if (streaming.request) {
+            resident += streamedBytes(streaming, streaming.request->firstLevel)
+                - streamedBytes(streaming, streaming.residentLevel);
+            inFlight++;
+        }
+        else if (!streaming.failed
+            && streaming.wantedLevel < streaming.residentLevel) {
+            candidates.push_back(&shared);
+        }
+    }
+
+    // biggest gain in detail first
+    std::sort(candidates.begin(), candidates.end(),
+        [](const AppSharedTexture* a, const AppSharedTexture* b) {
+        return a->streaming.residentLevel - a->streaming.wantedLevel
+            > b->streaming.residentLevel - b->streaming.wantedLevel;
+    });
+    for (AppSharedTexture* shared : candidates) {
+        if (inFlight >= MAX_TEXTURE_STREAM_REQUESTS) {
+            break;
+        }
+        AppTextureStreaming& streaming = shared->streaming;
+        VkDeviceSize extra = streamedBytes(streaming, streaming.wantedLevel)
+            - streamedBytes(streaming, streaming.residentLevel);
+
+        // least recently visible textures drop back to their tail
+        while (resident + extra > TEXTURE_BUDGET) {
+            AppSharedTexture* victim = nullptr;
+            for (auto& entry : texture_registry_) {
+                const AppTextureStreaming& other = entry.second.streaming;
+                if (!other.enabled || other.request
+                    || other.residentLevel >= other.tailLevel
+                    || other.lastVisibleFrame == stream_frame_) {
+                    continue;
+                }
+                if (!victim || other.lastVisibleFrame
+                    < victim->streaming.lastVisibleFrame) {
+                    victim = &entry.second;
+                }
+            }
+            if (!victim) {
+                break;
+            }
+            AppTextureStreaming& evicted = victim->streaming;
+            resident -= streamedBytes(evicted, evicted.residentLevel)
+                - streamedBytes(evicted, evicted.tailLevel);
+            retireTexture(victim->info.texture);
+            uploadTextureLevels(victim->info.texture, evicted.tail, 0);
+            evicted.residentLevel = evicted.tailLevel;
+        }
+        if (resident + extra > TEXTURE_BUDGET) {
+            // everything left is on screen
+            break;
+        }
+
+        // decoded again from disk, only the tail stays in memory
+        auto request = std::make_shared<AppTextureStreamRequest>();
+        request->firstLevel = streaming.wantedLevel;
+        streaming.request = request;
+        std::string path = shared->info.path;
+        job_system_.submit([this, request, path] {
+            try {
+                decodeSingleTexture(path, request->image);
+            }
+            catch (const std::exception& error) {
+                std::cerr << error.what() << std::endl;
+                request->failed = true;
+            }
+            request->done = true;
+        });
+        resident += extra;
+        inFlight++;
+    }
+    texture_resident_bytes_ = resident;
+
+    // new images of this frame, nothing recorded is a no-op. not waited
+    // on here, the offscreen submit in draw waits on the semaphore
+    stream_upload_submitted_ = upload_batch_.submit(stream_upload_semaphore_);
+
+    // the other frame in flight may still use its own set
+    if (material_table_dirty_frames_ & (1u << current_frame_)) {
+        updateMaterialTableSet(current_frame_);
+        material_table_dirty_frames_ &= ~(1u << current_frame_);
+    }
+}
+
+void VulkanApp::cleanupTextureStreaming() {
+    // decodes still running only touch their request
+    job_system_.waitIdle();
+    for (const auto& texture : retired_textures_) {
+        vkDestroyImageView(device_, texture.imageView, nullptr);
+        vkDestroyImage(device_, texture.image, nullptr);
+        memory_allocator_.free(texture.deviceMemory);
+    }
+    retired_textures_.clear();
+}
+
+// cubemap =================================================
+void VulkanApp::prepareSkybox() {
+    prepareSkyboxTexture();
+    loadSkyboxMesh();
+    createSkyboxDescriptorSetLayout();
+    createSkyboxDescriptorSet();
+    createSkyboxPipelineLayout();
+}
+
+
+void VulkanApp::prepareSkyboxTexture()
+{
+    getEnabledFeatures();
+    //VkFormat format{};
+    VkFormat format;
 
     std::string filename;
     //if (device_features_.textureCompressionBC) {
@@ -3237,57 +4175,8 @@ void VulkanApp::prepareSkyboxTexture()
     cubemap.height = texCube.extent().y;
     cubemap.mipLevels = texCube.levels();
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingMemory;
-
-    // =======================================================================
-
-    VkMemoryAllocateInfo memAllocInfo{};
-    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
     VkMemoryRequirements memReqs;
 
-    VkBufferCreateInfo bufferCreateInfo{};
-    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferCreateInfo.size = texCube.size();
-    // This buffer is used as a transfer source for the buffer copy
-    bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    if (vkCreateBuffer(device_, &bufferCreateInfo, nullptr, &stagingBuffer) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to create stagingBuffer");
-    }
-
-    // Get memory requirements for the staging buffer (alignment, memory type bits)
-    vkGetBufferMemoryRequirements(device_, stagingBuffer, &memReqs);
-    memAllocInfo.allocationSize = memReqs.size;
-    // Get memory type index for a host visible buffer
-    memAllocInfo.memoryTypeIndex = skybox_getMemoryType(
-        memReqs.memoryTypeBits,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-    );
-
-    if (vkAllocateMemory(device_, &memAllocInfo, nullptr, &stagingMemory) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to allocate mem for stagingBuffer");
-
-    }
-    if (vkBindBufferMemory(device_, stagingBuffer, stagingMemory, 0) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to bind mem for stagingBuffer");
-
-    }
-
-    // Copy texture data into staging buffer
-    uint8_t *data;
-    if (vkMapMemory(device_, stagingMemory, 0, memReqs.size, 0, (void **)&data) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to map mem for stagingBuffer");
-
-    }
-    memcpy(data, texCube.data(), texCube.size());
-    vkUnmapMemory(device_, stagingMemory);
-
     // Create optimal tiled target image
     VkImageCreateInfo imageCreateInfo{};
     imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -3317,48 +4206,19 @@ void VulkanApp::prepareSkyboxTexture()
 
     // =========================================================================
     vkGetImageMemoryRequirements(device_, cubemap.textureInfo.texture.image, &memReqs);
-    memAllocInfo.allocationSize = memReqs.size;
-    memAllocInfo.memoryTypeIndex = findMemoryType(
-        memReqs.memoryTypeBits,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-    );
-
-    if (vkAllocateMemory(device_,
-        &memAllocInfo, nullptr,
-        &cubemap.textureInfo.texture.deviceMemory)
-        != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to allocate mem for cubemap image");
-    }
+    cubemap.textureInfo.texture.deviceMemory = memory_allocator_.allocate(
+        memReqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
 
     if (vkBindImageMemory(device_,
         cubemap.textureInfo.texture.image,
-        cubemap.textureInfo.texture.deviceMemory, 0) 
+        cubemap.textureInfo.texture.deviceMemory.memory,
+        cubemap.textureInfo.texture.deviceMemory.offset) 
         != VK_SUCCESS)
     {
         throw std::runtime_error("failed to bind mem for cubemap image");
     }
 
-    VkCommandBufferAllocateInfo cmdBufAllocateInfo{};
-    cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmdBufAllocateInfo.commandPool = command_pool_;
-    cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmdBufAllocateInfo.commandBufferCount = 1;
-
-    VkCommandBuffer copyCmd{};
-    if (vkAllocateCommandBuffers(device_, &cmdBufAllocateInfo, &copyCmd) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to allocate copy comd");
-    }
-
-    VkCommandBufferBeginInfo cmdBufInfo{};
-    cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-
-    if (vkBeginCommandBuffer(copyCmd, &cmdBufInfo) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to begin copy comd");
-    }
-
+    // the upload batch stages texCube itself, offsets are relative to it
     std::vector<VkBufferImageCopy> bufferCopyRegions;
     uint32_t offset = 0;
     for (uint32_t face = 0; face < 6; face++)
@@ -3391,70 +4251,12 @@ void VulkanApp::prepareSkyboxTexture()
     subresourceRange.levelCount = cubemap.mipLevels;
     subresourceRange.layerCount = 6;
 
-    skybox_transitionLayout(
-        copyCmd,
-        cubemap.textureInfo.texture.image,
-        VK_IMAGE_LAYOUT_UNDEFINED,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        subresourceRange,
-        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT
-    );
-
-    vkCmdCopyBufferToImage(
-        copyCmd,
-        stagingBuffer,
-        cubemap.textureInfo.texture.image,
-
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    upload_batch_.copyToImage(cubemap.textureInfo.texture.image,
+        subresourceRange, texCube.data(), texCube.size(),
+        bufferCopyRegions.data(),
         static_cast<uint32_t>(bufferCopyRegions.size()),
-        bufferCopyRegions.data()
-    );
-
-    skybox_transitionLayout(
-        copyCmd,
-        cubemap.textureInfo.texture.image,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        subresourceRange,
-        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT
-    );
-
-    if (vkEndCommandBuffer(copyCmd) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to end copy comd");
-    }
-
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &copyCmd;
-
-
-    // Create fence to ensure that the command buffer has finished executing
-    VkFenceCreateInfo fenceInfo{};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceInfo.flags = 0;
-
-    VkFence fence;
-    if (vkCreateFence(device_, &fenceInfo, nullptr, &fence) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to create fence");
-    }
-
-    // Submit to the queue
-    if (vkQueueSubmit(queue_, 1, &submitInfo, fence) != VK_SUCCESS) {
-        throw std::runtime_error("failed to submit queue");
-    }
-    // Wait for the fence to signal that command buffer has finished executing
-    if (vkWaitForFences(device_, 1, &fence, VK_TRUE, 100000000000))
-    {
-        throw std::runtime_error("failed to wait");
-
-    }
-    vkDestroyFence(device_, fence, nullptr);
-
+        queue_families_.graphicsFamily.value());
 
     // create sampler
     VkSamplerCreateInfo sampler{};
@@ -3504,37 +4306,15 @@ void VulkanApp::prepareSkyboxTexture()
     descriptorImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
     descriptorImageInfo.imageView = cubemap.textureInfo.texture.imageView;
     descriptorImageInfo.sampler = cubemap.textureInfo.texture.sampler;
-
-    // Clean up staging resources
-    vkFreeMemory(device_, stagingMemory, nullptr);
-    vkDestroyBuffer(device_, stagingBuffer, nullptr);
 }
 
 void VulkanApp::loadSkyboxMesh() {
 
 
-    tempPushTriangleSwitch = false;
+    // not part of the rt scene, only the mesh is needed
     skybox_.skyBoxCube.mesh.meshPath = "../../models/maya_cube.obj";
-    loadSingleSceneObjectMesh(skybox_.skyBoxCube.mesh);
-#ifdef SHOW_SHADOW_SCENE
-    tempPushTriangleSwitch = true;
-#endif // SHOW_SHADOW_SCENE
-}
-
-void VulkanApp::createSkyboxUniformBuffer() {
-    VkDeviceSize bufferSize = sizeof(AppSkyBoxUniformBufferContent);
-    createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        skybox_.uniformBufferAndContent.uniformBuffer.buffer,
-        skybox_.uniformBufferAndContent.uniformBuffer.deviceMemory);
-
-    VkDescriptorBufferInfo& buffer_info =
-        skybox_.uniformBufferAndContent.uniformBuffer.descriptorBufferInfo;
-    
-    buffer_info.buffer =
-        skybox_.uniformBufferAndContent.uniformBuffer.buffer;
-    buffer_info.offset = 0;
-    buffer_info.range = VK_WHOLE_SIZE;
+    skybox_.skyBoxCube.mesh.mesh =
+        acquireMesh(skybox_.skyBoxCube.mesh.meshPath);
 }
 
 void VulkanApp::createSkyboxDescriptorSetLayout() {
@@ -3542,7 +4322,7 @@ void VulkanApp::createSkyboxDescriptorSetLayout() {
         // binding 0: uniform buf (cam)
         apputil::createDescriptorSetLayoutBinding(
             0,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             1,
             VK_SHADER_STAGE_VERTEX_BIT),
         // binding 1: cube map texture
@@ -3580,14 +4360,16 @@ void VulkanApp::createSkyboxDescriptorSet() {
         throw std::runtime_error("failed to allocate deferred_.descriptorSet!");
     }
 
+    VkDescriptorBufferInfo camera_buffer_info =
+        uniformRingDescriptor(sizeof(AppSkyBoxUniformBufferContent));
+
     std::vector<VkWriteDescriptorSet> write_sets = {
         // binding 0: uniform buf (cam)
         apputil::createBufferWriteDescriptorSet(
             skybox_scene_object.descriptorSet,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             0,
-            &skybox_.uniformBufferAndContent.uniformBuffer
-            .descriptorBufferInfo,
+            &camera_buffer_info,
             1),
         // binding 1: cube map tex
         apputil::createImageWriteDescriptorSet(
@@ -3744,164 +4526,9 @@ void VulkanApp::getEnabledFeatures()
 }
 
 
-uint32_t VulkanApp::skybox_getMemoryType(uint32_t typeBits,
-    VkMemoryPropertyFlags properties,
-    VkBool32 *memTypeFound) {
-    for (uint32_t i = 0; i < device_memory_properties_.memoryTypeCount; i++)
-    {
-        if ((typeBits & 1) == 1)
-        {
-            if ((device_memory_properties_.memoryTypes[i].propertyFlags & properties) == properties)
-            {
-                if (memTypeFound)
-                {
-                    *memTypeFound = true;
-                }
-                return i;
-            }
-        }
-        typeBits >>= 1;
-    }
-
-    if (memTypeFound)
-    {
-        *memTypeFound = false;
-        return 0;
-    }
-    else
-    {
-        throw std::runtime_error("Could not find a matching memory type");
-    }
-}
-
-void VulkanApp::skybox_transitionLayout(VkCommandBuffer cmdbuffer,
-    VkImage image,
-    VkImageLayout oldImageLayout,
-    VkImageLayout newImageLayout,
-    VkImageSubresourceRange subresourceRange,
-    VkPipelineStageFlags srcStageMask,
-    VkPipelineStageFlags dstStageMask)
-{
-    // Create an image barrier object
-    VkImageMemoryBarrier imageMemoryBarrier{};
-    imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    imageMemoryBarrier.oldLayout = oldImageLayout;
-    imageMemoryBarrier.newLayout = newImageLayout;
-    imageMemoryBarrier.image = image;
-    imageMemoryBarrier.subresourceRange = subresourceRange;
-
-    // Source layouts (old)
-    // Source access mask controls actions that have to be finished on the old layout
-    // before it will be transitioned to the new layout
-    switch (oldImageLayout)
-    {
-    case VK_IMAGE_LAYOUT_UNDEFINED:
-        // Image layout is undefined (or does not matter)
-        // Only valid as initial layout
-        // No flags required, listed only for completeness
-        imageMemoryBarrier.srcAccessMask = 0;
-        break;
-
-    case VK_IMAGE_LAYOUT_PREINITIALIZED:
-        // Image is preinitialized
-        // Only valid as initial layout for linear images, preserves memory contents
-        // Make sure host writes have been finished
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL:
-        // Image is a color attachment
-        // Make sure any writes to the color buffer have been finished
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL:
-        // Image is a depth/stencil attachment
-        // Make sure any writes to the depth/stencil buffer have been finished
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
-        // Image is a transfer source 
-        // Make sure any reads from the image have been finished
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
-        // Image is a transfer destination
-        // Make sure any writes to the image have been finished
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
-        // Image is read by a shader
-        // Make sure any shader reads from the image have been finished
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-        break;
-    default:
-        // Other source layouts aren't handled (yet)
-        break;
-    }
-
-    // Target layouts (new)
-    // Destination access mask controls the dependency for the new image layout
-    switch (newImageLayout)
-    {
-    case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
-        // Image will be used as a transfer destination
-        // Make sure any writes to the image have been finished
-        imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
-        // Image will be used as a transfer source
-        // Make sure any reads from the image have been finished
-        imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL:
-        // Image will be used as a color attachment
-        // Make sure any writes to the color buffer have been finished
-        imageMemoryBarrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL:
-        // Image layout will be used as a depth/stencil attachment
-        // Make sure any writes to depth/stencil buffer have been finished
-        imageMemoryBarrier.dstAccessMask = imageMemoryBarrier.dstAccessMask | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-        break;
-
-    case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
-        // Image will be read in a shader (sampler, input attachment)
-        // Make sure any writes to the image have been finished
-        if (imageMemoryBarrier.srcAccessMask == 0)
-        {
-            imageMemoryBarrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
-        }
-        imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-        break;
-    default:
-        // Other source layouts aren't handled (yet)
-        break;
-    }
-
-    // Put barrier inside setup command buffer
-    vkCmdPipelineBarrier(
-        cmdbuffer,
-        srcStageMask,
-        dstStageMask,
-        0,
-        0, nullptr,
-        0, nullptr,
-        1, &imageMemoryBarrier);
-}
-
 // deferred =================================================
 void VulkanApp::prepareDeferred() {
     prepareQuadVertexAndIndexBuffer();
-    createDeferredUniformBuffer();
     createDeferredPBRTextures();
     createDeferredDescriptorSetLayout();
     createDeferredDescriptorSet();
@@ -3914,26 +4541,10 @@ void VulkanApp::prepareDeferred() {
      createDeferredCommandBuffer();
 }
 
-void VulkanApp::createDeferredUniformBuffer() {
-    VkDeviceSize bufferSize = sizeof(AppDeferredUniformBufferContent);
-    createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        deferred_.uniformBufferAndContent.uniformBuffer.buffer,
-        deferred_.uniformBufferAndContent.uniformBuffer.deviceMemory
-    );
-
-    VkDescriptorBufferInfo& buffer_info =
-        deferred_.uniformBufferAndContent.uniformBuffer.descriptorBufferInfo;
-
-    buffer_info.buffer =
-        deferred_.uniformBufferAndContent.uniformBuffer.buffer;
-    buffer_info.offset = 0;
-    buffer_info.range = VK_WHOLE_SIZE;
-}
-
 void VulkanApp::createDeferredPBRTextures() {
     deferred_.pbrTextures.brdfLUT.path = "../../textures/brdfLUT.png";
-    loadSingleSceneObjectTexture(deferred_.pbrTextures.brdfLUT);
+    // a lut is read at exact coordinates, mips would only blur it
+    loadSingleSceneObjectTexture(deferred_.pbrTextures.brdfLUT, false);
     int a = 0;
 }
 
@@ -3943,7 +4554,7 @@ void VulkanApp::createDeferredDescriptorSetLayout() {
         // binding 0: uniform buffer
         apputil::createDescriptorSetLayoutBinding(
             0,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             1,
             VK_SHADER_STAGE_FRAGMENT_BIT),
         // binding 1: position texture
@@ -4003,90 +4614,96 @@ void VulkanApp::createDeferredDescriptorSetLayout() {
 }
 
 void VulkanApp::createDeferredDescriptorSet() {
-    VkDescriptorSetAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    allocInfo.descriptorPool = descriptor_pool_;
-    allocInfo.descriptorSetCount = 1;
-    allocInfo.pSetLayouts = &deferred_.descriptorSetLayout;
-
-    if (vkAllocateDescriptorSets(device_, &allocInfo, &deferred_.descriptorSet)
-        != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate deferred_.descriptorSet!");
-    }
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        VkDescriptorSet& descriptorSet = deferred_.descriptorSets[frame];
 
-    // binding 7 start =====================================
-    VkDescriptorImageInfo rt_imageInfo{};
-    rt_imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-    rt_imageInfo.imageView = rt_result.textureImageView;
-    rt_imageInfo.sampler = rt_result.textureSampler;
+        VkDescriptorSetAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = descriptor_pool_;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &deferred_.descriptorSetLayout;
 
-    VkWriteDescriptorSet binding7WriteSet{};
-    binding7WriteSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    binding7WriteSet.dstSet = deferred_.descriptorSet;
-    binding7WriteSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    binding7WriteSet.dstBinding = 7;
-    binding7WriteSet.pImageInfo = &rt_imageInfo;
-    binding7WriteSet.descriptorCount = 1;
-    // end =====================================
+        if (vkAllocateDescriptorSets(device_, &allocInfo, &descriptorSet)
+            != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate deferred_.descriptorSet!");
+        }
 
-    // update this descriptorSet
-    std::vector<VkWriteDescriptorSet> write_sets = {
-        // binding 0: deferred uniform buffer
-        apputil::createBufferWriteDescriptorSet(
-            deferred_.descriptorSet,
-            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-            0,
-            &deferred_.uniformBufferAndContent.uniformBuffer
-            .descriptorBufferInfo,
-            1),
-        // binding 1: world position
-        apputil::createImageWriteDescriptorSet(
-            deferred_.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            1,
-            &offscreen_.frameBufferAssets.position.descriptorImageInfo,
-            1),
-        // binding 2: world normal
-        apputil::createImageWriteDescriptorSet(
-            deferred_.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            2,
-            &offscreen_.frameBufferAssets.normal.descriptorImageInfo,
-            1),
-        // binding 3: color
-        apputil::createImageWriteDescriptorSet(
-            deferred_.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            3,
-            &offscreen_.frameBufferAssets.color.descriptorImageInfo,
-            1),
-        // binding 4: mrao
-        apputil::createImageWriteDescriptorSet(
-            deferred_.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            4,
-            &offscreen_.frameBufferAssets.mrao.descriptorImageInfo,
-            1),
-        // binding 5: cube map
-        apputil::createImageWriteDescriptorSet(
-            deferred_.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            5,
-            &skybox_.skyBoxCube.cubemap.textureInfo.texture.descriptorImageInfo,
-            1),
-        // binding 6: brdfLUT
-        apputil::createImageWriteDescriptorSet(
-            deferred_.descriptorSet,
-            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            6,
-            &deferred_.pbrTextures.brdfLUT.texture.descriptorImageInfo,
-            1),
-        // binding 7: ray tracing result
-        binding7WriteSet
-    };
+        // binding 7 start =====================================
+        VkDescriptorImageInfo rt_imageInfo{};
+        rt_imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        rt_imageInfo.imageView = rt_results[frame].textureImageView;
+        rt_imageInfo.sampler = rt_results[frame].textureSampler;
+
+        VkWriteDescriptorSet binding7WriteSet{};
+        binding7WriteSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        binding7WriteSet.dstSet = descriptorSet;
+        binding7WriteSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        binding7WriteSet.dstBinding = 7;
+        binding7WriteSet.pImageInfo = &rt_imageInfo;
+        binding7WriteSet.descriptorCount = 1;
+        // end =====================================
+
+        VkDescriptorBufferInfo deferred_buffer_info =
+            uniformRingDescriptor(sizeof(AppDeferredUniformBufferContent));
+
+        // update this descriptorSet
+        std::vector<VkWriteDescriptorSet> write_sets = {
+            // binding 0: deferred uniform buffer
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                0,
+                &deferred_buffer_info,
+                1),
+            // binding 1: world position
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                1,
+                &offscreen_.frameBufferAssets[frame].position.descriptorImageInfo,
+                1),
+            // binding 2: world normal
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                2,
+                &offscreen_.frameBufferAssets[frame].normal.descriptorImageInfo,
+                1),
+            // binding 3: color
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                3,
+                &offscreen_.frameBufferAssets[frame].color.descriptorImageInfo,
+                1),
+            // binding 4: mrao
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                4,
+                &offscreen_.frameBufferAssets[frame].mrao.descriptorImageInfo,
+                1),
+            // binding 5: cube map
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                5,
+                &skybox_.skyBoxCube.cubemap.textureInfo.texture.descriptorImageInfo,
+                1),
+            // binding 6: brdfLUT
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                6,
+                &deferred_.pbrTextures.brdfLUT.texture.descriptorImageInfo,
+                1),
+            // binding 7: ray tracing result
+            binding7WriteSet
+        };
 
-    vkUpdateDescriptorSets(device_, static_cast<uint32_t>(write_sets.size()),
-        write_sets.data(), 0, NULL);
+        vkUpdateDescriptorSets(device_, static_cast<uint32_t>(write_sets.size()),
+            write_sets.data(), 0, NULL);
+    }
 }
 
 void VulkanApp::createDeferredPipelineLayout() {
@@ -4113,7 +4730,9 @@ void VulkanApp::createDeferredRenderPass() {
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    colorAttachment.finalLayout = headless_.enabled
+        ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+        : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentDescription depthAttachment = {};
     depthAttachment.format = findDepthFormat();
@@ -4150,15 +4769,21 @@ void VulkanApp::createDeferredRenderPass() {
     // Subpass dependencies for layout transitions
     std::array<VkSubpassDependency, 2> dependencies;
 
+    // depth_attachment_ is shared by all frames in flight, so the previous
+    // frame's depth writes have to finish before this one clears it
     dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
     dependencies[0].dstSubpass = 0;
-    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+        | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
     dependencies[0].dstStageMask =
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+        | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT
+        | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
     dependencies[0].dstAccessMask =
         VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
-        | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+        | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
     dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
     dependencies[1].srcSubpass = 0;
@@ -4171,6 +4796,12 @@ void VulkanApp::createDeferredRenderPass() {
         | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
     dependencies[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
     dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    if (headless_.enabled) {
+        // the color target is copied to the readback buffer afterwards
+        dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        dependencies[1].dependencyFlags = 0;
+    }
 
     std::array<VkAttachmentDescription, 2> attachments = {
         colorAttachment, depthAttachment
@@ -4291,8 +4922,6 @@ void VulkanApp::createDeferredPipeline() {
 }
 
 void VulkanApp::createDeferredCommandBuffer() {
-    deferred_command_buffers_.resize(swapchain_images_.size());
-
     VkCommandBufferAllocateInfo allocInfo = {};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.commandPool = command_pool_;
@@ -4305,72 +4934,89 @@ void VulkanApp::createDeferredCommandBuffer() {
         throw std::runtime_error(
             "failed to allocate deferred_command_buffer_s!");
     }
+}
 
-    for (size_t i = 0; i < deferred_command_buffers_.size(); i++) {
-        VkCommandBufferBeginInfo beginInfo = apputil::cmdBufferBegin(
-            VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
-
-        if (vkBeginCommandBuffer(deferred_command_buffers_[i], &beginInfo)
-            != VK_SUCCESS) {
-
-            throw std::runtime_error(
-                "failed to begin recording deferred_command_buffer_s!");
-        }
-
-        VkRenderPassBeginInfo renderPassInfo = {};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = deferred_.renderPass;;
-        renderPassInfo.framebuffer = swapchain_framebuffers_[i];
-        renderPassInfo.renderArea.offset = { 0, 0 };
-        renderPassInfo.renderArea.extent = swapchain_extent_;
-
-        std::array<VkClearValue, 2> clearValues = {};
-        clearValues[0].color = { 0.3f, 0.0f, 0.3f, 1.0f };
-        clearValues[1].depthStencil = { 1.0f, 0 };
-
-        renderPassInfo.clearValueCount =
-            static_cast<uint32_t>(clearValues.size());
-        renderPassInfo.pClearValues = clearValues.data();
-
-        vkCmdBeginRenderPass(deferred_command_buffers_[i], &renderPassInfo,
-            VK_SUBPASS_CONTENTS_INLINE);
+void VulkanApp::recordDeferredCommandBuffer(int frame, uint32_t imageIndex) {
+    VkCommandBuffer commandBuffer = deferred_command_buffers_[frame];
 
-        VkViewport viewport{};
-        viewport.width = swapchain_extent_.width;
-        viewport.height = swapchain_extent_.height;
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
-        vkCmdSetViewport(deferred_command_buffers_[i], 0, 1, &viewport);
+    VkCommandBufferBeginInfo beginInfo = apputil::cmdBufferBegin(
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 
-        VkRect2D scissor{};
-        scissor.extent.width = swapchain_extent_.width;
-        scissor.extent.height = swapchain_extent_.height;
-        scissor.offset.x = 0.0f;
-        scissor.offset.y = 1.0f;
-        vkCmdSetScissor(deferred_command_buffers_[i], 0, 1, &scissor);
-
-        // VkBuffer vertexBuffers[] = { quadVertexBuffer };
-        VkDeviceSize offsets[1] = { 0 };
-
-        vkCmdBindDescriptorSets(deferred_command_buffers_[i],
-            VK_PIPELINE_BIND_POINT_GRAPHICS,
-            deferred_.pipelineLayout, 0, 1,
-            &deferred_.descriptorSet, 0, nullptr);
-
-        vkCmdBindPipeline(deferred_command_buffers_[i],
-            VK_PIPELINE_BIND_POINT_GRAPHICS, deferred_.pipeline);
-        vkCmdBindVertexBuffers(deferred_command_buffers_[i], 0, 1,
-            &quadVertexBuffer, offsets);
-        vkCmdBindIndexBuffer(deferred_command_buffers_[i], quadIndexBuffer, 0,
-            VK_INDEX_TYPE_UINT32);
-        vkCmdDrawIndexed(deferred_command_buffers_[i], static_cast<uint32_t>(6),
-            1, 0, 0, 1);
-        vkCmdEndRenderPass(deferred_command_buffers_[i]);
-
-        if (vkEndCommandBuffer(deferred_command_buffers_[i]) != VK_SUCCESS) {
-            throw std::runtime_error(
-                "failed to end deferred_command_buffer_s!");
-        }
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error(
+            "failed to begin recording deferred_command_buffer_s!");
+    }
+
+    // handed back by the rt pass on the compute queue
+    if (async_compute_) {
+        uint32_t graphicsFamily = queue_families_.graphicsFamily.value();
+        uint32_t computeFamily = queue_families_.computeFamily.value();
+        recordImageOwnershipTransfer(commandBuffer,
+            { rt_results[frame].textureImage },
+            VK_IMAGE_LAYOUT_GENERAL, computeFamily, graphicsFamily, false,
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+        recordImageOwnershipTransfer(commandBuffer,
+            { offscreen_.frameBufferAssets[frame].position.image,
+              offscreen_.frameBufferAssets[frame].normal.image },
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            computeFamily, graphicsFamily, false,
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+    }
+
+    VkRenderPassBeginInfo renderPassInfo = {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = deferred_.renderPass;;
+    renderPassInfo.framebuffer = swapchain_framebuffers_[imageIndex];
+    renderPassInfo.renderArea.offset = { 0, 0 };
+    renderPassInfo.renderArea.extent = swapchain_extent_;
+
+    std::array<VkClearValue, 2> clearValues = {};
+    clearValues[0].color = { 0.3f, 0.0f, 0.3f, 1.0f };
+    clearValues[1].depthStencil = { 1.0f, 0 };
+
+    renderPassInfo.clearValueCount =
+        static_cast<uint32_t>(clearValues.size());
+    renderPassInfo.pClearValues = clearValues.data();
+
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+        VK_SUBPASS_CONTENTS_INLINE);
+
+    VkViewport viewport{};
+    viewport.width = swapchain_extent_.width;
+    viewport.height = swapchain_extent_.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+    VkRect2D scissor{};
+    scissor.extent.width = swapchain_extent_.width;
+    scissor.extent.height = swapchain_extent_.height;
+    scissor.offset.x = 0.0f;
+    scissor.offset.y = 1.0f;
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    // VkBuffer vertexBuffers[] = { quadVertexBuffer };
+    VkDeviceSize offsets[1] = { 0 };
+
+    vkCmdBindDescriptorSets(commandBuffer,
+        VK_PIPELINE_BIND_POINT_GRAPHICS,
+        deferred_.pipelineLayout, 0, 1,
+        &deferred_.descriptorSets[frame], 1,
+        &deferred_.uniformBufferAndContent.dynamicOffset);
+
+    vkCmdBindPipeline(commandBuffer,
+        VK_PIPELINE_BIND_POINT_GRAPHICS, deferred_.pipeline);
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1,
+        &quadVertexBuffer, offsets);
+    vkCmdBindIndexBuffer(commandBuffer, quadIndexBuffer, 0,
+        VK_INDEX_TYPE_UINT32);
+    vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(6),
+        1, 0, 0, 1);
+    vkCmdEndRenderPass(commandBuffer);
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error(
+            "failed to end deferred_command_buffer_s!");
     }
 }
 
@@ -4380,23 +5026,32 @@ void VulkanApp::draw() {
     uint32_t imageIndex;
     VkResult result = vkAcquireNextImageKHR(device_, swapchain_,
         std::numeric_limits<uint64_t>::max(),
-        semaphores_.presentComplete,
+        semaphores_.presentComplete[current_frame_],
         VK_NULL_HANDLE, &imageIndex);
+    // suboptimal still acquired the image and signals the semaphore. out
+    // of date can't be recovered from, the swapchain is never recreated
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+        throw std::runtime_error("failed to acquire swap chain image!");
+    }
 
-    // submit offscreen
-    VkPipelineStageFlags waitStages[] = {
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-    };
+    // the uniform offsets change every frame, so record against them now
+    recordOffscreenCommandBuffer(current_frame_);
+    rt_recordComputeCommandBuffer(current_frame_);
+    recordDeferredCommandBuffer(current_frame_, imageIndex);
 
-    VkSemaphore waitSemaphores[] = { semaphores_.presentComplete };
-    VkSemaphore signalSemaphores[] = { offscreen_complete_semaphore_};
-    mySubmitInfo.pWaitDstStageMask = waitStages;
-    mySubmitInfo.waitSemaphoreCount = 1;
-    mySubmitInfo.pWaitSemaphores = waitSemaphores;
+    // submit offscreen
+    // the g buffer of this frame is only touched by this frame, so there is
+    // nothing to wait for until the deferred pass writes the swapchain image,
+    // except the texture levels streamed in this frame
+    VkPipelineStageFlags streamWaitStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    mySubmitInfo.pWaitDstStageMask = &streamWaitStage;
+    mySubmitInfo.waitSemaphoreCount = stream_upload_submitted_ ? 1 : 0;
+    mySubmitInfo.pWaitSemaphores = &stream_upload_semaphore_;
+    stream_upload_submitted_ = false;
     mySubmitInfo.signalSemaphoreCount = 1;
-    mySubmitInfo.pSignalSemaphores = signalSemaphores;
+    mySubmitInfo.pSignalSemaphores = &offscreen_complete_semaphores_[current_frame_];
     mySubmitInfo.commandBufferCount = 1;
-    mySubmitInfo.pCommandBuffers = &offscreen_.commandBuffer;
+    mySubmitInfo.pCommandBuffers = &offscreen_.commandBuffers[current_frame_];
     
     if (vkQueueSubmit(queue_, 1, &mySubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
     {
@@ -4404,35 +5059,57 @@ void VulkanApp::draw() {
     }
 
     // submit rt compute
+    VkPipelineStageFlags computeWaitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    mySubmitInfo.pWaitDstStageMask = &computeWaitStage;
     mySubmitInfo.waitSemaphoreCount = 1;
-    mySubmitInfo.pWaitSemaphores = &offscreen_complete_semaphore_;
+    mySubmitInfo.pWaitSemaphores = &offscreen_complete_semaphores_[current_frame_];
     mySubmitInfo.signalSemaphoreCount = 1;
-    mySubmitInfo.pSignalSemaphores = &rt_complete_sema;
+    mySubmitInfo.pSignalSemaphores = &rt_complete_semas[current_frame_];
     mySubmitInfo.commandBufferCount = 1;
-    mySubmitInfo.pCommandBuffers = &compute_.rt_computeCmdBuffer;
-    if (vkQueueSubmit(queue_, 1, &mySubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+    mySubmitInfo.pCommandBuffers = &compute_.rt_computeCmdBuffers[current_frame_];
+    if (vkQueueSubmit(compute_.rt_computeQueue, 1, &mySubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
     {
         throw std::runtime_error("failed to submit compute_.rt_computeCmdBuffer");
     }
 
     // submit deferred
-    mySubmitInfo.waitSemaphoreCount = 1;
-    mySubmitInfo.pWaitSemaphores = &rt_complete_sema;
+    VkPipelineStageFlags deferredWaitStages[] = {
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+    };
+    VkSemaphore deferredWaitSemaphores[] = {
+        rt_complete_semas[current_frame_],
+        semaphores_.presentComplete[current_frame_]
+    };
+    mySubmitInfo.pWaitDstStageMask = deferredWaitStages;
+    mySubmitInfo.waitSemaphoreCount = 2;
+    mySubmitInfo.pWaitSemaphores = deferredWaitSemaphores;
     mySubmitInfo.signalSemaphoreCount = 1;
-    mySubmitInfo.pSignalSemaphores = &semaphores_.renderComplete;
+    mySubmitInfo.pSignalSemaphores = &semaphores_.renderComplete[current_frame_];
     mySubmitInfo.commandBufferCount = 1;
-    mySubmitInfo.pCommandBuffers = &deferred_command_buffers_[imageIndex];
-    if (vkQueueSubmit(queue_, 1, &mySubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+    mySubmitInfo.pCommandBuffers = &deferred_command_buffers_[current_frame_];
+
+    // the last submit of the frame signals its fence, mainLoop waits on it
+    // before touching this frame's resources again
+    vkResetFences(device_, 1, &waitFences[current_frame_]);
+    if (vkQueueSubmit(queue_, 1, &mySubmitInfo, waitFences[current_frame_]) != VK_SUCCESS)
     {
         throw std::runtime_error("failed to submit deferred commmand buf");
     }
 
-    VkResult res = queuePresent(queue_, imageIndex, semaphores_.renderComplete);
-    vkQueueWaitIdle(queue_);
+    result = queuePresent(queue_, imageIndex,
+        semaphores_.renderComplete[current_frame_]);
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+        throw std::runtime_error("failed to present swap chain image!");
+    }
+
+    current_frame_ = (current_frame_ + 1) % MAX_FRAMES_IN_FLIGHT;
 }
 
 void VulkanApp::updateUniformBuffers() {
-    float time = GET_CLOBAL_TIME_GAP_SINCE_START();
+    float time = headless_.enabled
+        ? headless_frame_ * headless_.timeStep
+        : GET_CLOBAL_TIME_GAP_SINCE_START();
 
     // offscreen camera
     auto& ocs_ubo = offscreen_.uniformBufferAndContent.content;
@@ -4440,59 +5117,38 @@ void VulkanApp::updateUniformBuffers() {
     ocs_ubo.projMatrix = firstPersonCam->GetProj();
     ocs_ubo.viewMatrix = firstPersonCam->GetView();
 
-    uniformBufferCpy(
-        offscreen_.uniformBufferAndContent.uniformBuffer.deviceMemory, 
-        &ocs_ubo, sizeof(ocs_ubo));   
+    offscreen_.uniformBufferAndContent.dynamicOffset =
+        uniformRingPush(&ocs_ubo, sizeof(ocs_ubo));
 
     // scene object positions
-    auto& ground_ubo = scene_objects_[0].uniformBufferAndContent;
-    uniformBufferCpy(
-        ground_ubo.uniformBuffer.deviceMemory,
-        &ground_ubo.content, sizeof(ground_ubo.content));
 #ifdef SHOW_SHADOW_SCENE
     glm::mat4 modelMat;
     modelMat = glm::scale(glm::vec3(4.0f, 4.0f, 4.0f));
     modelMat = glm::translate(glm::vec3(0.f, 1.f, 0.f)) * modelMat;
-    auto& box_ubo = scene_objects_[1].uniformBufferAndContent;
-    box_ubo.content.modelMatrix = modelMat;
-    uniformBufferCpy(
-        box_ubo.uniformBuffer.deviceMemory,
-        &box_ubo.content, sizeof(box_ubo.content));
-
-    //auto& box2_ubo = scene_objects_[2].uniformBufferAndContent;
-    //uniformBufferCpy(
-    //    box2_ubo.uniformBuffer.deviceMemory,
-    //    &box2_ubo.content, sizeof(box2_ubo.content));
-
-    //auto& box3_ubo = scene_objects_[3].uniformBufferAndContent;
-    //uniformBufferCpy(
-    //    box3_ubo.uniformBuffer.deviceMemory,
-    //    &box3_ubo.content, sizeof(box3_ubo.content));
-#else
-    auto& sphere1_ubo = scene_objects_[1].uniformBufferAndContent;
-    uniformBufferCpy(
-        sphere1_ubo.uniformBuffer.deviceMemory,
-        &sphere1_ubo.content, sizeof(sphere1_ubo.content));
-
-    auto& sphere2_ubo = scene_objects_[2].uniformBufferAndContent;
-    uniformBufferCpy(
-        sphere2_ubo.uniformBuffer.deviceMemory,
-        &sphere2_ubo.content, sizeof(sphere2_ubo.content));
-
-    auto& sphere3_ubo = scene_objects_[3].uniformBufferAndContent;
-    uniformBufferCpy(
-        sphere3_ubo.uniformBuffer.deviceMemory,
-        &sphere3_ubo.content, sizeof(sphere3_ubo.content));
-
-    auto& sphere4_ubo = scene_objects_[4].uniformBufferAndContent;
-    uniformBufferCpy(
-        sphere4_ubo.uniformBuffer.deviceMemory,
-        &sphere4_ubo.content, sizeof(sphere4_ubo.content));
+    scene_objects_[1].modelMatrix = modelMat;
 #endif // SHOW_SHADOW_SCENE
 
-    
-        
-    
+    cullSceneObjects();
+    writeInstanceData();
+
+    // gpu culling, same matrices as the g buffer pass
+    auto& cull_ubo = cull_.uniformBufferAndContent;
+    cull_ubo.content.viewProj = ocs_ubo.projMatrix * ocs_ubo.viewMatrix;
+    // the first pyramid is cleared to the far plane, any matrix will do
+    cull_ubo.content.prevViewProj = cull_.hasPrevViewProj
+        ? cull_.prevViewProj : cull_ubo.content.viewProj;
+    cull_.prevViewProj = cull_ubo.content.viewProj;
+    cull_.hasPrevViewProj = true;
+    cull_ubo.content.viewportSize = glm::vec2(swapchain_extent_.width,
+        swapchain_extent_.height);
+    cull_ubo.content.hizSize = glm::vec2(cull_.hiz.width, cull_.hiz.height);
+    cull_ubo.content.instanceCount = instance_count_;
+    cull_ubo.content.drawCount = static_cast<uint32_t>(draw_groups_.size());
+    cull_ubo.content.hizLevels = cull_.hiz.levels;
+    cull_ubo.content.maxDepth = OFFSCREEN_MODEL_MAX_DEPTH;
+
+    cull_ubo.dynamicOffset =
+        uniformRingPush(&cull_ubo.content, sizeof(cull_ubo.content));
 
     // skybox
     auto& skybox_ubo = skybox_.uniformBufferAndContent;
@@ -4501,9 +5157,8 @@ void VulkanApp::updateUniformBuffers() {
     skybox_ubo.content.projMatrix = firstPersonCam->GetProj();
     skybox_ubo.content.viewMatrix = firstPersonCam->GetView();
 
-    uniformBufferCpy(
-        skybox_ubo.uniformBuffer.deviceMemory,
-        &skybox_ubo.content, sizeof(skybox_ubo.content));
+    skybox_ubo.dynamicOffset =
+        uniformRingPush(&skybox_ubo.content, sizeof(skybox_ubo.content));
 
     // deferred
     auto& deferred_ubo = deferred_.uniformBufferAndContent;
@@ -4516,23 +5171,14 @@ void VulkanApp::updateUniformBuffers() {
 
     deferred_ubo.content.lightPos = lightPos;
 
-    uniformBufferCpy(
-        deferred_ubo.uniformBuffer.deviceMemory,
-        &deferred_ubo.content, sizeof(deferred_ubo.content));
+    deferred_ubo.dynamicOffset =
+        uniformRingPush(&deferred_ubo.content, sizeof(deferred_ubo.content));
 
     // ray trace
     
 }
 
 // helper
-void VulkanApp::uniformBufferCpy(VkDeviceMemory& device_memory, void* ubo_ptr,
-    size_t size) {
-    void* data;
-    vkMapMemory(device_, device_memory, 0, size, 0, &data);
-    memcpy(data, ubo_ptr, size);
-    vkUnmapMemory(device_, device_memory);
-}
-
 glm::mat4 VulkanApp::getSkyboxModelMat() {
     // skybox cam
     glm::mat4 modelMat = glm::mat4(1.0f);
@@ -4555,54 +5201,1217 @@ void VulkanApp::showFPS() {
         float time = globalTime - fps_last_time_;
         fps_last_time_ = globalTime;
         std::cout << "FPS: " << float(fps_display_cycle_) / time << std::endl;
+        std::cout << "objects: " << visible_instance_count_ << " of "
+            << instance_objects_.size() << " in view" << std::endl;
+        if (texture_streaming_) {
+            std::cout << "textures: "
+                << texture_resident_bytes_ / (1024 * 1024) << " of "
+                << TEXTURE_BUDGET / (1024 * 1024) << " MB resident"
+                << std::endl;
+        }
+    }
+}
+
+
+// instancing =================================================
+void VulkanApp::buildDrawGroups() {
+    // objects using the same three textures share a material, every
+    // texture gets one slot of the array
+    std::map<std::array<AppTexture*, 3>, uint32_t> materialLookup;
+    std::map<AppTexture*, uint32_t> textureSlots;
+    auto textureSlot = [&](AppTexture* texture) {
+        auto inserted = textureSlots.emplace(texture,
+            static_cast<uint32_t>(material_textures_.size()));
+        if (inserted.second) {
+            material_textures_.push_back(texture);
+        }
+        return inserted.first->second;
+    };
+    materials_.clear();
+    material_textures_.clear();
+    for (auto& scene_object : scene_objects_) {
+        std::array<AppTexture*, 3> key = { scene_object.albedo.texture,
+            scene_object.normal.texture, scene_object.mrao.texture };
+        auto inserted = materialLookup.emplace(key,
+            static_cast<uint32_t>(materials_.size()));
+        if (inserted.second) {
+            AppMaterial material{};
+            material.albedo = key[0];
+            material.normal = key[1];
+            material.mrao = key[2];
+            material.data.albedo = textureSlot(key[0]);
+            material.data.normal = textureSlot(key[1]);
+            material.data.mrao = textureSlot(key[2]);
+            materials_.push_back(material);
+        }
+        scene_object.materialIndex = inserted.first->second;
+    }
+
+    if (material_textures_.size() > material_texture_capacity_) {
+        throw std::runtime_error(
+            "failed to build material table, more textures than the device can bind");
+    }
+
+    if (scene_objects_.size() > MAX_SCENE_INSTANCES) {
+        throw std::runtime_error(
+            "failed to build draw groups, more than MAX_SCENE_INSTANCES objects");
+    }
+
+    instance_objects_.resize(scene_objects_.size());
+    for (uint32_t i = 0; i < instance_objects_.size(); ++i) {
+        instance_objects_[i] = i;
+    }
+#ifdef GPU_INSTANCING
+    // neighbours in the instance buffer share a mesh, the material comes
+    // from the instance
+    std::stable_sort(instance_objects_.begin(), instance_objects_.end(),
+        [this](uint32_t a, uint32_t b) {
+        return std::less<AppMesh*>()(scene_objects_[a].mesh,
+            scene_objects_[b].mesh);
+    });
+#endif
+
+    draw_groups_.clear();
+    for (uint32_t i = 0; i < instance_objects_.size(); ++i) {
+        AppSceneObject& scene_object = scene_objects_[instance_objects_[i]];
+        bool newGroup = draw_groups_.empty()
+            || draw_groups_.back().mesh != scene_object.mesh;
+#ifndef GPU_INSTANCING
+        newGroup = true;
+#endif
+        if (newGroup) {
+            AppDrawGroup group{};
+            group.mesh = scene_object.mesh;
+            group.firstInstance = i;
+            draw_groups_.push_back(group);
+        }
+        draw_groups_.back().instanceCount++;
+        scene_object.drawIndex =
+            static_cast<uint32_t>(draw_groups_.size() - 1);
+    }
+    instance_bounds_.resize(instance_objects_.size());
+    visible_instances_.resize(instance_objects_.size());
+
+    // contiguous ranges of draw groups, one secondary command buffer each
+    uint32_t groupCount = static_cast<uint32_t>(draw_groups_.size());
+    uint32_t chunkCount = std::min({ job_system_.concurrency(),
+        MAX_RECORD_CHUNKS, groupCount });
+    record_chunks_.clear();
+    for (uint32_t chunk = 0; chunk < chunkCount; ++chunk) {
+        uint32_t begin = groupCount * chunk / chunkCount;
+        uint32_t end = groupCount * (chunk + 1) / chunkCount;
+        record_chunks_.push_back({ begin, end - begin });
+    }
+
+    std::cout << scene_objects_.size() << " scene objects, "
+        << materials_.size() << " materials, " << material_textures_.size()
+        << " textures, " << draw_groups_.size() << " draws" << std::endl;
+}
+
+void VulkanApp::createMaterialTable() {
+    std::vector<AppMaterialData> data(materials_.size());
+    for (size_t i = 0; i < materials_.size(); ++i) {
+        data[i] = materials_[i].data;
+    }
+    VkDeviceSize size = sizeof(AppMaterialData) * data.size();
+    createBuffer(size,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        material_buffer_, material_buffer_memory_);
+    upload_batch_.copyToBuffer(material_buffer_, data.data(), size,
+        queue_families_.graphicsFamily.value());
+
+    std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT,
+        offscreen_.descriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptor_pool_;
+    allocInfo.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+    allocInfo.pSetLayouts = layouts.data();
+
+    if (vkAllocateDescriptorSets(device_, &allocInfo,
+        material_table_sets_.data()) != VK_SUCCESS)
+    {
+        throw std::runtime_error(
+            "failed to allocate material_table_sets_");
+    }
+
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        updateMaterialTableSet(frame);
+    }
+    material_table_dirty_frames_ = 0;
+}
+
+void VulkanApp::updateMaterialTableSet(int frame) {
+    VkDescriptorSet descriptorSet = material_table_sets_[frame];
+
+    // camera ubo lives in uniform_ring_, the instance buffer holds one
+    // slice per frame in flight, offsets of both are given at bind time
+    VkDescriptorBufferInfo camera_buffer_info =
+        uniformRingDescriptor(sizeof(AppOffscreenUniformBufferContent));
+    VkDescriptorBufferInfo instance_buffer_info{};
+    instance_buffer_info.buffer = instance_buffer_;
+    instance_buffer_info.offset = 0;
+    instance_buffer_info.range = sizeof(AppInstanceData) * MAX_SCENE_INSTANCES;
+    VkDescriptorBufferInfo material_buffer_info{};
+    material_buffer_info.buffer = material_buffer_;
+    material_buffer_info.offset = 0;
+    material_buffer_info.range = VK_WHOLE_SIZE;
+
+    VkDescriptorBufferInfo visible_buffer_info{};
+    visible_buffer_info.buffer = cull_.visibleBuffers[frame];
+    visible_buffer_info.offset = 0;
+    visible_buffer_info.range = VK_WHOLE_SIZE;
+
+    std::vector<VkDescriptorImageInfo> texture_infos;
+    texture_infos.reserve(material_textures_.size());
+    for (const AppTexture* texture : material_textures_) {
+        texture_infos.push_back(texture->descriptorImageInfo);
+    }
+
+    std::vector<VkWriteDescriptorSet> write_sets = {
+        // binding 0: offscreen uniformBuffer
+        apputil::createBufferWriteDescriptorSet(
+            descriptorSet,
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            0,
+            &camera_buffer_info,
+            1),
+        // binding 1: instance data
+        apputil::createBufferWriteDescriptorSet(
+            descriptorSet,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            1,
+            &instance_buffer_info,
+            1),
+        // binding 2: material table
+        apputil::createBufferWriteDescriptorSet(
+            descriptorSet,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            2,
+            &material_buffer_info,
+            1),
+        // binding 3: texture array, slots from buildDrawGroups
+        apputil::createImageWriteDescriptorSet(
+            descriptorSet,
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            3,
+            texture_infos.data(),
+            static_cast<uint32_t>(texture_infos.size())),
+        // binding 4: this frame's visible instance list
+        apputil::createBufferWriteDescriptorSet(
+            descriptorSet,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            4,
+            &visible_buffer_info,
+            1),
+    };
+
+    vkUpdateDescriptorSets(device_, static_cast<uint32_t>(write_sets.size()),
+        write_sets.data(), 0, NULL);
+}
+
+void VulkanApp::cleanupMaterialTable() {
+    vkDestroyBuffer(device_, material_buffer_, nullptr);
+    memory_allocator_.free(material_buffer_memory_);
+}
+
+void VulkanApp::createInstanceBuffer() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device_, &properties);
+    VkDeviceSize alignment = properties.limits.minStorageBufferOffsetAlignment;
+
+    // one slice per frame in flight, like uniform_ring_
+    instance_slice_size_ = sizeof(AppInstanceData) * MAX_SCENE_INSTANCES;
+    instance_slice_size_ =
+        (instance_slice_size_ + alignment - 1) & ~(alignment - 1);
+    createBuffer(instance_slice_size_ * MAX_FRAMES_IN_FLIGHT,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        instance_buffer_, instance_buffer_memory_);
+    instance_dynamic_offset_ = 0;
+}
+
+void VulkanApp::writeInstanceData() {
+    // called after the fence of current_frame_ has signaled
+    instance_dynamic_offset_ =
+        static_cast<uint32_t>(instance_slice_size_ * current_frame_);
+    AppInstanceData* instances = reinterpret_cast<AppInstanceData*>(
+        static_cast<unsigned char*>(instance_buffer_memory_.mapped)
+        + instance_dynamic_offset_);
+
+    // the visible list is ascending, so instances stay grouped by draw and
+    // every group fits its range of the gpu visible list
+    instance_count_ = cpu_culling_ ? visible_instance_count_
+        : static_cast<uint32_t>(instance_objects_.size());
+    for (uint32_t i = 0; i < instance_count_; ++i) {
+        uint32_t instance = cpu_culling_ ? visible_instances_[i] : i;
+        const AppSceneObject& scene_object =
+            scene_objects_[instance_objects_[instance]];
+        instances[i].modelMatrix = scene_object.modelMatrix;
+        instances[i].materialIndex = scene_object.materialIndex;
+        instances[i].drawIndex = scene_object.drawIndex;
+    }
+}
+
+void VulkanApp::cleanupInstanceBuffer() {
+    vkDestroyBuffer(device_, instance_buffer_, nullptr);
+    memory_allocator_.free(instance_buffer_memory_);
+}
+
+// cpu culling =================================================
+void VulkanApp::cullSceneObjects() {
+    // models may move every frame, so the bounds follow
+    for (uint32_t i = 0; i < instance_objects_.size(); ++i) {
+        AppSceneObject& scene_object = scene_objects_[instance_objects_[i]];
+        frustumcull::transformBox(scene_object.modelMatrix,
+            scene_object.mesh->aabbMin, scene_object.mesh->aabbMax,
+            scene_object.aabbMin, scene_object.aabbMax);
+        instance_bounds_.set(i, scene_object.aabbMin, scene_object.aabbMax);
+    }
+
+    // same matrices as the g buffer pass
+    const auto& camera = offscreen_.uniformBufferAndContent.content;
+    frustumcull::Frustum frustum =
+        frustumcull::fromViewProj(camera.projMatrix * camera.viewMatrix);
+    visible_instance_count_ = static_cast<uint32_t>(frustumcull::cull(
+        frustum, instance_bounds_, visible_instances_.data()));
+}
+
+// gpu culling =================================================
+void VulkanApp::prepareGpuCulling() {
+    // needs the draw groups, the meshes in the geometry pool and the g
+    // buffer depth
+    createCullDescriptorSetLayout();
+    createCullBuffers();
+    createHiZ();
+    createCullDescriptorSets();
+    createCullPipelines();
+}
+
+void VulkanApp::createCullDescriptorSetLayout() {
+    std::vector<VkDescriptorSetLayoutBinding> bindings = {
+        // binding 0: camera and counts
+        apputil::createDescriptorSetLayoutBinding(
+            0,
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 1: instance data, same slice as the g buffer pass
+        apputil::createDescriptorSetLayoutBinding(
+            1,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 2: draw groups
+        apputil::createDescriptorSetLayoutBinding(
+            2,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 3: indirect draws
+        apputil::createDescriptorSetLayoutBinding(
+            3,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 4: draw count and instance counts
+        apputil::createDescriptorSetLayoutBinding(
+            4,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 5: visible instance list
+        apputil::createDescriptorSetLayoutBinding(
+            5,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        // binding 6: hi-z pyramid
+        apputil::createDescriptorSetLayoutBinding(
+            6,
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT)
+    };
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+
+    if (vkCreateDescriptorSetLayout(device_, &layoutInfo, nullptr,
+        &cull_.descriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create cull_.descriptorSetLayout!");
+    }
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &cull_.descriptorSetLayout;
+
+    if (vkCreatePipelineLayout(device_, &pipelineLayoutInfo, nullptr,
+        &cull_.pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create cull_.pipelineLayout!");
+    }
+}
+
+void VulkanApp::createCullBuffers() {
+    // never zero sized, an empty scene just draws nothing
+    VkDeviceSize drawCount = std::max<size_t>(draw_groups_.size(), 1);
+    VkDeviceSize instanceCount = std::max<size_t>(instance_objects_.size(), 1);
+
+    std::vector<AppCullDrawData> draws(draw_groups_.size());
+    for (uint32_t chunk = 0; chunk < record_chunks_.size(); ++chunk) {
+        const AppRecordChunk& range = record_chunks_[chunk];
+        for (uint32_t i = range.firstDraw;
+            i < range.firstDraw + range.drawCount; ++i) {
+            const AppDrawGroup& group = draw_groups_[i];
+            draws[i].aabbMin = glm::vec4(group.mesh->aabbMin, 0.0f);
+            draws[i].aabbMax = glm::vec4(group.mesh->aabbMax, 0.0f);
+            draws[i].indexCount = group.mesh->indexCount;
+            draws[i].firstIndex = group.mesh->firstIndex;
+            draws[i].vertexOffset = group.mesh->vertexOffset;
+            draws[i].firstInstance = group.firstInstance;
+            draws[i].chunk = chunk;
+            draws[i].chunkFirstDraw = range.firstDraw;
+        }
+    }
+    createBuffer(sizeof(AppCullDrawData) * drawCount,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        cull_.drawBuffer, cull_.drawMemory);
+    if (!draws.empty()) {
+        upload_batch_.copyToBuffer(cull_.drawBuffer, draws.data(),
+            sizeof(AppCullDrawData) * draws.size(),
+            queue_families_.graphicsFamily.value());
+    }
+
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        createBuffer(sizeof(VkDrawIndexedIndirectCommand) * drawCount,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            cull_.indirectBuffers[frame], cull_.indirectMemories[frame]);
+        // reset with vkCmdFillBuffer before every cull
+        createBuffer(sizeof(uint32_t) * (MAX_RECORD_CHUNKS + drawCount),
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+            | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            cull_.countBuffers[frame], cull_.countMemories[frame]);
+        createBuffer(sizeof(uint32_t) * instanceCount,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            cull_.visibleBuffers[frame], cull_.visibleMemories[frame]);
+    }
+}
+
+void VulkanApp::createHiZ() {
+    AppHiZ& hiz = cull_.hiz;
+
+    // power of two at or below the screen size, a level 0 texel covers
+    // less than 2x2 depth texels and every later level halves exactly
+    auto floorPow2 = [](uint32_t value) {
+        uint32_t pow2 = 1;
+        while (pow2 * 2 <= value) {
+            pow2 *= 2;
+        }
+        return pow2;
+    };
+    hiz.width = floorPow2(swapchain_extent_.width);
+    hiz.height = floorPow2(swapchain_extent_.height);
+    hiz.levels = imageutil::mipLevelCount(hiz.width, hiz.height);
+
+    VkFormat format = VK_FORMAT_R32_SFLOAT;
+    createImage(hiz.width, hiz.height, format, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT
+        | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        hiz.image, hiz.deviceMemory, hiz.levels);
+    hiz.imageView = createImageView(hiz.image, format,
+        VK_IMAGE_ASPECT_COLOR_BIT, hiz.levels);
+
+    hiz.levelViews.resize(hiz.levels);
+    for (uint32_t level = 0; level < hiz.levels; ++level) {
+        VkImageViewCreateInfo viewInfo = {};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = hiz.image;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = format;
+        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        viewInfo.subresourceRange.baseMipLevel = level;
+        viewInfo.subresourceRange.levelCount = 1;
+        viewInfo.subresourceRange.baseArrayLayer = 0;
+        viewInfo.subresourceRange.layerCount = 1;
+        if (vkCreateImageView(device_, &viewInfo, nullptr,
+            &hiz.levelViews[level]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create hi-z level view!");
+        }
+    }
+
+    // texels are compared, never filtered
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_NEAREST;
+    samplerInfo.minFilter = VK_FILTER_NEAREST;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.maxAnisotropy = 1.0f;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = static_cast<float>(hiz.levels);
+    samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+    if (vkCreateSampler(device_, &samplerInfo, nullptr, &hiz.sampler)
+        != VK_SUCCESS) {
+        throw std::runtime_error("failed to create hi-z sampler!");
+    }
+
+    // cleared to the far plane, so nothing is occluded in the first frame.
+    // stays in GENERAL from then on
+    VkCommandBuffer commandBuffer =
+        upload_batch_.commandBuffer(queue_families_.graphicsFamily.value());
+    VkImageSubresourceRange range = {};
+    range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    range.levelCount = hiz.levels;
+    range.layerCount = 1;
+
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = hiz.image;
+    barrier.subresourceRange = range;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    VkClearColorValue farPlane = { { 1.0f, 0.0f, 0.0f, 0.0f } };
+    vkCmdClearColorImage(commandBuffer, hiz.image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &farPlane, 1, &range);
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    // binding 0: level above, binding 1: level written
+    std::vector<VkDescriptorSetLayoutBinding> bindings = {
+        apputil::createDescriptorSetLayoutBinding(
+            0,
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT),
+        apputil::createDescriptorSetLayoutBinding(
+            1,
+            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            1,
+            VK_SHADER_STAGE_COMPUTE_BIT)
+    };
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+
+    if (vkCreateDescriptorSetLayout(device_, &layoutInfo, nullptr,
+        &hiz.descriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create hiz.descriptorSetLayout!");
+    }
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &hiz.descriptorSetLayout;
+
+    if (vkCreatePipelineLayout(device_, &pipelineLayoutInfo, nullptr,
+        &hiz.pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create hiz.pipelineLayout!");
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.layout = hiz.pipelineLayout;
+    pipelineInfo.stage = loadShader("../../shaders/hiz.comp.spv",
+        VK_SHADER_STAGE_COMPUTE_BIT);
+
+    if (vkCreateComputePipelines(device_, pipelineCache, 1, &pipelineInfo,
+        nullptr, &hiz.pipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create hiz.pipeline!");
+    }
+
+    uint32_t setCount = hiz.levels * MAX_FRAMES_IN_FLIGHT;
+    std::vector<VkDescriptorSetLayout> layouts(setCount,
+        hiz.descriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptor_pool_;
+    allocInfo.descriptorSetCount = setCount;
+    allocInfo.pSetLayouts = layouts.data();
+
+    hiz.descriptorSets.resize(setCount);
+    if (vkAllocateDescriptorSets(device_, &allocInfo,
+        hiz.descriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate hiz.descriptorSets");
+    }
+
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        for (uint32_t level = 0; level < hiz.levels; ++level) {
+            VkDescriptorSet descriptorSet =
+                hiz.descriptorSets[frame * hiz.levels + level];
+
+            VkDescriptorImageInfo src_info{};
+            src_info.sampler = hiz.sampler;
+            if (level == 0) {
+                src_info.imageView =
+                    offscreen_.frameBufferAssets[frame].depth.imageView;
+                src_info.imageLayout =
+                    VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+            }
+            else {
+                src_info.imageView = hiz.levelViews[level - 1];
+                src_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            }
+            VkDescriptorImageInfo dst_info{};
+            dst_info.imageView = hiz.levelViews[level];
+            dst_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+            std::vector<VkWriteDescriptorSet> write_sets = {
+                apputil::createImageWriteDescriptorSet(
+                    descriptorSet,
+                    VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                    0,
+                    &src_info,
+                    1),
+                apputil::createImageWriteDescriptorSet(
+                    descriptorSet,
+                    VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                    1,
+                    &dst_info,
+                    1),
+            };
+            vkUpdateDescriptorSets(device_,
+                static_cast<uint32_t>(write_sets.size()), write_sets.data(),
+                0, NULL);
+        }
+    }
+}
+
+void VulkanApp::createCullDescriptorSets() {
+    std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT,
+        cull_.descriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptor_pool_;
+    allocInfo.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+    allocInfo.pSetLayouts = layouts.data();
+
+    if (vkAllocateDescriptorSets(device_, &allocInfo,
+        cull_.descriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate cull_.descriptorSets");
+    }
+
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        VkDescriptorSet descriptorSet = cull_.descriptorSets[frame];
+
+        // offsets of both dynamic buffers are given at bind time
+        VkDescriptorBufferInfo cull_buffer_info =
+            uniformRingDescriptor(sizeof(AppCullUniformBufferContent));
+        VkDescriptorBufferInfo instance_buffer_info{};
+        instance_buffer_info.buffer = instance_buffer_;
+        instance_buffer_info.offset = 0;
+        instance_buffer_info.range =
+            sizeof(AppInstanceData) * MAX_SCENE_INSTANCES;
+        VkDescriptorBufferInfo draw_buffer_info{};
+        draw_buffer_info.buffer = cull_.drawBuffer;
+        draw_buffer_info.range = VK_WHOLE_SIZE;
+        VkDescriptorBufferInfo indirect_buffer_info{};
+        indirect_buffer_info.buffer = cull_.indirectBuffers[frame];
+        indirect_buffer_info.range = VK_WHOLE_SIZE;
+        VkDescriptorBufferInfo count_buffer_info{};
+        count_buffer_info.buffer = cull_.countBuffers[frame];
+        count_buffer_info.range = VK_WHOLE_SIZE;
+        VkDescriptorBufferInfo visible_buffer_info{};
+        visible_buffer_info.buffer = cull_.visibleBuffers[frame];
+        visible_buffer_info.range = VK_WHOLE_SIZE;
+        VkDescriptorImageInfo hiz_info{};
+        hiz_info.sampler = cull_.hiz.sampler;
+        hiz_info.imageView = cull_.hiz.imageView;
+        hiz_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        std::vector<VkWriteDescriptorSet> write_sets = {
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                0,
+                &cull_buffer_info,
+                1),
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                1,
+                &instance_buffer_info,
+                1),
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                2,
+                &draw_buffer_info,
+                1),
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                3,
+                &indirect_buffer_info,
+                1),
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                4,
+                &count_buffer_info,
+                1),
+            apputil::createBufferWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                5,
+                &visible_buffer_info,
+                1),
+            apputil::createImageWriteDescriptorSet(
+                descriptorSet,
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                6,
+                &hiz_info,
+                1),
+        };
+        vkUpdateDescriptorSets(device_,
+            static_cast<uint32_t>(write_sets.size()), write_sets.data(),
+            0, NULL);
+    }
+}
+
+void VulkanApp::createCullPipelines() {
+    // PASS selects culling (0) or compaction (1) in shaders/cull.comp
+    VkSpecializationMapEntry passEntry = {};
+    passEntry.constantID = 0;
+    passEntry.offset = 0;
+    passEntry.size = sizeof(uint32_t);
+
+    VkPipeline* pipelines[] = { &cull_.cullPipeline, &cull_.compactPipeline };
+    for (uint32_t pass = 0; pass < 2; ++pass) {
+        VkSpecializationInfo specialization = {};
+        specialization.mapEntryCount = 1;
+        specialization.pMapEntries = &passEntry;
+        specialization.dataSize = sizeof(pass);
+        specialization.pData = &pass;
+
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout = cull_.pipelineLayout;
+        pipelineInfo.stage = loadShader("../../shaders/cull.comp.spv",
+            VK_SHADER_STAGE_COMPUTE_BIT);
+        pipelineInfo.stage.pSpecializationInfo = &specialization;
+
+        if (vkCreateComputePipelines(device_, pipelineCache, 1, &pipelineInfo,
+            nullptr, pipelines[pass]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create cull pipeline!");
+        }
+    }
+}
+
+void VulkanApp::recordCullCommands(VkCommandBuffer commandBuffer, int frame) {
+	// instances written for this frame, only the cpu culling survivors
+	// when it is on
+	uint32_t instanceCount = instance_count_;
+	uint32_t drawCount = static_cast<uint32_t>(draw_groups_.size());
+
+	// counts start at zero, and the hi-z written at the end of the frame
+	// before has to be visible
+	vkCmdFillBuffer(commandBuffer, cull_.countBuffers[frame], 0,
+		VK_WHOLE_SIZE, 0);
+
+	VkMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask =
+		VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask =
+		VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	// binding 0 then binding 1
+	uint32_t dynamicOffsets[] = {
+		cull_.uniformBufferAndContent.dynamicOffset,
+		instance_dynamic_offset_
+	};
+	vkCmdBindDescriptorSets(commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE, cull_.pipelineLayout, 0, 1,
+		&cull_.descriptorSets[frame], 2, dynamicOffsets);
+
+	// one thread per instance, survivors are appended to their group
+	vkCmdBindPipeline(commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE, cull_.cullPipeline);
+	vkCmdDispatch(commandBuffer, (instanceCount + 63) / 64, 1, 1);
+
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask =
+		VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	// one thread per group, groups with instances left become draws
+	vkCmdBindPipeline(commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE, cull_.compactPipeline);
+	vkCmdDispatch(commandBuffer, (drawCount + 63) / 64, 1, 1);
+
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask =
+		VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void VulkanApp::recordHiZCommands(VkCommandBuffer commandBuffer, int frame) {
+	AppHiZ& hiz = cull_.hiz;
+
+	// the cull pass of this frame read the pyramid being overwritten, the
+	// depth is handled by the render pass dependency
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 0, nullptr, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE, hiz.pipeline);
+
+	VkMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+	uint32_t width = hiz.width;
+	uint32_t height = hiz.height;
+	for (uint32_t level = 0; level < hiz.levels; ++level) {
+		vkCmdBindDescriptorSets(commandBuffer,
+			VK_PIPELINE_BIND_POINT_COMPUTE, hiz.pipelineLayout, 0, 1,
+			&hiz.descriptorSets[frame * hiz.levels + level], 0, nullptr);
+		vkCmdDispatch(commandBuffer, (width + 7) / 8, (height + 7) / 8, 1);
+
+		// the next level reads this one
+		vkCmdPipelineBarrier(commandBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+		width = std::max(width / 2, 1u);
+		height = std::max(height / 2, 1u);
+	}
+}
+
+void VulkanApp::cleanupGpuCulling() {
+    AppHiZ& hiz = cull_.hiz;
+    vkDestroyPipeline(device_, hiz.pipeline, nullptr);
+    vkDestroyPipelineLayout(device_, hiz.pipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device_, hiz.descriptorSetLayout, nullptr);
+    vkDestroySampler(device_, hiz.sampler, nullptr);
+    for (VkImageView view : hiz.levelViews) {
+        vkDestroyImageView(device_, view, nullptr);
+    }
+    vkDestroyImageView(device_, hiz.imageView, nullptr);
+    vkDestroyImage(device_, hiz.image, nullptr);
+    memory_allocator_.free(hiz.deviceMemory);
+
+    vkDestroyPipeline(device_, cull_.cullPipeline, nullptr);
+    vkDestroyPipeline(device_, cull_.compactPipeline, nullptr);
+    vkDestroyPipelineLayout(device_, cull_.pipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device_, cull_.descriptorSetLayout, nullptr);
+
+    vkDestroyBuffer(device_, cull_.drawBuffer, nullptr);
+    memory_allocator_.free(cull_.drawMemory);
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        vkDestroyBuffer(device_, cull_.indirectBuffers[frame], nullptr);
+        memory_allocator_.free(cull_.indirectMemories[frame]);
+        vkDestroyBuffer(device_, cull_.countBuffers[frame], nullptr);
+        memory_allocator_.free(cull_.countMemories[frame]);
+        vkDestroyBuffer(device_, cull_.visibleBuffers[frame], nullptr);
+        memory_allocator_.free(cull_.visibleMemories[frame]);
+    }
+}
+
+// uniform ring =================================================
+void VulkanApp::createUniformRing() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device_, &properties);
+    uniform_ring_.alignment =
+        properties.limits.minUniformBufferOffsetAlignment;
+
+    VkDeviceSize size = UNIFORM_RING_FRAME_SIZE * MAX_FRAMES_IN_FLIGHT;
+    createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        uniform_ring_.buffer, uniform_ring_.deviceMemory, true);
+
+    // host visible blocks stay mapped for the lifetime of the app,
+    // coherent so no flushes
+    uniform_ring_.mapped =
+        static_cast<unsigned char*>(uniform_ring_.deviceMemory.mapped);
+    uniform_ring_.head = 0;
+    uniform_ring_.frameEnd = 0;
+}
+
+void VulkanApp::beginUniformRingFrame() {
+    // called after the fence of current_frame_ has signaled, nothing on the
+    // gpu reads this slice anymore
+    uniform_ring_.head = UNIFORM_RING_FRAME_SIZE * current_frame_;
+    uniform_ring_.frameEnd = uniform_ring_.head + UNIFORM_RING_FRAME_SIZE;
+}
+
+uint32_t VulkanApp::uniformRingPush(const void* data, size_t size) {
+    // minUniformBufferOffsetAlignment is always a power of two
+    VkDeviceSize alignment = uniform_ring_.alignment;
+    VkDeviceSize offset =
+        (uniform_ring_.head + alignment - 1) & ~(alignment - 1);
+    if (offset + size > uniform_ring_.frameEnd) {
+        throw std::runtime_error(
+            "failed to push uniform data, uniform_ring_ frame slice is full");
+    }
+
+    memcpy(uniform_ring_.mapped + offset, data, size);
+    uniform_ring_.head = offset + size;
+    return static_cast<uint32_t>(offset);
+}
+
+VkDescriptorBufferInfo VulkanApp::uniformRingDescriptor(VkDeviceSize range) {
+    VkDescriptorBufferInfo buffer_info{};
+    buffer_info.buffer = uniform_ring_.buffer;
+    buffer_info.offset = 0;
+    buffer_info.range = range;
+    return buffer_info;
+}
+
+void VulkanApp::cleanupUniformRing() {
+    vkDestroyBuffer(device_, uniform_ring_.buffer, nullptr);
+    memory_allocator_.free(uniform_ring_.deviceMemory);
+}
+
+// headless =================================================
+void VulkanApp::createHeadlessColorTarget() {
+    swapchain_imageformat_ = VK_FORMAT_R8G8B8A8_UNORM;
+    swapchain_extent_ = { static_cast<uint32_t>(WIDTH),
+        static_cast<uint32_t>(HEIGHT) };
+
+    swapchain_images_.resize(1);
+    createImage(swapchain_extent_.width, swapchain_extent_.height,
+        swapchain_imageformat_,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        swapchain_images_[0], headless_color_memory_);
+
+    swapchain_imageviews_.resize(1);
+    swapchain_imageviews_[0] = createImageView(swapchain_images_[0],
+        swapchain_imageformat_, VK_IMAGE_ASPECT_COLOR_BIT);
+}
+
+void VulkanApp::prepareHeadlessReadback() {
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = command_pool_;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = MAX_FRAMES_IN_FLIGHT;
+    if (vkAllocateCommandBuffers(device_, &allocInfo,
+        headless_copy_cmd_buffers_.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate headless_copy_cmd_buffers_");
+    }
+
+    // one readback buffer per frame in flight so the cpu can read frame N
+    // while the gpu is still copying frame N + 1
+    VkDeviceSize size = swapchain_extent_.width * swapchain_extent_.height * 4;
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            headless_readback_buffers_[frame], headless_readback_memories_[frame]);
+        // stays mapped, read once per frame
+        headless_readback_mapped_[frame] =
+            headless_readback_memories_[frame].mapped;
+
+        VkCommandBuffer copyCmdBuffer = headless_copy_cmd_buffers_[frame];
+        VkCommandBufferBeginInfo beginInfo = apputil::cmdBufferBegin(
+            VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+        if (vkBeginCommandBuffer(copyCmdBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin headless_copy_cmd_buffer");
+        }
+
+        // the deferred render pass leaves the target in TRANSFER_SRC_OPTIMAL
+        VkBufferImageCopy region = {};
+        region.bufferOffset = 0;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = { 0, 0, 0 };
+        region.imageExtent = { swapchain_extent_.width,
+            swapchain_extent_.height, 1 };
+        vkCmdCopyImageToBuffer(copyCmdBuffer, swapchain_images_[0],
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            headless_readback_buffers_[frame], 1, &region);
+
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.buffer = headless_readback_buffers_[frame];
+        barrier.offset = 0;
+        barrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(copyCmdBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+            0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+        if (vkEndCommandBuffer(copyCmdBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to end headless_copy_cmd_buffer");
+        }
+    }
+}
+
+void VulkanApp::headlessLoop() {
+    const size_t pixelCount = swapchain_extent_.width * swapchain_extent_.height;
+    // png encoding is slower than a frame, so it runs on worker threads while
+    // the gpu renders the next frame
+    const size_t maxPendingWrites =
+        std::max(1u, std::thread::hardware_concurrency());
+    std::deque<std::future<void>> pendingWrites;
+
+    // frame number whose pixels are still in flight in each readback slot
+    std::array<int64_t, MAX_FRAMES_IN_FLIGHT> pendingFrames;
+    pendingFrames.fill(-1);
+
+    // fence of the slot is signaled, copy its pixels out and hand them to
+    // a writer thread
+    auto flushFrame = [&](uint32_t frame) {
+        if (pendingFrames[frame] < 0) {
+            return;
+        }
+        auto* mapped = static_cast<unsigned char*>(
+            headless_readback_mapped_[frame]);
+        std::vector<unsigned char> pixels(mapped, mapped + pixelCount * 4);
+
+        char index[16];
+        snprintf(index, sizeof(index), "%04u",
+            static_cast<uint32_t>(pendingFrames[frame]));
+        std::string path = headless_.outputPrefix + index + ".png";
+        pendingFrames[frame] = -1;
+
+        if (pendingWrites.size() >= maxPendingWrites) {
+            pendingWrites.front().get();
+            pendingWrites.pop_front();
+        }
+        pendingWrites.push_back(std::async(std::launch::async,
+            [this, path, pixels = std::move(pixels)]() {
+            writeHeadlessFrame(path, pixels);
+        }));
+    };
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (headless_frame_ = 0; headless_frame_ < headless_.frameCount;
+        ++headless_frame_) {
+        vkWaitForFences(device_, 1, &waitFences[current_frame_], VK_TRUE,
+            std::numeric_limits<uint64_t>::max());
+        flushFrame(current_frame_);
+
+        beginUniformRingFrame();
+        updateUniformBuffers();
+        rt_updateUniformBuffer();
+        drawHeadless();
+        pendingFrames[current_frame_] = headless_frame_;
+
+        current_frame_ = (current_frame_ + 1) % MAX_FRAMES_IN_FLIGHT;
+    }
+
+    // oldest slot first so the files come out in order
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        vkWaitForFences(device_, 1, &waitFences[current_frame_], VK_TRUE,
+            std::numeric_limits<uint64_t>::max());
+        flushFrame(current_frame_);
+        current_frame_ = (current_frame_ + 1) % MAX_FRAMES_IN_FLIGHT;
+    }
+
+    while (!pendingWrites.empty()) {
+        pendingWrites.front().get();
+        pendingWrites.pop_front();
+    }
+    vkDeviceWaitIdle(device_);
+
+    float seconds = std::chrono::duration<float, std::chrono::seconds::period>(
+        std::chrono::high_resolution_clock::now() - startTime).count();
+    std::cout << "headless: " << headless_.frameCount << " frames in "
+        << seconds << " s, " << headless_.frameCount / seconds
+        << " frames/s" << std::endl;
+}
+
+void VulkanApp::drawHeadless() {
+    // same chain as draw(), minus acquire and present
+    recordOffscreenCommandBuffer(current_frame_);
+    rt_recordComputeCommandBuffer(current_frame_);
+    recordDeferredCommandBuffer(current_frame_, 0);
+
+    VkPipelineStageFlags computeWaitStage =
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    VkPipelineStageFlags deferredWaitStage =
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+    // submit offscreen
+    mySubmitInfo.waitSemaphoreCount = 0;
+    mySubmitInfo.pWaitSemaphores = nullptr;
+    mySubmitInfo.pWaitDstStageMask = nullptr;
+    mySubmitInfo.signalSemaphoreCount = 1;
+    mySubmitInfo.pSignalSemaphores = &offscreen_complete_semaphores_[current_frame_];
+    mySubmitInfo.commandBufferCount = 1;
+    mySubmitInfo.pCommandBuffers = &offscreen_.commandBuffers[current_frame_];
+    if (vkQueueSubmit(queue_, 1, &mySubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+    {
+        throw std::runtime_error("failed to submit offscreen_.commandBuffer");
+    }
+
+    // submit rt compute
+    mySubmitInfo.waitSemaphoreCount = 1;
+    mySubmitInfo.pWaitSemaphores = &offscreen_complete_semaphores_[current_frame_];
+    mySubmitInfo.pWaitDstStageMask = &computeWaitStage;
+    mySubmitInfo.signalSemaphoreCount = 1;
+    mySubmitInfo.pSignalSemaphores = &rt_complete_semas[current_frame_];
+    mySubmitInfo.commandBufferCount = 1;
+    mySubmitInfo.pCommandBuffers = &compute_.rt_computeCmdBuffers[current_frame_];
+    if (vkQueueSubmit(compute_.rt_computeQueue, 1, &mySubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+    {
+        throw std::runtime_error("failed to submit compute_.rt_computeCmdBuffer");
+    }
+
+    // submit deferred and the readback copy together
+    std::array<VkCommandBuffer, 2> cmdBuffers = {
+        deferred_command_buffers_[current_frame_],
+        headless_copy_cmd_buffers_[current_frame_]
+    };
+    mySubmitInfo.waitSemaphoreCount = 1;
+    mySubmitInfo.pWaitSemaphores = &rt_complete_semas[current_frame_];
+    mySubmitInfo.pWaitDstStageMask = &deferredWaitStage;
+    mySubmitInfo.signalSemaphoreCount = 0;
+    mySubmitInfo.pSignalSemaphores = nullptr;
+    mySubmitInfo.commandBufferCount = static_cast<uint32_t>(cmdBuffers.size());
+    mySubmitInfo.pCommandBuffers = cmdBuffers.data();
+    // headlessLoop waits on the fence before reading the slot back
+    vkResetFences(device_, 1, &waitFences[current_frame_]);
+    if (vkQueueSubmit(queue_, 1, &mySubmitInfo, waitFences[current_frame_]) != VK_SUCCESS)
+    {
+        throw std::runtime_error("failed to submit headless deferred commmand buf");
     }
 }
 
+void VulkanApp::writeHeadlessFrame(const std::string& path,
+    const std::vector<unsigned char>& pixels) {
+    int width = static_cast<int>(swapchain_extent_.width);
+    int height = static_cast<int>(swapchain_extent_.height);
+    if (!stbi_write_png(path.c_str(), width, height, 4, pixels.data(),
+        width * 4)) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
+void VulkanApp::cleanupHeadless() {
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+        vkDestroyBuffer(device_, headless_readback_buffers_[frame], nullptr);
+        memory_allocator_.free(headless_readback_memories_[frame]);
+    }
+
+    vkDestroyImageView(device_, swapchain_imageviews_[0], nullptr);
+    vkDestroyImage(device_, swapchain_images_[0], nullptr);
+    memory_allocator_.free(headless_color_memory_);
+}
 
 // tryout: combine skybox and offscrenn =================================================
 
 void VulkanApp::createOffscreenForSkyboxAndModel() {
-	if (offscreen_.commandBuffer == VK_NULL_HANDLE)
-	{
-		VkCommandBufferAllocateInfo cmdBufAllocateInfo{};
-		cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-		cmdBufAllocateInfo.commandPool = command_pool_;
-		cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-		cmdBufAllocateInfo.commandBufferCount = 1;
-		if (vkAllocateCommandBuffers(device_, &cmdBufAllocateInfo, &offscreen_.commandBuffer) != VK_SUCCESS) {
-			throw std::runtime_error("failed to create offscreenCommandBuffer");
-		}
+	VkCommandBufferAllocateInfo cmdBufAllocateInfo{};
+	cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	cmdBufAllocateInfo.commandPool = command_pool_;
+	cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	cmdBufAllocateInfo.commandBufferCount = MAX_FRAMES_IN_FLIGHT;
+	if (vkAllocateCommandBuffers(device_, &cmdBufAllocateInfo, offscreen_.commandBuffers.data()) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create offscreenCommandBuffer");
 	}
 
 	VkSemaphoreCreateInfo semaphoreCreateInfo{};
 	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-	if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &offscreen_complete_semaphore_) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create offscreenSemaphore");
+	for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+		if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &offscreen_complete_semaphores_[frame]) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create offscreenSemaphore");
+		}
+	}
+	// waited by the same frame's offscreen submit, so one is enough
+	if (vkCreateSemaphore(device_, &semaphoreCreateInfo, nullptr, &stream_upload_semaphore_) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create stream upload semaphore");
+	}
+}
+
+// recorded each frame after updateUniformBuffers
+void VulkanApp::recordOffscreenCommandBuffer(int frame) {
+	VkCommandBuffer commandBuffer = offscreen_.commandBuffers[frame];
+
+	// the fence of this frame has been waited on, nothing recorded into
+	// its pools is pending anymore
+	for (AppRecordThread& thread : record_threads_) {
+		vkResetCommandPool(device_, thread.commandPools[frame], 0);
+		thread.used[frame] = 0;
 	}
 
+	VkCommandBufferInheritanceInfo inheritance = {};
+	inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritance.renderPass = offscreen_.renderPass;
+	inheritance.subpass = 0;
+	inheritance.framebuffer = offscreen_.frameBufferAssets[frame].frameBuffer;
+
+	// one secondary per record chunk plus the skybox, spread over the job
+	// system. the skybox goes last so it is still drawn behind the models
+	uint32_t chunkCount = static_cast<uint32_t>(record_chunks_.size());
+	std::vector<VkCommandBuffer> secondaries(chunkCount + 1);
+	job_system_.parallelFor(chunkCount + 1, [&](uint32_t i) {
+		VkCommandBuffer secondary =
+			beginSecondaryCommandBuffer(frame, inheritance);
+		if (i < chunkCount) {
+			recordModelChunk(secondary, frame, i);
+		}
+		else {
+			recordSkybox(secondary, frame);
+		}
+		if (vkEndCommandBuffer(secondary) != VK_SUCCESS) {
+			throw std::runtime_error("failed to end offscreen secondary command buffer");
+		}
+		secondaries[i] = secondary;
+	});
+
 	VkCommandBufferBeginInfo cmdBufInfo{};
 	cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-	if (vkBeginCommandBuffer(offscreen_.commandBuffer, &cmdBufInfo) != VK_SUCCESS) {
+	if (vkBeginCommandBuffer(commandBuffer, &cmdBufInfo) != VK_SUCCESS) {
 		throw std::runtime_error("failed to begin offscreen_.commandBuffer");
 	}
 
-	// IMPT: to draw models, use viewport from 0 to n;
-	float n_depth = 0.9999999f;
-	VkViewport viewport{};
-	viewport.width = swapchain_extent_.width;
-	viewport.height = swapchain_extent_.height;
-	viewport.minDepth = 0.f;
-	viewport.maxDepth = n_depth;
-	vkCmdSetViewport(offscreen_.commandBuffer, 0, 1, &viewport);
-
-	VkRect2D scissor{};
-	scissor.extent.width = swapchain_extent_.width;
-	scissor.extent.height = swapchain_extent_.height;
-	scissor.offset.x = 0;
-	scissor.offset.y = 0;
-	vkCmdSetScissor(offscreen_.commandBuffer, 0, 1, &scissor);
+	// fills this frame's indirect draws, outside the render pass
+	recordCullCommands(commandBuffer, frame);
 
 	std::array<VkClearValue, 5> clearValues;
 	clearValues[0].color = { { 0.0f, 0.0f, 0.0f, 0.0f } };
@@ -4614,88 +6423,194 @@ void VulkanApp::createOffscreenForSkyboxAndModel() {
 	VkRenderPassBeginInfo renderPassBeginInfo{};
 	renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
 	renderPassBeginInfo.renderPass = offscreen_.renderPass;
-	renderPassBeginInfo.framebuffer = offscreen_.frameBufferAssets.frameBuffer;
+	renderPassBeginInfo.framebuffer = offscreen_.frameBufferAssets[frame].frameBuffer;
 	renderPassBeginInfo.renderArea.extent.width = swapchain_extent_.width;
 	renderPassBeginInfo.renderArea.extent.height = swapchain_extent_.height;
 	renderPassBeginInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
 	renderPassBeginInfo.pClearValues = clearValues.data();
 
-	vkCmdBeginRenderPass(offscreen_.commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+	vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo,
+		VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	vkCmdExecuteCommands(commandBuffer,
+		static_cast<uint32_t>(secondaries.size()), secondaries.data());
+	vkCmdEndRenderPass(commandBuffer);
+
+	// next frame's occlusion test reads this frame's depth
+	recordHiZCommands(commandBuffer, frame);
+
+	// the rt pass reads position and normal on the compute queue
+	if (async_compute_) {
+		recordImageOwnershipTransfer(commandBuffer,
+			{ offscreen_.frameBufferAssets[frame].position.image,
+			  offscreen_.frameBufferAssets[frame].normal.image },
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			queue_families_.graphicsFamily.value(),
+			queue_families_.computeFamily.value(), true,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+	}
 
-	VkDeviceSize offsets[1] = { 0 };
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+		throw std::runtime_error("failed to end offscreenCommandBuffer");
+	}
+}
 
-	vkCmdBindPipeline(
-		offscreen_.commandBuffer,
-		VK_PIPELINE_BIND_POINT_GRAPHICS,
-		offscreen_.pipeline);
+// multithreaded recording =================================================
+void VulkanApp::createRecordThreads() {
+	VkCommandPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = queue_families_.graphicsFamily.value();
+	// reset as a whole once per frame
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+	// workers plus the thread calling parallelFor
+	record_threads_.resize(job_system_.concurrency());
+	for (AppRecordThread& thread : record_threads_) {
+		for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+			if (vkCreateCommandPool(device_, &poolInfo, nullptr,
+				&thread.commandPools[frame]) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create record thread command pool!");
+			}
+			thread.used[frame] = 0;
+		}
+	}
+}
 
-	// draw models
-	for (auto& scene_object : scene_objects_) {
-		vkCmdBindDescriptorSets(offscreen_.commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS, offscreen_.pipelineLayout, 0, 1,
-			&scene_object.descriptorSet, 0, NULL);
+void VulkanApp::cleanupRecordThreads() {
+	// frees the command buffers along with the pools
+	for (AppRecordThread& thread : record_threads_) {
+		for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; ++frame) {
+			vkDestroyCommandPool(device_, thread.commandPools[frame], nullptr);
+		}
+	}
+	record_threads_.clear();
+}
 
-		vkCmdBindVertexBuffers(offscreen_.commandBuffer, 0, 1,
-			&scene_object.vertexBuffer.buffer, offsets);
+VkCommandBuffer VulkanApp::beginSecondaryCommandBuffer(int frame,
+	const VkCommandBufferInheritanceInfo& inheritance) {
+	AppRecordThread& thread = record_threads_[JobSystem::threadIndex()];
+	std::vector<VkCommandBuffer>& buffers = thread.commandBuffers[frame];
+
+	if (thread.used[frame] == buffers.size()) {
+		VkCommandBufferAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = thread.commandPools[frame];
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		allocInfo.commandBufferCount = 1;
+		VkCommandBuffer commandBuffer;
+		if (vkAllocateCommandBuffers(device_, &allocInfo, &commandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate secondary command buffer");
+		}
+		buffers.push_back(commandBuffer);
+	}
+	VkCommandBuffer commandBuffer = buffers[thread.used[frame]++];
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+		| VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+	beginInfo.pInheritanceInfo = &inheritance;
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("failed to begin secondary command buffer");
+	}
+	return commandBuffer;
+}
 
-		vkCmdBindIndexBuffer(offscreen_.commandBuffer,
-			scene_object.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+// secondaries inherit no state, each one sets up the whole pipeline
+void VulkanApp::recordModelChunk(VkCommandBuffer commandBuffer, int frame,
+	uint32_t chunk) {
+	const AppRecordChunk& range = record_chunks_[chunk];
 
-		vkCmdDrawIndexed(
-			offscreen_.commandBuffer,
-			static_cast<uint32_t>(scene_object.indexCount),
-			1, 0, 0, 0);
-	}
+	// IMPT: to draw models, use viewport from 0 to n;
+	VkViewport viewport{};
+	viewport.width = swapchain_extent_.width;
+	viewport.height = swapchain_extent_.height;
+	viewport.minDepth = 0.f;
+	viewport.maxDepth = OFFSCREEN_MODEL_MAX_DEPTH;
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+	VkRect2D scissor{};
+	scissor.extent.width = swapchain_extent_.width;
+	scissor.extent.height = swapchain_extent_.height;
+	scissor.offset.x = 0;
+	scissor.offset.y = 0;
+	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-    // start draw sky box
+	vkCmdBindPipeline(
+		commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS,
+		offscreen_.pipeline);
 
+	// one set for the whole pass, binding 0 camera, binding 1 this
+	// frame's instance slice
+	uint32_t dynamicOffsets[] = {
+		offscreen_.uniformBufferAndContent.dynamicOffset,
+		instance_dynamic_offset_
+	};
+	vkCmdBindDescriptorSets(commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS, offscreen_.pipelineLayout, 0, 1,
+		&material_table_sets_[frame], 2, dynamicOffsets);
+
+	VkDeviceSize offsets[1] = { 0 };
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1,
+		&geometry_pool_.vertexBuffer, offsets);
+	vkCmdBindIndexBuffer(commandBuffer,
+		geometry_pool_.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+
+	// the cull pass compacts the chunk's groups with visible instances
+	// into the start of its range and counts them in its own slot.
+	// gl_InstanceIndex starts at the group's firstInstance and indexes the
+	// visible list, which holds instance buffer indices
+	vkCmdDrawIndexedIndirectCount(
+		commandBuffer,
+		cull_.indirectBuffers[frame],
+		sizeof(VkDrawIndexedIndirectCommand) * range.firstDraw,
+		cull_.countBuffers[frame], sizeof(uint32_t) * chunk,
+		range.drawCount,
+		sizeof(VkDrawIndexedIndirectCommand));
+}
+
+void VulkanApp::recordSkybox(VkCommandBuffer commandBuffer, int frame) {
 	// IMPT: 
 	// since the renderpass is only related to framebuffers and clearvalue
 	// we use the same renderpass but different pipeline
 	// 1. change viewport and scissor for command buffer
-	VkViewport viewport_2{};
-	viewport_2.width = swapchain_extent_.width;
-	viewport_2.height = swapchain_extent_.height;
-	viewport_2.minDepth = n_depth;
-	viewport_2.maxDepth = 1.0f;
-	vkCmdSetViewport(offscreen_.commandBuffer, 0, 1, &viewport_2);
-
-	VkRect2D scissor_2{};
-	scissor_2.extent.width = swapchain_extent_.width;
-	scissor_2.extent.height = swapchain_extent_.height;
-	scissor_2.offset.x = 0;
-	scissor_2.offset.y = 0;
-	vkCmdSetScissor(offscreen_.commandBuffer, 0, 1, &scissor_2);
-
-	//2. change pipeline from offscreen from skybox
-	bool use_skybox = true;
-	if (use_skybox)
-	{
-		vkCmdBindPipeline(
-			offscreen_.commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			skybox_.pipeline);
-
-		vkCmdBindDescriptorSets(offscreen_.commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS, skybox_.pipelineLayout, 0, 1,
-			&skybox_.skyBoxCube.mesh.descriptorSet, 0, NULL);
-
-		vkCmdBindVertexBuffers(offscreen_.commandBuffer, 0, 1,
-			&skybox_.skyBoxCube.mesh.vertexBuffer.buffer, offsets);
+	VkViewport viewport{};
+	viewport.width = swapchain_extent_.width;
+	viewport.height = swapchain_extent_.height;
+	viewport.minDepth = OFFSCREEN_MODEL_MAX_DEPTH;
+	viewport.maxDepth = 1.0f;
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
 
-		vkCmdBindIndexBuffer(offscreen_.commandBuffer,
-			skybox_.skyBoxCube.mesh.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+	VkRect2D scissor{};
+	scissor.extent.width = swapchain_extent_.width;
+	scissor.extent.height = swapchain_extent_.height;
+	scissor.offset.x = 0;
+	scissor.offset.y = 0;
+	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-		vkCmdDrawIndexed(
-			offscreen_.commandBuffer,
-			skybox_.skyBoxCube.mesh.indexCount,
-			1, 0, 0, 0);
-	}
+	//2. change pipeline from offscreen from skybox
+	vkCmdBindPipeline(
+		commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS,
+		skybox_.pipeline);
 
-	vkCmdEndRenderPass(offscreen_.commandBuffer);
+	vkCmdBindDescriptorSets(commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS, skybox_.pipelineLayout, 0, 1,
+		&skybox_.skyBoxCube.mesh.descriptorSet, 1,
+		&skybox_.uniformBufferAndContent.dynamicOffset);
 
-	if (vkEndCommandBuffer(offscreen_.commandBuffer) != VK_SUCCESS) {
-		throw std::runtime_error("failed to end offscreenCommandBuffer");
-	}
+	// the cube lives in the geometry pool like every mesh
+	VkDeviceSize offsets[1] = { 0 };
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1,
+		&geometry_pool_.vertexBuffer, offsets);
+	vkCmdBindIndexBuffer(commandBuffer,
+		geometry_pool_.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+
+	const AppMesh* cube = skybox_.skyBoxCube.mesh.mesh;
+	vkCmdDrawIndexed(
+		commandBuffer,
+		cube->indexCount,
+		1, cube->firstIndex, cube->vertexOffset, 0);
 }
 
@@ -24,14 +24,17 @@
 #include <fstream>
 #include <array>
 #include <unordered_map>
+#include <string>
 #include "camera.h"
 #include "app_util.h"
+#include "bvh.h"
+#include "frustum_cull.h"
+#include "job_system.h"
+#include "upload_batch.h"
 
 const int WIDTH = 800;
 const int HEIGHT = 600;
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
-
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_LUNARG_standard_validation"
 };
@@ -50,6 +53,8 @@ struct QueueFamilyIndices {
     std::optional<uint32_t> graphicsFamily;
     std::optional<uint32_t> presentFamily;
     std::optional<uint32_t> computeFamily;
+    // filled after the search, falls back to graphicsFamily
+    std::optional<uint32_t> transferFamily;
     bool isComplete() {
         return graphicsFamily.has_value() && presentFamily.has_value() && computeFamily.has_value();
     }
@@ -78,29 +83,35 @@ struct RTUniformBufferObject {							// Compute shader uniform block object
     } camera;
 };
 
+// top level of the ray tracing bvh, the per instance transforms live in
+// rt_topLevelBuffer next to its nodes
 struct RT_GEOM
 {
-	glm::mat4 transform;
-	glm::mat4 inverseTransform;
+	uint32_t instanceCount;
+	uint32_t pad[3];
 };
 
 
+// render without a window, swapchain or present, frames are read back to png
+struct HeadlessSettings {
+    bool enabled = false;
+    uint32_t frameCount = 1;
+    // frame i is written to <outputPrefix><i>.png
+    std::string outputPrefix = "frame_";
+    // animation time advanced per frame, keeps batch output deterministic
+    float timeStep = 1.0f / 60.0f;
+    // pick a VK_PHYSICAL_DEVICE_TYPE_CPU device (lavapipe, swiftshader) if present
+    bool preferCpuDevice = true;
+};
+
 struct MyTexture
 {
     VkImage textureImage;
-    VkDeviceMemory textureImageMemory;
+    AppAllocation textureImageMemory;
     VkImageView textureImageView;
     VkSampler textureSampler;
 };
 
-struct MyUniformBuffer {
-    VkBuffer buffer;
-    VkDeviceMemory deviceMem;
-    VkDescriptorBufferInfo desBuffInfo;
-    //VkBufferUsageFlags bufferUsageFlags;
-    //VkMemoryPropertyFlags memProperyFlags;
-};
-
 struct Sphere {									// Shader uses std140 layout (so we only use vec4 instead of vec3)
     glm::vec3 pos;
     float radius;
@@ -125,6 +136,7 @@ struct Plane {
 class VulkanApp {
 public:
     VulkanApp();
+    explicit VulkanApp(const HeadlessSettings& headless);
     void run();
 
 private:
@@ -138,7 +150,14 @@ private:
     VkPhysicalDevice physical_device_ = VK_NULL_HANDLE;
     VkDevice device_;
 
+    // graphics and present
     VkQueue queue_;
+    // uploads, see upload_batch_
+    VkQueue transfer_queue_;
+    QueueFamilyIndices queue_families_;
+    // the rt pass runs on compute_.rt_computeQueue of another family, the
+    // images it shares with the graphics passes change owner every frame
+    bool async_compute_ = false;
 
     VkSwapchainKHR swapchain_;
     std::vector<VkImage> swapchain_images_;
@@ -200,26 +219,24 @@ private:
 
     bool hasStencilComponent(VkFormat format);
 
-    VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags);
-
-    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory);
+    VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels = 1);
 
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
+    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, AppAllocation& imageMemory, uint32_t mipLevels = 1);
 
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
+    // records the barrier only, mostly into upload_batch_.commandBuffer()
+    void transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
 
 
     void createDescriptorPool();
 
-    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
-
-    VkCommandBuffer beginSingleTimeCommands();
+    // sharedWithCompute makes the buffer concurrent between the graphics and
+    // compute families, for buffers both write or read every frame
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, AppAllocation& bufferMemory, bool sharedWithCompute = false);
 
-    void endSingleTimeCommands(VkCommandBuffer commandBuffer);
-
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-
-    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
+    // one half of a queue family ownership transfer of color images, recorded
+    // with release on the old owner's queue and without on the new one's.
+    // stage and access are the producer's on release, the consumer's on acquire
+    void recordImageOwnershipTransfer(VkCommandBuffer commandBuffer, const std::vector<VkImage>& images, VkImageLayout layout, uint32_t srcFamily, uint32_t dstFamily, bool release, VkPipelineStageFlags stage, VkAccessFlags access);
 
     VkShaderModule createShaderModule(const std::vector<char>& code);
 
@@ -235,6 +252,8 @@ private:
 
     bool checkDeviceExtensionSupport(VkPhysicalDevice device);
 
+    std::vector<const char*> getRequiredDeviceExtensions();
+
     QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
 
     std::vector<const char*> getRequiredExtensions();
@@ -259,7 +278,9 @@ private:
 
     void setupVertexDescriptions();
 
+    // signaled when the gpu is done with a frame's resources
     std::vector<VkFence> waitFences;
+    uint32_t current_frame_ = 0;
     void initSemAndSubmitInfo();
 
     VkResult queuePresent(VkQueue queue, uint32_t imageIndex, VkSemaphore waitSemaphore = VK_NULL_HANDLE);
@@ -267,7 +288,6 @@ private:
 
 	// ray tracing =================================================
 	void rt_createSema();
-	void rt_createUniformBuffers();
     void rt_prepareStorageBuffers();
 	void rt_prepareTextureTarget(MyTexture& tex, VkFormat format, uint32_t width = WIDTH, uint32_t height = HEIGHT);
 	void rt_graphics_setupDescriptorSetLayout();
@@ -279,6 +299,7 @@ private:
 	//void rt_setupDescriptorPool(); // all pipeline use the same pool
 	void rt_prepareCompute();
 	void rt_createComputeCommandBuffer();
+	void rt_recordComputeCommandBuffer(int frame);
 	void rt_createRaytraceDisplayCommandBuffer();
 	void rt_draw();
 
@@ -286,24 +307,63 @@ private:
     Plane newPlane(glm::vec3 normal, float distance, glm::vec3 diffuse, float specular);
 	void rt_updateUniformBuffer();
     void rt_loadObj(std::vector<Triangle>&);
+    // object space triangles and bottom level nodes of every mesh
     std::vector<Triangle> rt_all_triangles;
+    std::vector<BVHNode> rt_bvh_nodes;
+
+	// two level bvh =================================================
+	// a mesh gets one bottom level however many objects use it, moving
+	// objects only rebuild the top level over rt_instanceObjects
+	std::unordered_map<const AppMesh*, uint32_t> rt_meshRoots;
+	// scene object and bottom level root of every ray traced instance
+	std::vector<uint32_t> rt_instanceObjects;
+	std::vector<uint32_t> rt_instanceRoots;
+	std::vector<glm::mat4> rt_instanceMatrices;
+	std::vector<BVHInstance> rt_topLevelInstances;
+	std::vector<BVHNode> rt_topLevelNodes;
+	// one slice per frame in flight, nodes then instances, mapped
+	VkBuffer rt_topLevelBuffer;
+	AppAllocation rt_topLevelMemory;
+	VkDeviceSize rt_topLevelSliceSize;
+	VkDeviceSize rt_topLevelInstanceOffset;
+	void rt_addInstance(uint32_t objectIndex);
+	void rt_createTopLevelBuffer();
+	void rt_buildTopLevel(int frame);
+	void rt_cleanupTopLevelBuffer();
 
 
 	uint32_t rt_currentId = 0;
-	MyTexture rt_result;
+	std::array<MyTexture, MAX_FRAMES_IN_FLIGHT> rt_results;
+
+	// shadow upsample =================================================
+	// rays are traced into rt_lowResults at 1 / rt_traceScale of the
+	// screen, then upsampled into rt_results. at 1 they go straight there
+	uint32_t rt_traceScale = SHADOW_TRACE_SCALE;
+	std::array<MyTexture, MAX_FRAMES_IN_FLIGHT> rt_lowResults;
+	struct {
+		VkDescriptorSetLayout descriptorSetLayout;
+		std::array<VkDescriptorSet, MAX_FRAMES_IN_FLIGHT> descriptorSets;
+		VkPipelineLayout pipelineLayout;
+		VkPipeline pipeline;
+	} rt_upsample;
+	void rt_prepareShadowUpsample();
+	void rt_cleanupShadowUpsample();
+	MyTexture& rt_traceTarget(int frame) {
+		return rt_traceScale > 1 ? rt_lowResults[frame] : rt_results[frame];
+	}
 	RTUniformBufferObject rt_ubo;
 	RT_GEOM rt_g;
 	std::vector<VkCommandBuffer> rt_drawCommandBuffer;
-	VkSemaphore rt_complete_sema;
+	std::array<VkSemaphore, MAX_FRAMES_IN_FLIGHT> rt_complete_semas;
 
 
     // todo: ray tracing part share the same queue with whom???????
     
-		// union buffer
+		// offsets of this frame's ubos in uniform_ring_
 	struct {
-		MyUniformBuffer rt_compute;
-		MyUniformBuffer rt_geom;
-	} rt_uniformBuffers;
+		uint32_t rt_compute;
+		uint32_t rt_geom;
+	} rt_uniformOffsets;
 	
 	struct {
       //  VkDescriptorSet descriptorSetPreCompute;	// Raytraced image display shader bindings before compute shader image manipulation
@@ -319,28 +379,29 @@ private:
         struct rayTracingSceneObjectBuffer
         {
             VkBuffer buffer;
-            VkDeviceMemory deviceMem;
-        }myPlaneBuffer, mySphereBuffer, myTriBuffer;
+            AppAllocation deviceMem;
+        }myPlaneBuffer, mySphereBuffer, myTriBuffer, myBVHBuffer;
 
 		//RT_AppSceneObject rt_scene_obj;
 
         VkDescriptorSetLayout rt_computeDescriptorSetLayout;
-        VkDescriptorSet rt_computeDescriptorSet;
+        std::array<VkDescriptorSet, MAX_FRAMES_IN_FLIGHT> rt_computeDescriptorSets;
         VkPipelineLayout rt_computePipelineLayout;
 ;
         VkPipeline rt_computePipine;
         VkQueue rt_computeQueue;
+        // on the compute family, rt_computeCmdBuffers come from here
+        VkCommandPool rt_commandPool;
         VkFence rt_fence;
-        VkCommandBuffer rt_computeCmdBuffer = VK_NULL_HANDLE;
+        std::array<VkCommandBuffer, MAX_FRAMES_IN_FLIGHT> rt_computeCmdBuffers;
 
     } compute_;
 
     // offscreen =================================================
     AppOffscreenPipelineAssets offscreen_;
-    VkSemaphore offscreen_complete_semaphore_ = VK_NULL_HANDLE;
+    std::array<VkSemaphore, MAX_FRAMES_IN_FLIGHT> offscreen_complete_semaphores_;
     void prepareOffscreen();
     void prepareOffscreenCommandBuffer();
-    void createOffscreenUniformBuffer();
     // this one is called before loading model
     void createOffscreenDescriptorSetLayout();
     void createOffscreenPipelineLayout();
@@ -352,10 +413,129 @@ private:
     std::vector<AppSceneObject> scene_objects_;
     void prepareSceneObjectsData();
     void prepareSceneObjectsDescriptor();
-    void loadSingleSceneObjectMesh(AppSceneObject& scene_object);
-    void loadSingleSceneObjectTexture(AppTextureInfo& texture);
-    void createModelMatrixUniformBuffer(AppSceneObject& scene_object);
-    void createSceneObjectDescriptorSet(AppSceneObject& scene_object);
+    // cook/decode run on job_system_ workers, upload on the main thread
+    void cookSingleMesh(AppMesh& mesh, AppMeshData& data);
+    void uploadSingleMesh(AppMesh& mesh, const AppMeshData& data);
+    // mipmaps builds the full chain, off for lookup tables
+    void decodeSingleTexture(const std::string& path, AppImageData& image,
+        bool mipmaps = true);
+    // levels before firstLevel are left out, for streamed textures
+    void uploadSingleTexture(AppTextureInfo& texture_info,
+        const AppImageData& image, uint32_t firstLevel = 0);
+    // image and view for levels [firstLevel, end) of image, upload
+    // recorded into upload_batch_. the sampler is left alone
+    void uploadTextureLevels(AppTexture& texture, const AppImageData& image,
+        uint32_t firstLevel);
+    // decode and upload right away, for textures outside the registry
+    void loadSingleSceneObjectTexture(AppTextureInfo& texture,
+        bool mipmaps = true);
+
+    // material table =================================================
+    // every material texture sits in one sampler array, instances index
+    // the material ssbo, which indexes the array. the whole g buffer pass
+    // binds a single set
+    std::vector<AppMaterial> materials_;
+    // texture of every array slot, filled by buildDrawGroups
+    std::vector<AppTexture*> material_textures_;
+    uint32_t material_texture_capacity_;
+    VkBuffer material_buffer_;
+    AppAllocation material_buffer_memory_;
+    // one per frame in flight, so streaming can rewrite the set of the
+    // frame being recorded while the other one is still on the gpu
+    std::array<VkDescriptorSet, MAX_FRAMES_IN_FLIGHT> material_table_sets_;
+    // bit per frame whose set still points at a replaced image view
+    uint32_t material_table_dirty_frames_ = 0;
+    void createMaterialTable();
+    void updateMaterialTableSet(int frame);
+    void cleanupMaterialTable();
+
+    // instancing =================================================
+    std::vector<AppDrawGroup> draw_groups_;
+    // scene object of every instance, in instance buffer order
+    std::vector<uint32_t> instance_objects_;
+    // MAX_SCENE_INSTANCES per frame in flight, persistently mapped
+    VkBuffer instance_buffer_;
+    AppAllocation instance_buffer_memory_;
+    VkDeviceSize instance_slice_size_;
+    uint32_t instance_dynamic_offset_;
+    void buildDrawGroups();
+    void createInstanceBuffer();
+    void writeInstanceData();
+    void cleanupInstanceBuffer();
+
+    // cpu culling =================================================
+    bool cpu_culling_ = false;
+    // world bounds in instance buffer order
+    frustumcull::Boxes instance_bounds_;
+    // instances inside the camera frustum, ascending, so still grouped by
+    // draw. filled every frame, also used by texture streaming
+    std::vector<uint32_t> visible_instances_;
+    uint32_t visible_instance_count_ = 0;
+    // instances written to the instance buffer this frame
+    uint32_t instance_count_ = 0;
+    // updates the world bounds of every scene object and culls them
+    void cullSceneObjects();
+
+    // gpu culling =================================================
+    // the g buffer pass draws whatever the cull pass left in the indirect
+    // buffers of its frame, occlusion is tested against the depth of the
+    // frame before
+    AppGpuCullingAssets cull_;
+    void prepareGpuCulling();
+    void createCullDescriptorSetLayout();
+    void createCullBuffers();
+    void createCullDescriptorSets();
+    void createCullPipelines();
+    void createHiZ();
+    // recorded into the offscreen command buffer around the render pass
+    void recordCullCommands(VkCommandBuffer commandBuffer, int frame);
+    void recordHiZCommands(VkCommandBuffer commandBuffer, int frame);
+    void cleanupGpuCulling();
+
+    // geometry pool =================================================
+    AppGeometryPool geometry_pool_;
+    void createGeometryPool();
+    void cleanupGeometryPool();
+
+    // asset registry =================================================
+    // meshes and textures are loaded once per path and refcounted, scene
+    // objects keep pointers into these maps (node based, so they stay valid)
+    std::unordered_map<std::string, AppMesh> mesh_registry_;
+    std::unordered_map<std::string, AppSharedTexture> texture_registry_;
+    // acquired but not loaded yet
+    std::vector<AppMesh*> pending_meshes_;
+    std::vector<AppTextureInfo*> pending_textures_;
+    JobSystem job_system_;
+    AppMesh* acquireMesh(const std::string& path);
+    AppTexture* acquireTexture(const std::string& path);
+    void releaseMesh(const std::string& path);
+    void releaseTexture(const std::string& path);
+    void acquireSceneObjectAssets(AppSceneObject& scene_object);
+    // loads everything acquired since the last call in parallel
+    void loadPendingAssets();
+    void releaseSceneObjectAssets(AppSceneObject& scene_object);
+
+    // texture streaming =================================================
+    // off in headless mode, where frames must not depend on load timing
+    bool texture_streaming_ = false;
+    // frames since streaming started, for lru and retiring images
+    uint64_t stream_frame_ = 0;
+    VkDeviceSize texture_resident_bytes_ = 0;
+    std::vector<AppRetiredTexture> retired_textures_;
+    // signaled by the upload of this frame's new levels, the offscreen
+    // submit waits on it instead of the cpu waiting on the upload fence
+    VkSemaphore stream_upload_semaphore_ = VK_NULL_HANDLE;
+    bool stream_upload_submitted_ = false;
+    // keeps the tail of the startup decode, returns the first level to
+    // upload
+    uint32_t initTextureStreaming(AppSharedTexture& shared,
+        const AppImageData& image);
+    // once per frame after its fence, before recording
+    void updateTextureStreaming();
+    void computeWantedTextureLevels();
+    // destroyed later, the material table sets are rewritten
+    void retireTexture(AppTexture& texture);
+    void cleanupTextureStreaming();
 
     // skybox =================================================
     AppSkyboxPipelineAssets skybox_;
@@ -365,39 +545,25 @@ private:
     void prepareSkybox();
     void prepareSkyboxTexture();
     void loadSkyboxMesh();
-    void createSkyboxUniformBuffer();
     void createSkyboxDescriptorSetLayout();
     void createSkyboxDescriptorSet();
     void createSkyboxPipelineLayout();
     void createSkyboxPipeline();
     // helper
     void getEnabledFeatures();
-    uint32_t skybox_getMemoryType(uint32_t typeBits,
-        VkMemoryPropertyFlags properties,
-        VkBool32 *memTypeFound = nullptr);
-    // TODO: merge this in the original one
-    void skybox_transitionLayout(
-        VkCommandBuffer cmdbuffer,
-        VkImage image,
-        VkImageLayout oldImageLayout,
-        VkImageLayout newImageLayout,
-        VkImageSubresourceRange subresourceRange,
-        VkPipelineStageFlags srcStageMask,
-        VkPipelineStageFlags dstStageMask
-    );
 
     // deferred =================================================
     AppDeferredPipelineAssets deferred_;
-    std::vector<VkCommandBuffer> deferred_command_buffers_;
+    // recorded every frame once the swapchain image is known
+    std::array<VkCommandBuffer, MAX_FRAMES_IN_FLIGHT> deferred_command_buffers_;
     VkBuffer quadVertexBuffer;
-    VkDeviceMemory quadVertexBufferMemory;
+    AppAllocation quadVertexBufferMemory;
     VkBuffer quadIndexBuffer;
-    VkDeviceMemory quadIndexBufferMemory;
+    AppAllocation quadIndexBufferMemory;
     // TODO: put quad in here after all fo deferred
     // is done
     void prepareDeferred();
     void prepareQuadVertexAndIndexBuffer();
-    void createDeferredUniformBuffer();
     void createDeferredPBRTextures();
     void createDeferredDescriptorSetLayout();
     void createDeferredDescriptorSet();
@@ -406,6 +572,7 @@ private:
     void createSwapChainFramebuffers();
     void createDeferredPipeline();
     void createDeferredCommandBuffer();
+    void recordDeferredCommandBuffer(int frame, uint32_t imageIndex);
     // helper
     void createQuadVertexBuffer();
     void createQuadIndexBuffer();
@@ -425,20 +592,66 @@ private:
     int fps_display_cycle_ = 100;
     float fps_last_time_ = 0.0f;
     // helper
-    void uniformBufferCpy(VkDeviceMemory& device_memory, void* ubo_ptr,
-        size_t size);
     glm::mat4 getSkyboxModelMat();
     VkSubmitInfo mySubmitInfo;
 
     struct {
         // Swap chain image presentation
-        VkSemaphore presentComplete;
+        std::array<VkSemaphore, MAX_FRAMES_IN_FLIGHT> presentComplete;
         // Command buffer submission and execution
-        VkSemaphore renderComplete;
+        std::array<VkSemaphore, MAX_FRAMES_IN_FLIGHT> renderComplete;
     } semaphores_;
 
+    // device memory =================================================
+    // every buffer and image is sub-allocated from here, see device_memory.h
+    DeviceMemoryAllocator memory_allocator_;
+    // every startup upload is recorded here and flushed at the end of
+    // initVulkan, see upload_batch.h
+    UploadBatch upload_batch_;
+
+    // uniform ring =================================================
+    AppUniformRing uniform_ring_;
+    void createUniformRing();
+    void beginUniformRingFrame();
+    // copies data into the current frame's slice, returns its dynamic offset
+    uint32_t uniformRingPush(const void* data, size_t size);
+    VkDescriptorBufferInfo uniformRingDescriptor(VkDeviceSize range);
+    void cleanupUniformRing();
+
+    // headless =================================================
+    HeadlessSettings headless_;
+    uint32_t headless_frame_ = 0;
+    AppAllocation headless_color_memory_;
+    // one readback per frame in flight, frame N is written out while N+1 renders
+    std::array<VkBuffer, MAX_FRAMES_IN_FLIGHT> headless_readback_buffers_;
+    std::array<AppAllocation, MAX_FRAMES_IN_FLIGHT> headless_readback_memories_;
+    std::array<void*, MAX_FRAMES_IN_FLIGHT> headless_readback_mapped_;
+    std::array<VkCommandBuffer, MAX_FRAMES_IN_FLIGHT> headless_copy_cmd_buffers_;
+    // stands in for the swapchain so the deferred pass renders unchanged
+    void createHeadlessColorTarget();
+    void prepareHeadlessReadback();
+    void headlessLoop();
+    void drawHeadless();
+    void writeHeadlessFrame(const std::string& path,
+        const std::vector<unsigned char>& pixels);
+    void cleanupHeadless();
+
 	// tryout =================================================
 	void createOffscreenForSkyboxAndModel();
+	void recordOffscreenCommandBuffer(int frame);
+
+	// multithreaded recording =================================================
+	// draw group ranges of the g buffer pass, set by buildDrawGroups
+	std::vector<AppRecordChunk> record_chunks_;
+	// indexed by JobSystem::threadIndex
+	std::vector<AppRecordThread> record_threads_;
+	void createRecordThreads();
+	void cleanupRecordThreads();
+	// from the calling thread's pool of this frame, already begun
+	VkCommandBuffer beginSecondaryCommandBuffer(int frame,
+		const VkCommandBufferInheritanceInfo& inheritance);
+	void recordModelChunk(VkCommandBuffer commandBuffer, int frame, uint32_t chunk);
+	void recordSkybox(VkCommandBuffer commandBuffer, int frame);
 };
 
 